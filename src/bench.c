@@ -0,0 +1,574 @@
+/* ncdc - NCurses Direct Connect client
+
+  Copyright (c) 2011-2022 Yoran Heling
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+
+// ncdc-bench: Measures the throughput of a number of hot code paths without
+// requiring a hub or any network connections. This is linked against the same
+// objects as ncdc itself, with this file replacing main.c.
+//
+// Output is one line per benchmark, tab-separated:
+//   name  count  usec  rate  unit
+// where 'count' is the number of operations (or bytes) performed in 'usec'
+// microseconds. Lines starting with '#' are comments. All data is written to
+// a temporary session directory that is removed afterwards.
+
+#include "ncdc.h"
+#include "bench.h"
+
+
+// Symbols normally provided by main.c
+
+const char *main_version = PACKAGE_VERSION;
+
+GMainLoop *main_loop;
+
+
+void ncdc_quit() {
+  g_main_loop_quit(main_loop);
+}
+
+
+char *ncdc_version() {
+  return PACKAGE_STRING " (ncdc-bench)";
+}
+
+
+
+
+// Benchmark infrastructure
+
+static double bench_scale = 1.0;
+static char **bench_only = NULL;
+static char *bench_dir = NULL;
+
+
+// Whether the benchmark with the given name should be run.
+static gboolean bench_want(const char *name) {
+  char **o;
+  if(!bench_only || !*bench_only)
+    return TRUE;
+  for(o=bench_only; *o; o++)
+    if(strncmp(name, *o, strlen(*o)) == 0)
+      return TRUE;
+  return FALSE;
+}
+
+
+// Number of items to use for a benchmark, scaled with --scale.
+static int bench_n(int n) {
+  return MAX(1, (int)(n*bench_scale));
+}
+
+
+static void bench_report(const char *name, double count, gint64 usec, double div, const char *unit) {
+  usec = MAX(1, usec);
+  printf("%s\t%.0f\t%"G_GINT64_FORMAT"\t%.2f\t%s\n", name, count, usec, count/div/((double)usec/1e6), unit);
+  fflush(stdout);
+}
+
+#define bench_ops(name, count, usec) bench_report(name, count, usec, 1.0, "ops/s")
+#define bench_mib(name, count, usec) bench_report(name, count, usec, 1024.0*1024.0, "MiB/s")
+
+
+static void bench_rmtree(const char *path) {
+  GDir *d = g_dir_open(path, 0, NULL);
+  const char *n;
+  while(d && (n = g_dir_read_name(d))) {
+    char *p = g_build_filename(path, n, NULL);
+    if(g_file_test(p, G_FILE_TEST_IS_DIR) && !g_file_test(p, G_FILE_TEST_IS_SYMLINK))
+      bench_rmtree(p);
+    else
+      g_unlink(p);
+    g_free(p);
+  }
+  if(d)
+    g_dir_close(d);
+  g_rmdir(path);
+}
+
+
+static void bench_log(const gchar *dom, GLogLevelFlags lvl, const gchar *msg, gpointer dat) {
+  if(lvl & (G_LOG_LEVEL_ERROR|G_LOG_LEVEL_CRITICAL|G_LOG_LEVEL_WARNING))
+    fprintf(stderr, "%s\n", msg);
+}
+
+
+
+
+// Synthetic file list
+
+static const char *bench_words[] = {
+  "music", "video", "linux", "album", "live", "remix", "season", "episode",
+  "disc", "bonus", "extended", "edition", "the", "of", "and", "collection",
+  "ubuntu", "debian", "documentary", "concert", "original", "soundtrack",
+  "backup", "photos", "holiday", "archive", "release", "final", "draft", "demo"
+};
+
+static const char *bench_exts[] = {
+  "mp3", "flac", "avi", "mkv", "iso", "zip", "jpg", "txt", "nfo", "ogg"
+};
+
+
+// Creates a random name of a few words, excluding the extension.
+static void bench_name(GRand *r, GString *s) {
+  int i, n = g_rand_int_range(r, 2, 5);
+  g_string_truncate(s, 0);
+  for(i=0; i<n; i++) {
+    if(i)
+      g_string_append_c(s, ' ');
+    g_string_append(s, bench_words[g_rand_int_range(r, 0, G_N_ELEMENTS(bench_words))]);
+  }
+  g_string_append_printf(s, " %d", g_rand_int_range(r, 0, 100000));
+}
+
+
+// Creates a list with the given number of files, 100 files to a directory and
+// 50 directories per share root. The list is deterministic for a given size,
+// so that the numbers of different runs can be compared.
+static fl_list_t *bench_list(int files) {
+  GRand *r = g_rand_new_with_seed(42);
+  GString *name = g_string_new("");
+  fl_list_t *root = fl_list_create("", FALSE);
+  root->sub = g_ptr_array_new_with_free_func(fl_list_free);
+  fl_list_t *share = NULL, *dir = NULL;
+  int i, j;
+
+  for(i=0; i<files; i++) {
+    if(i % 5000 == 0) {
+      g_string_printf(name, "share%d", i/5000);
+      share = fl_list_create(name->str, FALSE);
+      share->sub = g_ptr_array_new_with_free_func(fl_list_free);
+      fl_list_add(root, share, -1);
+    }
+    if(i % 100 == 0) {
+      if(dir)
+        fl_list_sort(dir);
+      bench_name(r, name);
+      dir = fl_list_create(name->str, FALSE);
+      dir->sub = g_ptr_array_new_with_free_func(fl_list_free);
+      fl_list_add(share, dir, -1);
+    }
+    bench_name(r, name);
+    g_string_append_printf(name, ".%s", bench_exts[g_rand_int_range(r, 0, G_N_ELEMENTS(bench_exts))]);
+    fl_list_t *f = fl_list_create(name->str, FALSE);
+    f->isfile = TRUE;
+    f->hastth = TRUE;
+    f->size = g_rand_int(r) + ((guint64)g_rand_int_range(r, 0, 4)<<32);
+    for(j=0; j<24; j+=4) {
+      guint32 v = g_rand_int(r);
+      memcpy(f->tth+j, &v, 4);
+    }
+    fl_list_add(dir, f, -1);
+  }
+  if(dir)
+    fl_list_sort(dir);
+  for(i=0; i<root->sub->len; i++)
+    fl_list_sort(g_ptr_array_index(root->sub, i));
+  fl_list_sort(root);
+
+  g_string_free(name, TRUE);
+  g_rand_free(r);
+  return root;
+}
+
+
+// Calls cb() on every file in the list.
+static void bench_list_files(fl_list_t *fl, void (*cb)(fl_list_t *, gpointer), gpointer dat) {
+  int i;
+  fl_list_expand(fl);
+  for(i=0; i<fl->sub->len; i++) {
+    fl_list_t *c = g_ptr_array_index(fl->sub, i);
+    if(c->isfile)
+      cb(c, dat);
+    else
+      bench_list_files(c, cb, dat);
+  }
+}
+
+
+
+
+// Hashing
+
+static void bench_hash() {
+  int len = 1024*1024;
+  int i, num = bench_n(256);
+  char *buf = g_malloc(len);
+  for(i=0; i<len; i++)
+    buf[i] = i*7;
+
+  if(bench_want("tiger_update")) {
+    tiger_ctx_t t;
+    char res[24];
+    gint64 s = g_get_monotonic_time();
+    tiger_init(&t);
+    for(i=0; i<num; i++)
+      tiger_update(&t, buf, len);
+    tiger_final(&t, res);
+    bench_mib("tiger_update", (double)num*len, g_get_monotonic_time()-s);
+  }
+
+  if(bench_want("tth_update")) {
+    tth_ctx_t *t = g_new(tth_ctx_t, 1);
+    char res[24];
+    gint64 s = g_get_monotonic_time();
+    tth_init(t);
+    for(i=0; i<num; i++)
+      tth_update(t, buf, len);
+    tth_final(t, res);
+    bench_mib("tth_update", (double)num*len, g_get_monotonic_time()-s);
+    g_free(t);
+  }
+
+  g_free(buf);
+}
+
+
+
+
+// File lists
+
+static int bench_search_matches;
+
+static void bench_search_match(fl_list_t *f, gpointer dat) {
+  if(fl_search_match_full(f, dat))
+    bench_search_matches++;
+}
+
+
+static void bench_bloom_add(fl_list_t *f, gpointer dat) {
+  bloom_add(dat, f->tth);
+}
+
+
+static void bench_fl() {
+  int files = bench_n(1000000);
+  fl_list_t *fl = bench_list(files);
+  char *fn = g_build_filename(bench_dir, "bench.xml.bz2", NULL);
+  GError *err = NULL;
+  gint64 s;
+  int i;
+
+  if(bench_want("fl_save")) {
+    s = g_get_monotonic_time();
+    if(!fl_save(fl, "BENCH", 0, FALSE, NULL, fn, &err)) {
+      fprintf(stderr, "fl_save: %s\n", err->message);
+      g_clear_error(&err);
+    } else
+      bench_ops("fl_save", files, g_get_monotonic_time()-s);
+  }
+
+  if(bench_want("fl_load")) {
+    if(!g_file_test(fn, G_FILE_TEST_EXISTS) && !fl_save(fl, "BENCH", 0, FALSE, NULL, fn, &err)) {
+      fprintf(stderr, "fl_save: %s\n", err->message);
+      g_clear_error(&err);
+    } else {
+      s = g_get_monotonic_time();
+      fl_list_t *l = fl_load(fn, &err, FALSE);
+      if(!l) {
+        fprintf(stderr, "fl_load: %s\n", err->message);
+        g_clear_error(&err);
+      } else {
+        bench_ops("fl_load", files, g_get_monotonic_time()-s);
+        fl_list_free(l);
+      }
+    }
+  }
+  g_unlink(fn);
+  g_free(fn);
+
+  fl_search_t q = {};
+  q.sizem = -2;
+  q.filedir = 3;
+  char *kw[] = { "live", "concert", NULL };
+  q.and = fl_search_create_and(kw);
+
+  if(bench_want("fl_search_rec")) {
+    int num = 10;
+    fl_list_t **res = g_new(fl_list_t *, files);
+    s = g_get_monotonic_time();
+    for(i=0; i<num; i++)
+      fl_search_rec(fl, &q, res, files);
+    bench_ops("fl_search_rec", num, g_get_monotonic_time()-s);
+    g_free(res);
+  }
+
+  if(bench_want("fl_search_match_full")) {
+    s = g_get_monotonic_time();
+    bench_list_files(fl, bench_search_match, &q);
+    bench_ops("fl_search_match_full", files, g_get_monotonic_time()-s);
+  }
+  fl_search_free_and(q.and);
+
+  // Typical parameters for a share of this size
+  bloom_t b;
+  bloom_init(&b, 2*1024*1024, 8, 24);
+
+  if(bench_want("bloom_add")) {
+    s = g_get_monotonic_time();
+    bench_list_files(fl, bench_bloom_add, &b);
+    bench_ops("bloom_add", files, g_get_monotonic_time()-s);
+  }
+
+  if(bench_want("fl_local_bloom")) {
+    s = g_get_monotonic_time();
+    fl_local_set_list(fl);
+    bench_ops("fl_local_set_list", files, g_get_monotonic_time()-s);
+    fl = NULL;
+
+    s = g_get_monotonic_time();
+    fl_local_bloom(&b);
+    bench_ops("fl_local_bloom", files, g_get_monotonic_time()-s);
+
+    int num = 100;
+    s = g_get_monotonic_time();
+    for(i=0; i<num; i++)
+      fl_local_bloom(&b);
+    bench_ops("fl_local_bloom_cached", num, g_get_monotonic_time()-s);
+  }
+  g_free(b.d);
+
+  if(fl)
+    fl_list_free(fl);
+}
+
+
+
+
+// Protocol
+
+static void bench_adc() {
+  static const char *msgs[] = {
+    "BINF AAAB IDABCDEFGHIJKLMNOPQRSTUVWXYZ234567ABCDEFG NIsome\\suser SS1234567890123 SF12345 VEncdc\\s1.24 SL3 HN1 HR0 HO0 SUTCP4,ADC0,SEGA I4192.168.1.10 DEa\\sdescription",
+    "BSCH AAAC TOabcdef AN\\slive ANconcert EX\\sflac",
+    "DMSG AAAB AAAC hello\\sthere,\\show\\sare\\syou? PMAAAB",
+    "IQUI AAAD",
+    "BSCH AAAE TRLWPNACQDBZRYXW3VHJVCJ64QBZNGHOHHHZWCLNQ",
+  };
+  int i, num = bench_n(1000000);
+
+  if(bench_want("adc_parse")) {
+    gint64 s = g_get_monotonic_time();
+    for(i=0; i<num; i++) {
+      adc_cmd_t cmd;
+      GError *err = NULL;
+      if(adc_parse(msgs[i % G_N_ELEMENTS(msgs)], &cmd, NULL, &err))
+        adc_cmd_free(&cmd);
+      else
+        g_error_free(err);
+    }
+    bench_ops("adc_parse", num, g_get_monotonic_time()-s);
+  }
+
+  if(bench_want("adc_param")) {
+    // The parameters adc_sch() looks for
+    static const char *names[] = { "AN", "NO", "EX", "LE", "GE", "EQ", "TY", "TR", "TD" };
+    adc_cmd_t cmd;
+    adc_parse(msgs[1], &cmd, NULL, NULL);
+    int j, found = 0;
+    gint64 s = g_get_monotonic_time();
+    for(i=0; i<num; i++)
+      for(j=0; j<(int)G_N_ELEMENTS(names); j++)
+        if(adc_cmd_param(&cmd, 0, names[j]))
+          found++;
+    bench_ops("adc_param", num*G_N_ELEMENTS(names), g_get_monotonic_time()-s);
+    adc_cmd_free(&cmd);
+    if(!found)
+      g_warning("adc_param: nothing found");
+  }
+
+  if(bench_want("adc_escape")) {
+    static const char *strs[] = {
+      "a plain string without anything special",
+      "Some \\ slashes, spaces\nand newlines",
+      "nothing",
+    };
+    gint64 s = g_get_monotonic_time();
+    for(i=0; i<num; i++)
+      g_free(adc_escape(strs[i % G_N_ELEMENTS(strs)], FALSE));
+    bench_ops("adc_escape", num, g_get_monotonic_time()-s);
+  }
+}
+
+
+
+
+// Network message splitting. Feeds a stream of NMDC messages through a
+// socketpair() into a net_t and reads them back with net_readmsg(), which
+// goes through the same asy_read() and asy_handlerbuf() code as a hub
+// connection.
+
+static int bench_net_left;
+
+
+static void bench_net_msg(net_t *n, char *msg, int len) {
+  if(--bench_net_left > 0)
+    net_readmsg(n, '|', bench_net_msg);
+  else
+    g_main_loop_quit(main_loop);
+}
+
+
+static void bench_net_err(net_t *n, int action, const char *err) {
+  fprintf(stderr, "net: %s\n", err);
+  g_main_loop_quit(main_loop);
+}
+
+
+static gpointer bench_net_writer(gpointer dat) {
+  int *arg = dat;
+  int i, sock = arg[0], num = arg[1];
+  GString *buf = g_string_sized_new(64*1024);
+  for(i=0; i<num; i++) {
+    g_string_append_printf(buf, "$MyINFO $ALL user%d some description here<ncdc V:1.24,M:A,H:1/0/2,S:3>$ $100\001$mail@example.com$%d$|", i, i*1000);
+    if(buf->len >= 60*1024 || i == num-1) {
+      char *p = buf->str;
+      gsize left = buf->len;
+      while(left > 0) {
+        ssize_t r = write(sock, p, left);
+        if(r < 0 && errno == EINTR)
+          continue;
+        if(r <= 0)
+          goto done;
+        p += r;
+        left -= r;
+      }
+      g_string_truncate(buf, 0);
+    }
+  }
+done:
+  g_string_free(buf, TRUE);
+  close(sock);
+  return NULL;
+}
+
+
+static void bench_net() {
+  if(!bench_want("asy_handlerbuf"))
+    return;
+
+  int sv[2];
+  if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+    fprintf(stderr, "socketpair: %s\n", g_strerror(errno));
+    return;
+  }
+  fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL, 0)|O_NONBLOCK);
+
+  int num = bench_n(500000);
+  int arg[2] = { sv[1], num };
+  bench_net_left = num;
+  net_t *n = net_new(NULL, bench_net_err);
+  net_connected(n, sv[0], "bench", FALSE);
+  net_readmsg(n, '|', bench_net_msg);
+
+  gint64 s = g_get_monotonic_time();
+  GThread *t = g_thread_new("bench writer", bench_net_writer, arg);
+  g_main_loop_run(main_loop);
+  gint64 e = g_get_monotonic_time();
+  g_thread_join(t);
+
+  if(bench_net_left <= 0)
+    bench_ops("asy_handlerbuf", num, e-s);
+  net_disconnect(n);
+  net_unref(n);
+}
+
+
+
+
+// Database
+
+static void bench_db() {
+  if(!bench_want("db_queue_push"))
+    return;
+
+  // db_fl_addhash() pushes two queries and waits for the result of the last
+  // one, the same as the hash threads do after hashing a file.
+  int i, num = bench_n(20000);
+  char root[24] = {};
+  char path[64];
+  gint64 s = g_get_monotonic_time();
+  for(i=0; i<num; i++) {
+    memcpy(root, &i, sizeof(i));
+    g_snprintf(path, sizeof(path), "/bench/file%d", i);
+    db_fl_addhash(path, i*1024, i, root, g_memdup(root, 24), 24);
+  }
+  bench_ops("db_queue_push", num, g_get_monotonic_time()-s);
+}
+
+
+
+
+static GOptionEntry bench_options[] = {
+  { "scale", 's', 0, G_OPTION_ARG_DOUBLE, &bench_scale,
+      "Multiply the size of each benchmark by this factor (default: 1.0).", "N" },
+  { G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_STRING_ARRAY, &bench_only,
+      NULL, "[BENCHMARK...]" },
+  { NULL }
+};
+
+
+int main(int argc, char **argv) {
+  setlocale(LC_ALL, "");
+
+  GOptionContext *optx = g_option_context_new("- ncdc benchmarks");
+  g_option_context_set_summary(optx, "Only runs the benchmarks whose name starts with any of the given arguments.");
+  g_option_context_add_main_entries(optx, bench_options, NULL);
+  GError *err = NULL;
+  if(!g_option_context_parse(optx, &argc, &argv, &err)) {
+    puts(err->message);
+    exit(1);
+  }
+  g_option_context_free(optx);
+
+  if(!(bench_dir = g_dir_make_tmp("ncdc-bench-XXXXXX", &err))) {
+    fprintf(stderr, "Can't create temporary directory: %s\n", err->message);
+    exit(1);
+  }
+
+  gnutls_global_init();
+  main_loop = g_main_loop_new(NULL, FALSE);
+  g_log_set_default_handler(bench_log, NULL);
+
+  db_dir = g_strdup(bench_dir);
+  db_init();
+  vars_init();
+  tth_init_global();
+  net_init_global();
+
+  printf("# %s, scale %.2f\n", PACKAGE_STRING, bench_scale);
+  printf("# name\tcount\tusec\trate\tunit\n");
+  fflush(stdout);
+
+  bench_hash();
+  bench_adc();
+  bench_net();
+  bench_fl();
+  bench_db();
+
+  db_close();
+  gnutls_global_deinit();
+  bench_rmtree(bench_dir);
+  return 0;
+}
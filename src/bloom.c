@@ -57,6 +57,23 @@ int bloom_init(bloom_t *b, int m, int k, int h) {
 void bloom_add(bloom_t *b, const char *hash) {
   int i, j, pos = 0;
   guint64 tmp;
+
+  // Fast path: extract each sub-hash with a single 64-bit load. The hash is
+  // copied into a padded buffer so that the last load stays within bounds.
+  if(b->h <= 56) {
+    unsigned char buf[32] = {};
+    guint64 mask = (((guint64)1)<<b->h) - 1;
+    memcpy(buf, hash, 24);
+    for(i=0; i<b->k; i++) {
+      memcpy(&tmp, buf+(pos>>3), 8);
+      tmp = (GUINT64_FROM_LE(tmp) >> (pos&7)) & mask;
+      pos += b->h;
+      j = tmp % (b->m<<3);
+      b->d[j>>3] |= 1<<(j&7);
+    }
+    return;
+  }
+
   for(i=0; i<b->k; i++) {
     tmp = 0;
     for(j=0; j<b->h; j++) {
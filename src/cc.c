@@ -29,6 +29,13 @@
 
 // List of expected incoming or outgoing connections.  This is list managed by
 // the functions below, in addition to cc_init_global() and cc_remove_hub(),
+//
+// All expects time out after CC_EXPECT_TIMEOUT seconds, so cc_expected is
+// also ordered by expiry time and a single timer for its head is enough. To
+// avoid scanning the list for every incoming connection, the expects are
+// also indexed by token (ADC) and by nick (NMDC).
+
+#define CC_EXPECT_TIMEOUT 60
 
 typedef struct cc_expect_t {
   hub_t *hub;
@@ -38,36 +45,68 @@ typedef struct cc_expect_t {
   char *token;  // ADC
   char *kp;     // ADC - slice-alloc'ed with 32 bytes
   time_t added;
-  int timeout_src;
+  GList *link;  // in cc_expected
   gboolean adc : 1;
   gboolean dl : 1;  // if we were the one starting the connection (i.e. we want to download)
 } cc_expect_t;
 
 
 static GQueue *cc_expected;
+static GHashTable *cc_expect_idx; // token (ADC) or nick (NMDC) -> GQueue of cc_expect_t
+static guint cc_expect_timer = 0;
+
+
+static void cc_expect_idx_free(gpointer dat) {
+  g_queue_free(dat);
+}
+
+
+static char *cc_expect_key(cc_expect_t *e) {
+  return e->adc ? e->token : e->nick;
+}
 
 
-static void cc_expect_rm(GList *n, cc_t *success) {
-  cc_expect_t *e = n->data;
+static void cc_expect_rm(cc_expect_t *e, cc_t *success) {
   if(e->dl && !success)
     dl_user_cc(e->uid, FALSE);
   else if(e->dl)
     success->dl = TRUE;
-  g_source_remove(e->timeout_src);
+  char *key = cc_expect_key(e);
+  GQueue *q = key ? g_hash_table_lookup(cc_expect_idx, key) : NULL;
+  if(q) {
+    g_queue_remove(q, e);
+    if(!q->length)
+      g_hash_table_remove(cc_expect_idx, key);
+  }
+  g_queue_delete_link(cc_expected, e->link);
   if(e->kp)
     g_slice_free1(32, e->kp);
   g_free(e->token);
   g_free(e->nick);
   g_slice_free(cc_expect_t, e);
-  g_queue_delete_link(cc_expected, n);
 }
 
 
-static gboolean cc_expect_timeout(gpointer data) {
-  GList *n = data;
-  cc_expect_t *e = n->data;
-  g_message("Expected connection from %s on %s, but received none.", e->nick, e->hub->tab->name);
-  cc_expect_rm(n, NULL);
+static gboolean cc_expect_timeout(gpointer dat);
+
+static void cc_expect_schedule() {
+  if(cc_expect_timer || !cc_expected->head)
+    return;
+  cc_expect_t *e = cc_expected->head->data;
+  time_t left = e->added + CC_EXPECT_TIMEOUT - time(NULL);
+  cc_expect_timer = g_timeout_add_seconds_full(G_PRIORITY_LOW, MAX(left, 1), cc_expect_timeout, NULL, NULL);
+}
+
+
+static gboolean cc_expect_timeout(gpointer dat) {
+  time_t now = time(NULL);
+  cc_expect_t *e;
+  while(cc_expected->head && (e = cc_expected->head->data)->added + CC_EXPECT_TIMEOUT <= now) {
+    g_message("Expected connection from %s on %s, but received none.", e->nick, e->hub->tab->name);
+    cc_expect_rm(e, NULL);
+  }
+  cc_expect_timer = 0;
+  cc_expect_schedule();
   return FALSE;
 }
 
@@ -91,7 +130,18 @@ void cc_expect_add(hub_t *hub, hub_user_t *u, guint16 port, char *t, gboolean dl
     e->token = g_strdup(t);
   time(&(e->added));
   g_queue_push_tail(cc_expected, e);
-  e->timeout_src = g_timeout_add_seconds_full(G_PRIORITY_LOW, 60, cc_expect_timeout, cc_expected->tail, NULL);
+  e->link = cc_expected->tail;
+
+  char *key = cc_expect_key(e);
+  if(key) {
+    GQueue *q = g_hash_table_lookup(cc_expect_idx, key);
+    if(!q) {
+      q = g_queue_new();
+      g_hash_table_insert(cc_expect_idx, g_strdup(key), q);
+    }
+    g_queue_push_tail(q, e);
+  }
+  cc_expect_schedule();
 }
 
 
@@ -99,18 +149,19 @@ void cc_expect_add(hub_t *hub, hub_user_t *u, guint16 port, char *t, gboolean dl
 // cc->hub and cc->kp_user and removes it from the expects list. cc->token must
 // be known, and either cc->cid must be set or a uid must be given.
 static gboolean cc_expect_adc_rm(cc_t *cc, guint64 uid) {
-  // We're calculating the uid for each (expect->hub->id, cc->cid) pair in the
-  // list and compare it with expect->uid to see if we've got the right user.
-  // This isn't the most efficient solution...
+  // Only the expects with the same token are considered. We're calculating
+  // the uid for each (expect->hub->id, cc->cid) pair and compare it with
+  // expect->uid to see if we've got the right user.
+  GQueue *q = g_hash_table_lookup(cc_expect_idx, cc->token);
   GList *n;
-  for(n=cc_expected->head; n; n=n->next) {
+  for(n=q?q->head:NULL; n; n=n->next) {
     cc_expect_t *e = n->data;
-    if(e->adc && e->port == cc->port && strcmp(cc->token, e->token) == 0 && e->uid == (cc->cid ? hub_user_adc_id(e->hub->id, cc->cid) : uid)) {
+    if(e->adc && e->port == cc->port && e->uid == (cc->cid ? hub_user_adc_id(e->hub->id, cc->cid) : uid)) {
       cc->uid = e->uid;
       cc->hub = e->hub;
       cc->kp_user = e->kp;
       e->kp = NULL;
-      cc_expect_rm(n, cc);
+      cc_expect_rm(e, cc);
       return TRUE;
     }
   }
@@ -121,15 +172,16 @@ static gboolean cc_expect_adc_rm(cc_t *cc, guint64 uid) {
 // Same as above, but for NMDC. Sets cc->dl, cc->uid and cc->hub. cc->nick_raw
 // must be known, and for passive connections cc->hub must also be known.
 static gboolean cc_expect_nmdc_rm(cc_t *cc) {
+  GQueue *q = g_hash_table_lookup(cc_expect_idx, cc->nick_raw);
   GList *n;
-  for(n=cc_expected->head; n; n=n->next) {
+  for(n=q?q->head:NULL; n; n=n->next) {
     cc_expect_t *e = n->data;
     if(cc->hub && cc->hub != e->hub)
       continue;
-    if(!e->adc && e->port == cc->port && strcmp(e->nick, cc->nick_raw) == 0) {
+    if(!e->adc && e->port == cc->port) {
       cc->hub = e->hub;
       cc->uid = e->uid;
-      cc_expect_rm(n, cc);
+      cc_expect_rm(e, cc);
       return TRUE;
     }
   }
@@ -141,9 +193,16 @@ static gboolean cc_expect_nmdc_rm(cc_t *cc) {
 
 // Throttling of GET file offset, for buggy clients that keep requesting the
 // same file+offset. Throttled to 1 request per hour, with an allowed burst of 10.
+//
+// Items are aged on a timer wheel with THROTTLE_SLOTS slots of THROTTLE_TICK
+// seconds each. An item is put in the slot of the first tick after its
+// throttle time. Updating an item doesn't move it; when its slot comes up
+// and the item is still in use, it is simply put in a later slot.
 
 #define THROTTLE_INTV 3600
 #define THROTTLE_BURST 10
+#define THROTTLE_TICK 600
+#define THROTTLE_SLOTS 64
 
 typedef struct throttle_get_t {
   char tth[24];
@@ -153,12 +212,18 @@ typedef struct throttle_get_t {
 } throttle_get_t;
 
 static GHashTable *throttle_list; // initialized in cc_init_global()
+static GPtrArray *throttle_wheel[THROTTLE_SLOTS];
+static time_t throttle_tick; // last processed tick
 
 
 static guint throttle_hash(gconstpointer key) {
   const throttle_get_t *t = key;
-  guint *tth = (guint *)t->tth;
-  return *tth + (gint)t->offset + (gint)t->uid;
+  // The TTH and uid are already hashes, so mixing in the offset is enough.
+  guint64 tth, h;
+  memcpy(&tth, t->tth, 8);
+  h = tth ^ t->uid ^ (t->offset * G_GUINT64_CONSTANT(0x9E3779B97F4A7C15));
+  h ^= h >> 32;
+  return h;
 }
 
 
@@ -174,6 +239,14 @@ static void throttle_free(gpointer dat) {
 }
 
 
+static void throttle_wheel_add(throttle_get_t *t) {
+  int slot = (t->throttle/THROTTLE_TICK + 1) % THROTTLE_SLOTS;
+  if(!throttle_wheel[slot])
+    throttle_wheel[slot] = g_ptr_array_new();
+  g_ptr_array_add(throttle_wheel[slot], t);
+}
+
+
 static gboolean throttle_check(cc_t *cc, char *tth, guint64 offset) {
   // construct a key
   throttle_get_t key;
@@ -195,23 +268,110 @@ static gboolean throttle_check(cc_t *cc, char *tth, guint64 offset) {
   // value not present, add it
   val = g_slice_dup(throttle_get_t, &key);
   g_hash_table_insert(throttle_list, val, val);
+  throttle_wheel_add(val);
   return FALSE;
 }
 
 
-static gboolean throttle_purge_func(gpointer key, gpointer val, gpointer dat) {
-  throttle_get_t *v = val;
+// Purge old throttle items from the throttle_list. Called from a timer that is
+// initialized in cc_init_global(), only looks at the wheel slots of the ticks
+// that have passed since the previous call.
+static gboolean throttle_purge(gpointer dat) {
+  time_t t = time(NULL);
+  time_t tick = t/THROTTLE_TICK;
+  int r = 0;
+  for(; throttle_tick < tick; throttle_tick++) {
+    int slot = (throttle_tick+1) % THROTTLE_SLOTS;
+    GPtrArray *a = throttle_wheel[slot];
+    if(!a || !a->len)
+      continue;
+    throttle_wheel[slot] = g_ptr_array_new();
+    guint i;
+    for(i=0; i<a->len; i++) {
+      throttle_get_t *v = g_ptr_array_index(a, i);
+      if(v->throttle < t) {
+        g_hash_table_remove(throttle_list, v);
+        r++;
+      } else
+        throttle_wheel_add(v);
+    }
+    g_ptr_array_unref(a);
+  }
+  g_debug("throttle_purge: Purged %d items, %d items left.", r, g_hash_table_size(throttle_list));
+  return TRUE;
+}
+
+
+
+
+// Tracks which users have recently requested a file, to detect files that are
+// being uploaded to several users at the same time. These are not purged from
+// the OS cache after sending (see flush_file_cache), otherwise every user
+// would cause the file to be read from disk again.
+
+#define HOTFILE_USERS 3   // recent users before a file is considered hot
+#define HOTFILE_SLOTS 8
+#define HOTFILE_TIME  600 // how long a request counts as recent
+#define HOTFILE_READAHEAD (16*1024*1024)
+
+typedef struct hotfile_t {
+  char tth[24];
+  guint64 uid[HOTFILE_SLOTS];
+  time_t last[HOTFILE_SLOTS];
+} hotfile_t;
+
+static GHashTable *hotfile_list; // tth -> hotfile_t, initialized in cc_global_init()
+
+
+static void hotfile_free(gpointer dat) {
+  g_slice_free(hotfile_t, dat);
+}
+
+
+// Registers a request for the file and returns whether it's hot.
+static gboolean hotfile_add(const char *tth, guint64 uid) {
+  hotfile_t *h = g_hash_table_lookup(hotfile_list, tth);
+  if(!h) {
+    h = g_slice_new0(hotfile_t);
+    memcpy(h->tth, tth, 24);
+    g_hash_table_insert(hotfile_list, h->tth, h);
+  }
+
+  // Replace the slot of this user, or otherwise the oldest one
+  time_t now = time(NULL);
+  int i, slot = 0, n = 0;
+  for(i=0; i<HOTFILE_SLOTS; i++) {
+    if(h->uid[i] == uid) {
+      slot = i;
+      break;
+    }
+    if(h->last[i] < h->last[slot])
+      slot = i;
+  }
+  h->uid[slot] = uid;
+  h->last[slot] = now;
+
+  for(i=0; i<HOTFILE_SLOTS; i++)
+    if(h->last[i] > now-HOTFILE_TIME)
+      n++;
+  return n >= HOTFILE_USERS;
+}
+
+
+static gboolean hotfile_purge_func(gpointer key, gpointer val, gpointer dat) {
+  hotfile_t *h = val;
   time_t *t = dat;
-  return v->throttle < *t ? TRUE : FALSE;
+  int i;
+  for(i=0; i<HOTFILE_SLOTS; i++)
+    if(h->last[i] > *t-HOTFILE_TIME)
+      return FALSE;
+  return TRUE;
 }
 
 
-// Purge old throttle items from the throttle_list. Called from a timer that is
-// initialized in cc_init_global().
-static gboolean throttle_purge(gpointer dat) {
+static gboolean hotfile_purge(gpointer dat) {
   time_t t = time(NULL);
-  int r = g_hash_table_foreach_remove(throttle_list, throttle_purge_func, &t);
-  g_debug("throttle_purge: Purged %d items, %d items left.", r, g_hash_table_size(throttle_list));
+  g_hash_table_foreach_remove(hotfile_list, hotfile_purge_func, &t);
   return TRUE;
 }
 
@@ -219,6 +379,168 @@ static gboolean throttle_purge(gpointer dat) {
 
 
 
+// Cache of partial file lists sent in reply to "ADCGET list". Clients browsing
+// our share tend to request the same directories over and over again, this
+// avoids re-serializing and compressing them each time. The cache is emptied
+// whenever fl_local_gen or fl_local_hashgen changes.
+
+#define LISTCACHE_MAX 100
+
+typedef struct listcache_t {
+  GString *buf;
+  int len; // Uncompressed size, as returned by fl_save()
+} listcache_t;
+
+static GHashTable *listcache;  // "<cid><re1><zlib><path>" -> listcache_t, initialized in cc_global_init()
+static guint listcache_gen, listcache_hashgen;
+
+
+static void listcache_free(gpointer dat) {
+  listcache_t *l = dat;
+  g_string_free(l->buf, TRUE);
+  g_slice_free(listcache_t, l);
+}
+
+
+// Returns the partial list of the given directory. The returned object is
+// owned by the cache and remains valid until the next call.
+static listcache_t *listcache_get(fl_list_t *f, const char *id, gboolean zlib, gboolean re1, GError **err) {
+  if(listcache_gen != fl_local_gen || listcache_hashgen != fl_local_hashgen || g_hash_table_size(listcache) >= LISTCACHE_MAX) {
+    g_hash_table_remove_all(listcache);
+    listcache_gen = fl_local_gen;
+    listcache_hashgen = fl_local_hashgen;
+  }
+
+  const char *cid = var_get(0, VAR_cid);
+  char *key = g_strdup_printf("%s%d%d%s", cid, re1?1:0, zlib?1:0, id);
+  listcache_t *l = g_hash_table_lookup(listcache, key);
+  if(l) {
+    g_free(key);
+    return l;
+  }
+
+  // Use a targetsize of 16k for non-recursive lists and 256k for recursive
+  // ones. This should give useful results in most cases. The only exception
+  // here is Jucy, which does not handle "Incomplete" entries in a recursive
+  // list, but... yeah, that's Jucy's problem. :-)
+  GString *buf = g_string_new("");
+  int len = fl_save(f, cid, re1 ? 256*1024 : 16*1024, zlib, buf, NULL, err);
+  if(!len) {
+    g_string_free(buf, TRUE);
+    g_free(key);
+    return NULL;
+  }
+  l = g_slice_new(listcache_t);
+  l->buf = buf;
+  l->len = len;
+  g_hash_table_insert(listcache, key, l);
+  return l;
+}
+
+
+
+
+// Cache of open files for "ADCGET file" requests. Popular files are fetched
+// in many small segments by several users at once; this saves a path lookup,
+// stat() and open() for each segment. Uploads get a dup() of the cached
+// descriptor and read from explicit offsets, so they can share it. The cache
+// is emptied whenever fl_local_gen changes, and an entry is checked again with
+// stat() when it's older than FILECACHE_CHECK seconds, to detect files that
+// have been modified or replaced without a refresh.
+
+#define FILECACHE_MAX   32
+#define FILECACHE_CHECK 60
+
+typedef struct filecache_t {
+  fl_list_t *fl;
+  char *path; // filesystem encoding
+  int fd;
+  struct stat st;
+  time_t checked;
+  GList *lru;
+} filecache_t;
+
+static GHashTable *filecache;  // fl_list_t -> filecache_t, initialized in cc_global_init()
+static GQueue filecache_lru = G_QUEUE_INIT; // most recently used first
+static guint filecache_gen;
+
+
+static void filecache_free(gpointer dat) {
+  filecache_t *c = dat;
+  close(c->fd);
+  g_free(c->path);
+  g_queue_delete_link(&filecache_lru, c->lru);
+  g_slice_free(filecache_t, c);
+}
+
+
+// Closes files that haven't been used for a while, so that we don't hold on
+// to deleted files.
+static gboolean filecache_purge(gpointer dat) {
+  time_t now = time(NULL);
+  while(filecache_lru.tail && ((filecache_t *)filecache_lru.tail->data)->checked < now-FILECACHE_CHECK)
+    g_hash_table_remove(filecache, ((filecache_t *)filecache_lru.tail->data)->fl);
+  return TRUE;
+}
+
+
+// Returns the open file for f, or NULL if it's not available. The returned
+// object is owned by the cache and remains valid until the next call.
+static filecache_t *filecache_get(fl_list_t *f) {
+  if(filecache_gen != fl_local_gen) {
+    g_hash_table_remove_all(filecache);
+    filecache_gen = fl_local_gen;
+  }
+
+  time_t now = time(NULL);
+  filecache_t *c = g_hash_table_lookup(filecache, f);
+  if(c && c->checked < now-FILECACHE_CHECK) {
+    struct stat st;
+    if(stat(c->path, &st) < 0 || st.st_dev != c->st.st_dev || st.st_ino != c->st.st_ino
+        || st.st_size != c->st.st_size || st.st_mtime != c->st.st_mtime) {
+      g_hash_table_remove(filecache, f);
+      c = NULL;
+    } else
+      c->checked = now;
+  }
+  if(c) {
+    g_queue_unlink(&filecache_lru, c->lru);
+    g_queue_push_head_link(&filecache_lru, c->lru);
+    return c;
+  }
+
+  char *enc_path = fl_local_path(f);
+  char *path = g_filename_from_utf8(enc_path, -1, NULL, NULL, NULL);
+  g_free(enc_path);
+  int fd = path ? open(path, O_RDONLY) : -1;
+  struct stat st;
+  if(fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+    if(fd < 0 && path && errno != ENOENT)
+      g_message("Error opening '%s' for sending: %s", path, g_strerror(errno));
+    if(fd >= 0)
+      close(fd);
+    g_free(path);
+    return NULL;
+  }
+
+  if(g_hash_table_size(filecache) >= FILECACHE_MAX)
+    g_hash_table_remove(filecache, ((filecache_t *)filecache_lru.tail->data)->fl);
+  c = g_slice_new(filecache_t);
+  c->fl = f;
+  c->path = path;
+  c->fd = fd;
+  c->st = st;
+  c->checked = now;
+  g_queue_push_head(&filecache_lru, c);
+  c->lru = filecache_lru.head;
+  g_hash_table_insert(filecache, f, c);
+  return c;
+}
+
+
+
+
+
 // Main C-C objects
 
 #if INTERFACE
@@ -338,10 +660,20 @@ GSequence *cc_list;
 
 void cc_global_init() {
   cc_expected = g_queue_new();
+  cc_expect_idx = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, cc_expect_idx_free);
   cc_list = g_sequence_new(NULL);
 
   throttle_list = g_hash_table_new_full(throttle_hash, throttle_equal, NULL, throttle_free);
-  g_timeout_add_seconds_full(G_PRIORITY_LOW, 600, throttle_purge, NULL, NULL);
+  throttle_tick = time(NULL)/THROTTLE_TICK;
+  g_timeout_add_seconds_full(G_PRIORITY_LOW, THROTTLE_TICK, throttle_purge, NULL, NULL);
+
+  hotfile_list = g_hash_table_new_full(g_int_hash, tiger_hash_equal, NULL, hotfile_free);
+  g_timeout_add_seconds_full(G_PRIORITY_LOW, HOTFILE_TIME, hotfile_purge, NULL, NULL);
+
+  listcache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, listcache_free);
+
+  filecache = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, filecache_free);
+  g_timeout_add_seconds_full(G_PRIORITY_LOW, FILECACHE_CHECK, filecache_purge, NULL, NULL);
 }
 
 
@@ -399,7 +731,7 @@ void cc_remove_hub(hub_t *hub) {
     p = n->next;
     cc_expect_t *e = n->data;
     if(e->hub == hub)
-      cc_expect_rm(n, NULL);
+      cc_expect_rm(e, NULL);
     n = p;
   }
 }
@@ -610,7 +942,7 @@ static void handle_adcsnd(cc_t *cc, gboolean tthl, guint64 start, gint64 bytes)
       cc->last_size = dl->size = bytes;
       dl->hassize = TRUE;
     }
-    net_recvfile(cc->net, bytes, dlfile_recv, handle_recvdone, cc->dlthread);
+    net_recvfile(cc->net, bytes, dlfile_recv, dlfile_recv_ready, handle_recvdone, cc->dlthread);
     cc->dlthread = NULL;
   } else {
     g_return_if_fail(start == 0 && bytes > 0 && (bytes%24) == 0 && bytes < 48*1024);
@@ -627,15 +959,16 @@ static void handle_sendcomplete(net_t *net) {
 }
 
 
-static void send_file(cc_t *cc, const char *path, guint64 start, guint64 len, gboolean flush, GError **err) {
-  int fd = 0;
-  if((fd = open(path, O_RDONLY)) < 0 || lseek(fd, start, SEEK_SET) == (off_t)-1) {
+// Sends the file from the cache if c is given, otherwise opens path.
+static void send_file(cc_t *cc, filecache_t *c, const char *path, guint64 start, guint64 len, gboolean flush, GError **err) {
+  int fd = c ? dup(c->fd) : open(path, O_RDONLY);
+  if(fd < 0) {
     // Don't give a detailed error message, the remote shouldn't know too much about us.
     g_set_error_literal(err, 1, 50, "Error opening file");
-    g_message("Error opening/seeking '%s' for sending: %s", path, g_strerror(errno));
+    g_message("Error opening '%s' for sending: %s", c ? c->path : path, g_strerror(errno));
     return;
   }
-  net_sendfile(cc->net, fd, len, flush, handle_sendcomplete);
+  net_sendfile(cc->net, fd, start, len, flush, handle_sendcomplete);
 }
 
 
@@ -655,7 +988,8 @@ static void handle_adcget(cc_t *cc, char *type, char *id, guint64 start, gint64
     char root[24];
     base32_decode(id+4, root);
     int len = 0;
-    char *dat = db_fl_gettthl(root, &len);
+    char *buf;
+    const char *dat = db_fl_gettthl(root, &len, &buf);
     if(!dat)
       g_set_error_literal(err, 1, 51, "File Not Available");
     else if(!cc->slot_granted && throttle_check(cc, root, G_MAXUINT64)) {
@@ -665,8 +999,8 @@ static void handle_adcget(cc_t *cc, char *type, char *id, guint64 start, gint64
       // no need to adc_escape(id) here, since it cannot contain any special characters
       net_writef(cc->net, cc->adc ? "CSND tthl %s 0 %d\n" : "$ADCSND tthl %s 0 %d|", id, len);
       net_write(cc->net, dat, len);
-      g_free(dat);
     }
+    g_free(buf);
     return;
   }
 
@@ -681,24 +1015,17 @@ static void handle_adcget(cc_t *cc, char *type, char *id, guint64 start, gint64
       g_set_error_literal(err, 1, 51, "File Not Available");
       return;
     }
-    // Use a targetsize of 16k for non-recursive lists and 256k for recursive
-    // ones. This should give useful results in most cases. The only exception
-    // here is Jucy, which does not handle "Incomplete" entries in a recursive
-    // list, but... yeah, that's Jucy's problem. :-)
-    GString *buf = g_string_new("");
     GError *e = NULL;
-    int len = fl_save(f, var_get(0, VAR_cid), re1 ? 256*1024 : 16*1024, zlib, buf, NULL, &e);
-    if(!len) {
+    listcache_t *l = listcache_get(f, id, zlib, re1, &e);
+    if(!l) {
       g_set_error(err, 1, 50, "Creating partial XML list: %s", e->message);
       g_error_free(e);
-      g_string_free(buf, TRUE);
       return;
     }
     char *eid = adc_escape(id, !cc->adc);
-    net_writef(cc->net, cc->adc ? "CSND list %s 0 %d%s\n" : "$ADCSND list %s 0 %d%s|", eid, len, zlib ? " ZL1" : "");
-    net_write(cc->net, buf->str, buf->len);
+    net_writef(cc->net, cc->adc ? "CSND list %s 0 %d%s\n" : "$ADCSND list %s 0 %d%s|", eid, l->len, zlib ? " ZL1" : "");
+    net_write(cc->net, l->buf->str, l->buf->len);
     g_free(eid);
-    g_string_free(buf, TRUE);
     return;
   }
 
@@ -727,20 +1054,21 @@ static void handle_adcget(cc_t *cc, char *type, char *id, guint64 start, gint64
   } else if(strncmp(id, "TTH/", 4) == 0 && istth(id+4)) {
     char root[24];
     base32_decode(id+4, root);
-    GSList *l = fl_local_from_tth(root);
-    f = l ? l->data : NULL;
-  }
-
-  if(f) {
-    char *enc_path = fl_local_path(f);
-    path = g_filename_from_utf8(enc_path, -1, NULL, NULL, NULL);
-    g_free(enc_path);
-    vpath = fl_list_path(f);
+    f = fl_local_from_tth(root);
   }
 
   // validate
   struct stat st = {};
-  if(!path || stat(path, &st) < 0 || !S_ISREG(st.st_mode) || start > st.st_size) {
+  filecache_t *fc = f ? filecache_get(f) : NULL;
+  gboolean ok = FALSE;
+  if(fc) {
+    st = fc->st;
+    ok = TRUE;
+  } else if(!f)
+    ok = path && stat(path, &st) == 0 && S_ISREG(st.st_mode);
+  if(f)
+    vpath = fl_local_vpath(f);
+  if(!ok || start > st.st_size) {
     if(st.st_size && start > st.st_size)
       g_set_error_literal(err, 1, 52, "File Part Not Available");
     else
@@ -781,7 +1109,12 @@ static void handle_adcget(cc_t *cc, char *type, char *id, guint64 start, gint64
       tmp, start, bytes);
     cc->state = CCS_TRANSFER;
     time(&cc->last_start);
-    send_file(cc, path, start, cc->last_length, strcmp(vpath, "files.xml.bz2") == 0 ? FALSE : TRUE, err);
+    // Our own file list is never purged, neither are files that other users
+    // are downloading as well. Those are read ahead instead.
+    gboolean hot = f && hotfile_add(f->tth, cc->uid);
+    if(hot)
+      fadv_readahead(fc->fd, start, MIN(bytes, HOTFILE_READAHEAD));
+    send_file(cc, fc, path, start, cc->last_length, f && !hot, err);
     g_free(tmp);
   } else {
     g_set_error_literal(err, 1, 53, "No Slots Available");
@@ -808,13 +1141,13 @@ static void handle_id(cc_t *cc, hub_user_t *u) {
   // known yet. This doesn't matter, however, as the hub already sends IP
   // information with ADC (if it didn't, we won't be able to connect in the
   // first place).
-  if(net_is_connected(cc->net) && (ip4_isany(u->ip4) && ip6_isany(u->ip6))) {
+  if(net_is_connected(cc->net) && (ip4_isany(u->ip4) && !u->ip6)) {
     yuri_t uri;
     if(yuri_parse_copy(net_remoteaddr(cc->net), &uri) == 0) {
       if(uri.hosttype == YURI_IPV4)
         u->ip4 = ip4_pack(uri.host);
       else
-        u->ip6 = ip6_pack(uri.host);
+        hub_user_setip6(u, uri.host);
       free(uri.buf);
     }
   }
@@ -866,7 +1199,7 @@ static void adc_handle(net_t *net, char *msg, int _len) {
 
   if(cmd.type != 'C') {
     g_message("CC:%s: Not a client command: %s", net_remoteaddr(cc->net), msg);
-    g_strfreev(cmd.argv);
+    adc_cmd_free(&cmd);
     return;
   }
 
@@ -903,8 +1236,8 @@ static void adc_handle(net_t *net, char *msg, int _len) {
       cc_disconnect(cc, TRUE);
     } else {
       cc->state = CCS_IDLE;;
-      char *id = adc_getparam(cmd.argv, "ID", NULL);
-      char *token = adc_getparam(cmd.argv, "TO", NULL);
+      char *id = adc_cmd_param(&cmd, 0, "ID");
+      char *token = adc_cmd_param(&cmd, 0, "TO");
       if(!id || (cc->active && !token)) {
         g_set_error_literal(&cc->err, 1, 0, "Protocol error.");
         g_message("CC:%s: No token or CID present: %s", net_remoteaddr(cc->net), msg);
@@ -958,7 +1291,7 @@ static void adc_handle(net_t *net, char *msg, int _len) {
       gint64 len = g_ascii_strtoll(cmd.argv[3], NULL, 0);
       GError *err = NULL;
       handle_adcget(cc, cmd.argv[0], cmd.argv[1], start, len,
-        cc->zlig&&adc_getparam(cmd.argv, "ZL", NULL)?TRUE:FALSE, adc_getparam(cmd.argv, "RE", NULL)?TRUE:FALSE, &err);
+        cc->zlig&&adc_cmd_param(&cmd, 0, "ZL")?TRUE:FALSE, adc_cmd_param(&cmd, 0, "RE")?TRUE:FALSE, &err);
       if(err) {
         GString *r = adc_generate('C', ADCC_STA, 0, 0);
         g_string_append_printf(r, " 1%02d", err->code);
@@ -978,7 +1311,7 @@ static void adc_handle(net_t *net, char *msg, int _len) {
       g_set_error_literal(&cc->err, 1, 0, "Protocol error.");
       g_message("CC:%s: Received message in wrong state: %s", net_remoteaddr(cc->net), msg);
       cc_disconnect(cc, TRUE);
-    } else if(adc_getparam(cmd.argv, "ZL", NULL)) {
+    } else if(adc_cmd_param(&cmd, 0, "ZL")) {
       // Even though we indicate support for ZLIG, we don't actually support
       // *receiving* zlib compressed transfers. So this is an error.
       // TODO: This is in violation with the ADC spec, to probably want to fix
@@ -1005,8 +1338,7 @@ static void adc_handle(net_t *net, char *msg, int _len) {
       } else if(strncmp(cmd.argv[1], "TTH/", 4) == 0 && istth(cmd.argv[1]+4)) {
         char root[24];
         base32_decode(cmd.argv[1]+4, root);
-        GSList *l = fl_local_from_tth(root);
-        f = l ? l->data : NULL;
+        f = fl_local_from_tth(root);
       }
       // Generate response
       GString *r;
@@ -1016,7 +1348,7 @@ static void adc_handle(net_t *net, char *msg, int _len) {
       } else {
         r = adc_generate('C', ADCC_RES, 0, 0);
         g_string_append_printf(r, " SL%d SI%"G_GUINT64_FORMAT, var_get_int(0, VAR_slots) - cc_slots_in_use(NULL), f->size);
-        char *path = fl_list_path(f);
+        char *path = fl_local_vpath(f);
         adc_append(r, "FN", path);
         g_free(path);
         if(f->isfile) {
@@ -1071,7 +1403,7 @@ static void adc_handle(net_t *net, char *msg, int _len) {
       g_set_error(&cc->err, 1, 0, "(%s) %s", cmd.argv[0], cmd.argv[1]);
       if(cmd.argv[0][0] == '2')
         cc_disconnect(cc, FALSE);
-    } else if(!adc_getparam(cmd.argv, "RF", NULL))
+    } else if(!adc_cmd_param(&cmd, 0, "RF"))
       g_message("CC:%s: Status: (%s) %s", net_remoteaddr(cc->net), cmd.argv[0], cmd.argv[1]);
     break;
 
@@ -1079,7 +1411,7 @@ static void adc_handle(net_t *net, char *msg, int _len) {
     g_message("CC:%s: Unknown command: %s", net_remoteaddr(cc->net), msg);
   }
 
-  g_strfreev(cmd.argv);
+  adc_cmd_free(&cmd);
 }
 
 
@@ -1427,13 +1759,13 @@ void cc_nmdc_connect(cc_t *cc, const char *host, unsigned short port, const char
 void cc_adc_connect(cc_t *cc, hub_user_t *u, const char *laddr, unsigned short port, gboolean tls, char *token) {
   g_return_if_fail(cc->state == CCS_CONN);
   g_return_if_fail(cc->hub);
-  g_return_if_fail(u && u->active && !(ip4_isany(u->ip4) && ip6_isany(u->ip6)));
+  g_return_if_fail(u && u->active && !(ip4_isany(u->ip4) && !u->ip6));
   cc->tls = tls;
   cc->adc = TRUE;
   cc->token = g_strdup(token);
   /* TODO: If the user has both ip4 and ip6, we should prefer the AF used to
    * connect to the hub, rather than ip4. */
-  const char *host = !ip4_isany(u->ip4) ? ip4_unpack(u->ip4) : ip6_unpack(u->ip6);
+  const char *host = !ip4_isany(u->ip4) ? ip4_unpack(u->ip4) : ip6_unpack(hub_user_ip6(u));
   g_snprintf(cc->remoteaddr, sizeof(cc->remoteaddr), ip4_isany(u->ip4) ? "[%s]:%d" : "%s:%d", host, (int)port);
 
   // check whether this was as a reply to a RCM from us
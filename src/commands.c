@@ -696,6 +696,21 @@ static void c_queue(char *args) {
 }
 
 
+static void c_perf(char *args) {
+  static perf_snap_t *last = NULL;
+  if(args[0]) {
+    ui_m(NULL, 0, "This command does not accept any arguments.");
+    return;
+  }
+  perf_snap_t *cur = perf_snapshot();
+  char *str = perf_format(last, cur, TRUE);
+  ui_mf(NULL, 0, "\n%s\n", str);
+  g_free(str);
+  g_free(last);
+  last = cur;
+}
+
+
 static void c_gc(char *args) {
   if(args[0])
     ui_m(NULL, 0, "This command does not accept any arguments.");
@@ -1272,6 +1287,7 @@ static cmd_t cmds[] = {
   { "nick",        c_nick,        NULL             },
   { "open",        c_open,        c_open_sug       },
   { "password",    c_password,    NULL             },
+  { "perf",        c_perf,        NULL             },
   { "pm",          c_msg,         c_msg_sug        },
   { "queue",       c_queue,       NULL             },
   { "quit",        c_quit,        NULL             },
@@ -33,7 +33,13 @@
 //
 // Some properties of this implementation:
 // - Multiple UPDATE/DELETE/INSERT statements in a short interval are grouped
-//   together in a single transaction.
+//   together in a single transaction. A transaction is committed after
+//   DB_FLUSH_TIMEOUT or after DB_FLUSH_QUERIES queries, whichever comes first.
+// - The database uses a write-ahead log, so a commit is a sequential append
+//   rather than a rewrite of the modified pages.
+// - Queries can be grouped into a batch with db_batch_begin() and
+//   db_batch_end(), in which case they are handed to the database thread at
+//   once and executed in the same transaction.
 // - All queries are executed in the same order as they are queued.
 
 
@@ -61,6 +67,7 @@ static GHashTable *db_stmt_cache = NULL;
 //     INT64: int64
 //     TEXT:  string
 //     BLOB:  dat
+//     BLOBTAKE: int32 length, ptr to the data. Freed by the database thread.
 //     RES:   ptr to a GAsyncQueue followed by an array of int32 DBQ_* items
 //            until DBQ_END. (Only INT, INT64, TEXT and BLOB can be used)
 //   if(type != END)
@@ -80,6 +87,7 @@ static GHashTable *db_stmt_cache = NULL;
 #define DBF_LAST    2 // Current query must be the last in a transaction (forces a flush)
 #define DBF_SINGLE  4 // Query must not be executed in a transaction (e.g. VACUUM)
 #define DBF_NOCACHE 8 // Don't cache this query in the prepared statement cache
+#define DBF_RES    16 // Query sends back results (set by db_queue_item_create())
 #define DBF_END   128 // Signal the database thread to close
 
 // Column types
@@ -91,11 +99,20 @@ static GHashTable *db_stmt_cache = NULL;
 #define DBQ_BLOB   5 // int length, char *data (NULL allowed)
 #define DBQ_RES    6
 #define DBQ_LASTID 7 // To indicate that the query wants the last inserted row id as result
+#define DBQ_BLOBTAKE 8 // int length, char *data (NULL allowed). data is g_free()'d after use.
 
 
 // How long to keep a transaction active before flushing. In microseconds.
 #define DB_FLUSH_TIMEOUT (5000000)
 
+// Maximum number of queries in a single transaction. Larger transactions are
+// committed early, to keep the WAL file and the commit latency in bounds.
+// Queries chained with DBF_NEXT are never split.
+#define DB_FLUSH_QUERIES 2000
+
+// The flags of a queue item, without modifying its read offset.
+#define db_queue_item_flags(q) (((gint32 *)(q))[1])
+
 
 // Give back a final response and unref the queue.
 static void db_queue_item_final(GAsyncQueue *res, int code, gint64 lastid) {
@@ -111,6 +128,21 @@ static void db_queue_item_final(GAsyncQueue *res, int code, gint64 lastid) {
 }
 
 
+// Skips over the value of an argument of type t, freeing it if necessary.
+static void db_queue_item_skip(char *q, int t) {
+  switch(t) {
+  case DBQ_INT:   (void)darray_get_int32(q); break;
+  case DBQ_INT64: (void)darray_get_int64(q); break;
+  case DBQ_TEXT:
+  case DBQ_BLOB:  darray_get_dat(q, NULL); break;
+  case DBQ_BLOBTAKE:
+    (void)darray_get_int32(q);
+    g_free(darray_get_ptr(q));
+    break;
+  }
+}
+
+
 // Give back an error result and decrement the reference counter of the
 // response queue. Assumes the `flags' has already been read.
 static void db_queue_item_error(char *q) {
@@ -118,7 +150,7 @@ static void db_queue_item_error(char *q) {
   b++; // otherwise gcc will complain
   int t;
   while((t = darray_get_int32(q)) != DBQ_END && t != DBQ_RES)
-    ;
+    db_queue_item_skip(q, t);
   if(t == DBQ_RES)
     db_queue_item_final(darray_get_ptr(q), SQLITE_ERROR, 0);
 }
@@ -153,6 +185,7 @@ static int db_queue_process_prepare(sqlite3 *db, const char *query, sqlite3_stmt
 // It is assumed that the first `flags' part of the queue item has already been
 // fetched.
 static int db_queue_process_one(sqlite3 *db, char *q, gboolean nocache, gboolean transaction, GAsyncQueue **res, gint64 *lastid) {
+  gint64 start = perf_start();
   char *query = darray_get_ptr(q);
   *res = NULL;
   *lastid = 0;
@@ -173,8 +206,10 @@ static int db_queue_process_one(sqlite3 *db, char *q, gboolean nocache, gboolean
   int i = 1;
   char *a;
   while((t = darray_get_int32(q)) != DBQ_END && t != DBQ_RES) {
-    if(r == SQLITE_ERROR)
+    if(r == SQLITE_ERROR) {
+      db_queue_item_skip(q, t);
       continue;
+    }
     switch(t) {
     case DBQ_NULL:
       sqlite3_bind_null(s, i);
@@ -192,6 +227,13 @@ static int db_queue_process_one(sqlite3 *db, char *q, gboolean nocache, gboolean
       a = darray_get_dat(q, &n);
       sqlite3_bind_blob(s, i, a, n, SQLITE_STATIC);
       break;
+    case DBQ_BLOBTAKE:
+      // SQLite frees the data when the parameter is re-bound or the
+      // statement is finalized, and also when binding fails.
+      n = darray_get_int32(q);
+      a = darray_get_ptr(q);
+      sqlite3_bind_blob(s, i, a, n, g_free);
+      break;
     }
     i++;
   }
@@ -246,6 +288,7 @@ static int db_queue_process_one(sqlite3 *db, char *q, gboolean nocache, gboolean
   if(nocache)
     sqlite3_finalize(s);
 
+  perf_time(db_query, start);
   return r;
 }
 
@@ -293,6 +336,7 @@ static int db_queue_process_begin(sqlite3 *db) {
 
 static void db_queue_process(sqlite3 *db) {
   gint64 trans_end = 0; // 0 if no transaction is active
+  int trans_num = 0; // number of queries in the active transaction
   gboolean donext = FALSE;
   gboolean errtrans = FALSE;
 
@@ -369,6 +413,7 @@ static void db_queue_process(sqlite3 *db) {
     // start a new transaction for normal/NEXT queries
     if(!trans_end) {
       trans_end = g_get_monotonic_time() + DB_FLUSH_TIMEOUT;
+      trans_num = 0;
       r = db_queue_process_begin(db);
       if(r != SQLITE_DONE) {
         if(flags & DBF_NEXT)
@@ -393,6 +438,11 @@ static void db_queue_process(sqlite3 *db) {
         errtrans = TRUE;
       else
         trans_end = 0;
+
+    // Commit early if the transaction has grown large enough
+    } else if(++trans_num >= DB_FLUSH_QUERIES && !(flags & DBF_NEXT)) {
+      db_queue_process_commit(db);
+      trans_end = 0;
     }
   }
 }
@@ -410,6 +460,10 @@ static gpointer db_thread_func(gpointer dat) {
 
   sqlite3_busy_timeout(db, 10);
   sqlite3_exec(db, "PRAGMA foreign_keys = FALSE", NULL, NULL, NULL);
+  // With a WAL, synchronous = NORMAL only syncs on checkpoints. A power loss
+  // may lose the last few transactions, but never corrupts the database.
+  sqlite3_exec(db, "PRAGMA journal_mode = WAL", NULL, NULL, NULL);
+  sqlite3_exec(db, "PRAGMA synchronous = NORMAL", NULL, NULL, NULL);
 
   // Create prepared statement cache and start handling queries
   db_stmt_cache = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, db_stmt_free);
@@ -422,6 +476,12 @@ static gpointer db_thread_func(gpointer dat) {
 }
 
 
+// Number of items waiting to be processed by the database thread.
+int db_queue_length() {
+  return db_queue ? g_async_queue_length(db_queue) : 0;
+}
+
+
 // Flushes the queue, blocks until all queries are processed and then performs
 // a little cleanup.
 void db_close() {
@@ -478,12 +538,23 @@ static void *db_queue_item_create(int flags, const char *q, ...) {
       } else
         darray_add_int32(a, DBQ_NULL);
       break;
+    case DBQ_BLOBTAKE:
+      t = va_arg(va, int);
+      p = va_arg(va, char *);
+      if(p) {
+        darray_add_int32(a, DBQ_BLOBTAKE);
+        darray_add_int32(a, t);
+        darray_add_ptr(a, p);
+      } else
+        darray_add_int32(a, DBQ_NULL);
+      break;
     default:
       g_return_val_if_reached(NULL);
     }
   }
 
   if(t == DBQ_RES) {
+    db_queue_item_flags(a->data) |= DBF_RES;
     darray_add_int32(a, DBQ_RES);
     GAsyncQueue *queue = va_arg(va, GAsyncQueue *);
     g_async_queue_ref(queue);
@@ -499,9 +570,74 @@ static void *db_queue_item_create(int flags, const char *q, ...) {
 }
 
 
-#define db_queue_lock() g_async_queue_lock(db_queue)
+// The batch of the current thread, NULL if no batch has been started.
+static GPrivate db_batch;
+
+
+// Pushes all queries of a batch, chained with DBF_NEXT so that they end up in
+// the same transaction. The db_queue must be locked.
+static void db_batch_flush_unlocked(GPtrArray *b) {
+  guint i;
+  for(i=0; i<b->len; i++) {
+    char *q = g_ptr_array_index(b, i);
+    if(i < b->len-1)
+      db_queue_item_flags(q) |= DBF_NEXT;
+    g_async_queue_push_unlocked(db_queue, q);
+  }
+  g_ptr_array_set_size(b, 0);
+}
+
+
+// Queues an item, or adds it to the batch of the current thread. Queries that
+// send back results are never delayed, the caller would wait forever.
+static void db_queue_add(char *q) {
+  GPtrArray *b = g_private_get(&db_batch);
+  if(b && !(db_queue_item_flags(q) & (DBF_RES|DBF_LAST|DBF_SINGLE))) {
+    g_ptr_array_add(b, q);
+    return;
+  }
+  g_async_queue_lock(db_queue);
+  if(b)
+    db_batch_flush_unlocked(b);
+  g_async_queue_push_unlocked(db_queue, q);
+  g_async_queue_unlock(db_queue);
+}
+
+
+// Starts a batch for the current thread. Fire-and-forget queries queued
+// before the matching db_batch_end() are sent to the database thread at once
+// and executed in a single transaction. This avoids taking the queue lock and
+// waking up the database thread for every row when many rows are added.
+void db_batch_begin() {
+  g_return_if_fail(!g_private_get(&db_batch));
+  g_private_set(&db_batch, g_ptr_array_new());
+}
+
+
+void db_batch_end() {
+  GPtrArray *b = g_private_get(&db_batch);
+  g_return_if_fail(b);
+  g_private_set(&db_batch, NULL);
+  if(b->len) {
+    g_async_queue_lock(db_queue);
+    db_batch_flush_unlocked(b);
+    g_async_queue_unlock(db_queue);
+  }
+  g_ptr_array_unref(b);
+}
+
+
+// Locks the queue. Any pending batch is pushed first, to keep the queries in
+// order.
+static void db_queue_lock() {
+  g_async_queue_lock(db_queue);
+  GPtrArray *b = g_private_get(&db_batch);
+  if(b)
+    db_batch_flush_unlocked(b);
+}
+
 #define db_queue_unlock() g_async_queue_unlock(db_queue)
-#define db_queue_push(...) g_async_queue_push(db_queue, db_queue_item_create(__VA_ARGS__))
+#define db_queue_push(...) db_queue_add(db_queue_item_create(__VA_ARGS__))
 #define db_queue_push_unlocked(...) g_async_queue_push_unlocked(db_queue, db_queue_item_create(__VA_ARGS__))
 
 
@@ -509,21 +645,409 @@ static void *db_queue_item_create(int flags, const char *q, ...) {
 
 
 
+// TTHL store
+//
+// With tthl_store enabled, the TTHL data of newly hashed files is appended to
+// tthl.dat in the session directory instead of the hashdata table. In that
+// case hashdata.tthloff holds the offset of the record in the file and
+// hashdata.tthl is empty. A record consists of:
+//   char root[24]
+//   guint32 length (host byte order)
+//   char data[length]
+// The file is only appended to by the hasher threads, and mmap()'d for
+// reading. Records that are not referenced anymore are reclaimed by
+// db_tthl_compact() on /gc, which writes the live records to tthl.dat.new.
+// The new offsets are committed together with a DB_TTHL_SWAP row in the vars
+// table, and tthl.dat is only replaced after that. If ncdc is stopped in
+// between, db_tthl_recover() finishes or discards the swap on the next start,
+// depending on whether the row is present.
+
+#define DB_TTHL_HEAD 28
+#define DB_TTHL_SWAP "tthl_swap"
+
+static GMutex db_tthl_lock; // protects db_tthl_fd, db_tthl_end, db_tthl_gen and db_tthl_compacting
+static int db_tthl_fd = -1;
+static guint64 db_tthl_end = 0;
+static guint db_tthl_gen = 0; // incremented when the store has been replaced
+static gboolean db_tthl_compacting = FALSE;
+// Only accessed from the main thread
+static char *db_tthl_map = NULL;
+static guint64 db_tthl_maplen = 0;
+static guint db_tthl_mapgen = 0;
+
+
+// Opens the store, if it isn't open already. db_tthl_lock must be held.
+static gboolean db_tthl_open(gboolean create) {
+  if(db_tthl_fd >= 0)
+    return TRUE;
+  char *fn = g_build_filename(db_dir, "tthl.dat", NULL);
+  db_tthl_fd = open(fn, O_RDWR|(create ? O_CREAT : 0), 0600);
+  if(db_tthl_fd < 0 && (create || errno != ENOENT))
+    g_warning("Unable to open `%s': %s", fn, g_strerror(errno));
+  g_free(fn);
+  if(db_tthl_fd < 0)
+    return FALSE;
+  // A partially written record at the end of the file is simply ignored,
+  // it will be removed on the next compaction.
+  struct stat st;
+  db_tthl_end = fstat(db_tthl_fd, &st) ? 0 : st.st_size;
+  return TRUE;
+}
+
+
+// Writes a record at the given offset of fd.
+static gboolean db_tthl_write(int fd, guint64 off, const char *root, const char *tthl, int len) {
+  char head[DB_TTHL_HEAD];
+  guint32 l = len;
+  memcpy(head, root, 24);
+  memcpy(head+24, &l, 4);
+  if(pwrite(fd, head, DB_TTHL_HEAD, off) != DB_TTHL_HEAD || pwrite(fd, tthl, len, off+DB_TTHL_HEAD) != len) {
+    g_warning("Error writing to the TTHL store: %s", g_strerror(errno));
+    return FALSE;
+  }
+  return TRUE;
+}
+
+
+// Appends a record and returns its offset, or -1 on error. db_tthl_lock must
+// be held.
+static gint64 db_tthl_append(const char *root, const char *tthl, int len) {
+  if(!db_tthl_open(TRUE) || !db_tthl_write(db_tthl_fd, db_tthl_end, root, tthl, len))
+    return -1;
+  gint64 off = db_tthl_end;
+  db_tthl_end += DB_TTHL_HEAD+len;
+  return off;
+}
+
+
+// Reads the complete record at the given offset of a store that is 'end'
+// bytes long into buf. Returns FALSE if there is no valid record for the
+// root.
+static gboolean db_tthl_read(int fd, guint64 end, gint64 off, const char *root, GString *buf) {
+  char head[DB_TTHL_HEAD];
+  guint32 len;
+  if(off < 0 || pread(fd, head, DB_TTHL_HEAD, off) != DB_TTHL_HEAD || memcmp(head, root, 24) != 0)
+    return FALSE;
+  memcpy(&len, head+24, 4);
+  if(off+DB_TTHL_HEAD+len > end)
+    return FALSE;
+  g_string_set_size(buf, DB_TTHL_HEAD+len);
+  memcpy(buf->str, head, DB_TTHL_HEAD);
+  return pread(fd, buf->str+DB_TTHL_HEAD, len, off+DB_TTHL_HEAD) == len;
+}
+
+
+static void db_tthl_unmap() {
+  if(db_tthl_map)
+    munmap(db_tthl_map, db_tthl_maplen);
+  db_tthl_map = NULL;
+  db_tthl_maplen = 0;
+}
+
+
+// Returns a pointer to the TTHL data of the record at the given offset, or
+// NULL if there is no valid record for the root. The mapping is extended when
+// the record lies beyond it, and replaced after a compaction. Must be called
+// from the main thread, the pointer remains valid until the next call.
+static const char *db_tthl_get(gint64 off, const char *root, int *len) {
+  g_mutex_lock(&db_tthl_lock);
+  gboolean open = db_tthl_open(FALSE);
+  guint64 end = db_tthl_end;
+  if(!open || off < 0 || off+DB_TTHL_HEAD > end) {
+    g_mutex_unlock(&db_tthl_lock);
+    return NULL;
+  }
+
+  if(db_tthl_mapgen != db_tthl_gen || off+DB_TTHL_HEAD > db_tthl_maplen) {
+    db_tthl_unmap();
+    db_tthl_map = mmap(NULL, end, PROT_READ, MAP_SHARED, db_tthl_fd, 0);
+    if(db_tthl_map == MAP_FAILED) {
+      g_warning("Unable to mmap() the TTHL store: %s", g_strerror(errno));
+      db_tthl_map = NULL;
+      g_mutex_unlock(&db_tthl_lock);
+      return NULL;
+    }
+    db_tthl_maplen = end;
+    db_tthl_mapgen = db_tthl_gen;
+  }
+  g_mutex_unlock(&db_tthl_lock);
+
+  const char *rec = db_tthl_map+off;
+  guint32 l;
+  memcpy(&l, rec+24, 4);
+  if(memcmp(rec, root, 24) != 0 || off+DB_TTHL_HEAD+l > db_tthl_maplen)
+    return NULL;
+  *len = l;
+  return rec+DB_TTHL_HEAD;
+}
+
+
+// Finishes or discards a compaction that was interrupted, see
+// db_tthl_compact(). Called on startup, before the store is opened.
+static void db_tthl_recover() {
+  char *fn = g_build_filename(db_dir, "tthl.dat", NULL);
+  char *newfn = g_build_filename(db_dir, "tthl.dat.new", NULL);
+
+  GAsyncQueue *a = g_async_queue_new_full(g_free);
+  db_queue_push(0, "SELECT 1 FROM vars WHERE name = ? AND hub = 0",
+    DBQ_TEXT, DB_TTHL_SWAP,
+    DBQ_RES, a, DBQ_INT,
+    DBQ_END
+  );
+  char *r = g_async_queue_pop(a);
+  gboolean swap = darray_get_int32(r) == SQLITE_ROW;
+  g_free(r);
+  if(swap) {
+    r = g_async_queue_pop(a);
+    g_free(r);
+  }
+  g_async_queue_unref(a);
+
+  if(!swap)
+    unlink(newfn);
+  else if(rename(newfn, fn) < 0 && errno != ENOENT)
+    g_warning("Unable to rename `%s' to `%s': %s", newfn, fn, g_strerror(errno));
+  else
+    db_queue_push(0, "DELETE FROM vars WHERE name = ? AND hub = 0", DBQ_TEXT, DB_TTHL_SWAP, DBQ_END);
+
+  g_free(fn);
+  g_free(newfn);
+}
+
+
+// A record that has moved, or TTHL data that has been moved from the hashdata
+// table to the store.
+typedef struct db_tthl_move_t {
+  char hash[40];
+  gint64 off;
+  gboolean migrate;
+} db_tthl_move_t;
+
+
+// Copies 'len' bytes at 'from' in the current store to 'to' in fd.
+// db_tthl_lock must be held.
+static gboolean db_tthl_copy(int fd, guint64 from, guint64 to, guint64 len) {
+  char buf[64*1024];
+  while(len > 0) {
+    int r = pread(db_tthl_fd, buf, MIN(len, sizeof(buf)), from);
+    if(r <= 0 || pwrite(fd, buf, r, to) != r)
+      return FALSE;
+    from += r;
+    to += r;
+    len -= r;
+  }
+  return TRUE;
+}
+
+
+static gpointer db_tthl_compact_thread(gpointer dat) {
+  gboolean migrate = GPOINTER_TO_INT(dat);
+  char *fn = g_build_filename(db_dir, "tthl.dat", NULL);
+  char *newfn = g_build_filename(db_dir, "tthl.dat.new", NULL);
+  GArray *moves = g_array_new(FALSE, FALSE, sizeof(db_tthl_move_t));
+  GAsyncQueue *a = g_async_queue_new_full(g_free);
+  GString *buf = g_string_new("");
+  db_tthl_move_t m;
+  char root[24];
+  guint64 w = 0;
+  int moved = 0, added = 0;
+  gboolean err = FALSE;
+  char *r;
+
+  int fd = open(newfn, O_RDWR|O_CREAT|O_TRUNC, 0600);
+  if(fd < 0) {
+    g_warning("Unable to open `%s': %s", newfn, g_strerror(errno));
+    g_mutex_lock(&db_tthl_lock);
+    goto done;
+  }
+
+  // Only records before 'end' are considered here. The hashers only append to
+  // the store, and the rows of their records are queued while holding the
+  // lock, so the rows returned by this query all point before 'end'.
+  g_mutex_lock(&db_tthl_lock);
+  int oldfd = db_tthl_fd;
+  guint64 end = db_tthl_end, oldsize = end;
+  db_queue_push(DBF_NOCACHE, "SELECT root, tthloff FROM hashdata WHERE tthloff IS NOT NULL ORDER BY tthloff",
+    DBQ_RES, a, DBQ_TEXT, DBQ_INT64,
+    DBQ_END
+  );
+  g_mutex_unlock(&db_tthl_lock);
+
+  while((r = g_async_queue_pop(a)) && darray_get_int32(r) == SQLITE_ROW) {
+    char *hash = darray_get_string(r);
+    gint64 off = darray_get_int64(r);
+    base32_decode(hash, root);
+    if(!err && db_tthl_read(oldfd, end, off, root, buf)) {
+      if(pwrite(fd, buf->str, buf->len, w) != (ssize_t)buf->len) {
+        g_warning("Error writing to the TTHL store: %s", g_strerror(errno));
+        err = TRUE;
+      } else {
+        if(off != (gint64)w) {
+          strcpy(m.hash, hash);
+          m.off = w;
+          m.migrate = FALSE;
+          g_array_append_val(moves, m);
+          moved++;
+        }
+        w += buf->len;
+      }
+    }
+    g_free(r);
+  }
+  g_free(r);
+
+  if(migrate && !err) {
+    db_queue_push(DBF_NOCACHE, "SELECT root, tthl FROM hashdata WHERE tthloff IS NULL AND length(tthl) > 0",
+      DBQ_RES, a, DBQ_TEXT, DBQ_BLOB,
+      DBQ_END
+    );
+    while((r = g_async_queue_pop(a)) && darray_get_int32(r) == SQLITE_ROW) {
+      char *hash = darray_get_string(r);
+      int len;
+      char *dat = darray_get_dat(r, &len);
+      base32_decode(hash, root);
+      if(!err && db_tthl_write(fd, w, root, dat, len)) {
+        strcpy(m.hash, hash);
+        m.off = w;
+        m.migrate = TRUE;
+        g_array_append_val(moves, m);
+        added++;
+        w += DB_TTHL_HEAD+len;
+      } else
+        err = TRUE;
+      g_free(r);
+    }
+    g_free(r);
+  }
+
+  // Everything that has been appended in the meantime is still referenced,
+  // copy it as a whole. From here on the hashers have to wait until the store
+  // has been replaced. They would have to wait for the database anyway.
+  g_mutex_lock(&db_tthl_lock);
+  guint64 tail = db_tthl_end - end;
+  if(!err && (!db_tthl_copy(fd, end, w, tail) || fsync(fd) < 0)) {
+    g_warning("Error writing to the TTHL store: %s", g_strerror(errno));
+    err = TRUE;
+  }
+  if(err)
+    goto done;
+
+  // Update the offsets and mark the new store as current in a single
+  // transaction. The tail is shifted first, while it is still the only part
+  // of the store at or after 'end'.
+  int i;
+  db_queue_lock();
+  if(tail)
+    db_queue_push_unlocked(DBF_NEXT, "UPDATE hashdata SET tthloff = tthloff + ? WHERE tthloff >= ?",
+      DBQ_INT64, (gint64)w - (gint64)end, DBQ_INT64, (gint64)end, DBQ_END);
+  for(i=0; i<moves->len; i++) {
+    db_tthl_move_t *mv = &g_array_index(moves, db_tthl_move_t, i);
+    db_queue_push_unlocked(DBF_NEXT, mv->migrate
+        ? "UPDATE hashdata SET tthl = '', tthloff = ? WHERE root = ?"
+        : "UPDATE hashdata SET tthloff = ? WHERE root = ?",
+      DBQ_INT64, mv->off, DBQ_TEXT, mv->hash, DBQ_END);
+  }
+  db_queue_push_unlocked(DBF_NEXT, "INSERT OR REPLACE INTO vars (name, hub, value) VALUES (?, 0, '1')",
+    DBQ_TEXT, DB_TTHL_SWAP, DBQ_END);
+  db_queue_push_unlocked(DBF_LAST|DBF_NOCACHE, "SELECT 1", DBQ_RES, a, DBQ_END);
+  db_queue_unlock();
+  g_free(g_async_queue_pop(a));
+
+  // The rows now point into the new store, so it is used from here on even if
+  // the rename fails; db_tthl_recover() will try again on the next start.
+  gboolean renamed = rename(newfn, fn) == 0;
+  if(!renamed)
+    g_warning("Unable to rename `%s' to `%s': %s", newfn, fn, g_strerror(errno));
+  else {
+    int dir = open(db_dir, O_RDONLY);
+    if(dir >= 0) {
+      fsync(dir);
+      close(dir);
+    }
+  }
+  close(db_tthl_fd);
+  db_tthl_fd = fd;
+  db_tthl_end = w + tail;
+  db_tthl_gen++;
+  fd = -1;
+  if(renamed)
+    db_queue_push(0, "DELETE FROM vars WHERE name = ? AND hub = 0", DBQ_TEXT, DB_TTHL_SWAP, DBQ_END);
+
+  g_message("TTHL store compacted from %"G_GUINT64_FORMAT" to %"G_GUINT64_FORMAT" bytes, %d records moved and %d added.",
+    oldsize+tail, db_tthl_end, moved, added);
+
+done:
+  db_tthl_compacting = FALSE;
+  g_mutex_unlock(&db_tthl_lock);
+  if(fd >= 0) {
+    close(fd);
+    unlink(newfn);
+  }
+  g_async_queue_unref(a);
+  g_string_free(buf, TRUE);
+  g_array_unref(moves);
+  g_free(fn);
+  g_free(newfn);
+  return NULL;
+}
+
+
+// Removes records that are not referenced from the hashdata table anymore. If
+// tthl_store is enabled, TTHL data that is still in the hashdata table is
+// moved to the store as well. The live records are copied to a new store in a
+// separate thread, the hashers are only kept from adding new records while
+// the new offsets are committed and the stores are swapped.
+static void db_tthl_compact() {
+  g_mutex_lock(&db_tthl_lock);
+  gboolean migrate = var_get_bool(0, VAR_tthl_store);
+  gboolean start = !db_tthl_compacting && db_tthl_open(migrate);
+  if(start)
+    db_tthl_compacting = TRUE;
+  g_mutex_unlock(&db_tthl_lock);
+  if(start)
+    g_thread_unref(g_thread_new("tthl compact", db_tthl_compact_thread, GINT_TO_POINTER(migrate)));
+}
+
+
+
+
 // hashdata and hashfiles
 
-// Adds a file to hashfiles and, if not present yet, hashdata. Returns the new hashfiles.id.
-gint64 db_fl_addhash(const char *path, guint64 size, time_t lastmod, const char *root, const char *tthl, int tthl_len) {
+// Adds a file to hashfiles and, if not present yet, hashdata. Returns the new
+// hashfiles.id. Takes ownership of the g_malloc()'d tthl data, which is
+// handed to SQLite without copying.
+gint64 db_fl_addhash(const char *path, guint64 size, time_t lastmod, const char *root, char *tthl, int tthl_len) {
   char hash[40] = {};
   base32_encode(root, hash);
 
+  // The store lock is held until the row has been queued, so that
+  // db_tthl_compact() never sees a record without its row.
+  gint64 off = -1;
+  if(var_get_bool(0, VAR_tthl_store)) {
+    g_mutex_lock(&db_tthl_lock);
+    off = db_tthl_append(root, tthl, tthl_len);
+    if(off < 0)
+      g_mutex_unlock(&db_tthl_lock);
+  }
+
   db_queue_lock();
-  db_queue_push_unlocked(DBF_NEXT,
-    "INSERT OR IGNORE INTO hashdata (root, size, tthl) VALUES(?, ?, ?)",
-    DBQ_TEXT, hash,
-    DBQ_INT64, (gint64)size,
-    DBQ_BLOB, tthl_len, tthl,
-    DBQ_END
-  );
+  if(off >= 0) {
+    g_free(tthl);
+    db_queue_push_unlocked(DBF_NEXT,
+      "INSERT OR IGNORE INTO hashdata (root, size, tthl, tthloff) VALUES(?, ?, '', ?)",
+      DBQ_TEXT, hash,
+      DBQ_INT64, (gint64)size,
+      DBQ_INT64, off,
+      DBQ_END
+    );
+  } else
+    db_queue_push_unlocked(DBF_NEXT,
+      "INSERT OR IGNORE INTO hashdata (root, size, tthl) VALUES(?, ?, ?)",
+      DBQ_TEXT, hash,
+      DBQ_INT64, (gint64)size,
+      DBQ_BLOBTAKE, tthl_len, tthl,
+      DBQ_END
+    );
 
   // hashfiles.
   // Note that it in certain situations it may happen that a row with the same
@@ -540,6 +1064,8 @@ gint64 db_fl_addhash(const char *path, guint64 size, time_t lastmod, const char
     DBQ_END
   );
   db_queue_unlock();
+  if(off >= 0)
+    g_mutex_unlock(&db_tthl_lock);
 
   char *r = g_async_queue_pop(a);
   guint64 id = darray_get_int32(r) == SQLITE_DONE ? darray_get_int64(r) : 0;
@@ -549,25 +1075,36 @@ gint64 db_fl_addhash(const char *path, guint64 size, time_t lastmod, const char
 }
 
 
-// Fetch the tthl data associated with a TTH root. Return value must be
-// g_free()'d. Returns NULL on error or when it's not in the DB.
-char *db_fl_gettthl(const char *root, int *len) {
+// Fetch the tthl data associated with a TTH root. Returns NULL on error or
+// when it's not in the DB. If the data is in the TTHL store, the returned
+// pointer points into the mapped store and remains valid until the next call.
+// Otherwise it is a copy that is also stored in *buf, which must be
+// g_free()'d. Must be called from the main thread.
+const char *db_fl_gettthl(const char *root, int *len, char **buf) {
   char hash[40] = {};
   base32_encode(root, hash);
 
   GAsyncQueue *a = g_async_queue_new_full(g_free);
-  db_queue_push(0, "SELECT COALESCE(tthl, '') FROM hashdata WHERE root = ?",
+  db_queue_push(0, "SELECT COALESCE(tthl, ''), COALESCE(tthloff, -1) FROM hashdata WHERE root = ?",
     DBQ_TEXT, hash,
-    DBQ_RES, a, DBQ_BLOB,
+    DBQ_RES, a, DBQ_BLOB, DBQ_INT64,
     DBQ_END
   );
 
   char *r = g_async_queue_pop(a);
   int n = 0;
-  char *res = darray_get_int32(r) == SQLITE_ROW ? darray_get_dat(r, &n) : NULL;
-  res = n ? g_memdup(res, n) : NULL;
+  const char *res = NULL;
+  *buf = NULL;
+  if(darray_get_int32(r) == SQLITE_ROW) {
+    char *dat = darray_get_dat(r, &n);
+    gint64 off = darray_get_int64(r);
+    if(off >= 0)
+      res = db_tthl_get(off, root, &n);
+    else if(n)
+      res = *buf = g_memdup(dat, n);
+  }
   if(len)
-    *len = n;
+    *len = res ? n : 0;
 
   g_free(r);
   g_async_queue_unref(a);
@@ -646,6 +1183,7 @@ void db_fl_purgedata() {
   db_queue_push_unlocked(DBF_NEXT, "DELETE FROM hashdata WHERE NOT EXISTS(SELECT 1 FROM hashfiles WHERE tth = root)", DBQ_END);
   db_queue_push_unlocked(0, "DROP INDEX hashfiles_tth_gc", DBQ_END);
   db_queue_unlock();
+  db_tthl_compact();
 }
 
 
@@ -825,6 +1363,32 @@ void db_dl_adduser(const char *tth, guint64 uid, char error, const char *error_m
 }
 
 
+// Fetch the tthl data of a dl row. Return value must be g_free()'d. Returns
+// NULL on error or when it's not in the DB.
+char *db_dl_gettthl(const char *tth, int *len) {
+  char hash[40] = {};
+  base32_encode(tth, hash);
+
+  GAsyncQueue *a = g_async_queue_new_full(g_free);
+  db_queue_push(0, "SELECT COALESCE(tthl, '') FROM dl WHERE tth = ?",
+    DBQ_TEXT, hash,
+    DBQ_RES, a, DBQ_BLOB,
+    DBQ_END
+  );
+
+  char *r = g_async_queue_pop(a);
+  int n = 0;
+  char *res = darray_get_int32(r) == SQLITE_ROW ? darray_get_dat(r, &n) : NULL;
+  res = n ? g_memdup(res, n) : NULL;
+  if(len)
+    *len = n;
+
+  g_free(r);
+  g_async_queue_unref(a);
+  return res;
+}
+
+
 gboolean db_dl_checkhash(const char *root, int num, const char *hash) {
   char rhash[40] = {};
   base32_encode(root, rhash);
@@ -1526,12 +2090,13 @@ static void db_init_schema() {
   // New database? Initialize schema.
   if(ver == 0) {
     db_queue_lock();
-    db_queue_push_unlocked(DBF_NEXT|DBF_NOCACHE, "PRAGMA user_version = 2", DBQ_END);
+    db_queue_push_unlocked(DBF_NEXT|DBF_NOCACHE, "PRAGMA user_version = 3", DBQ_END);
     db_queue_push_unlocked(DBF_NEXT|DBF_NOCACHE,
       "CREATE TABLE hashdata ("
       "  root TEXT NOT NULL PRIMARY KEY,"
       "  size INTEGER NOT NULL,"
-      "  tthl BLOB NOT NULL"
+      "  tthl BLOB NOT NULL,"
+      "  tthloff INTEGER"
       ")", DBQ_END);
     db_queue_push_unlocked(DBF_NEXT|DBF_NOCACHE,
       "CREATE TABLE hashfiles ("
@@ -1594,6 +2159,20 @@ static void db_init_schema() {
     g_free(r);
     g_async_queue_unref(a);
   }
+
+  // Version 2 didn't have hashdata.tthloff
+  if(ver == 1 || ver == 2) {
+    db_queue_lock();
+    GAsyncQueue *a = g_async_queue_new_full(g_free);
+    db_queue_push_unlocked(DBF_NEXT|DBF_NOCACHE, "PRAGMA user_version = 3", DBQ_END);
+    db_queue_push_unlocked(DBF_LAST|DBF_NOCACHE, "ALTER TABLE hashdata ADD COLUMN tthloff INTEGER", DBQ_RES, a, DBQ_END);
+    db_queue_unlock();
+    char *r = g_async_queue_pop(a);
+    if(darray_get_int32(r) != SQLITE_DONE)
+      g_error("Error updating database schema.");
+    g_free(r);
+    g_async_queue_unref(a);
+  }
 }
 
 
@@ -1612,7 +2191,7 @@ void db_init() {
   db_queue = g_async_queue_new();
   db_thread = g_thread_new("database thread", db_thread_func, g_build_filename(db_dir, "db.sqlite3", NULL));
 
-  db_init_schema();
+  db_init_schema();  db_tthl_recover();
 }
 
 
@@ -51,6 +51,13 @@ struct dl_user_t {
   cc_t *cc;             // Always when state = IDL or ACT, may be set or NULL in EXP
   GSequence *queue;     // list of dl_user_dl_t, ordered by dl_user_dl_sort()
   dl_user_dl_t *active; // when state = DLU_ACT, the dud that is being downloaded (NULL if it had been removed from the queue while downloading)
+  int sched;            // index into dl_sched, -1 if the user is not in the heap
+  // Heap key, a snapshot of the user state and of the dl item that would be
+  // downloaded from them, taken by dl_sched_update(). See dl_sched_cmp().
+  gboolean sched_idl : 1;
+  gboolean sched_islist : 1;
+  signed char sched_prio;
+  char *sched_dest;
 };
 
 /* State machine for dl_user.state:
@@ -120,8 +127,13 @@ struct dl_t {
   char *dest;            // destination path
   GSequenceIter *iter;   // used by ui_dl
   GSList *threads;       // maintained by dlfile.c
+  GSequence *threadidx;  // index of the threads, maintained by dlfile.c
   guint8 *bitmap;        // Only used if hastthl, maintained by dlfile.c
+  char *tthl;            // In-memory copy of the TTHL data while downloading, maintained by dlfile.c
+  int tthl_len;
   guint bitmap_src;      // timeout source for flushing the bitmap, maintained by dlfile.c
+  GQueue wqueue;         // dlfile_write_t's waiting for the writer, protected by dlfile_write_lock
+  gboolean wbusy;        // whether a writer thread is handling wqueue, protected by dlfile_write_lock
   /* Maintained by dlfile.c, protects dl_t.{have,bitmap,bitmap_src} and
    * dlfile_thread_t.{allocated,avail,chunk}.
    * Some other fields are shared, too, but those are never modified while a
@@ -175,6 +187,11 @@ char *dl_strerror(char err, const char *sub) {
 // dl_user_t related functions
 
 static gboolean dl_user_waitdone(gpointer dat);
+static void dl_sched_update(dl_user_t *du);
+static void dl_sched_remove(dl_user_t *du);
+
+// Number of users in the DLU_ACT state
+static int dl_sched_active = 0;
 
 
 // Determine whether a dl_user_dl struct can be considered as "enabled".
@@ -217,14 +234,17 @@ static void dl_user_dl_free(gpointer x) {
 // Get the highest-priority file in the users' queue that is not already being
 // downloaded. This function can be assumed to be relatively fast, in most
 // cases the first iteration will be enough, in the worst case it at most
-// <download_slots> iterations.
+// <download_slots> iterations. A file that is already being downloaded
+// entirely may still be returned for a connected user that is fast enough to
+// take over from a slow source, see dlfile_endgame().
 // Returns NULL if there is no dl item in the queue that is enabled and not
 // being downloaded.
 static dl_user_dl_t *dl_user_getdl(const dl_user_t *du) {
   GSequenceIter *i = g_sequence_get_begin_iter(du->queue);
   for(; !g_sequence_iter_is_end(i); i=g_sequence_iter_next(i)) {
     dl_user_dl_t *dud = g_sequence_get(i);
-    if(dl_user_dl_enabled(dud) && !dud->dl->allbusy)
+    if(dl_user_dl_enabled(dud) && (!dud->dl->allbusy
+        || (du->cc && dlfile_endgame(dud->dl, du->uid, ratecalc_rate(net_rate_in(du->cc->net))))))
       return dud;
   }
   return NULL;
@@ -246,6 +266,12 @@ static void dl_user_setstate(dl_user_t *du, int state) {
   if(state >= 0 && du->state == DLU_ACT && state != DLU_ACT && du->active)
     du->active = NULL;
 
+  // Keep track of the number of used download slots
+  if(state >= 0 && du->state == DLU_ACT && state != DLU_ACT)
+    dl_sched_active--;
+  else if(state >= 0 && du->state != DLU_ACT && state == DLU_ACT)
+    dl_sched_active++;
+
   // Set state
   //g_debug("dlu:%"G_GINT64_MODIFIER"x: %d -> %d (active = %s)", du->uid, du->state, state, du->active ? "true":"false");
   if(state >= 0)
@@ -253,14 +279,15 @@ static void dl_user_setstate(dl_user_t *du, int state) {
 
   // Check whether there is any value in keeping this dl_user struct in memory
   if(du->state == DLU_NCO && !g_sequence_get_length(du->queue)) {
+    dl_sched_remove(du);
     g_hash_table_remove(queue_users, &du->uid);
     g_sequence_free(du->queue);
     g_slice_free(dl_user_t, du);
     return;
   }
 
-  // Check whether we can initiate a download again. (We could be more
-  // selective here to possibly decrease CPU usage, but oh well.)
+  // Check whether we can initiate a download again.
+  dl_sched_update(du);
   dl_queue_start();
 }
 
@@ -292,7 +319,16 @@ void dl_user_cc(guint64 uid, cc_t *cc) {
 // get from that user. May be called with uid=0 after joining a hub, in which
 // case all users in the queue will be checked.
 void dl_user_join(guint64 uid) {
-  if(!uid || g_hash_table_lookup(queue_users, &uid))
+  dl_user_t *du = uid ? g_hash_table_lookup(queue_users, &uid) : NULL;
+  if(du)
+    dl_sched_update(du);
+  else if(!uid) {
+    GHashTableIter iter;
+    g_hash_table_iter_init(&iter, queue_users);
+    while(g_hash_table_iter_next(&iter, NULL, (gpointer *)&du))
+      dl_sched_update(du);
+  }
+  if(!uid || du)
     dl_queue_start();
 }
 
@@ -310,6 +346,7 @@ static void dl_user_add(dl_t *dl, guint64 uid, char error, const char *error_msg
     du->state = DLU_NCO;
     du->uid = uid;
     du->queue = g_sequence_new(dl_user_dl_free);
+    du->sched = -1;
     g_hash_table_insert(queue_users, &du->uid, du);
   }
 
@@ -323,6 +360,7 @@ static void dl_user_add(dl_t *dl, guint64 uid, char error, const char *error_msg
   // Add to du->queue and dl->u
   g_ptr_array_add(dl->u, g_sequence_insert_sorted(du->queue, dud, dl_user_dl_sort, NULL));
   uit_dl_dud_listchange(dud, UITDL_ADD);
+  dl_sched_update(du);
 }
 
 
@@ -404,78 +442,208 @@ static gboolean dl_queue_start_user(dl_user_t *du) {
 }
 
 
+// Scheduler: a binary heap of all users that are a possible target (as
+// determined by dl_queue_start_istarget()), ordered by the priority to
+// download from them. A user is (re)positioned in the heap by
+// dl_sched_update() whenever something changes that may affect its position.
+// The heap only compares the key stored in dl_user_t, so outdated keys don't
+// break the heap itself. Not every change is reported, however (e.g. a user
+// leaving a hub or a dlfile thread taking the last free segment), so the top
+// of the heap is validated before it is used, and the heap is rebuilt from
+// all users when it turns out to be outdated. It is also rebuilt periodically
+// to catch users that became a target without anything calling
+// dl_sched_update(), see dl_queue_check().
+static GPtrArray *dl_sched = NULL;
+static gboolean dl_sched_stale = FALSE;
+
+
 // Compares two dl_user structs by a "priority" to determine from whom to
 // download first. Note that users in the IDL state always get priority over
 // users in the NCO state, in order to prevent the situation that the
 // lower-priority user in the IDL state is connected to anyway in a next
 // iteration. Returns -1 if a has a higher priority than b.
-// This function assumes dl_queue_start_istarget() for both arguments.
-static gint dl_queue_start_cmp(gconstpointer a, gconstpointer b) {
-  const dl_user_t *ua = a;
-  const dl_user_t *ub = b;
-  return -1*(
-    ua->state == DLU_IDL && ub->state != DLU_IDL ?  1 :
-    ua->state != DLU_IDL && ub->state == DLU_IDL ? -1 :
-    dl_user_dl_sort(dl_user_getdl(ub), dl_user_getdl(ua), NULL)
-  );
+// The remaining keys are the same as in dl_user_dl_sort(), except that the dl
+// items are always enabled.
+static gint dl_sched_cmp(const dl_user_t *a, const dl_user_t *b) {
+  return
+    a->sched_idl && !b->sched_idl ? -1 :
+    !a->sched_idl && b->sched_idl ?  1 :
+    a->sched_islist && !b->sched_islist ? -1 :
+    !a->sched_islist && b->sched_islist ?  1 :
+    a->sched_prio > b->sched_prio ? -1 :
+    a->sched_prio < b->sched_prio ?  1 :
+    strcmp(a->sched_dest, b->sched_dest);
 }
 
 
-// Initiates a new connection to a user or requests a file from an already
-// connected user, based on the current state of dl_user and dl structs.  This
-// function is relatively slow, so is executed from a timeout to bulk-check
-// everything after some state variables have changed. Should not be called
-// directly, use dl_queue_start() instead.
-static gboolean dl_queue_start_do(gpointer dat) {
-  int freeslots = var_get_int(0, VAR_download_slots);
-
-  // Walk through all users in the queue and:
-  // - determine possible targets to connect to or to start a transfer from
-  // - determine the highest-priority target
-  // - calculate freeslots
-  GPtrArray *targets = g_ptr_array_new();
-  dl_user_t *du, *target = NULL;
-  int target_i = 0;
+// Returns the dl item that the heap key of the user should be based on, or
+// NULL if the user is not a target.
+static dl_user_dl_t *dl_sched_dud(dl_user_t *du) {
+  return dl_queue_start_istarget(du) ? dl_user_getdl(du) : NULL;
+}
+
+
+static void dl_sched_setkey(dl_user_t *du, const dl_user_dl_t *dud) {
+  du->sched_idl = du->state == DLU_IDL;
+  du->sched_islist = dud->dl->islist;
+  du->sched_prio = dud->dl->prio;
+  if(!du->sched_dest || strcmp(du->sched_dest, dud->dl->dest) != 0) {
+    g_free(du->sched_dest);
+    du->sched_dest = g_strdup(dud->dl->dest);
+  }
+}
+
+
+// Whether the user is still a target and its key is still up to date.
+static gboolean dl_sched_valid(dl_user_t *du) {
+  const dl_user_dl_t *dud = dl_sched_dud(du);
+  return dud && du->sched_idl == (du->state == DLU_IDL) && du->sched_islist == dud->dl->islist
+    && du->sched_prio == dud->dl->prio && strcmp(du->sched_dest, dud->dl->dest) == 0;
+}
+
+
+static void dl_sched_set(int i, dl_user_t *du) {
+  g_ptr_array_index(dl_sched, i) = du;
+  du->sched = i;
+}
+
+
+static void dl_sched_up(int i) {
+  dl_user_t *du = g_ptr_array_index(dl_sched, i);
+  while(i > 0) {
+    dl_user_t *p = g_ptr_array_index(dl_sched, (i-1)/2);
+    if(dl_sched_cmp(p, du) <= 0)
+      break;
+    dl_sched_set(i, p);
+    i = (i-1)/2;
+  }
+  dl_sched_set(i, du);
+}
+
+
+static void dl_sched_down(int i) {
+  dl_user_t *du = g_ptr_array_index(dl_sched, i);
+  int n = dl_sched->len;
+  while(2*i+1 < n) {
+    int c = 2*i+1;
+    if(c+1 < n && dl_sched_cmp(g_ptr_array_index(dl_sched, c+1), g_ptr_array_index(dl_sched, c)) < 0)
+      c++;
+    dl_user_t *cu = g_ptr_array_index(dl_sched, c);
+    if(dl_sched_cmp(du, cu) <= 0)
+      break;
+    dl_sched_set(i, cu);
+    i = c;
+  }
+  dl_sched_set(i, du);
+}
+
+
+static void dl_sched_remove(dl_user_t *du) {
+  int i = du->sched;
+  if(i < 0)
+    return;
+  du->sched = -1;
+  g_free(du->sched_dest);
+  du->sched_dest = NULL;
+  dl_user_t *last = g_ptr_array_remove_index(dl_sched, dl_sched->len-1);
+  if(last == du)
+    return;
+  dl_sched_set(i, last);
+  dl_sched_up(i);
+  dl_sched_down(last->sched);
+}
+
+
+// Adds, repositions or removes a user in the heap, depending on its current
+// state.
+static void dl_sched_update(dl_user_t *du) {
+  const dl_user_dl_t *dud = dl_sched_dud(du);
+  if(!dud) {
+    dl_sched_remove(du);
+    return;
+  }
+  dl_sched_setkey(du, dud);
+  if(du->sched < 0) {
+    g_ptr_array_add(dl_sched, du);
+    dl_sched_up(dl_sched->len-1);
+  } else {
+    dl_sched_up(du->sched);
+    dl_sched_down(du->sched);
+  }
+}
+
+
+// Updates the key of every user and rebuilds the heap.
+static void dl_sched_rebuild() {
+  int i;
+  for(i=0; i<dl_sched->len; i++)
+    ((dl_user_t *)g_ptr_array_index(dl_sched, i))->sched = -1;
+  g_ptr_array_set_size(dl_sched, 0);
+
   GHashTableIter iter;
+  dl_user_t *du;
   g_hash_table_iter_init(&iter, queue_users);
   while(g_hash_table_iter_next(&iter, NULL, (gpointer *)&du)) {
-    if(du->state == DLU_ACT)
-      freeslots--;
-    if(dl_queue_start_istarget(du)) {
-      if(!target || dl_queue_start_cmp(target, du) > 0) {
-        target_i = targets->len;
-        target = du;
-      }
-      g_ptr_array_add(targets, du);
+    const dl_user_dl_t *dud = dl_sched_dud(du);
+    if(dud) {
+      dl_sched_setkey(du, dud);
+      g_ptr_array_add(dl_sched, du);
+      du->sched = dl_sched->len-1;
+    } else if(du->sched_dest) {
+      g_free(du->sched_dest);
+      du->sched_dest = NULL;
     }
   }
+  for(i=dl_sched->len/2-1; i>=0; i--)
+    dl_sched_down(i);
+  dl_sched_stale = FALSE;
+}
 
-  // Try to connect to the previously found highest-priority target, then go
-  // through the list again to eliminate any users that may not be a target
-  // anymore and to fetch a new highest-priority target.
-  while(freeslots > 0 && target) {
-    if(dl_queue_start_user(target) && !--freeslots)
-      break;
-    g_ptr_array_remove_index_fast(targets, target_i);
-
-    int i = 0;
-    target = NULL;
-    while(i < targets->len) {
-      du = g_ptr_array_index(targets, i);
-      if(!dl_queue_start_istarget(du))
-        g_ptr_array_remove_index_fast(targets, i);
-      else {
-        if(!target || dl_queue_start_cmp(target, du) > 0) {
-          target_i = i;
-          target = du;
-        }
-        i++;
-      }
+
+// To be called when something has changed to a dl item that affects its
+// users, e.g. its priority or whether there's a segment available for
+// downloading.
+void dl_sched_dl(dl_t *dl) {
+  int i;
+  for(i=0; i<dl->u->len; i++)
+    dl_sched_update(((dl_user_dl_t *)g_sequence_get(g_ptr_array_index(dl->u, i)))->u);
+  dl_queue_start();
+}
+
+
+// Initiates a new connection to a user or requests a file from an already
+// connected user, based on the current state of dl_user and dl structs. This
+// function is executed from a timeout to bulk-check everything after some
+// state variables have changed. Should not be called directly, use
+// dl_queue_start() instead.
+static gboolean dl_queue_start_do(gpointer dat) {
+  int freeslots = var_get_int(0, VAR_download_slots) - dl_sched_active;
+
+  // Take the highest-priority target from the heap. Its key may be outdated,
+  // in which case the entire heap is rebuilt. The top is used right after a
+  // rebuild, and dl_queue_start_user() takes the user out of the heap, so this
+  // loop always terminates.
+  gboolean rebuilt = FALSE;
+  if(dl_sched_stale && freeslots > 0) {
+    dl_sched_rebuild();
+    rebuilt = TRUE;
+  }
+  while(freeslots > 0 && dl_sched->len) {
+    dl_user_t *du = g_ptr_array_index(dl_sched, 0);
+    if(!rebuilt && !dl_sched_valid(du)) {
+      dl_sched_rebuild();
+      rebuilt = TRUE;
+      continue;
+    }
+    rebuilt = FALSE;
+    if(!dl_queue_start_istarget(du)) {
+      dl_sched_remove(du);
+      continue;
     }
+    if(dl_queue_start_user(du) && !--freeslots)
+      break;
   }
 
-  g_ptr_array_unref(targets);
-
   // Reset this value *after* performing all the checks and starts, to ignore
   // any dl_queue_start() calls while this function was working - this function
   // already takes those changes into account anyway.
@@ -498,6 +666,40 @@ void dl_queue_start() {
 }
 
 
+// Called from the one-second timer. Every DL_SCHED_RECHECK seconds, the heap
+// is marked as outdated and rebuilt if there are free download slots, so that
+// users that became a target without a dl_sched_update() are considered.
+//
+// Idle connected users are checked every second. Whether they can take over
+// a segment in the endgame (see dlfile_endgame()) depends on transfer rates,
+// which change all the time without any event to trigger a check.
+#define DL_SCHED_RECHECK 10
+
+void dl_queue_check() {
+  static int n = 0;
+  if(var_get_int(0, VAR_download_slots) <= dl_sched_active)
+    return;
+  if(++n >= DL_SCHED_RECHECK) {
+    n = 0;
+    dl_sched_stale = TRUE;
+    dl_queue_start();
+    return;
+  }
+
+  gboolean found = FALSE;
+  GHashTableIter iter;
+  dl_user_t *du;
+  g_hash_table_iter_init(&iter, queue_users);
+  while(g_hash_table_iter_next(&iter, NULL, (gpointer *)&du))
+    if(du->state == DLU_IDL && du->sched < 0) {
+      dl_sched_update(du);
+      found = found || du->sched >= 0;
+    }
+  if(found)
+    dl_queue_start();
+}
+
+
 
 
 
@@ -604,26 +806,31 @@ void dl_queue_add_fl(guint64 uid, fl_list_t *fl, char *base, GRegex *excl) {
   }
   {
     // don't download already shared files if download_shared is set to false.
-    GSList *localfl = fl_local_from_tth(fl->tth);
-    if(!var_get_bool(0, VAR_download_shared) && fl->hastth && localfl && localfl->data) {
-      fl_list_t *localf = localfl->data;
+    fl_list_t *localf = fl_local_from_tth(fl->tth);
+    if(!var_get_bool(0, VAR_download_shared) && fl->hastth && localf) {
       ui_mf(NULL, 0, "Ignoring `%s' : already shared as `%s'", fl->name, localf->name);
       return;
     }
   }
 
 
+  // Queue the database rows of a whole directory in a single batch
+  if(!base)
+    db_batch_begin();
   char *name = base ? g_build_filename(base, fl->name, NULL) : g_strdup(fl->name);
   if(fl->isfile) {
     if(!dl_queue_addfile(uid, fl->tth, fl->size, name))
       ui_mf(NULL, 0, "Ignoring `%s': already queued.", name);
   } else {
+    fl_list_expand(fl);
     int i;
     for(i=0; i<fl->sub->len; i++)
       dl_queue_add_fl(uid, g_ptr_array_index(fl->sub, i), name, excl);
   }
-  if(!base)
+  if(!base) {
+    db_batch_end();
     ui_mf(NULL, 0, "%s added to queue.", name);
+  }
   g_free(name);
 }
 
@@ -662,23 +869,31 @@ int dl_queue_matchfile(guint64 uid, char *tth) {
 }
 
 
+typedef struct dl_queue_match_t {
+  guint64 uid;
+  int n;
+  int *added;
+} dl_queue_match_t;
+
+
+static void dl_queue_match_tth(const char *tth, gpointer dat) {
+  dl_queue_match_t *m = dat;
+  int r = dl_queue_matchfile(m->uid, (char *)tth);
+  if(r == 1)
+    (*m->added)++;
+  if(r >= 0)
+    m->n++;
+}
+
+
 // Recursively walks through the file list and adds the user to matching dl
 // items. Returns the number of items found, and the number of items for which
 // the user was added is stored in *added (should be initialized to zero).
+// Lazily loaded lists are not expanded.
 int dl_queue_match_fl(guint64 uid, fl_list_t *fl, int *added) {
-  if(fl->isfile && fl->hastth) {
-    int r = dl_queue_matchfile(uid, fl->tth);
-    if(r == 1)
-      (*added)++;
-    return r >= 0 ? 1 : 0;
-
-  } else {
-    int n = 0;
-    int i;
-    for(i=0; i<fl->sub->len; i++)
-      n += dl_queue_match_fl(uid, g_ptr_array_index(fl->sub, i), added);
-    return n;
-  }
+  dl_queue_match_t m = { uid, 0, added };
+  fl_list_foreach_tth(fl, dl_queue_match_tth, &m);
+  return m.n;
 }
 
 
@@ -729,12 +944,10 @@ void dl_queue_setprio(dl_t *dl, signed char prio) {
   for(i=0; i<dl->u->len; i++)
     g_sequence_sort_changed(g_ptr_array_index(dl->u, i), dl_user_dl_sort, NULL);
   // Start downloading or re-attempt finalization if it is enabled
-  if(enabled) {
-    if(!dl->active_threads && (dl->hassize || !dl->islist) && dl->have == dl->size)
-      dlfile_finished(dl);
-    else
-      dl_queue_start();
-  }
+  if(enabled && !dl->active_threads && (dl->hassize || !dl->islist) && dl->have == dl->size)
+    dlfile_finished(dl);
+  else
+    dl_sched_dl(dl);
   /* TODO: Disconnect active users if the dl item is disabled */
 }
 
@@ -791,6 +1004,7 @@ void dl_queue_setuerr(guint64 uid, char *tth, char e, const char *emsg) {
   // update DB
   db_dl_setuerr(uid, tth, e, emsg);
 
+  dl_sched_update(du);
   dl_queue_start();
 }
 
@@ -910,6 +1124,10 @@ void dl_settthl(guint64 uid, char *tth, char *tthl, int len) {
   db_dl_settthl(tth, tthl, newlen);
   dl->hastthl = TRUE;
   dl->hash_block = bs;
+  // No need to fetch this from the database again in dlfile_open()
+  g_free(dl->tthl);
+  dl->tthl = g_memdup(tthl, newlen);
+  dl->tthl_len = newlen;
 }
 
 
@@ -953,7 +1171,9 @@ void dl_load_dlu(const char *tth, guint64 uid, char error, const char *error_msg
 
 
 void dl_init_global() {
+  dlfile_init_global();
   queue_users = g_hash_table_new(g_int64_hash, g_int64_equal);
+  dl_sched = g_ptr_array_new();
   dl_queue = g_hash_table_new(g_int_hash, tiger_hash_equal);
   // load stuff from the database
   db_dl_getdls(dl_load_dl);
@@ -38,6 +38,12 @@
  * segment: A range of chunks that is requested for downloading in a single
  *          CGET/$ADCGET. Not necessarily aligned to or a multiple of the block
  *          size. Segments are allocated at the start of a thread.
+ *
+ * The threads of a file are also kept in dl->threadidx, ordered by what
+ * dlfile_getchunk() is looking for: idle threads with the most undownloaded
+ * chunks first, followed by busy threads with the most unallocated chunks.
+ * Neither of these change while data is being received, as both avail and
+ * allocated are decremented at the same time.
  */
 
 
@@ -60,6 +66,20 @@ struct dlfile_thread_t {
   guint32 chunk;     /* Current chunk number */
   guint32 len;       /* Number of bytes downloaded into this chunk */
   gboolean busy;     /* Whether this thread is being used */
+  gboolean preempted;/* Taken over by a faster source, stop receiving data */
+  GSequenceIter *idx;/* Position in dl->threadidx, NULL if not indexed */
+  /* Used to measure the rate of the current segment */
+  gint64 seg_start;
+  guint64 seg_recv;
+  /* Write-behind buffer, holds the received part of the current chunk */
+  char *wbuf;
+  guint64 wbufoff;
+  guint32 wbuflen;
+  /* Protected by dlfile_write_lock */
+  int wpending;      /* Number of queued dlfile_write_t's */
+  char *werr;        /* Error from the writer thread */
+  gboolean wpaused;  /* Reading has been paused by dlfile_recv_ready() */
+  gboolean wdone;    /* dlfile_recv_done() is waiting for the writer */
   /* Fields for deferred error reporting */
   guint64 uid;
   char *err_msg, *uerr_msg;
@@ -69,6 +89,45 @@ struct dlfile_thread_t {
 #endif
 
 
+/* Received data is written to disk by a pool of writer threads rather than by
+ * the transfer threads themselves, so that a slow disk doesn't directly stall
+ * the network reads, and writes happen in whole chunks. Each file has its own
+ * queue (dl->wqueue) that is handled by at most one writer at a time, so
+ * requests for a single file are handled in FIFO order while different files
+ * can be written in parallel. Bitmap updates are done by the writer after the
+ * data has been written, so the bitmap never claims data that isn't on disk
+ * yet. */
+typedef struct {
+  dlfile_thread_t *t;
+  char *buf;       /* NULL if there's nothing to write */
+  guint64 off;
+  guint32 len;
+  gboolean mark;   /* Mark 'chunk' as downloaded once written */
+  guint32 chunk;
+  guint32 unmark;  /* Mark this many chunks starting at 'chunk' as not downloaded */
+} dlfile_write_t;
+
+/* Max. number of queued requests for a single thread. Reading from the
+ * network is paused when this is reached, as a form of backpressure when the
+ * disk can't keep up. */
+#define DLFILE_WRITE_MAX 16
+
+/* Max. number of writer threads */
+#define DLFILE_WRITERS 4
+
+static GThreadPool *dlfile_writer = NULL;
+static GMutex dlfile_write_lock;
+
+
+/* Endgame: When there are no free blocks left, a source that is at least
+ * DLFILE_ENDGAME_FACTOR times faster may take over the remaining part of a
+ * busy thread, if that saves at least DLFILE_ENDGAME_MIN seconds. The rate of
+ * a source is only considered after DLFILE_RATE_MIN seconds of measurement. */
+#define DLFILE_ENDGAME_FACTOR 2
+#define DLFILE_ENDGAME_MIN 60
+#define DLFILE_RATE_MIN 10
+
+
 static guint32 dlfile_chunks(guint64 size) {
   return (size+DLFILE_CHUNKSIZE-1)/DLFILE_CHUNKSIZE;
 }
@@ -81,6 +140,125 @@ static gboolean dlfile_hasfreeblock(dlfile_thread_t *t) {
 }
 
 
+/* Measured rate of the current segment of a busy thread, 0 if unknown. Must
+ * be called with dl->lock held. */
+static guint64 dlfile_thread_rate(dlfile_thread_t *t) {
+  gint64 elapsed = g_get_monotonic_time() - t->seg_start;
+  if(!t->busy || elapsed < DLFILE_RATE_MIN*G_USEC_PER_SEC)
+    return 0;
+  return t->seg_recv * G_USEC_PER_SEC / elapsed;
+}
+
+
+static gint dlfile_thread_cmp(gconstpointer a, gconstpointer b, gpointer dat) {
+  const dlfile_thread_t *x = a;
+  const dlfile_thread_t *y = b;
+  guint32 kx = x->busy ? x->avail - x->allocated : x->avail;
+  guint32 ky = y->busy ? y->avail - y->allocated : y->avail;
+  return x->busy != y->busy ? (x->busy ? 1 : -1)
+    : kx != ky ? (kx > ky ? -1 : 1)
+    : x < y ? -1 : x > y ? 1 : 0;
+}
+
+
+/* Creates dl->threadidx if it doesn't exist yet. Must be called with dl->lock
+ * held, not used for file lists. */
+static void dlfile_index(dl_t *dl) {
+  if(dl->threadidx)
+    return;
+  dl->threadidx = g_sequence_new(NULL);
+  GSList *l;
+  for(l=dl->threads; l; l=l->next) {
+    dlfile_thread_t *t = l->data;
+    t->idx = g_sequence_insert_sorted(dl->threadidx, t, dlfile_thread_cmp, NULL);
+  }
+}
+
+
+static void dlfile_index_add(dlfile_thread_t *t) {
+  if(t->dl->threadidx)
+    t->idx = g_sequence_insert_sorted(t->dl->threadidx, t, dlfile_thread_cmp, NULL);
+}
+
+
+static void dlfile_index_changed(dlfile_thread_t *t) {
+  if(t->idx)
+    g_sequence_sort_changed(t->idx, dlfile_thread_cmp, NULL);
+}
+
+
+static void dlfile_index_rm(dlfile_thread_t *t) {
+  if(t->idx)
+    g_sequence_remove(t->idx);
+  t->idx = NULL;
+}
+
+
+/* Returns an idle thread to continue downloading from, or otherwise a busy
+ * thread that has an unallocated block that can be split off, or NULL if
+ * neither exists. Must be called with dl->lock held. */
+static dlfile_thread_t *dlfile_findfree(dl_t *dl) {
+  dlfile_index(dl);
+  GSequenceIter *i = g_sequence_get_begin_iter(dl->threadidx);
+  for(; !g_sequence_iter_is_end(i); i=g_sequence_iter_next(i)) {
+    dlfile_thread_t *t = g_sequence_get(i);
+    if(!t->busy) {
+      if(t->avail)
+        return t;
+      continue;
+    }
+    /* This is true for the first busy thread unless no thread has a full
+     * unallocated block left. After that point, only the partial block at
+     * the end of the file can still be free, which may require looking at
+     * the remaining threads. */
+    if(dlfile_hasfreeblock(t))
+      return t;
+  }
+  return NULL;
+}
+
+
+/* Finds a busy thread that would be finished much sooner if its remaining
+ * chunks were downloaded again from the start of its current block by a
+ * source with the given rate. Must be called with dl->lock held. */
+static dlfile_thread_t *dlfile_endgame_victim(dl_t *dl, guint64 uid, guint64 speed) {
+  if(dl->islist || !speed)
+    return NULL;
+  guint32 chunksinblock = dl->hash_block / DLFILE_CHUNKSIZE;
+  dlfile_thread_t *v = NULL;
+  guint64 best = 0;
+  GSList *l;
+  for(l=dl->threads; l; l=l->next) {
+    dlfile_thread_t *t = l->data;
+    /* A thread that is exactly at a block boundary may still be checking
+     * the hash of its previous block. */
+    if(!t->busy || t->preempted || t->uid == uid || !t->avail || !(t->chunk % chunksinblock || t->len))
+      continue;
+    guint64 rate = dlfile_thread_rate(t);
+    if(!rate)
+      continue;
+    guint64 end = MIN((guint64)(t->chunk + t->avail) * DLFILE_CHUNKSIZE, dl->size);
+    guint64 left = (end - ((guint64)t->chunk * DLFILE_CHUNKSIZE + t->len)) / rate;
+    guint64 redo = (end - (guint64)(t->chunk / chunksinblock) * dl->hash_block) / speed;
+    if(left >= DLFILE_ENDGAME_MIN + redo && left >= DLFILE_ENDGAME_FACTOR * redo && left - redo > best) {
+      best = left - redo;
+      v = t;
+    }
+  }
+  return v;
+}
+
+
+/* Whether dlfile_getchunk() would take over a thread for a source with the
+ * given rate. Only relevant when dl->allbusy. */
+gboolean dlfile_endgame(dl_t *dl, guint64 uid, guint64 speed) {
+  g_mutex_lock(&dl->lock);
+  gboolean r = dlfile_endgame_victim(dl, uid, speed) != NULL;
+  g_mutex_unlock(&dl->lock);
+  return r;
+}
+
+
 /* Highly verbose debugging function. Prints out a list of threads for a particular dl item. */
 static void dlfile_threaddump(dl_t *dl, int n) {
 #if 0
@@ -141,6 +319,146 @@ static void dlfile_save_bitmap_defer(dl_t *dl) {
 }
 
 
+static void dlfile_recv_finish(dlfile_thread_t *t);
+
+static gboolean dlfile_recv_finish_idle(gpointer dat) {
+  dlfile_recv_finish(dat);
+  return FALSE;
+}
+
+
+static void dlfile_write_do(dlfile_write_t *w) {
+  dlfile_thread_t *t = w->t;
+  dl_t *dl = t->dl;
+  const char *err = NULL;
+
+  off_t off = w->off;
+  size_t rem = w->len;
+  const char *buf = w->buf;
+  while(rem > 0) {
+    ssize_t r = pwrite(dl->incfd, buf, rem, off);
+    if(r <= 0) {
+      err = g_strerror(errno);
+      break;
+    }
+    off += r;
+    rem -= r;
+    buf += r;
+  }
+  if(w->len && !err)
+    fadv_oneshot(dl->incfd, w->off, w->len, VAR_FFC_DOWNLOAD);
+
+  if((w->mark && !err) || w->unmark) {
+    g_mutex_lock(&dl->lock);
+    guint32 i;
+    if(w->mark && !err)
+      bita_set(dl->bitmap, w->chunk);
+    for(i=w->chunk; i<w->chunk+w->unmark; i++)
+      bita_reset(dl->bitmap, i);
+    dlfile_save_bitmap_defer(dl);
+    g_mutex_unlock(&dl->lock);
+  }
+
+  if(err) {
+    g_mutex_lock(&dlfile_write_lock);
+    if(!t->werr)
+      t->werr = g_strdup(err);
+    g_mutex_unlock(&dlfile_write_lock);
+  }
+}
+
+
+/* Handles the queue of a single file. */
+static void dlfile_write_thread(gpointer dat, gpointer udat) {
+  dl_t *dl = dat;
+
+  g_mutex_lock(&dlfile_write_lock);
+  dlfile_write_t *w = g_queue_pop_head(&dl->wqueue);
+  while(w) {
+    g_mutex_unlock(&dlfile_write_lock);
+    dlfile_write_do(w);
+    g_free(w->buf);
+
+    g_mutex_lock(&dlfile_write_lock);
+    dlfile_thread_t *t = w->t;
+    g_slice_free(dlfile_write_t, w);
+    t->wpending--;
+    /* Nothing may touch dl after the last request has been handled, the
+     * completion of dlfile_recv_done() may free it. Any remaining requests
+     * belong to threads that are still active, which keeps dl alive. */
+    w = g_queue_pop_head(&dl->wqueue);
+    if(!w)
+      dl->wbusy = FALSE;
+    if(t->wpaused && t->wpending < DLFILE_WRITE_MAX) {
+      t->wpaused = FALSE;
+      net_syn_wake();
+    }
+    if(t->wdone && !t->wpending) {
+      t->wdone = FALSE;
+      g_idle_add(dlfile_recv_finish_idle, t);
+    }
+  }
+  g_mutex_unlock(&dlfile_write_lock);
+}
+
+
+/* Never blocks, so that it can be called with dl->lock held. Requests that
+ * have to be ordered with respect to a takeover in dlfile_getchunk() must be
+ * queued while holding dl->lock. */
+static void dlfile_write_push(dlfile_thread_t *t, dlfile_write_t *w) {
+  w->t = t;
+  g_mutex_lock(&dlfile_write_lock);
+  t->wpending++;
+  g_queue_push_tail(&t->dl->wqueue, w);
+  gboolean start = !t->dl->wbusy;
+  t->dl->wbusy = TRUE;
+  if(start)
+    g_thread_pool_push(dlfile_writer, t->dl, NULL);
+  g_mutex_unlock(&dlfile_write_lock);
+}
+
+
+/* Queues the write-behind buffer of t. If mark is set, 'chunk' is set in the
+ * bitmap after the data has been written. */
+static void dlfile_write_flush(dlfile_thread_t *t, gboolean mark, guint32 chunk) {
+  if(!t->wbuf)
+    return;
+  dlfile_write_t *w = g_slice_new0(dlfile_write_t);
+  w->buf = t->wbuf;
+  w->off = t->wbufoff;
+  w->len = t->wbuflen;
+  w->mark = mark;
+  w->chunk = chunk;
+  t->wbuf = NULL;
+  t->wbuflen = 0;
+  dlfile_write_push(t, w);
+}
+
+
+/* Moves an error reported by the writer to t->err. Returns TRUE if there was
+ * an error. */
+static gboolean dlfile_write_error(dlfile_thread_t *t) {
+  g_mutex_lock(&dlfile_write_lock);
+  char *err = t->werr;
+  t->werr = NULL;
+  g_mutex_unlock(&dlfile_write_lock);
+  if(!err)
+    return FALSE;
+  if(!t->err) {
+    t->err = DLE_IO_INC;
+    t->err_msg = err;
+  } else
+    g_free(err);
+  return TRUE;
+}
+
+
+void dlfile_init_global() {
+  g_mutex_init(&dlfile_write_lock);
+  dlfile_writer = g_thread_pool_new(dlfile_write_thread, NULL, DLFILE_WRITERS, TRUE, NULL);
+}
+
+
 static void dlfile_load_canconvert(dl_t *dl) {
   static gboolean canconvert = FALSE;
   if(canconvert)
@@ -349,7 +667,12 @@ void dlfile_rm(dl_t *dl) {
   for(l=dl->threads; l; l=l->next)
     g_slice_free(dlfile_thread_t, l->data);
   g_slist_free(dl->threads);
+  if(dl->threadidx)
+    g_sequence_free(dl->threadidx);
+  dl->threadidx = NULL;
   g_free(dl->bitmap);
+  g_free(dl->tthl);
+  dl->tthl = NULL;
 }
 
 
@@ -364,6 +687,11 @@ static gboolean dlfile_open(dl_t *dl) {
     return FALSE;
   }
 
+  /* Keep the TTHL data in memory while downloading, so that verifying a block
+   * doesn't require a round trip to the database thread. */
+  if(!dl->islist && dl->hastthl && !dl->tthl && dl->size >= dl->hash_block)
+    dl->tthl = db_dl_gettthl(dl->hash, &dl->tthl_len);
+
   /* Everything else has already been initialized if we have a thread or bitmap */
   if(dl->threads || dl->bitmap)
     return TRUE;
@@ -396,6 +724,9 @@ void dlfile_finished(dl_t *dl) {
   if(dl->incfd <= 0 && !dlfile_open(dl))
     return;
 
+  g_free(dl->tthl);
+  dl->tthl = NULL;
+
   /* Regular files: Remove bitmap from the file
    * File lists: Ensure that the file size is correct after we've downloaded a
    *   longer file list before that got interrupted. */
@@ -476,37 +807,68 @@ dlfile_thread_t *dlfile_getchunk(dl_t *dl, guint64 uid, guint64 speed) {
     return t;
   }
 
-  /* Walk through the threads and look for:
-   *      t = Thread with largest avail and with allocated = 0
-   *   tsec = Thread with an unallocated block and largest avail-allocated
-   */
-  dlfile_thread_t *tsec = NULL;
-  GSList *l;
-
   g_mutex_lock(&dl->lock);
   dlfile_threaddump(dl, 1);
-  for(l=dl->threads; l; l=l->next) {
-    dlfile_thread_t *ti = l->data;
-    if(ti->avail && (!tsec || ti->avail-ti->allocated > tsec->avail-tsec->allocated) && dlfile_hasfreeblock(ti))
-      tsec = ti;
-    if(!ti->busy && (!t || ti->avail > t->avail))
-      t = ti;
-  }
+  guint32 chunksinblock = dl->hash_block/DLFILE_CHUNKSIZE;
+  dlfile_thread_t *v = NULL;
+  guint32 unmark = 0;
+  t = dlfile_findfree(dl);
+
+  /* Split off a new thread from the unallocated part of a busy thread. The
+   * split point is chosen such that both sources are expected to finish at
+   * the same time, or in the middle if the rates aren't known yet. */
+  if(t && t->busy) {
+    dlfile_thread_t *tsec = t;
+    guint32 lo = tsec->chunk + tsec->allocated;
+    guint32 hi = tsec->chunk + tsec->avail;
+    guint64 rsec = dlfile_thread_rate(tsec);
+    guint64 x = (hi - lo) / 2;
+    if(rsec && speed) {
+      gint64 y = ((gint64)(hi - lo) * rsec - (gint64)tsec->allocated * speed) / (gint64)(rsec + speed);
+      x = CLAMP(y, 0, (gint64)(hi - lo));
+    }
+    guint32 bmin = ((lo + chunksinblock - 1) / chunksinblock) * chunksinblock;
+    guint32 bmax = ((hi - 1) / chunksinblock) * chunksinblock;
+    guint32 chunk = ((lo + x) / chunksinblock) * chunksinblock;
+    chunk = CLAMP(chunk, bmin, bmax);
 
-  if(!t) {
-    guint32 chunksinblock = dl->hash_block/DLFILE_CHUNKSIZE;
-    guint32 chunk = ((tsec->chunk + tsec->allocated + (tsec->avail - tsec->allocated)/2) / chunksinblock) * chunksinblock;
-    if(chunk < tsec->chunk + tsec->allocated) /* Only possible for the last block in the file */
-      chunk += chunksinblock;
     t = g_slice_new0(dlfile_thread_t);
     t->dl = dl;
     t->chunk = chunk;
-    t->avail = tsec->avail - (chunk - tsec->chunk);
-    g_return_val_if_fail(t->avail > 0, NULL);
+    t->avail = hi - chunk;
     tth_init(&t->hash_tth);
 
     tsec->avail -= t->avail;
+    dlfile_index_changed(tsec);
     dl->threads = g_slist_prepend(dl->threads, t);
+    dlfile_index_add(t);
+
+  /* Endgame, take over the remaining chunks of a slow thread, starting from
+   * its current block. Its progress within that block is lost, as the hash
+   * of a block can only be calculated from its start. */
+  } else if(!t && (v = dlfile_endgame_victim(dl, uid, speed))) {
+    guint32 bstart = (v->chunk / chunksinblock) * chunksinblock;
+    g_message("Taking over chunks %u-%u of `%s' from a slow source (%"G_GUINT64_FORMAT" B/s).",
+      bstart, v->chunk + v->avail, dl->dest, dlfile_thread_rate(v));
+    unmark = v->chunk - bstart;
+    dl->have -= (guint64)unmark * DLFILE_CHUNKSIZE + v->len;
+
+    t = g_slice_new0(dlfile_thread_t);
+    t->dl = dl;
+    t->chunk = bstart;
+    t->avail = v->chunk + v->avail - bstart;
+    tth_init(&t->hash_tth);
+
+    v->preempted = TRUE;
+    v->avail = v->allocated = 0;
+    dlfile_index_changed(v);
+    dl->threads = g_slist_prepend(dl->threads, t);
+    dlfile_index_add(t);
+  }
+
+  if(!t) {
+    g_mutex_unlock(&dl->lock);
+    return NULL;
   }
 
   /* Number of chunks to request as one segment. The size of a segment is
@@ -520,15 +882,24 @@ dlfile_thread_t *dlfile_getchunk(dl_t *dl, guint64 uid, guint64 speed) {
     t->allocated = t->avail;
   t->busy = TRUE;
   t->uid = uid;
+  t->seg_start = g_get_monotonic_time();
+  t->seg_recv = 0;
+  dlfile_index_changed(t);
   dl->active_threads++;
 
-  /* Go through the list again to update dl->allbusy */
-  for(l=dl->threads; l; l=l->next) {
-    dlfile_thread_t *ti = l->data;
-    if(ti->avail && (!ti->busy || dlfile_hasfreeblock(ti)))
-      break;
+  dl->allbusy = !dlfile_findfree(dl);
+
+  /* The chunks of the preempted thread in its current block are not
+   * downloaded anymore. This goes through the writer, so that it happens
+   * after any pending writes of the preempted thread. Those are queued with
+   * dl->lock held, so holding it here as well ensures that the final chunk
+   * of the preempted thread can't be marked after this. */
+  if(unmark) {
+    dlfile_write_t *w = g_slice_new0(dlfile_write_t);
+    w->chunk = t->chunk;
+    w->unmark = unmark;
+    dlfile_write_push(v, w);
   }
-  dl->allbusy = !l;
 
   dlfile_threaddump(dl, 2);
   g_mutex_unlock(&dl->lock);
@@ -538,15 +909,28 @@ dlfile_thread_t *dlfile_getchunk(dl_t *dl, guint64 uid, guint64 speed) {
 }
 
 
+/* Verifies a leaf against the in-memory TTHL data, falling back to the
+ * database if that couldn't be loaded. */
+static gboolean dlfile_checkhash(dl_t *dl, guint32 num, const char *leaf) {
+  if(dl->size < dl->hash_block)
+    return memcmp(leaf, dl->hash, 24) == 0;
+  if(dl->tthl)
+    return (num+1)*24 <= (guint32)dl->tthl_len && memcmp(dl->tthl+(num*24), leaf, 24) == 0;
+  return db_dl_checkhash(dl->hash, num, leaf);
+}
+
+
 static gboolean dlfile_recv_check(dlfile_thread_t *t, char *leaf) {
   guint32 num = (t->chunk-1)/(t->dl->hash_block / DLFILE_CHUNKSIZE);
-  if(t->dl->size < t->dl->hash_block ? memcmp(leaf, t->dl->hash, 24) == 0 : db_dl_checkhash(t->dl->hash, num, leaf))
+  if(dlfile_checkhash(t->dl, num, leaf))
     return TRUE;
 
   g_mutex_lock(&t->dl->lock);
 
   /* Hash failure, remove the failed block from the bitmap and dl->have, and
-   * reset this thread so that the block can be re-downloaded. */
+   * reset this thread so that the block can be re-downloaded. (A thread is
+   * never preempted while it may be checking a block, see
+   * dlfile_endgame_victim()) */
   guint32 startchunk = num * (t->dl->hash_block / DLFILE_CHUNKSIZE);
   // Or: chunksinblock = MIN(t->dl->hash_block / DLFILE_CHUNKSIZE, dlfile_chunks(t->dl->size) - startchunk);
   guint32 chunksinblock = t->chunk - startchunk;
@@ -555,61 +939,56 @@ static gboolean dlfile_recv_check(dlfile_thread_t *t, char *leaf) {
   t->allocated += chunksinblock;
   t->dl->have -= MIN(t->dl->hash_block, t->dl->size - (guint64)startchunk * DLFILE_CHUNKSIZE);
 
-  guint32 i;
-  for(i=startchunk; i<startchunk+chunksinblock; i++)
-    bita_set(t->dl->bitmap, i);
-  dlfile_save_bitmap_defer(t->dl);
-
   g_mutex_unlock(&t->dl->lock);
 
+  /* Goes through the writer, so that it happens after the chunks have been
+   * marked as downloaded. */
+  dlfile_write_t *w = g_slice_new0(dlfile_write_t);
+  w->chunk = startchunk;
+  w->unmark = chunksinblock;
+  dlfile_write_push(t, w);
+
   t->uerr = DLE_HASH;
   t->uerr_msg = g_strdup_printf("Hash for block %u (chunk %u-%u) does not match.", num, startchunk, startchunk+chunksinblock);
   return FALSE;
 }
 
 
-static gboolean dlfile_recv_write(dlfile_thread_t *t, const char *buf, int len) {
-  off_t off = ((guint64)t->chunk * DLFILE_CHUNKSIZE) + t->len;
-  off_t offi = off;
-  size_t rem = len;
-  const char *bufi = buf;
-  while(rem > 0) {
-    ssize_t r = pwrite(t->dl->incfd, bufi, rem, offi);
-    if(r <= 0) {
-      t->err = DLE_IO_INC;
-      t->err_msg = g_strdup(g_strerror(errno));
-      return FALSE;
-    }
-    offi += r;
-    rem -= r;
-    bufi += r;
-  }
-  fadv_oneshot(t->dl->incfd, off, len, VAR_FFC_DOWNLOAD);
-  return TRUE;
-}
-
-
-/* Called when new data has been received from a downloading thread.  The data
- * is written to the file, the TTH calculation is updated and checked with the
- * DB, and the bitmap is updated.
+/* Called when new data has been received from a downloading thread. The data
+ * is added to the write-behind buffer, which is queued for writing whenever a
+ * chunk is complete. The TTH calculation is updated and checked with the DB.
  * This function may be called from another OS thread.
  * Returns TRUE to indicate success, FALSE on failure. */
 gboolean dlfile_recv(void *vt, const char *buf, int len) {
   dlfile_thread_t *t = vt;
-  if(!dlfile_recv_write(t, buf, len))
+  if(dlfile_write_error(t))
     return FALSE;
 
   while(len > 0) {
     guint32 inchunk = MIN((guint32)len, DLFILE_CHUNKSIZE - t->len);
-    t->len += inchunk;
-    gboolean islast = ((guint64)t->chunk * DLFILE_CHUNKSIZE) + t->len == t->dl->size;
+    if(!t->wbuf) {
+      t->wbuf = g_malloc(DLFILE_CHUNKSIZE);
+      t->wbufoff = ((guint64)t->chunk * DLFILE_CHUNKSIZE) + t->len;
+      t->wbuflen = 0;
+    }
+    memcpy(t->wbuf + t->wbuflen, buf, inchunk);
+    t->wbuflen += inchunk;
+    gboolean islast = ((guint64)t->chunk * DLFILE_CHUNKSIZE) + t->len + inchunk == t->dl->size;
 
     if(!t->dl->islist)
       tth_update(&t->hash_tth, buf, inchunk);
     buf += inchunk;
     len -= inchunk;
 
+    /* t->len is only modified with the lock held, so that
+     * dlfile_getchunk() can safely preempt this thread. */
     g_mutex_lock(&t->dl->lock);
+    if(t->preempted) {
+      g_mutex_unlock(&t->dl->lock);
+      return FALSE;
+    }
+    t->len += inchunk;
+    t->seg_recv += inchunk;
     t->dl->have += inchunk;
 
     if(!islast && t->len < DLFILE_CHUNKSIZE) {
@@ -617,14 +996,13 @@ gboolean dlfile_recv(void *vt, const char *buf, int len) {
       continue;
     }
 
-    if(!t->dl->islist) {
-      bita_set(t->dl->bitmap, t->chunk);
-      dlfile_save_bitmap_defer(t->dl);
-    }
+    guint32 chunk = t->chunk;
     t->chunk++;
     t->allocated--;
     t->avail--;
     t->len = 0;
+    /* Queued with the lock held, see dlfile_getchunk() */
+    dlfile_write_flush(t, !t->dl->islist, chunk);
     g_mutex_unlock(&t->dl->lock);
 
     if(!t->dl->islist && (islast || t->chunk % (t->dl->hash_block / DLFILE_CHUNKSIZE) == 0)) {
@@ -639,19 +1017,71 @@ gboolean dlfile_recv(void *vt, const char *buf, int len) {
 }
 
 
+/* Called by the transfer thread before reading more data. Returns FALSE if
+ * the writer is lagging behind, in which case reading is paused until the
+ * writer has caught up and calls net_syn_wake().
+ * This function may be called from another OS thread. */
+gboolean dlfile_recv_ready(void *vt) {
+  dlfile_thread_t *t = vt;
+  g_mutex_lock(&dlfile_write_lock);
+  gboolean ready = t->wpending < DLFILE_WRITE_MAX;
+  if(!ready)
+    t->wpaused = TRUE;
+  g_mutex_unlock(&dlfile_write_lock);
+  return ready;
+}
+
+
+/* Called when the transfer has finished. The thread isn't considered done
+ * until everything has been written, since the file may be closed or
+ * finalized after that. Rather than waiting for the writer here, the rest is
+ * handled by dlfile_recv_finish(), which the writer schedules in the main
+ * thread once the queue of this thread is empty. */
 void dlfile_recv_done(dlfile_thread_t *t) {
+  /* Write out any partial chunk. The partial chunk of a preempted thread is
+   * discarded, it's being downloaded by another thread. */
+  if(t->preempted) {
+    g_free(t->wbuf);
+    t->wbuf = NULL;
+  }
+  dlfile_write_flush(t, FALSE, 0);
+
+  g_mutex_lock(&dlfile_write_lock);
+  gboolean wait = t->wpending > 0;
+  t->wdone = wait;
+  g_mutex_unlock(&dlfile_write_lock);
+  if(!wait)
+    dlfile_recv_finish(t);
+}
+
+
+static void dlfile_recv_finish(dlfile_thread_t *t) {
   dl_t *dl = t->dl;
+  dlfile_write_error(t);
+
   dl->active_threads--;
   t->busy = FALSE;
 
+  /* A thread that failed to write its last chunks isn't complete, even if it
+   * has received all data. */
   gboolean freet = FALSE;
-  if(dl->islist ? dl->hassize && dl->have == dl->size : !t->avail) {
+  if(!t->err && (dl->islist ? dl->hassize && dl->have == dl->size : !t->avail)) {
     g_return_if_fail(!(t->err || t->uerr)); /* A failed thread can't be complete */
     dl->threads = g_slist_remove(dl->threads, t);
+    g_mutex_lock(&dl->lock);
+    dlfile_index_rm(t);
+    g_mutex_unlock(&dl->lock);
     freet = TRUE;
   } else {
+    g_mutex_lock(&dl->lock);
     t->allocated = 0;
+    dlfile_index_changed(t);
+    g_mutex_unlock(&dl->lock);
     dl->allbusy = FALSE;
+    /* Other users of this file may be able to download from it again. No
+     * need for this if the file is being finished or removed below. */
+    if(g_hash_table_lookup(dl_queue, dl->hash) && !t->err)
+      dl_sched_dl(dl);
   }
   dlfile_threaddump(dl, 3);
 
@@ -150,6 +150,14 @@ static const doc_cmd_t doc_cmds[] = {
   " /password every time, use '/hset password <password>'. Be warned, however,"
   " that your password will be saved unencrypted in that case."
 },
+{ "perf", NULL, "Display performance counters.",
+  "Displays a number of internal performance counters, to help figure out"
+  " where ncdc is spending its time. The numbers cover the time since the"
+  " previous /perf, or since startup if it hasn't been used yet. The maximum is"
+  " over the entire run. Latencies and sizes are grouped into power-of-two"
+  " buckets, so the percentiles are an upper estimate.\n\n"
+  "See also the `perf_log' setting."
+},
 { "pm", "<user> [<message>]", "Alias for /msg",
   NULL
 },
@@ -312,7 +320,12 @@ static const doc_set_t doc_sets[] = {
   " seconds, 'm' for minutes, 'h' for hours and 'd' for days. Set to 0 to"
   " disable automatically refreshing the file list. This setting also"
   " determines whether ncdc will perform a refresh on startup. See the"
-  " `/refresh' command to manually refresh your file list."
+  " `/refresh' command to manually refresh your file list.\n\n"
+  "On systems with inotify support, ncdc watches the shared directories for"
+  " changes, and automatic refreshes after the first one will only scan the"
+  " directories that have been modified, and the interval can be as low as one"
+  " minute instead of ten. A full refresh is done again if not all directories"
+  " could be watched, or when too many changes happened at once."
 },
 { "backlog", 1, "<integer>",
   "When opening a hub or PM tab, ncdc can load a certain amount of lines from"
@@ -435,6 +448,14 @@ static const doc_set_t doc_sets[] = {
   " suffices are 's' for seconds, 'm' for minutes, 'h' for hours and 'd' for"
   " days. Set to 0 to disable the cache altogether."
 },
+{ "filelist_threads", 0, "<integer>",
+  "Number of threads to use for compressing your own file list. When set to a"
+  " value larger than 1, the list is written as a series of independently"
+  " compressed bzip2 streams and the compressed data of unchanged shared"
+  " directories is reused across updates, which makes updating the list of a"
+  " large share much faster. Note that some clients only read the first bzip2"
+  " stream of a file list and will see an incomplete list in this mode."
+},
 { "flush_file_cache", 0, "<none|upload|download|hash>[,...]",
   "Tell the OS to flush the file (disk) cache for file contents read while"
   " hashing and/or uploading or written to while downloading. On one hand, this"
@@ -443,7 +464,9 @@ static const doc_set_t doc_sets[] = {
   " shared files from the cache, even if they are still used by other"
   " applications. In general, it is a good idea to enable this if you also use"
   " your system for other things besides ncdc, you share large files (>100MB)"
-  " and people are not constantly downloading the same file from you."
+  " and people are not constantly downloading the same file from you. Files"
+  " that have been requested by several users in the past ten minutes are"
+  " never flushed after an upload."
 },
 { "geoip_cc", 0, "<path>|disabled",
   "Path to the GeoIP2 Country database file (GeoLite2-Country.mmdb), or"
@@ -454,6 +477,16 @@ static const doc_set_t doc_sets[] = {
   "Maximum file hashing speed. See the `download_rate' setting for allowed"
   " formats for this setting."
 },
+{ "hash_threads", 0, "<integer>",
+  "Maximum number of files to hash at the same time. Files are grouped by the"
+  " device that their shared directory resides on, and only one file from each"
+  " device is hashed at a time. Increasing this setting therefore only helps"
+  " if your shared directories are spread over multiple disks, or for large"
+  " files: threads that are not used for other disks are used to hash"
+  " different parts of a large (>512 MiB) file in parallel. You probably want"
+  " to keep this at 1 if you only share from a single spinning disk. The"
+  " `hash_rate' limit applies to all hash threads combined."
+},
 { "hubname", 1, "<string>",
   "The name of the currently opened hub tab. This is a user-assigned name, and"
   " is only used within ncdc itself. This is the same name as given to the"
@@ -535,6 +568,14 @@ static const doc_set_t doc_sets[] = {
   " `/password' command instead. Passwords are saved unencrypted in the config"
   " file."
 },
+{ "perf_log", 0, "<interval>",
+  "When set, the performance counters shown by /perf are written to"
+  " logs/perf.log at this interval. Each line contains the name of a counter"
+  " followed by its count, rate per second, average, median, 99th percentile and"
+  " maximum value, separated by tabs. Times are in microseconds and sizes in"
+  " bytes. The values cover the interval since the previous dump, except for"
+  " the maximum. Set to 0 to disable."
+},
 { "reconnect_timeout", 1, "<interval>",
   "The time to wait before automatically reconnecting to a hub. Set to 0 to"
   " disable automatic reconnect."
@@ -542,7 +583,8 @@ static const doc_set_t doc_sets[] = {
 { "sendfile", 0, "<boolean>",
   "Whether or not to use the sendfile() system call to upload files, if"
   " supported. Using sendfile() allows less resource usage while uploading, but"
-  " may not work well on all systems."
+  " may not work well on all systems. On Linux, this also enables kernel TLS"
+  " offload for uploads over TLS connections, when the kernel supports it."
 },
 { "share_emptydirs", 0, "<boolean>",
   "Share empty directories. When disabled (the default), empty directories in"
@@ -610,6 +652,23 @@ static const doc_set_t doc_sets[] = {
   " priority string for different types of connections (e.g. hub or"
   " incoming/outgoing client connections)."
 },
+{ "transfer_buffer", 0, "<size>",
+  "Maximum size of the buffers used for a single upload or download. Ncdc"
+  " starts out with small buffers and grows them, along with the kernel socket"
+  " buffers, to twice the measured rate times the round-trip time of the"
+  " connection. Raising this helps to saturate fast links with a high latency,"
+  " at the cost of memory. The sizes currently in use are displayed in the"
+  " connections tab. Note that the kernel may limit socket buffers further"
+  " (see the net.core.rmem_max and net.core.wmem_max sysctls on Linux)."
+},
+{ "tthl_store", 0, "<boolean>",
+  "Store the hash data of shared files in a separate file (tthl.dat in the"
+  " session directory) rather than in the database. This keeps the database"
+  " small and quick to vacuum with large shares. Hash data already in the"
+  " database is moved to this file on the next `/gc', which also reclaims the"
+  " space used by files that are not shared anymore. Disabling this option"
+  " only affects files that are hashed afterwards."
+},
 { "ui_time_format", 0, "<string>",
   "The format of the time displayed in the lower-left of the screen. Set `-' to"
   " not display a time at all. The string is passed to the Glib"
@@ -31,6 +31,8 @@
 
 #define STACKSIZE (8*1024)
 #define READBUFSIZE (32*1024)
+// Number of decompressed buffers that can be queued for the parser.
+#define READBUFNUM 8
 
 // Only used for attributes that we care about, and those tend to be short,
 // file names being the longest possible values. I am unaware of a filesystem
@@ -80,9 +82,12 @@ static void fl_load_token(ctx_t *x, yxml_ret_t r, GError **err) {
         g_set_error_literal(err, 1, 0, "Missing Name attribute in Directory element");
         return;
       }
-      fl_list_t *new = fl_list_create(x->name, FALSE);
-      new->isfile = FALSE;
-      new->sub = g_ptr_array_new_with_free_func(fl_list_free);
+      fl_list_t *new;
+      if(x->local) {
+        new = fl_list_create(x->name, FALSE);
+        new->sub = g_ptr_array_new_with_free_func(fl_list_free);
+      } else
+        new = fl_list_arena_create(x->root, x->name, FALSE, FALSE);
       fl_list_add(x->cur, new, -1);
       x->cur = new;
 
@@ -97,7 +102,7 @@ static void fl_load_token(ctx_t *x, yxml_ret_t r, GError **err) {
         return;
       }
       // Create the file entry
-      fl_list_t *new = fl_list_create(x->name, x->local);
+      fl_list_t *new = x->local ? fl_list_create(x->name, TRUE) : fl_list_arena_create(x->root, x->name, TRUE, FALSE);
       new->isfile = TRUE;
       new->size = x->filesize;
       new->hastth = TRUE;
@@ -235,11 +240,74 @@ static int fl_load_readbz(bz_stream *bzs, int fd, char *bzbuf, GError **err) {
 }
 
 
-static fl_list_t *fl_load_parse(int fd, bz_stream *bzs, gboolean local, GError **err) {
+// Bzip2 decompression runs in a separate thread, which fills a queue of
+// buffers that are consumed by the parser.
+typedef struct bzqueue_t {
+  int fd;
+  GMutex lock;
+  GCond cond;
+  char *bufs[READBUFNUM];
+  int lens[READBUFNUM];
+  int head, num;  // First filled buffer and number of filled buffers
+  gboolean eof;   // No more buffers will be filled
+  gboolean stop;  // Set by the parser to abort decompression
+  GError *err;
+} bzqueue_t;
+
+
+static gpointer fl_load_bzthread(gpointer dat) {
+  bzqueue_t *q = dat;
+  bz_stream bzs;
+  memset(&bzs, 0, sizeof(bz_stream));
+  BZ2_bzDecompressInit(&bzs, 0, 0);
+  char *bzbuf = g_malloc(READBUFSIZE);
+  GError *err = NULL;
+
+  while(1) {
+    g_mutex_lock(&q->lock);
+    while(q->num == READBUFNUM && !q->stop)
+      g_cond_wait(&q->cond, &q->lock);
+    int i = (q->head + q->num) % READBUFNUM;
+    gboolean stop = q->stop;
+    g_mutex_unlock(&q->lock);
+    if(stop)
+      break;
+
+    // The buffer at i is not touched by the parser until we increase num.
+    bzs.next_out = q->bufs[i];
+    bzs.avail_out = READBUFSIZE;
+    int len = fl_load_readbz(&bzs, q->fd, bzbuf, &err);
+
+    g_mutex_lock(&q->lock);
+    if(len < 0) {
+      q->err = err;
+      q->eof = TRUE;
+    } else if(len > 0) {
+      q->lens[i] = len;
+      q->num++;
+    }
+    g_cond_signal(&q->cond);
+    g_mutex_unlock(&q->lock);
+    if(len < 0)
+      break;
+  }
+
+  BZ2_bzDecompressEnd(&bzs);
+  g_free(bzbuf);
+  return NULL;
+}
+
+
+static fl_list_t *fl_load_parse(int fd, bzqueue_t *q, gboolean local, GError **err) {
   ctx_t *x = g_new(ctx_t, 1);
   x->state = S_START;
-  x->root = fl_list_create("", FALSE);
-  x->root->sub = g_ptr_array_new_with_free_func(fl_list_free);
+  // The local file list is modified during refreshes, other lists are
+  // read-only and can be allocated in an arena.
+  if(local) {
+    x->root = fl_list_create("", FALSE);
+    x->root->sub = g_ptr_array_new_with_free_func(fl_list_free);
+  } else
+    x->root = fl_list_arena_new();
   x->cur = x->root;
   x->filesize = G_MAXUINT64;
   x->local = local;
@@ -249,19 +317,36 @@ static fl_list_t *fl_load_parse(int fd, bz_stream *bzs, gboolean local, GError *
 
   yxml_init(&x->x, x->stack, STACKSIZE);
   int buflen = 0;
-  char *bzbuf = NULL;
+  char *pbuf;
+  gboolean release = FALSE;
 
   while(1) {
     // Fill buffer
-    if(bzs) {
-      if(!bzbuf)
-        bzbuf = g_malloc(READBUFSIZE);
-      bzs->next_out = x->buf;
-      bzs->avail_out = READBUFSIZE;
-      buflen = fl_load_readbz(bzs, fd, bzbuf, err);
+    if(q) {
+      g_mutex_lock(&q->lock);
+      if(release) {
+        q->head = (q->head + 1) % READBUFNUM;
+        q->num--;
+        g_cond_signal(&q->cond);
+      }
+      while(!q->num && !q->eof)
+        g_cond_wait(&q->cond, &q->lock);
+      if(q->num) {
+        pbuf = q->bufs[q->head];
+        buflen = q->lens[q->head];
+        release = TRUE;
+      } else {
+        buflen = -1;
+        if(q->err) {
+          g_propagate_error(err, q->err);
+          q->err = NULL;
+        }
+      }
+      g_mutex_unlock(&q->lock);
       if(buflen < 0)
         break;
     } else {
+      pbuf = x->buf;
       buflen = read(fd, x->buf, READBUFSIZE);
       if(buflen == 0)
         break;
@@ -272,7 +357,6 @@ static fl_list_t *fl_load_parse(int fd, bz_stream *bzs, gboolean local, GError *
     }
 
     // And parse
-    char *pbuf = x->buf;
     while(!*err && buflen > 0) {
       yxml_ret_t r = yxml_parse(&x->x, *pbuf);
       pbuf++;
@@ -295,19 +379,290 @@ static fl_list_t *fl_load_parse(int fd, bz_stream *bzs, gboolean local, GError *
     g_set_error_literal(err, 1, 0, "XML document did not end correctly");
 
   fl_list_t *root = x->root;
-  g_free(bzbuf);
   g_free(x->name);
   g_free(x);
   return root;
 }
 
 
+// Binary cache of a parsed file list, stored as "<file>.bin". Loading this
+// cache avoids decompressing and parsing the XML when a list is opened again.
+// The file is mapped into memory and consists of:
+//   fl_cache_head_t
+//   fl_cache_node_t[nodes], in depth-first order, starting with the root
+//   string table of nodes[].name, each name zero-terminated
+// All integers are stored in native byte order, the cache is not meant to be
+// portable.
+//
+// Non-local lists loaded from the cache keep the mapping open and are expanded
+// lazily: A directory only gets its children when fl_list_expand() is called
+// on it. The node index of each directory is stored in its (otherwise unused)
+// tth field.
+//
+// Files of the local list also store their fl_list_local_t fields, so that a
+// refresh doesn't have to look up every file in the database again.
+
+#define FL_CACHE_MAGIC "ncdcfl3"
+#define FL_CACHE_FILE   1
+#define FL_CACHE_HASTTH 2
+
+typedef struct fl_cache_head_t {
+  char magic[8];     // FL_CACHE_MAGIC
+  guint64 srcsize;   // size and mtime of the XML file the cache was created for
+  gint64 srcmtime;
+  guint32 nodes;
+  guint32 strsize;
+} fl_cache_head_t;
+
+typedef struct fl_cache_node_t {
+  guint64 size;
+  char tth[24];
+  guint32 name;  // offset into the string table
+  guint32 sub;   // number of direct children, for directories
+  guint32 flags; // FL_CACHE_*
+  guint32 end;   // index of the first node after this subtree
+  gint64 id;      // fl_list_local_t, only for local files
+  gint64 lastmod;
+} fl_cache_node_t;
+
+typedef struct fl_cache_t {
+  GMappedFile *map;
+  const fl_cache_node_t *node;
+  const char *str;
+  guint32 nodes, strsize;
+  gboolean local;
+} fl_cache_t;
+
+#define fl_cache_index(fl) (*(guint32 *)(fl)->tth)
+
+
+// Validates the subtree starting at node i, so that it can be expanded
+// later on without further checks. Returns the index after the subtree, 0 on
+// error.
+static guint32 fl_load_cache_check(fl_cache_t *c, guint32 i) {
+  const fl_cache_node_t *n = c->node + i;
+  if(n->name >= c->strsize)
+    return 0;
+  if(n->flags & FL_CACHE_FILE)
+    return n->end == i+1 ? n->end : 0;
+  guint32 j = i+1, num;
+  for(num=0; num<n->sub; num++) {
+    if(j >= c->nodes || !(j = fl_load_cache_check(c, j)))
+      return 0;
+  }
+  return n->end == j ? j : 0;
+}
+
+
+// Creates the children of the directory at node index i. Local lists are
+// created recursively, other directories are left for fl_list_expand().
+static void fl_load_cache_dir(fl_cache_t *c, fl_list_t *root, fl_list_t *dir, guint32 i) {
+  const fl_cache_node_t *d = c->node + i;
+  guint32 num;
+  for(num=0, i++; num<d->sub; num++) {
+    const fl_cache_node_t *n = c->node + i;
+    gboolean isfile = n->flags & FL_CACHE_FILE ? TRUE : FALSE;
+    fl_list_t *new;
+    if(c->local) {
+      // Like fl_load_token(), only files have a fl_list_local_t.
+      new = fl_list_create(c->str + n->name, isfile);
+      new->isfile = isfile;
+      if(isfile) {
+        fl_list_getlocal(new).id = n->id;
+        fl_list_getlocal(new).lastmod = n->lastmod;
+      } else
+        new->sub = g_ptr_array_new_full(n->sub, fl_list_free);
+    } else
+      new = fl_list_arena_create(root, c->str + n->name, isfile, FALSE);
+    new->size = n->size;
+    if(isfile && n->flags & FL_CACHE_HASTTH) {
+      new->hastth = TRUE;
+      memcpy(new->tth, n->tth, 24);
+    } else if(!isfile && !c->local) {
+      fl_cache_index(new) = i;
+      new->islazy = !c->local && n->sub > 0;
+    }
+    // The nodes are stored in sorted order, so no need to go through
+    // fl_list_add() and fl_list_sort().
+    new->parent = dir;
+    g_ptr_array_add(dir->sub, new);
+
+    if(c->local && !isfile)
+      fl_load_cache_dir(c, root, new, i);
+    i = n->end;
+  }
+}
+
+
+// Called by fl_list_expand()
+void fl_load_cache_expand(gpointer dat, fl_list_t *root, fl_list_t *dir) {
+  fl_load_cache_dir(dat, root, dir, fl_cache_index(dir));
+}
+
+
+// Calls cb() for every hashed file under the given directory, without
+// expanding it. Called by fl_list_foreach_tth().
+void fl_load_cache_foreach(gpointer dat, fl_list_t *dir, void (*cb)(const char *, gpointer), gpointer udat) {
+  fl_cache_t *c = dat;
+  guint32 i = fl_cache_index(dir);
+  guint32 end = c->node[i].end;
+  for(i++; i<end; i++)
+    if(c->node[i].flags & FL_CACHE_HASTTH)
+      cb(c->node[i].tth, udat);
+}
+
+
+void fl_load_cache_free(gpointer dat) {
+  fl_cache_t *c = dat;
+  g_mapped_file_unref(c->map);
+  g_slice_free(fl_cache_t, c);
+}
+
+
+// Returns NULL if there is no valid cache for the file.
+static fl_list_t *fl_load_cache(const char *file, gboolean local) {
+  struct stat st;
+  if(stat(file, &st) < 0)
+    return NULL;
+
+  char *fn = g_strconcat(file, ".bin", NULL);
+  GMappedFile *m = g_mapped_file_new(fn, FALSE, NULL);
+  g_free(fn);
+  if(!m)
+    return NULL;
+
+  const char *dat = g_mapped_file_get_contents(m);
+  gsize len = g_mapped_file_get_length(m);
+  const fl_cache_head_t *h = (const fl_cache_head_t *)dat;
+
+  if(!(len >= sizeof(fl_cache_head_t) && memcmp(h->magic, FL_CACHE_MAGIC, 8) == 0
+      && h->srcsize == (guint64)st.st_size && h->srcmtime == (gint64)st.st_mtime
+      && h->nodes >= 1 && h->strsize >= 1
+      && len == sizeof(fl_cache_head_t) + (gsize)h->nodes*sizeof(fl_cache_node_t) + h->strsize
+      && dat[len-1] == 0)) {
+    g_mapped_file_unref(m);
+    return NULL;
+  }
+
+  fl_cache_t *c = g_slice_new(fl_cache_t);
+  c->map = m;
+  c->node = (const fl_cache_node_t *)(dat + sizeof(fl_cache_head_t));
+  c->str = (const char *)(c->node + h->nodes);
+  c->nodes = h->nodes;
+  c->strsize = h->strsize;
+  c->local = local;
+  if(c->node->flags & FL_CACHE_FILE || fl_load_cache_check(c, 0) != c->nodes) {
+    fl_load_cache_free(c);
+    return NULL;
+  }
+
+  fl_list_t *root;
+  if(local) {
+    root = fl_list_create("", FALSE);
+    root->sub = g_ptr_array_new_full(c->node->sub, fl_list_free);
+  } else
+    root = fl_list_arena_new();
+  root->size = c->node->size;
+  fl_load_cache_dir(c, root, root, 0);
+
+  if(local)
+    fl_load_cache_free(c);
+  else
+    fl_list_arena_setlazy(root, c);
+  return root;
+}
+
+
+// Serializes a directory into the nodes array, skipping files that have not
+// been hashed, just like fl_save() does. Returns the size of the directory.
+static guint64 fl_load_cache_add(GArray *nodes, GString *str, fl_list_t *fl) {
+  fl_cache_node_t n;
+  memset(&n, 0, sizeof(fl_cache_node_t));
+  n.name = str->len;
+  g_string_append_len(str, fl->name, strlen(fl->name)+1);
+  if(fl->isfile) {
+    n.flags = FL_CACHE_FILE | (fl->hastth ? FL_CACHE_HASTTH : 0);
+    n.size = fl->size;
+    memcpy(n.tth, fl->tth, 24);
+    if(fl->islocal) {
+      n.id = fl_list_getlocal(fl).id;
+      n.lastmod = fl_list_getlocal(fl).lastmod;
+    }
+  }
+  guint idx = nodes->len;
+  n.end = idx+1;
+  g_array_append_val(nodes, n);
+
+  if(!fl->isfile) {
+    guint64 size = 0;
+    guint32 num = 0;
+    int i;
+    for(i=0; i<fl->sub->len; i++) {
+      fl_list_t *cur = g_ptr_array_index(fl->sub, i);
+      if(cur->isfile && !cur->hastth)
+        continue;
+      size += fl_load_cache_add(nodes, str, cur);
+      num++;
+    }
+    g_array_index(nodes, fl_cache_node_t, idx).size = size;
+    g_array_index(nodes, fl_cache_node_t, idx).sub = num;
+    g_array_index(nodes, fl_cache_node_t, idx).end = nodes->len;
+    return size;
+  }
+  return n.size;
+}
+
+
+// Writes the binary cache for a file list that has just been loaded from or
+// saved to the given file. Failure is not fatal, the cache is simply not used
+// in that case.
+void fl_load_cache_save(fl_list_t *fl, const char *file) {
+  struct stat st;
+  if(stat(file, &st) < 0)
+    return;
+
+  GArray *nodes = g_array_new(FALSE, FALSE, sizeof(fl_cache_node_t));
+  GString *str = g_string_new("");
+  fl_load_cache_add(nodes, str, fl);
+
+  fl_cache_head_t h;
+  memset(&h, 0, sizeof(fl_cache_head_t));
+  memcpy(h.magic, FL_CACHE_MAGIC, 8);
+  h.srcsize = st.st_size;
+  h.srcmtime = st.st_mtime;
+  h.nodes = nodes->len;
+  h.strsize = str->len;
+
+  char *fn = g_strconcat(file, ".bin", NULL);
+  char *tmp = g_strdup_printf("%s.tmp-%d", fn, rand());
+  FILE *f = fopen(tmp, "w");
+  gboolean ok = f
+    && fwrite(&h, sizeof(fl_cache_head_t), 1, f) == 1
+    && fwrite(nodes->data, sizeof(fl_cache_node_t), nodes->len, f) == nodes->len
+    && fwrite(str->str, 1, str->len, f) == str->len;
+  if(f && fclose(f))
+    ok = FALSE;
+  if(!ok || rename(tmp, fn) < 0) {
+    g_message("Unable to write file list cache %s: %s", fn, g_strerror(errno));
+    unlink(tmp);
+  }
+
+  g_free(tmp);
+  g_free(fn);
+  g_array_unref(nodes);
+  g_string_free(str, TRUE);
+}
+
+
 fl_list_t *fl_load(const char *file, GError **err, gboolean local) {
   g_return_val_if_fail(err == NULL || *err == NULL, NULL);
 
-  fl_list_t *root = NULL;
-  int fd;
-  bz_stream *bzs = NULL;
+  fl_list_t *root = fl_load_cache(file, local);
+  if(root)
+    return root;
+  int fd, i;
+  bzqueue_t *q = NULL;
+  GThread *bzthread = NULL;
   GError *ierr = NULL;
 
   // open file
@@ -317,18 +672,33 @@ fl_list_t *fl_load(const char *file, GError **err, gboolean local) {
     goto end;
   }
 
-  // Create BZ2 stream object if this is a bzip2 file
+  // Start the decompression thread if this is a bzip2 file
   if(strlen(file) > 4 && strcmp(file+(strlen(file)-4), ".bz2") == 0) {
-    bzs = g_new0(bz_stream, 1);
-    BZ2_bzDecompressInit(bzs, 0, 0);
+    q = g_new0(bzqueue_t, 1);
+    q->fd = fd;
+    g_mutex_init(&q->lock);
+    g_cond_init(&q->cond);
+    for(i=0; i<READBUFNUM; i++)
+      q->bufs[i] = g_malloc(READBUFSIZE);
+    bzthread = g_thread_new("fl_load", fl_load_bzthread, q);
   }
 
-  root = fl_load_parse(fd, bzs, local, &ierr);
+  root = fl_load_parse(fd, q, local, &ierr);
 
 end:
-  if(bzs) {
-    BZ2_bzDecompressEnd(bzs);
-    g_free(bzs);
+  if(q) {
+    g_mutex_lock(&q->lock);
+    q->stop = TRUE;
+    g_cond_signal(&q->cond);
+    g_mutex_unlock(&q->lock);
+    g_thread_join(bzthread);
+    if(q->err)
+      g_error_free(q->err);
+    for(i=0; i<READBUFNUM; i++)
+      g_free(q->bufs[i]);
+    g_mutex_clear(&q->lock);
+    g_cond_clear(&q->cond);
+    g_free(q);
   }
   if(fd >= 0)
     close(fd);
@@ -337,6 +707,15 @@ end:
     if(root)
       fl_list_free(root);
     root = NULL;
+  } else {
+    fl_load_cache_save(root, file);
+    // Replace the parsed list by the lazily expanded one, so that memory is
+    // only used for the directories that are actually opened.
+    fl_list_t *lazy = local ? NULL : fl_load_cache(file, FALSE);
+    if(lazy) {
+      fl_list_free(root);
+      root = lazy;
+    }
   }
   return root;
 }
@@ -345,8 +724,9 @@ end:
 
 
 
-// Async version of fl_load(). Performs the load in a background thread. Only
-// used for non-local filelists.
+// Async version of fl_load(). Performs the load in a background thread, with
+// bzip2 decompression in yet another thread. Also used for the local file
+// list at startup, so that a large share doesn't delay the UI.
 
 typedef struct async_t {
   char *file;
@@ -354,6 +734,7 @@ typedef struct async_t {
   void *dat;
   GError *err;
   fl_list_t *fl;
+  gboolean local;
 } async_t;
 
 
@@ -368,19 +749,20 @@ static gboolean async_d(gpointer dat) {
 
 static void async_f(gpointer dat, gpointer udat) {
   async_t *arg = dat;
-  arg->fl = fl_load(arg->file, &arg->err, FALSE);
+  arg->fl = fl_load(arg->file, &arg->err, arg->local);
   g_idle_add(async_d, arg);
 }
 
 
 // Ownership of both the file list and the error is passed to the callback
 // function.
-void fl_load_async(const char *file, void (*cb)(fl_list_t *, GError *, void *), void *dat) {
+void fl_load_async(const char *file, gboolean local, void (*cb)(fl_list_t *, GError *, void *), void *dat) {
   static GThreadPool *pool = NULL;
   if(!pool)
     pool = g_thread_pool_new(async_f, NULL, 2, FALSE, NULL);
   async_t *arg = g_slice_new0(async_t);
   arg->file = g_strdup(file);
+  arg->local = local;
   arg->dat = dat;
   arg->cb = cb;
   g_thread_pool_push(pool, arg, NULL);
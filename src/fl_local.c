@@ -33,43 +33,109 @@ fl_list_t      *fl_local_list  = NULL;
 GQueue         *fl_refresh_queue = NULL;
 time_t          fl_refresh_last = 0; // time when the last full file list refresh has been queued
 static gboolean fl_needflush = FALSE;
-// Index of the files in fl_local_list. Key = TTH root, value = GSList of files.
-static GHashTable *fl_hash_index;
+// Index of the hashed files in fl_local_list, see fl_hashindex_*() below.
+static fl_list_t **fl_hash_index = NULL;
+static guint fl_hash_index_mask;  // number of slots - 1
+static guint fl_hash_index_files; // number of occupied slots
+
+static guint fl_hashindex_slot(const char *tth) {
+  guint64 h;
+  memcpy(&h, tth, 8);
+  return ((guint)(h ^ (h>>32))) & fl_hash_index_mask;
+}
+// Index of the names in fl_local_list, see fl_nameindex_*() below.
+static GHashTable *fl_name_index;    // token -> fl_name_tok_t
+static GHashTable *fl_name_trigrams; // trigram -> GPtrArray of fl_name_tok_t
 guint64         fl_local_list_size;   // total share size, minus duplicate files
 int             fl_local_list_length; // total number of unique files in the share
+guint           fl_local_gen = 0;     // share generation, incremented when fl_local_list changes
+guint           fl_local_hashgen = 0; // incremented when files in fl_local_list have been hashed, see fl_hash_newgen()
+gboolean        fl_local_loading = FALSE; // TRUE while files.xml.bz2 is being loaded at startup
+static gboolean fl_load_refresh = FALSE;  // refresh requested while loading
 
 static GThreadPool *fl_scan_pool;
 static GThreadPool *fl_hash_pool;
 
-GHashTable       *fl_hash_queue = NULL; // set of files-to-hash
-guint64           fl_hash_queue_size = 0;
-static fl_list_t *fl_hash_cur = NULL;   // most recent file initiated for hashing
-ratecalc_t        fl_hash_rate;
-static guint64    fl_hash_reset = 0; // increased when fl_hash_cur is removed from the queue (to stop current hash operation)
-static GMutex     fl_hash_resetlock;
-static GCond      fl_hash_resetcond;
+GHashTable        *fl_hash_queue = NULL; // files-to-hash -> fl_hash_dev_t
+static gboolean    fl_hash_new = FALSE;  // files have been hashed since the last fl_hash_newgen()
+guint64            fl_hash_queue_size = 0;
+static GHashTable *fl_hash_cur = NULL;   // files currently being hashed -> fl_hash_t
+static int         fl_hash_active = 0;   // number of hash threads in use, see fl_hash_process()
+static GHashTable *fl_hash_devs = NULL;  // st_dev -> fl_hash_dev_t
+static GHashTable *fl_hash_roots = NULL; // share root -> fl_hash_dev_t, cache for fl_hash_getdev()
+ratecalc_t         fl_hash_rate;
+static GMutex      fl_hash_resetlock; // protects fl_hash_t.reset
+static GCond       fl_hash_resetcond;
 
 #define TTH_BUFSIZE (512*1024)
+#define TTH_BUFNUM  4
 
 
 // Utility functions
 
-// Get full path to an item in our list. Result should be free'd. This function
-// isn't particularly fast.
+// Cached filesystem and virtual paths of the directories in fl_local_list,
+// so that fl_local_path() and fl_local_vpath() don't have to walk up the tree
+// for every upload and search result. Flushed whenever fl_local_gen changes,
+// since that is the only time directories are added or removed.
+typedef struct fl_dirpath_t {
+  char *path;  // NULL for the root
+  char *vpath;
+} fl_dirpath_t;
+
+static GHashTable *fl_dirpath_cache = NULL; // fl_list_t -> fl_dirpath_t
+static guint fl_dirpath_gen;
+
+
+static void fl_dirpath_free(gpointer dat) {
+  fl_dirpath_t *p = dat;
+  g_free(p->path);
+  g_free(p->vpath);
+  g_slice_free(fl_dirpath_t, p);
+}
+
+
+static fl_dirpath_t *fl_dirpath(fl_list_t *dir) {
+  if(!fl_dirpath_cache)
+    fl_dirpath_cache = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, fl_dirpath_free);
+  if(fl_dirpath_gen != fl_local_gen) {
+    g_hash_table_remove_all(fl_dirpath_cache);
+    fl_dirpath_gen = fl_local_gen;
+  }
+
+  fl_dirpath_t *p = g_hash_table_lookup(fl_dirpath_cache, dir);
+  if(p)
+    return p;
+
+  p = g_slice_new(fl_dirpath_t);
+  if(!dir->parent) {
+    p->path = NULL;
+    p->vpath = g_strdup("/");
+  } else if(!dir->parent->parent) {
+    p->path = g_strdup(db_share_path(dir->name));
+    p->vpath = g_strconcat("/", dir->name, NULL);
+  } else {
+    fl_dirpath_t *pp = fl_dirpath(dir->parent);
+    p->path = g_build_filename(pp->path, dir->name, NULL);
+    p->vpath = g_build_filename(pp->vpath, dir->name, NULL);
+  }
+  g_hash_table_insert(fl_dirpath_cache, dir, p);
+  return p;
+}
+
+
+// Get full path to an item in our list. Result should be free'd.
 char *fl_local_path(fl_list_t *fl) {
-  if(!fl->parent->parent)
-    return g_strdup(db_share_path(fl->name));
-  char *tmp, *path = g_strdup(fl->name);
-  fl_list_t *cur = fl->parent;
-  while(cur->parent && cur->parent->parent) {
-    tmp = path;
-    path = g_build_filename(cur->name, path, NULL);
-    g_free(tmp);
-    cur = cur->parent;
-  }
-  tmp = g_build_filename(db_share_path(cur->name), path, NULL);
-  g_free(path);
-  return tmp;
+  if(!fl->isfile)
+    return g_strdup(fl_dirpath(fl)->path);
+  return g_build_filename(fl_dirpath(fl->parent)->path, fl->name, NULL);
+}
+
+
+// Same as fl_list_path(), but faster for items in our list.
+char *fl_local_vpath(fl_list_t *fl) {
+  if(!fl->isfile)
+    return g_strdup(fl_dirpath(fl)->vpath);
+  return g_build_filename(fl_dirpath(fl->parent)->vpath, fl->name, NULL);
 }
 
 
@@ -103,32 +169,143 @@ void fl_local_suggest(char *path, char **sug) {
 }
 
 
-// get files with the (raw) TTH. Result does not have to be freed.
-GSList *fl_local_from_tth(const char *root) {
-  return g_hash_table_lookup(fl_hash_index, root);
+// Iterate over the files with the given (raw) TTH. *it should be initialized
+// to zero, returns NULL when there are no more files.
+fl_list_t *fl_local_tth_iter(const char *root, guint *it) {
+  if(!fl_hash_index || *it == G_MAXUINT)
+    return NULL;
+  guint i = *it ? *it-1 : fl_hashindex_slot(root);
+  for(; fl_hash_index[i]; i=(i+1)&fl_hash_index_mask)
+    if(memcmp(fl_hash_index[i]->tth, root, 24) == 0) {
+      *it = ((i+1)&fl_hash_index_mask) + 1;
+      return fl_hash_index[i];
+    }
+  *it = G_MAXUINT;
+  return NULL;
+}
+
+
+// Get a file with the (raw) TTH, or NULL if we don't share it.
+fl_list_t *fl_local_from_tth(const char *root) {
+  guint it = 0;
+  return fl_local_tth_iter(root, &it);
+}
+
+
+// Bloom filters that have been requested by hubs are cached and updated from
+// fl_hashindex_insert(). Hashes can't be removed from a bloom filter, so
+// fl_hashindex_del() only counts the removals and a filter is rebuilt when too
+// many of its hashes are stale.
+
+#define FL_BLOOM_CACHE 4
+
+typedef struct fl_bloom_t {
+  bloom_t b;
+  int dels;
+} fl_bloom_t;
+
+static GSList *fl_bloom_cache = NULL; // most recently used first
+
+
+static void fl_bloom_insert(const char *tth) {
+  GSList *l;
+  for(l=fl_bloom_cache; l; l=l->next)
+    bloom_add(&((fl_bloom_t *)l->data)->b, tth);
+}
+
+
+static void fl_bloom_del() {
+  GSList *l;
+  for(l=fl_bloom_cache; l; l=l->next)
+    ((fl_bloom_t *)l->data)->dels++;
+}
+
+
+static void fl_bloom_free(fl_bloom_t *f) {
+  bloom_free(&f->b);
+  g_slice_free(fl_bloom_t, f);
 }
 
 
 // Fill a bloom filter with all local hashes
 void fl_local_bloom(bloom_t *b) {
-  GHashTableIter iter;
-  const char *tth;
-  g_hash_table_iter_init(&iter, fl_hash_index);
-  while(g_hash_table_iter_next(&iter, (gpointer *)&tth, NULL))
-    bloom_add(b, tth);
+  GSList *l;
+  fl_bloom_t *f = NULL;
+  for(l=fl_bloom_cache; l; l=l->next) {
+    f = l->data;
+    if(f->b.m == b->m && f->b.k == b->k && f->b.h == b->h)
+      break;
+  }
+
+  if(l && f->dels > 100 && f->dels > fl_local_list_length/8) {
+    fl_bloom_cache = g_slist_delete_link(fl_bloom_cache, l);
+    fl_bloom_free(f);
+    l = NULL;
+  }
+
+  if(l)
+    fl_bloom_cache = g_slist_remove_link(fl_bloom_cache, l);
+  else {
+    f = g_slice_new0(fl_bloom_t);
+    bloom_init(&f->b, b->m, b->k, b->h);
+    // Files with the same TTH are added multiple times, but that doesn't
+    // change the result.
+    guint i;
+    for(i=0; fl_hash_index && i<=fl_hash_index_mask; i++)
+      if(fl_hash_index[i])
+        bloom_add(&f->b, fl_hash_index[i]->tth);
+    l = g_slist_alloc();
+    l->data = f;
+
+    GSList *last = g_slist_nth(fl_bloom_cache, FL_BLOOM_CACHE-2);
+    if(last && last->next) {
+      fl_bloom_free(last->next->data);
+      g_slist_free_1(last->next);
+      last->next = NULL;
+    }
+  }
+  l->next = fl_bloom_cache;
+  fl_bloom_cache = l;
+
+  memcpy(b->d, f->b.d, b->m);
+}
+
+
+// Drops the cached files.xml.bz2 streams of the share root containing fl.
+static void fl_local_invalidate(fl_list_t *fl) {
+  while(fl->parent && fl->parent->parent)
+    fl = fl->parent;
+  fl_save_invalidate(fl->parent ? fl->name : NULL);
+}
+
+
+// Files that have been hashed only change the contents of the file list, not
+// its structure, so they don't need to flush everything that depends on
+// fl_local_gen. Caches of file list contents are flushed when fl_local_hashgen
+// changes instead, which happens once the hash queue is empty and at most once
+// per fl_flush() while hashing.
+static void fl_hash_newgen() {
+  if(fl_hash_new)
+    fl_local_hashgen++;
+  fl_hash_new = FALSE;
 }
 
 
 // should be run from a timer. periodically flushes all unsaved data to disk.
 gboolean fl_flush(gpointer dat) {
+  fl_hash_newgen();
   if(fl_needflush) {
     // save our file list
     GError *err = NULL;
-    if(!fl_save(fl_local_list, var_get(0, VAR_cid), 0, FALSE, NULL, fl_local_list_file, &err)) {
+    int threads = var_get_int(0, VAR_filelist_threads);
+    if(!(threads > 1
+        ? fl_save_parallel(fl_local_list, var_get(0, VAR_cid), threads, fl_local_list_file, &err)
+        : fl_save(fl_local_list, var_get(0, VAR_cid), 0, FALSE, NULL, fl_local_list_file, &err))) {
       // this is a pretty fatal error... oh well, better luck next time
       ui_mf(uit_main_tab, UIP_MED, "Error saving file list: %s", err->message);
       g_error_free(err);
-    }
+    } else
+      fl_load_cache_save(fl_local_list, fl_local_list_file);
   }
   fl_needflush = FALSE;
   return TRUE;
@@ -141,18 +318,49 @@ gboolean fl_is_refreshing(void) {
 
 // Hash index interface. These operate on fl_hash_index and make sure
 // fl_local_list_size and _length stay correct.
+//
+// The index is an open-addressing hash table with linear probing. Each slot
+// holds a pointer to a file, the TTH is read from the file itself and the
+// first 8 bytes of it are used as hash. Files with the same TTH simply occupy
+// multiple slots, so that the common case of a unique file costs only a single
+// pointer.
+
+static void fl_hashindex_grow() {
+  guint i, oldsize = fl_hash_index ? fl_hash_index_mask+1 : 0;
+  fl_list_t **old = fl_hash_index;
+  fl_hash_index_mask = oldsize ? oldsize*2-1 : 1023;
+  fl_hash_index = g_new0(fl_list_t *, fl_hash_index_mask+1);
+  for(i=0; i<oldsize; i++)
+    if(old[i]) {
+      guint j = fl_hashindex_slot(old[i]->tth);
+      while(fl_hash_index[j])
+        j = (j+1)&fl_hash_index_mask;
+      fl_hash_index[j] = old[i];
+    }
+  g_free(old);
+}
+
 
 // Add to the hash index
 static void fl_hashindex_insert(fl_list_t *fl) {
-  GSList *cur = g_hash_table_lookup(fl_hash_index, fl->tth);
-  if(cur) {
-    g_return_if_fail(cur == g_slist_insert(cur, fl, 1)); // insert item without modifying the pointer
-  } else {
-    cur = g_slist_prepend(cur, fl);
-    g_hash_table_insert(fl_hash_index, fl->tth, cur);
+  if(!fl_hash_index || (fl_hash_index_files+1)*4 > (fl_hash_index_mask+1)*3)
+    fl_hashindex_grow();
+
+  gboolean dupe = FALSE;
+  guint i = fl_hashindex_slot(fl->tth);
+  for(; fl_hash_index[i]; i=(i+1)&fl_hash_index_mask) {
+    g_return_if_fail(fl_hash_index[i] != fl);
+    if(!dupe && memcmp(fl_hash_index[i]->tth, fl->tth, 24) == 0)
+      dupe = TRUE;
+  }
+  fl_hash_index[i] = fl;
+  fl_hash_index_files++;
+
+  if(!dupe) {
     fl_local_list_size += fl->size;
+    fl_local_list_length++;
+    fl_bloom_insert(fl->tth);
   }
-  fl_local_list_length = g_hash_table_size(fl_hash_index);
 }
 
 
@@ -161,17 +369,287 @@ static void fl_hashindex_insert(fl_list_t *fl) {
 static void fl_hashindex_del(fl_list_t *fl) {
   if(!fl->hastth)
     return;
-  GSList *cur = g_hash_table_lookup(fl_hash_index, fl->tth);
   fl->hastth = FALSE;
 
-  cur = g_slist_remove(cur, fl);
-  if(!cur) {
-    g_hash_table_remove(fl_hash_index, fl->tth);
+  guint i = fl_hashindex_slot(fl->tth);
+  for(; fl_hash_index[i] && fl_hash_index[i] != fl; i=(i+1)&fl_hash_index_mask)
+    ;
+  g_return_if_fail(fl_hash_index[i]);
+
+  // Shift back the following items in the probe sequence to fill the gap.
+  guint j = i;
+  while(1) {
+    j = (j+1)&fl_hash_index_mask;
+    if(!fl_hash_index[j])
+      break;
+    guint k = fl_hashindex_slot(fl_hash_index[j]->tth);
+    if(i <= j ? (i < k && k <= j) : (i < k || k <= j))
+      continue;
+    fl_hash_index[i] = fl_hash_index[j];
+    i = j;
+  }
+  fl_hash_index[i] = NULL;
+  fl_hash_index_files--;
+
+  // Unless there's another file with the same TTH.
+  if(!fl_local_from_tth(fl->tth)) {
     fl_local_list_size -= fl->size;
-  // there's another file with the same TTH.
-  } else
-    g_hash_table_replace(fl_hash_index, ((fl_list_t *)cur->data)->tth, cur);
-  fl_local_list_length = g_hash_table_size(fl_hash_index);
+    fl_local_list_length--;
+    fl_bloom_del();
+  }
+}
+
+
+// Name index interface. Every name in fl_local_list is case-folded and split
+// into tokens at ASCII punctuation and whitespace. The index maps each token
+// to the files and directories that have it in their name, and a trigram
+// index on the tokens themselves is used to find all tokens containing a
+// search keyword. The index only narrows down the candidates for a search,
+// the actual matching is still done with fl_search_match_full(), so results
+// are the same as those of a full fl_search_rec().
+//
+// Tokens that are present in more than fl_name_maxlist items are not very
+// useful for narrowing down searches, so their item lists are dropped.
+
+#define fl_name_maxlist 10000
+
+#define fl_name_istok(c) (g_ascii_isalnum(c) || ((unsigned char)(c)) >= 0x80)
+
+#define fl_name_trigram(s) GUINT_TO_POINTER(((guint)(unsigned char)(s)[0] << 16) | ((guint)(unsigned char)(s)[1] << 8) | (unsigned char)(s)[2])
+
+typedef struct fl_name_tok_t {
+  GPtrArray *items; // NULL if the token is too common
+  char str[1];
+} fl_name_tok_t;
+
+
+static void fl_name_tok_free(gpointer dat) {
+  fl_name_tok_t *t = dat;
+  if(t->items)
+    g_ptr_array_unref(t->items);
+  g_free(t);
+}
+
+
+// Splits a case-folded name into its unique tokens. Modifies the string.
+// 'toks' must have room for fl_name_maxtokens(str) items.
+#define fl_name_maxtokens(s) (strlen(s)/2+1)
+
+static int fl_name_tokens(char *str, char **toks) {
+  int i, n = 0;
+  while(*str) {
+    while(*str && !fl_name_istok(*str))
+      str++;
+    if(!*str)
+      break;
+    char *t = str;
+    while(fl_name_istok(*str))
+      str++;
+    if(*str)
+      *(str++) = 0;
+    for(i=0; i<n; i++)
+      if(strcmp(toks[i], t) == 0)
+        break;
+    if(i == n)
+      toks[n++] = t;
+  }
+  return n;
+}
+
+
+static void fl_nameindex_insert(fl_list_t *fl) {
+  char *name = g_utf8_casefold(fl->name, -1);
+  char *toks[fl_name_maxtokens(name)];
+  int i, j, n = fl_name_tokens(name, toks);
+  for(i=0; i<n; i++) {
+    fl_name_tok_t *t = g_hash_table_lookup(fl_name_index, toks[i]);
+    if(!t) {
+      int len = strlen(toks[i]);
+      t = g_malloc(G_STRUCT_OFFSET(fl_name_tok_t, str) + len + 1);
+      strcpy(t->str, toks[i]);
+      t->items = g_ptr_array_new();
+      g_hash_table_insert(fl_name_index, t->str, t);
+      for(j=0; j+3<=len; j++) {
+        GPtrArray *a = g_hash_table_lookup(fl_name_trigrams, fl_name_trigram(t->str+j));
+        if(!a) {
+          a = g_ptr_array_new();
+          g_hash_table_insert(fl_name_trigrams, fl_name_trigram(t->str+j), a);
+        }
+        // A token may contain the same trigram multiple times
+        if(!a->len || g_ptr_array_index(a, a->len-1) != t)
+          g_ptr_array_add(a, t);
+      }
+    }
+    if(t->items && t->items->len >= fl_name_maxlist) {
+      g_ptr_array_unref(t->items);
+      t->items = NULL;
+    }
+    if(t->items)
+      g_ptr_array_add(t->items, fl);
+  }
+  g_free(name);
+}
+
+
+static void fl_nameindex_del(fl_list_t *fl) {
+  char *name = g_utf8_casefold(fl->name, -1);
+  char *toks[fl_name_maxtokens(name)];
+  int i, j, n = fl_name_tokens(name, toks);
+  for(i=0; i<n; i++) {
+    fl_name_tok_t *t = g_hash_table_lookup(fl_name_index, toks[i]);
+    if(!t || !t->items)
+      continue;
+    g_ptr_array_remove_fast(t->items, fl);
+    if(t->items->len)
+      continue;
+    // Remove the token entirely when nothing refers to it anymore
+    int len = strlen(t->str);
+    for(j=0; j+3<=len; j++) {
+      GPtrArray *a = g_hash_table_lookup(fl_name_trigrams, fl_name_trigram(t->str+j));
+      if(a && g_ptr_array_remove_fast(a, t) && !a->len)
+        g_hash_table_remove(fl_name_trigrams, fl_name_trigram(t->str+j));
+    }
+    g_hash_table_remove(fl_name_index, t->str);
+  }
+  g_free(name);
+}
+
+
+// Recursively adds or removes an item and everything below it.
+static void fl_nameindex_rec(fl_list_t *fl, gboolean add) {
+  if(add)
+    fl_nameindex_insert(fl);
+  else
+    fl_nameindex_del(fl);
+  int i;
+  for(i=0; !fl->isfile && i<fl->sub->len; i++)
+    fl_nameindex_rec(g_ptr_array_index(fl->sub, i), add);
+}
+
+
+// Finds the items whose name matches a single keyword, or returns NULL if the
+// keyword can't be used to narrow down the search.
+static GPtrArray *fl_nameindex_lookup(const char *keyword) {
+  // Any match of the keyword has the longest token of the keyword within one
+  // of its own tokens.
+  char *str = g_utf8_casefold(keyword, -1);
+  char *toks[fl_name_maxtokens(str)];
+  int i, j, n = fl_name_tokens(str, toks);
+  char *tok = NULL;
+  int len = 0;
+  for(i=0; i<n; i++)
+    if(strlen(toks[i]) > len) {
+      tok = toks[i];
+      len = strlen(tok);
+    }
+  if(len < 3) {
+    g_free(str);
+    return NULL;
+  }
+
+  // Use the least common trigram to get the tokens that may contain the keyword
+  GPtrArray *tri = NULL;
+  for(i=0; i+3<=len; i++) {
+    GPtrArray *a = g_hash_table_lookup(fl_name_trigrams, fl_name_trigram(tok+i));
+    if(!a || !tri || a->len < tri->len)
+      tri = a;
+    if(!a)
+      break;
+  }
+
+  GPtrArray *res = g_ptr_array_new();
+  for(i=0; tri && i<tri->len; i++) {
+    fl_name_tok_t *t = g_ptr_array_index(tri, i);
+    if(!strstr(t->str, tok))
+      continue;
+    if(!t->items || res->len + t->items->len > fl_name_maxlist) {
+      g_ptr_array_unref(res);
+      res = NULL;
+      break;
+    }
+    for(j=0; j<t->items->len; j++)
+      g_ptr_array_add(res, g_ptr_array_index(t->items, j));
+  }
+  g_free(str);
+  return res;
+}
+
+
+// Compares two items by their position in a depth-first walk of the tree, the
+// order in which fl_search_rec() finds them. Suitable for g_ptr_array_sort().
+static gint fl_local_treeorder(gconstpointer pa, gconstpointer pb) {
+  const fl_list_t *a = *((fl_list_t **)pa), *b = *((fl_list_t **)pb), *p;
+  int da = 0, db = 0;
+  for(p=a; p->parent; p=p->parent)
+    da++;
+  for(p=b; p->parent; p=p->parent)
+    db++;
+  // A directory comes before anything below it
+  for(; da > db; da--)
+    if((a = a->parent) == b)
+      return 1;
+  for(; db > da; db--)
+    if((b = b->parent) == a)
+      return -1;
+  while(a->parent != b->parent) {
+    a = a->parent;
+    b = b->parent;
+  }
+  return a == b ? 0 : fl_list_cmp(a, b);
+}
+
+
+// Replacement for fl_search_rec(fl_local_list, ..) that uses the name index
+// when possible. 'keywords' are the strings from which s->and was created.
+int fl_local_search(fl_search_t *s, char **keywords, fl_list_t **res, int max) {
+  // Not ready yet, act as if we don't have anything
+  if(!fl_local_list || fl_local_loading)
+    return 0;
+
+  // Get the smallest list of candidates
+  GPtrArray *cand = NULL;
+  for(; keywords && *keywords; keywords++) {
+    GPtrArray *a = fl_nameindex_lookup(*keywords);
+    if(a && (!cand || a->len < cand->len)) {
+      if(cand)
+        g_ptr_array_unref(cand);
+      cand = a;
+    } else if(a)
+      g_ptr_array_unref(a);
+  }
+  if(!cand) {
+    gint64 start = perf_start();
+    int n = fl_search_rec(fl_local_list, s, res, max);
+    perf_time(search_rec, start);
+    return n;
+  }
+
+  // A match is either a candidate or an item below a candidate. The same item
+  // can be a candidate more than once, and a candidate that is below another
+  // one doesn't have to be searched separately. The remaining candidates are
+  // searched in tree order, to get the same results as fl_search_rec().
+  GHashTable *set = g_hash_table_new(g_direct_hash, g_direct_equal);
+  GPtrArray *top = g_ptr_array_new();
+  int i, n = 0;
+  for(i=0; i<cand->len; i++)
+    g_hash_table_add(set, g_ptr_array_index(cand, i));
+  GHashTableIter iter;
+  gpointer key;
+  g_hash_table_iter_init(&iter, set);
+  while(g_hash_table_iter_next(&iter, &key, NULL)) {
+    fl_list_t *p;
+    for(p=((fl_list_t *)key)->parent; p && !g_hash_table_contains(set, p); p=p->parent)
+      ;
+    if(!p)
+      g_ptr_array_add(top, key);
+  }
+  g_ptr_array_sort(top, fl_local_treeorder);
+  for(i=0; n<max && i<top->len; i++)
+    n += fl_search_sub(g_ptr_array_index(top, i), s, res+n, max-n);
+  g_ptr_array_unref(top);
+  g_hash_table_unref(set);
+  g_ptr_array_unref(cand);
+  return n;
 }
 
 
@@ -181,9 +659,18 @@ static void fl_hashindex_del(fl_list_t *fl) {
 // Scanning directories
 
 // Note: The `file' structure points to a (sub-)item in fl_local_list, and will
-// be accessed from both the scan thread and the main thread. It is therefore
+// be accessed from both the scan threads and the main thread. It is therefore
 // important that no changes are made to the local file list while the scan
 // thread is active.
+//
+// The scan thread hands every directory to fl_scan_dirpool, so that several
+// directories are read and stat()'ed at the same time. Each directory task
+// only modifies the directory it was given, directory sizes and empty
+// directories are handled by fl_scan_finish() once all tasks are done.
+#define FL_SCAN_THREADS 8
+
+static GThreadPool *fl_scan_dirpool;
+
 typedef struct fl_scan_t {
   fl_list_t **file, **res;
   char **path;
@@ -191,9 +678,24 @@ typedef struct fl_scan_t {
   gboolean emptydirs;
   gboolean inc_hidden;
   gboolean symlink;
+  GHashTable *scan; // if set, only scan these directories (see fl_watch_scanset())
   gboolean (*donefun)(gpointer);
+  GMutex lock;
+  GCond cond;
+  int pending; // number of unfinished directory tasks, protected by lock
 } fl_scan_t;
 
+typedef struct fl_scan_task_t {
+  fl_scan_t *opts;
+  fl_list_t *parent, *old;
+  char *path, *vpath;
+} fl_scan_task_t;
+
+// Values in fl_scan_t.scan. Directories that have not changed themselves but
+// have changed subdirectories are visited without re-reading them.
+#define FL_SCAN_DIRTY 1
+#define FL_SCAN_VISIT 2
+
 
 // Removes duplicate files (that is, files with the same name in a
 // case-insensitive context) from a dirtectory.
@@ -205,7 +707,7 @@ static void fl_scan_rmdupes(fl_list_t *fl, const char *vpath) {
     if(fl_list_cmp_strict(a, b) == 0) {
       char *tmp = g_build_filename(vpath, b->name, NULL);
       ui_mf(uit_main_tab, UIP_MED, "Not sharing \"%s\": Other file with same name (but different case) already shared.", tmp);
-      fl_list_remove(b);
+      g_ptr_array_remove_index(fl->sub, i);
       g_free(tmp);
     } else
       i++;
@@ -217,9 +719,11 @@ static void fl_scan_rmdupes(fl_list_t *fl, const char *vpath) {
 // of DELETE FROM queries in a single transaction. This is significantly faster
 // than using a separate transaction for each DELETE.
 static void fl_scan_invalidate(gint64 id, gboolean force_flush) {
+  static GMutex lock;
   static gint64 rmids[50];
   static int i = 0;
 
+  g_mutex_lock(&lock);
   if(id)
     rmids[i++] = id;
 
@@ -227,6 +731,7 @@ static void fl_scan_invalidate(gint64 id, gboolean force_flush) {
     db_fl_rmfiles(rmids, i);
     i = 0;
   }
+  g_mutex_unlock(&lock);
 }
 
 
@@ -344,30 +849,69 @@ done:
 }
 
 
-// recursive
+// Like fl_list_add(), but doesn't update the size of the parents. Other
+// threads may be adding to those at the same time.
+static void fl_scan_add(fl_list_t *parent, fl_list_t *cur) {
+  cur->parent = parent;
+  g_ptr_array_add(parent->sub, cur);
+}
+
+
+// Copies the files and (empty) directories of an unchanged directory from the
+// old list, for FL_SCAN_VISIT.
+static void fl_scan_copy(fl_list_t *parent, fl_list_t *old) {
+  int i;
+  for(i=0; i<old->sub->len; i++) {
+    fl_list_t *cur = g_ptr_array_index(old->sub, i);
+    fl_scan_add(parent, cur->isfile ? fl_list_copy(cur) : fl_list_create(cur->name, FALSE));
+  }
+}
+
+
+static void fl_scan_push(fl_scan_t *opts, fl_list_t *parent, fl_list_t *old, char *path, char *vpath) {
+  fl_scan_task_t *t = g_slice_new(fl_scan_task_t);
+  t->opts = opts;
+  t->parent = parent;
+  t->old = old;
+  t->path = path;
+  t->vpath = vpath;
+  g_mutex_lock(&opts->lock);
+  opts->pending++;
+  g_mutex_unlock(&opts->lock);
+  g_thread_pool_push(fl_scan_dirpool, t, NULL);
+}
+
+
+// Queues a task for every subdirectory.
 // Doesn't handle paths longer than PATH_MAX, but I don't think it matters all that much.
 // *path is the filesystem path in filename encoding, vpath is the virtual path in UTF-8.
+// With opts->scan, directories that don't need to be scanned are left without
+// a sub array, fl_refresh_compare() will then keep their old contents.
 static void fl_scan_dir(fl_list_t *parent, fl_list_t *old, const char *path, const char *vpath, fl_scan_t *opts) {
-  GError *err = NULL;
-  GDir *dir = g_dir_open(path, 0, &err);
-  if(!dir) {
-    ui_mf(uit_main_tab, UIP_MED, "Error reading directory \"%s\": %s", vpath, g_strerror(errno));
-    g_error_free(err);
-    return;
-  }
-  const char *name;
-  while((name = g_dir_read_name(dir))) {
-    if(strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
-      continue;
-    if(!opts->inc_hidden && name[0] == '.')
-      continue;
-    // check with *excl, stat and create
-    fl_list_t *item = fl_scan_item(old, path, vpath, name, opts);
-    // and add it
-    if(item)
-      fl_list_add(parent, item, -1);
+  if(opts->scan && old && GPOINTER_TO_INT(g_hash_table_lookup(opts->scan, vpath)) == FL_SCAN_VISIT)
+    fl_scan_copy(parent, old);
+  else {
+    GError *err = NULL;
+    GDir *dir = g_dir_open(path, 0, &err);
+    if(!dir) {
+      ui_mf(uit_main_tab, UIP_MED, "Error reading directory \"%s\": %s", vpath, g_strerror(errno));
+      g_error_free(err);
+      return;
+    }
+    const char *name;
+    while((name = g_dir_read_name(dir))) {
+      if(strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+        continue;
+      if(!opts->inc_hidden && name[0] == '.')
+        continue;
+      // check with *excl, stat and create
+      fl_list_t *item = fl_scan_item(old, path, vpath, name, opts);
+      // and add it
+      if(item)
+        fl_scan_add(parent, item);
+    }
+    g_dir_close(dir);
   }
-  g_dir_close(dir);
 
   // Sort
   fl_list_sort(parent);
@@ -378,39 +922,89 @@ static void fl_scan_dir(fl_list_t *parent, fl_list_t *old, const char *path, con
   int i;
   for(i=0; i<parent->sub->len; i++) {
     fl_list_t *cur = g_ptr_array_index(parent->sub, i);
-    if(!cur->isfile) {
-      char *enc = g_filename_from_utf8(cur->name, -1, NULL, NULL, NULL);
-      char *cpath = g_build_filename(path, enc, NULL);
-      char *virtpath = g_build_filename(vpath, cur->name, NULL);
-      cur->sub = g_ptr_array_new_with_free_func(fl_list_free);
-      fl_scan_dir(cur, old && old->sub ? fl_list_file_strict(old, cur) : NULL, cpath, virtpath, opts);
+    if(cur->isfile)
+      continue;
+    char *virtpath = g_build_filename(vpath, cur->name, NULL);
+    fl_list_t *oldcur = old && old->sub ? fl_list_file_strict(old, cur) : NULL;
+    // Unchanged directory, keep the old one
+    if(opts->scan && oldcur && !oldcur->isfile && strcmp(oldcur->name, cur->name) == 0 && !g_hash_table_lookup(opts->scan, virtpath)) {
+      cur->size = oldcur->size;
       g_free(virtpath);
-      g_free(cpath);
-      g_free(enc);
+      continue;
     }
-    // Removes this item if it is an empty directory and if !opts->emptydirs.
-    if(!opts->emptydirs && !cur->isfile && !cur->sub->len) {
-      fl_list_remove(cur);
-      i--; // Make sure that the index doesn't change with the next iteration
+    char *enc = g_filename_from_utf8(cur->name, -1, NULL, NULL, NULL);
+    char *cpath = g_build_filename(path, enc, NULL);
+    g_free(enc);
+    cur->sub = g_ptr_array_new_with_free_func(fl_list_free);
+    fl_scan_push(opts, cur, oldcur, cpath, virtpath);
+  }
+}
+
+
+static void fl_scan_dirtask(gpointer data, gpointer udata) {
+  fl_scan_task_t *t = data;
+  fl_scan_t *opts = t->opts;
+  fl_scan_dir(t->parent, t->old, t->path, t->vpath, opts);
+  g_free(t->path);
+  g_free(t->vpath);
+  g_slice_free(fl_scan_task_t, t);
+
+  g_mutex_lock(&opts->lock);
+  if(!--opts->pending)
+    g_cond_signal(&opts->cond);
+  g_mutex_unlock(&opts->lock);
+}
+
+
+// Recursively calculates directory sizes and, if !opts->emptydirs, removes
+// empty directories. Directories without a sub array have not been scanned
+// and are left alone.
+static void fl_scan_finish(fl_list_t *fl, fl_scan_t *opts) {
+  guint64 size = 0;
+  int i;
+  for(i=0; i<fl->sub->len; i++) {
+    fl_list_t *cur = g_ptr_array_index(fl->sub, i);
+    if(!cur->isfile && cur->sub) {
+      fl_scan_finish(cur, opts);
+      if(!opts->emptydirs && !cur->sub->len) {
+        g_ptr_array_remove_index(fl->sub, i);
+        i--; // Make sure that the index doesn't change with the next iteration
+        continue;
+      }
     }
+    size += cur->size;
   }
+  fl->size = size;
 }
 
 
 // Must be called in a separate thread.
 static void fl_scan_thread(gpointer data, gpointer udata) {
   fl_scan_t *args = data;
+  g_mutex_init(&args->lock);
+  g_cond_init(&args->cond);
 
   int i, len = g_strv_length(args->path);
   for(i=0; i<len; i++) {
     fl_list_t *cur = fl_list_create("", FALSE);
-    char *tmp = g_filename_from_utf8(args->path[i], -1, NULL, NULL, NULL);
-    cur->sub = g_ptr_array_new_with_free_func(fl_list_free);
-    fl_scan_dir(cur, args->file[i], tmp, args->path[i], args);
-    g_free(tmp);
     args->res[i] = cur;
+    if(args->scan && !g_hash_table_lookup(args->scan, args->path[i]))
+      continue;
+    cur->sub = g_ptr_array_new_with_free_func(fl_list_free);
+    fl_scan_push(args, cur, args->file[i], g_filename_from_utf8(args->path[i], -1, NULL, NULL, NULL), g_strdup(args->path[i]));
   }
 
+  g_mutex_lock(&args->lock);
+  while(args->pending)
+    g_cond_wait(&args->cond, &args->lock);
+  g_mutex_unlock(&args->lock);
+
+  for(i=0; i<len; i++)
+    if(args->res[i]->sub)
+      fl_scan_finish(args->res[i], args);
+
+  g_mutex_clear(&args->lock);
+  g_cond_clear(&args->cond);
   fl_scan_invalidate(0, TRUE);
   g_idle_add_full(G_PRIORITY_HIGH_IDLE, args->donefun, args, NULL);
 }
@@ -423,9 +1017,21 @@ static void fl_scan_thread(gpointer data, gpointer udata) {
 // Hashing files
 
 
+// Files in the hash queue are grouped by the device that their share root
+// resides on. Only one file from each device is hashed at a time, so that
+// spinning disks still get a single sequential reader, while files on
+// different devices can be hashed in parallel (up to VAR_hash_threads).
+typedef struct fl_hash_dev_t {
+  gint64 dev;        // st_dev, also used as key in fl_hash_devs
+  int active;        // number of files from this device being hashed
+  GHashTable *files; // set of queued files that are not being hashed yet
+} fl_hash_dev_t;
+
+
 // This struct is passed from the main thread to the hasher and back with modifications.
 typedef struct fl_hash_t {
   fl_list_t *file; // only accessed from main thread
+  fl_hash_dev_t *dev; // only accessed from main thread
   char *path;        // owned by main thread, read from hash thread
   guint64 filesize;  // set by main thread
   char root[24];     // set by hash thread
@@ -433,7 +1039,8 @@ typedef struct fl_hash_t {
   time_t lastmod;    // set by hash thread
   gint64 id;         // set by hash thread
   gdouble time;      // set by hash thread
-  guint64 lastreset; // last value of fl_hash_reset when starting this thread
+  int threads;       // set by main thread, number of segments (threads) to hash this file with
+  gboolean reset;    // set by main thread when the file is removed from the queue (to stop this hash operation)
 } fl_hash_t;
 
 // Maximum number of levels, including root (level 0).  The ADC docs specify
@@ -456,29 +1063,82 @@ typedef struct fl_hash_t {
 // there's no need for better granularity than this
 #define fl_hash_max_granularity G_GUINT64_CONSTANT(64 * 1024)
 
+// Files are only split into segments to hash in parallel if each segment is
+// at least this large.
+#define fl_hash_min_segment G_GUINT64_CONSTANT(256 * 1024 * 1024)
+
+
+static guint64 fl_hash_blocksize(guint64 filesize) {
+  guint64 blocksize = tth_blocksize(filesize, 1<<(fl_hash_keep_level-1));
+  return MAX(blocksize, fl_hash_max_granularity);
+}
+
+
+// Number of segments to split a file into when there are the given number of
+// threads available for it.
+static int fl_hash_segments(guint64 filesize, int threads) {
+  int blocks_num = tth_num_blocks(filesize, fl_hash_blocksize(filesize));
+  int segs_num = MIN(threads, MIN(blocks_num, filesize / fl_hash_min_segment));
+  return MAX(segs_num, 1);
+}
+
+
+
+// Get the device group for a file in the local list. This stat()s the share
+// root rather than the file itself, so files on a filesystem mounted inside a
+// shared directory are grouped with their share root.
+static fl_hash_dev_t *fl_hash_getdev(fl_list_t *fl) {
+  while(fl->parent && fl->parent->parent)
+    fl = fl->parent;
+  fl_hash_dev_t *d = g_hash_table_lookup(fl_hash_roots, fl);
+  if(d)
+    return d;
+
+  struct stat st;
+  const char *share = db_share_path(fl->name);
+  char *path = share ? g_filename_from_utf8(share, -1, NULL, NULL, NULL) : NULL;
+  gint64 dev = path && stat(path, &st) == 0 ? (gint64)st.st_dev : 0;
+  g_free(path);
+
+  d = g_hash_table_lookup(fl_hash_devs, &dev);
+  if(!d) {
+    d = g_slice_new0(fl_hash_dev_t);
+    d->dev = dev;
+    d->files = g_hash_table_new(g_direct_hash, g_direct_equal);
+    g_hash_table_insert(fl_hash_devs, &d->dev, d);
+  }
+  g_hash_table_insert(fl_hash_roots, fl, d);
+  return d;
+}
 
 
 // adding/removing items from the files-to-be-hashed queue
 // _append() assumes that fl->hastth is false.
 #define fl_hash_queue_append(fl) do {\
     g_warn_if_fail(!fl->hastth);\
-    gboolean start = !g_hash_table_size(fl_hash_queue);\
-    if(start || !g_hash_table_lookup(fl_hash_queue, fl))\
+    if(!g_hash_table_lookup(fl_hash_queue, fl)) {\
+      fl_hash_dev_t *dev = fl_hash_getdev(fl);\
       fl_hash_queue_size += fl->size;\
-    g_hash_table_insert(fl_hash_queue, fl, (void *)1);\
-    if(start)\
-      fl_hash_process();\
+      g_hash_table_insert(fl_hash_queue, fl, dev);\
+      g_hash_table_insert(dev->files, fl, (void *)1);\
+      if(!dev->active)\
+        fl_hash_process();\
+    }\
   } while(0)
 
 
 #define fl_hash_queue_del(fl) do {\
-    if((fl)->isfile && g_hash_table_lookup(fl_hash_queue, fl)) {\
+    fl_hash_dev_t *dev = (fl)->isfile ? g_hash_table_lookup(fl_hash_queue, fl) : NULL;\
+    if(dev) {\
       fl_hash_queue_size -= fl->size;\
       g_hash_table_remove(fl_hash_queue, fl);\
-      if((fl) == fl_hash_cur) {\
+      g_hash_table_remove(dev->files, fl);\
+      fl_hash_t *cur = g_hash_table_lookup(fl_hash_cur, fl);\
+      if(cur) {\
+        g_hash_table_remove(fl_hash_cur, fl);\
         g_mutex_lock(&fl_hash_resetlock);\
-        fl_hash_reset++;\
-        g_cond_signal(&fl_hash_resetcond);\
+        cur->reset = TRUE;\
+        g_cond_broadcast(&fl_hash_resetcond);\
         g_mutex_unlock(&fl_hash_resetlock);\
       }\
     }\
@@ -501,10 +1161,10 @@ static void fl_hash_queue_delrec(fl_list_t *f) {
 // Checks whether this hashing operation has been cancelled and waits until the
 // hash ratecalc object has enough burst to allow us to continue hashing again.
 // Returns the allowed burst, or 0 on cancellation.
-static int fl_hash_burst(guint64 lastreset) {
+static int fl_hash_burst(fl_hash_t *args) {
   int b = 0;
   g_mutex_lock(&fl_hash_resetlock);
-  while(fl_hash_reset == lastreset && (b = ratecalc_burst(&fl_hash_rate)) <= 0)
+  while(!args->reset && (b = ratecalc_burst(&fl_hash_rate)) <= 0)
     g_cond_wait_until(&fl_hash_resetcond, &fl_hash_resetlock, g_get_monotonic_time() + 100*G_TIME_SPAN_MILLISECOND);
   g_mutex_unlock(&fl_hash_resetlock);
   return b;
@@ -513,11 +1173,182 @@ static int fl_hash_burst(guint64 lastreset) {
 
 static gboolean fl_hash_done(gpointer dat);
 
+// A range of blocks of a file to hash. Large files are split into several
+// segments that are hashed in parallel, each with their own reads. Blocks
+// in the range [first, last) are written to blocks.
+typedef struct fl_hash_seg_t {
+  fl_hash_t *args;
+  int fd;
+  guint64 blocksize;
+  int first, last;
+  gboolean tail; // Whether this is the last segment of the file
+  char *blocks;
+  GThread *thread;
+  gboolean done; // set when all blocks have been hashed
+  GError *err;
+} fl_hash_seg_t;
+
+
+// Reading is done in a separate thread, so that the disk doesn't sit idle
+// while we're hashing and vice versa. The reader fills a ring of TTH_BUFNUM
+// buffers, the hasher empties them in the same order.
+typedef struct fl_hash_rd_t {
+  fl_hash_seg_t *seg;
+  GMutex lock;
+  GCond cond;
+  char *bufs[TTH_BUFNUM];
+  int lens[TTH_BUFNUM];
+  int head, num;  // first filled buffer and number of filled buffers
+  gboolean eof;   // set when the reader has finished
+  gboolean ok;    // set when the full range has been read successfully
+  GError *err;
+} fl_hash_rd_t;
+
+
+static gpointer fl_hash_reader(gpointer dat) {
+  fl_hash_rd_t *rd = dat;
+  fl_hash_seg_t *seg = rd->seg;
+  fl_hash_t *args = seg->args;
+
+  guint64 off = seg->first*seg->blocksize;
+  // Number of bytes to read; the tail segment reads until EOF to detect files
+  // that have grown.
+  guint64 len = MIN(args->filesize, seg->last*seg->blocksize) - off;
+
+#ifdef HAVE_POSIX_FADVISE
+  posix_fadvise(seg->fd, off, seg->tail ? 0 : len, POSIX_FADV_SEQUENTIAL);
+#endif
+  fadv_t adv;
+  fadv_init(&adv, seg->fd, off, VAR_FFC_HASH);
+
+  int r, nr, i;
+  guint64 done = 0;
+  while(1) {
+    g_mutex_lock(&rd->lock);
+    while(rd->num == TTH_BUFNUM)
+      g_cond_wait(&rd->cond, &rd->lock);
+    i = (rd->head + rd->num) % TTH_BUFNUM;
+    g_mutex_unlock(&rd->lock);
+
+    if((nr = fl_hash_burst(args)) <= 0)
+      goto finish;
+    r = pread(seg->fd, rd->bufs[i], seg->tail ? MIN(nr, TTH_BUFSIZE) : MIN(MIN(nr, TTH_BUFSIZE), len-done), off+done);
+    if(r < 0) {
+      g_set_error(&rd->err, 1, 0, "Error reading file: %s", g_strerror(errno));
+      goto finish;
+    }
+    if(r == 0)
+      break;
+    done += r;
+    fadv_purge(&adv, r);
+    // file has been modified. time to back out
+    if(done > len)
+      break;
+    ratecalc_add(&fl_hash_rate, r);
+
+    g_mutex_lock(&rd->lock);
+    rd->lens[i] = r;
+    rd->num++;
+    g_cond_signal(&rd->cond);
+    g_mutex_unlock(&rd->lock);
+
+    if(!seg->tail && done == len)
+      break;
+  }
+  if(done != len)
+    g_set_error_literal(&rd->err, 1, 0, "File has been modified.");
+  else
+    rd->ok = TRUE;
+
+finish:
+  fadv_close(&adv);
+  g_mutex_lock(&rd->lock);
+  rd->eof = TRUE;
+  g_cond_signal(&rd->cond);
+  g_mutex_unlock(&rd->lock);
+  return NULL;
+}
+
+
+static gpointer fl_hash_segment(gpointer dat) {
+  fl_hash_seg_t *seg = dat;
+  fl_hash_t *args = seg->args;
+  tth_ctx_t tth;
+  tth_init(&tth);
+
+  int i;
+  fl_hash_rd_t rd = {};
+  rd.seg = seg;
+  g_mutex_init(&rd.lock);
+  g_cond_init(&rd.cond);
+  for(i=0; i<TTH_BUFNUM; i++)
+    rd.bufs[i] = g_malloc(TTH_BUFSIZE);
+  GThread *reader = g_thread_new("fl_hash_reader", fl_hash_reader, &rd);
+
+  int block_cur = seg->first;
+  guint64 block_len = 0;
+
+  while(1) {
+    g_mutex_lock(&rd.lock);
+    while(!rd.num && !rd.eof)
+      g_cond_wait(&rd.cond, &rd.lock);
+    // No need to hash the remaining buffers if the reader has given up
+    if(!rd.num || (rd.eof && !rd.ok)) {
+      g_mutex_unlock(&rd.lock);
+      break;
+    }
+    char *b = rd.bufs[rd.head];
+    int r = rd.lens[rd.head];
+    g_mutex_unlock(&rd.lock);
+
+    while(r > 0) {
+      int w = MIN(r, seg->blocksize-block_len);
+      tth_update(&tth, b, w);
+      block_len += w;
+      b += w;
+      r -= w;
+      if(block_len >= seg->blocksize) {
+        tth_final(&tth, seg->blocks+(block_cur*24));
+        tth_init(&tth);
+        block_cur++;
+        block_len = 0;
+      }
+    }
+
+    g_mutex_lock(&rd.lock);
+    rd.head = (rd.head + 1) % TTH_BUFNUM;
+    rd.num--;
+    g_cond_signal(&rd.cond);
+    g_mutex_unlock(&rd.lock);
+  }
+  g_thread_join(reader);
+
+  if(rd.err) {
+    g_propagate_error(&seg->err, rd.err);
+    goto finish;
+  }
+  if(!rd.ok)
+    goto finish;
+  // Calculate last block
+  if(!args->filesize || block_len) {
+    tth_final(&tth, seg->blocks+(block_cur*24));
+    block_cur++;
+  }
+  g_warn_if_fail(block_cur == seg->last);
+  seg->done = block_cur == seg->last;
+
+finish:
+  for(i=0; i<TTH_BUFNUM; i++)
+    g_free(rd.bufs[i]);
+  g_mutex_clear(&rd.lock);
+  g_cond_clear(&rd.cond);
+  return NULL;
+}
+
+
 static void fl_hash_thread(gpointer data, gpointer udata) {
   fl_hash_t *args = data;
-  // static, since only one hash thread is allowed and this saves stack space
-  tth_ctx_t tth;
-  char *buf = g_malloc(TTH_BUFSIZE);
+  fl_hash_seg_t *segs = NULL;
   char *blocks = NULL;
   int f = -1;
   char *real = NULL;
@@ -541,121 +1372,148 @@ static void fl_hash_thread(gpointer data, gpointer udata) {
   }
 
   // Initialize some stuff
-  guint64 blocksize = tth_blocksize(args->filesize, 1<<(fl_hash_keep_level-1));
-  blocksize = MAX(blocksize, fl_hash_max_granularity);
+  guint64 blocksize = fl_hash_blocksize(args->filesize);
   int blocks_num = tth_num_blocks(args->filesize, blocksize);
   blocks = g_malloc(24*blocks_num);
-  tth_init(&tth);
-
-  fadv_t adv;
-  fadv_init(&adv, f, 0, VAR_FFC_HASH);
-
-  int r, nr;
-  guint64 rd = 0;
-  int block_cur = 0;
-  guint64 block_len = 0;
 
-  if((nr = fl_hash_burst(args->lastreset)) <= 0)
-    goto finish;
-  while((r = read(f, buf, MIN(nr, TTH_BUFSIZE))) > 0) {
-    rd += r;
-    fadv_purge(&adv, r);
-    // file has been modified. time to back out
-    if(rd > args->filesize) {
-      g_set_error_literal(&args->err, 1, 0, "File has been modified.");
-      goto finish;
-    }
-    ratecalc_add(&fl_hash_rate, r);
-    // and hash
-    char *b = buf;
-    while(r > 0) {
-      int w = MIN(r, blocksize-block_len);
-      tth_update(&tth, b, w);
-      block_len += w;
-      b += w;
-      r -= w;
-      if(block_len >= blocksize) {
-        tth_final(&tth, blocks+(block_cur*24));
-        tth_init(&tth);
-        block_cur++;
-        block_len = 0;
-      }
-    }
-    if((nr = fl_hash_burst(args->lastreset)) <= 0)
-      goto finish;
+  // Split the file into segments of whole blocks
+  int i, segs_num = args->threads;
+  segs = g_new0(fl_hash_seg_t, segs_num);
+  for(i=0; i<segs_num; i++) {
+    segs[i].args = args;
+    segs[i].fd = f;
+    segs[i].blocksize = blocksize;
+    segs[i].first = (gint64)blocks_num * i / segs_num;
+    segs[i].last = (gint64)blocks_num * (i+1) / segs_num;
+    segs[i].tail = i == segs_num-1;
+    segs[i].blocks = blocks;
   }
-  if(r < 0) {
-    g_set_error(&args->err, 1, 0, "Error reading file: %s", g_strerror(errno));
-    goto finish;
+  if(segs_num > 1)
+    g_debug("fl: Hashing %s in %d segments.", real, segs_num);
+
+  // Hash the first segment in this thread, and the others in new threads
+  for(i=1; i<segs_num; i++)
+    segs[i].thread = g_thread_new("fl_hash_segment", fl_hash_segment, segs+i);
+  fl_hash_segment(segs);
+  for(i=1; i<segs_num; i++)
+    g_thread_join(segs[i].thread);
+
+  gboolean done = TRUE;
+  for(i=0; i<segs_num; i++) {
+    if(segs[i].err && !args->err)
+      g_propagate_error(&args->err, segs[i].err);
+    else if(segs[i].err)
+      g_error_free(segs[i].err);
+    done = done && segs[i].done;
   }
-  if(rd != args->filesize) {
-    g_set_error_literal(&args->err, 1, 0, "File has been modified.");
+  if(!done)
     goto finish;
-  }
-  // Calculate last block
-  if(!args->filesize || block_len) {
-    tth_final(&tth, blocks+(block_cur*24));
-    block_cur++;
-  }
-  g_return_if_fail(block_cur == blocks_num);
+
   // Calculate root hash
   tth_root(blocks, blocks_num, args->root);
 
   // Add to database
   args->id = db_fl_addhash(real, args->filesize, args->lastmod, args->root, blocks, 24*blocks_num);
+  blocks = NULL; // owned by the database thread now
   if(!args->id)
     g_set_error_literal(&args->err, 1, 0, "Error saving hash data to the database.");
 
 finish:
-  if(f > 0) {
-    fadv_close(&adv);
+  if(f >= 0)
     close(f);
-  }
-  g_free(buf);
+  g_free(segs);
   g_free(real);
   g_free(blocks);
   args->time = g_timer_elapsed(tm, NULL);
   g_timer_destroy(tm);
+  if(!args->err) {
+    perf_add(hash_file, args->time*1e6);
+    perf_add(hash_bytes, args->filesize);
+  }
   g_idle_add_full(G_PRIORITY_HIGH_IDLE, fl_hash_done, args, NULL);
 }
 
 
-static void fl_hash_process() {
-  if(!g_hash_table_size(fl_hash_queue)) {
-    ratecalc_unregister(&fl_hash_rate);
-    ratecalc_reset(&fl_hash_rate);
-    var_set_bool(0, VAR_fl_done, TRUE);
-    return;
-  }
-  var_set_bool(0, VAR_fl_done, FALSE);
-  ratecalc_register(&fl_hash_rate, RCC_HASH);
-
-  // get one item from fl_hash_queue
+// Start hashing the next file from the given device, using at most the given
+// number of threads.
+static void fl_hash_startdev(fl_hash_dev_t *dev, int threads) {
+  // get one item from the queued files of this device
   GHashTableIter iter;
   fl_list_t *file;
-  g_hash_table_iter_init(&iter, fl_hash_queue);
+  g_hash_table_iter_init(&iter, dev->files);
   g_hash_table_iter_next(&iter, (gpointer *)&file, NULL);
-  fl_hash_cur = file;
+  g_hash_table_iter_remove(&iter);
+
+  var_set_bool(0, VAR_fl_done, FALSE);
+  ratecalc_register(&fl_hash_rate, RCC_HASH);
 
   // pass stuff to the hash thread
   fl_hash_t *args = g_new0(fl_hash_t, 1);
   args->file = file;
+  args->dev = dev;
   char *tmp = fl_local_path(file);
   args->path = g_filename_from_utf8(tmp, -1, NULL, NULL, NULL);
   g_free(tmp);
   args->filesize = file->size;
-  args->lastreset = fl_hash_reset;
+  args->threads = fl_hash_segments(file->size, threads);
+  g_hash_table_insert(fl_hash_cur, file, args);
+  dev->active++;
+  fl_hash_active += args->threads;
+
   g_message("Start hashing %s", args->path);
   g_thread_pool_push(fl_hash_pool, args, NULL);
 }
 
 
+// Starts hashing files from idle devices, as long as there are free hash
+// threads. Every segment of a file counts as one thread against
+// VAR_hash_threads (its reader thread mostly waits on the disk), and the free
+// threads are divided among the idle devices that have work to do, so large
+// files can be hashed in parallel with whatever isn't used for other files.
+static void fl_hash_process() {
+  if(!g_hash_table_size(fl_hash_queue)) {
+    ratecalc_unregister(&fl_hash_rate);
+    ratecalc_reset(&fl_hash_rate);
+    var_set_bool(0, VAR_fl_done, TRUE);
+    fl_hash_newgen();
+    return;
+  }
+
+  int max = var_get_int(0, VAR_hash_threads);
+  GHashTableIter iter;
+  fl_hash_dev_t *dev;
+  int idle = 0;
+  g_hash_table_iter_init(&iter, fl_hash_devs);
+  while(g_hash_table_iter_next(&iter, NULL, (gpointer *)&dev))
+    if(!dev->active && g_hash_table_size(dev->files))
+      idle++;
+
+  g_hash_table_iter_init(&iter, fl_hash_devs);
+  while(fl_hash_active < max && g_hash_table_iter_next(&iter, NULL, (gpointer *)&dev))
+    if(!dev->active && g_hash_table_size(dev->files))
+      fl_hash_startdev(dev, MAX(1, (max - fl_hash_active) / idle--));
+}
+
+
+// Called when the hash_threads setting has been increased.
+void fl_hash_more() {
+  if(fl_hash_queue && g_hash_table_size(fl_hash_queue))
+    fl_hash_process();
+}
+
+
 static gboolean fl_hash_done(gpointer dat) {
   fl_hash_t *args = dat;
   fl_list_t *fl = args->file;
 
-  // remove file from queue, ignore this hash if the file was already removed
-  // by some other process.
+  args->dev->active--;
+  fl_hash_active -= args->threads;
+
+  // ignore this hash if the file was removed from the queue while it was
+  // being hashed. (The fl pointer may not even be valid anymore)
+  if(args->reset)
+    goto fl_hash_done_f;
+  g_hash_table_remove(fl_hash_cur, fl);
   if(!g_hash_table_remove(fl_hash_queue, fl))
     goto fl_hash_done_f;
 
@@ -673,6 +1531,8 @@ static gboolean fl_hash_done(gpointer dat) {
   fl_list_getlocal(fl).lastmod = args->lastmod;
   fl_list_getlocal(fl).id = args->id;
   fl_hashindex_insert(fl);
+  fl_local_invalidate(fl);
+  fl_hash_new = TRUE;
   fl_needflush = TRUE;
 
 fl_hash_done_f:
@@ -689,6 +1549,196 @@ fl_hash_done_f:
 
 
 
+// Watching the share for changes
+
+// When inotify is available, every shared directory is watched. Changes mark
+// the (filesystem) path of the directory as dirty, and the automatic refresh
+// will only scan those directories instead of the entire share. A full
+// refresh is done when events have been lost or when not all directories
+// could be watched.
+
+static int      fl_watch_fd = -1;
+static gboolean fl_watch_full = TRUE; // whether the next refresh must scan everything
+
+#ifdef HAVE_SYS_INOTIFY_H
+
+#define FL_WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF | IN_ONLYDIR)
+
+static GHashTable *fl_watch_wds;   // wd -> path
+static GHashTable *fl_watch_paths; // path -> wd, keys are owned by fl_watch_wds
+static GHashTable *fl_watch_dirty; // paths of changed directories
+
+
+static void fl_watch_forget(int wd) {
+  char *path = g_hash_table_lookup(fl_watch_wds, GINT_TO_POINTER(wd));
+  if(path) {
+    g_hash_table_remove(fl_watch_paths, path);
+    g_hash_table_remove(fl_watch_wds, GINT_TO_POINTER(wd));
+  }
+}
+
+
+// Make sure that fl and all new directories below it are being watched. *path
+// is the filesystem path in UTF-8, as given by fl_local_path().
+static void fl_watch_add(fl_list_t *fl, const char *path) {
+  if(fl_watch_fd < 0 || fl->isfile)
+    return;
+  if(!g_hash_table_lookup(fl_watch_paths, path)) {
+    char *enc = g_filename_from_utf8(path, -1, NULL, NULL, NULL);
+    int wd = enc ? inotify_add_watch(fl_watch_fd, enc, FL_WATCH_MASK) : -1;
+    g_free(enc);
+    if(wd < 0) {
+      if(errno == ENOSPC || errno == ENOMEM) {
+        if(!fl_watch_full)
+          ui_mf(uit_main_tab, UIP_MED, "Can't watch \"%s\" for changes: %s. Falling back to full refreshes.", path, g_strerror(errno));
+        fl_watch_full = TRUE;
+      }
+      return;
+    }
+    // The same wd is returned when the directory has been renamed.
+    fl_watch_forget(wd);
+    char *p = g_strdup(path);
+    g_hash_table_insert(fl_watch_wds, GINT_TO_POINTER(wd), p);
+    g_hash_table_insert(fl_watch_paths, p, GINT_TO_POINTER(wd));
+  }
+  int i;
+  for(i=0; i<fl->sub->len; i++) {
+    fl_list_t *c = g_ptr_array_index(fl->sub, i);
+    if(c->isfile)
+      continue;
+    char *cpath = g_build_filename(path, c->name, NULL);
+    if(!g_hash_table_lookup(fl_watch_paths, cpath))
+      fl_watch_add(c, cpath);
+    g_free(cpath);
+  }
+}
+
+
+// Returns the share item that path is in, or NULL if it's not shared.
+static db_share_item_t *fl_watch_shareroot(const char *path) {
+  db_share_item_t *l = db_share_list();
+  for(; l->name; l++) {
+    int len = strlen(l->path);
+    if(strncmp(path, l->path, len) == 0 && (!path[len] || path[len] == '/'))
+      return l;
+  }
+  return NULL;
+}
+
+
+// Stop watching directories that are not shared anymore.
+static void fl_watch_prune() {
+  if(fl_watch_fd < 0)
+    return;
+  GHashTableIter iter;
+  gpointer wd;
+  char *p;
+  g_hash_table_iter_init(&iter, fl_watch_wds);
+  while(g_hash_table_iter_next(&iter, &wd, (gpointer *)&p))
+    if(!fl_watch_shareroot(p))
+      inotify_rm_watch(fl_watch_fd, GPOINTER_TO_INT(wd));
+  // The watches are removed from our tables when IN_IGNORED is received.
+}
+
+
+static gboolean fl_watch_read(gpointer dat) {
+  char buf[8192] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  int r;
+  while((r = read(fl_watch_fd, buf, sizeof(buf))) > 0) {
+    char *ptr = buf;
+    while(ptr < buf+r) {
+      struct inotify_event *ev = (struct inotify_event *)ptr;
+      ptr += sizeof(struct inotify_event) + ev->len;
+      if(ev->mask & IN_Q_OVERFLOW) {
+        g_debug("fl: inotify queue overflow, doing a full refresh next time.");
+        fl_watch_full = TRUE;
+        continue;
+      }
+      char *path = g_hash_table_lookup(fl_watch_wds, GINT_TO_POINTER(ev->wd));
+      if(!path)
+        continue;
+      if(ev->mask & IN_IGNORED) {
+        fl_watch_forget(ev->wd);
+        continue;
+      }
+      // A removed or renamed directory is noticed by its parent
+      if(ev->mask & (IN_MOVE_SELF | IN_DELETE_SELF)) {
+        char *parent = g_path_get_dirname(path);
+        g_hash_table_add(fl_watch_dirty, parent);
+        if(ev->mask & IN_MOVE_SELF)
+          inotify_rm_watch(fl_watch_fd, ev->wd);
+      } else
+        g_hash_table_add(fl_watch_dirty, g_strdup(path));
+    }
+  }
+  return TRUE;
+}
+
+
+static void fl_watch_init() {
+  fl_watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if(fl_watch_fd < 0) {
+    g_warning("Unable to initialize inotify: %s", g_strerror(errno));
+    return;
+  }
+  fl_watch_wds = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+  fl_watch_paths = g_hash_table_new(g_str_hash, g_str_equal);
+  fl_watch_dirty = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+  GSource *src = fdsrc_new(fl_watch_fd, G_IO_IN);
+  g_source_set_callback(src, fl_watch_read, NULL, NULL);
+  g_source_attach(src, NULL);
+  g_source_unref(src);
+}
+
+
+// Converts the dirty directories into a set for fl_scan_t.scan, and clears
+// the dirty list. Returns NULL if there is nothing to do.
+static GHashTable *fl_watch_scanset() {
+  if(fl_watch_fd < 0 || !g_hash_table_size(fl_watch_dirty))
+    return NULL;
+  GHashTable *set = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+  GHashTableIter iter;
+  char *path;
+  g_hash_table_iter_init(&iter, fl_watch_dirty);
+  while(g_hash_table_iter_next(&iter, (gpointer *)&path, NULL)) {
+    db_share_item_t *l = fl_watch_shareroot(path);
+    if(!l)
+      continue;
+    int len = strlen(l->path);
+    g_hash_table_insert(set, g_strdup(path), GINT_TO_POINTER(FL_SCAN_DIRTY));
+    // Make sure all parents are visited
+    char *p = g_strdup(path), *sep;
+    while(strlen(p) > len && (sep = strrchr(p, '/')) && sep > p) {
+      *sep = 0;
+      if(!g_hash_table_lookup(set, p))
+        g_hash_table_insert(set, g_strdup(p), GINT_TO_POINTER(FL_SCAN_VISIT));
+    }
+    g_free(p);
+    if(!g_hash_table_lookup(set, l->path))
+      g_hash_table_insert(set, g_strdup(l->path), GINT_TO_POINTER(FL_SCAN_VISIT));
+  }
+  g_hash_table_remove_all(fl_watch_dirty);
+  if(!g_hash_table_size(set)) {
+    g_hash_table_unref(set);
+    return NULL;
+  }
+  return set;
+}
+
+#else
+
+#define fl_watch_add(fl, path) ((void)0)
+#define fl_watch_prune() ((void)0)
+#define fl_watch_init() ((void)0)
+#define fl_watch_scanset() NULL
+
+#endif
+
+
+
+
+
+
 // Refresh filelist & (un)share directories
 
 
@@ -706,6 +1756,7 @@ static fl_list_t *fl_refresh_getroot(const char *name) {
     cur->sub = g_ptr_array_new_with_free_func(fl_list_free);
     fl_list_add(fl_local_list, cur, -1);
     fl_list_sort(fl_local_list);
+    fl_nameindex_insert(cur);
   }
   return cur;
 }
@@ -743,6 +1794,7 @@ static void fl_refresh_delhash(fl_list_t *cur) {
 static void fl_refresh_compare(fl_list_t *old, fl_list_t *new) {
   int oldi = 0;
   int newi = 0;
+  fl_local_gen++;
   while(oldi < old->sub->len || newi < new->sub->len) {
     fl_list_t *oldl = oldi >= old->sub->len ? NULL : g_ptr_array_index(old->sub, oldi);
     fl_list_t *newl = newi >= new->sub->len ? NULL : g_ptr_array_index(new->sub, newi);
@@ -777,8 +1829,8 @@ static void fl_refresh_compare(fl_list_t *old, fl_list_t *new) {
         fl_list_getlocal(oldl).lastmod = fl_list_getlocal(newl).lastmod;
         // Add updated file to either the hash queue or index
         fl_refresh_addhash(oldl);
-      // Directory, recurse into it
-      } else
+      // Directory, recurse into it (unless it wasn't scanned)
+      } else if(newl->sub)
         fl_refresh_compare(oldl, newl);
       oldi++;
       newi++;
@@ -787,6 +1839,7 @@ static void fl_refresh_compare(fl_list_t *old, fl_list_t *new) {
     // remove
     if(remove) {
       fl_refresh_delhash(oldl);
+      fl_nameindex_rec(oldl, FALSE);
       fl_list_remove(oldl);
       // don't modify oldi, after deletion it will automatically point to the next item in the list
     }
@@ -796,6 +1849,7 @@ static void fl_refresh_compare(fl_list_t *old, fl_list_t *new) {
       fl_list_t *tmp = fl_list_copy(newl);
       fl_list_add(old, tmp, oldi);
       fl_refresh_addhash(tmp);
+      fl_nameindex_rec(tmp, TRUE);
       oldi++; // after fl_list_add(), oldi points to the new item. But we don't have to check that one again, so increase.
       newi++;
     }
@@ -822,6 +1876,9 @@ static void fl_refresh_compare(fl_list_t *old, fl_list_t *new) {
 
 static gboolean fl_refresh_scanned(gpointer dat);
 
+// Set by fl_watch_refresh(), used by the next refresh of fl_local_list.
+static GHashTable *fl_refresh_scanset = NULL;
+
 static void fl_refresh_process() {
   if(!fl_refresh_queue->head)
     return;
@@ -838,10 +1895,32 @@ static void fl_refresh_process() {
   if(excl)
     args->excl_regex = g_regex_new(excl, G_REGEX_OPTIMIZE, 0, NULL);
 
+  // Only scan the changed directories if this refresh was started by
+  // fl_watch_refresh().
+  if(dir == fl_local_list) {
+    args->scan = fl_refresh_scanset;
+    fl_refresh_scanset = NULL;
+    if(!args->scan)
+      fl_watch_full = FALSE;
+  }
+
   // Don't allow files in the scanned directory to be hashed while refreshing.
   // Since the refresh thread will create a completely new fl_list structure,
   // any changes to the old one will be lost.
-  fl_hash_queue_delrec(dir);
+  if(args->scan) {
+    GHashTableIter iter;
+    char *path;
+    g_hash_table_iter_init(&iter, args->scan);
+    while(g_hash_table_iter_next(&iter, (gpointer *)&path, NULL)) {
+      fl_list_t *d = fl_local_from_path(path);
+      int i;
+      for(i=0; d && !d->isfile && i<d->sub->len; i++) {
+        fl_list_t *f = g_ptr_array_index(d->sub, i);
+        fl_hash_queue_del(f);
+      }
+    }
+  } else
+    fl_hash_queue_delrec(dir);
 
   // one dir, the simple case
   if(dir != fl_local_list) {
@@ -854,6 +1933,7 @@ static void fl_refresh_process() {
   // refresh the entire share, which consists of multiple dirs.
   } else {
     time(&fl_refresh_last);
+    g_hash_table_remove_all(fl_hash_roots);
     db_share_item_t *l;
     int i, len = 0;
     for(l=db_share_list(); l->name; l++)
@@ -877,10 +1957,28 @@ static gboolean fl_refresh_scanned(gpointer dat) {
 
   int i, len = g_strv_length(args->path);
   for(i=0; i<len; i++) {
-    fl_refresh_compare(args->file[i], args->res[i]);
+    if(args->res[i]->sub) {
+      fl_refresh_compare(args->file[i], args->res[i]);
+      fl_local_invalidate(args->file[i]);
+    }
     fl_list_free(args->res[i]);
   }
 
+  // Watch any new directories
+  if(args->scan) {
+    GHashTableIter iter;
+    char *path;
+    g_hash_table_iter_init(&iter, args->scan);
+    while(g_hash_table_iter_next(&iter, (gpointer *)&path, NULL)) {
+      fl_list_t *d = fl_local_from_path(path);
+      if(d && d != fl_local_list)
+        fl_watch_add(d, path);
+    }
+    g_hash_table_unref(args->scan);
+  } else
+    for(i=0; i<len; i++)
+      fl_watch_add(args->file[i], args->path[i]);
+
   // If the hash queue is empty after calling fl_refresh_compare() then it
   // means the file list is completely hashed.
   if(!g_hash_table_size(fl_hash_queue))
@@ -904,6 +2002,11 @@ static gboolean fl_refresh_scanned(gpointer dat) {
 
 
 void fl_refresh(fl_list_t *dir) {
+  // The list is still being loaded, refresh everything once it's there
+  if(fl_local_loading) {
+    fl_load_refresh = TRUE;
+    return;
+  }
   if(!dir)
     dir = fl_local_list;
   GList *n;
@@ -929,7 +2032,7 @@ void fl_refresh(fl_list_t *dir) {
 // Adds a directory to the file list and initiates a refresh on it (Assumes the
 // directory has already been added to the config file).
 void fl_share(const char *dir) {
-  fl_refresh(fl_refresh_getroot(dir));
+  fl_refresh(fl_local_loading ? NULL : fl_refresh_getroot(dir));
 }
 
 
@@ -939,19 +2042,34 @@ void fl_share(const char *dir) {
 // when a currently-being-hashed file is removed due to the directory not being
 // present in the config file anymore).
 void fl_unshare(const char *dir) {
+  // The config has already been updated, a refresh after loading will
+  // remove the directory.
+  if(fl_local_loading) {
+    fl_load_refresh = TRUE;
+    return;
+  }
   if(dir) {
     fl_list_t *fl = fl_list_file(fl_local_list, dir);
     g_return_if_fail(fl);
     fl_hash_queue_delrec(fl);
     fl_refresh_delhash(fl);
+    fl_nameindex_rec(fl, FALSE);
+    fl_save_invalidate(fl->name);
+    g_hash_table_remove(fl_hash_roots, fl);
     fl_list_remove(fl);
   } else if(fl_local_list) {
     fl_hash_queue_delrec(fl_local_list);
     fl_refresh_delhash(fl_local_list);
+    g_hash_table_remove_all(fl_hash_roots);
+    g_hash_table_remove_all(fl_name_trigrams);
+    g_hash_table_remove_all(fl_name_index);
+    fl_save_invalidate(NULL);
     fl_list_free(fl_local_list);
     fl_local_list = fl_list_create("", FALSE);
     fl_local_list->sub = g_ptr_array_new_with_free_func(fl_list_free);
   }
+  fl_watch_prune();
+  fl_local_gen++;
   // force a refresh, people may be in a hurry with removing stuff
   fl_needflush = TRUE;
   fl_flush(NULL);
@@ -965,11 +2083,13 @@ void fl_unshare(const char *dir) {
 // Initialize local filelist
 
 
-// Walks through the file list and inserts everything into the fl_hashindex.
+// Walks through the file list and inserts everything into the fl_hashindex
+// and the name index.
 static void fl_init_list(fl_list_t *fl) {
   int i;
   for(i=0; i<fl->sub->len; i++) {
     fl_list_t *c = g_ptr_array_index(fl->sub, i);
+    fl_nameindex_insert(c);
     if(c->isfile && c->hastth)
       fl_hashindex_insert(c);
     else if(!c->isfile)
@@ -978,29 +2098,89 @@ static void fl_init_list(fl_list_t *fl) {
 }
 
 
+// Replaces fl_local_list with fl and indexes it. The old list must not have
+// any items in the indexes, i.e. it must be the empty list created by
+// fl_init(). Also used by ncdc-bench.
+void fl_local_set_list(fl_list_t *fl) {
+  if(!fl_name_index) {
+    fl_name_index = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, fl_name_tok_free);
+    fl_name_trigrams = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, (GDestroyNotify)g_ptr_array_unref);
+  }
+  if(fl_local_list)
+    fl_list_free(fl_local_list);
+  fl_local_list = fl;
+  fl_init_list(fl);
+  fl_local_gen++;
+}
+
+
+// Refresh only the directories that have changed since the last refresh.
+static void fl_watch_refresh() {
+  GHashTable *set = fl_watch_scanset();
+  if(!set)
+    return;
+  time(&fl_refresh_last);
+  fl_refresh_scanset = set;
+  fl_refresh(NULL);
+}
+
+
 static gboolean fl_init_autorefresh(gpointer dat) {
   int r = var_get_int(0, VAR_autorefresh);
   time_t t = time(NULL);
-  if(r && fl_refresh_last+r < t && !fl_is_refreshing() && fl_hash_queue_size == 0)
-    fl_refresh(NULL);
+  if(r && fl_refresh_last+r < t && !fl_local_loading && !fl_is_refreshing() && fl_hash_queue_size == 0) {
+    if(fl_watch_fd >= 0 && !fl_watch_full)
+      fl_watch_refresh();
+    else
+      fl_refresh(NULL);
+  }
   return TRUE;
 }
 
 
-void fl_init() {
-  GError *err = NULL;
-  gboolean dorefresh = FALSE;
+static void fl_init_finish(gboolean dorefresh) {
+  gboolean sharing = db_share_list()->name ? TRUE : FALSE;
 
+  // If ncdc was previously closed while hashing, make sure to force a refresh
+  // this time to continue the hash progress.
+  if(sharing && !var_get_bool(0, VAR_fl_done)) {
+    dorefresh = TRUE;
+    ui_m(uit_main_tab, UIM_NOTIFY, "File list incomplete, refreshing...");
+  }
+
+  if(dorefresh || fl_load_refresh || var_get_int(0, VAR_autorefresh))
+    fl_refresh(NULL);
+  fl_load_refresh = FALSE;
+}
+
+
+static void fl_init_loaded(fl_list_t *fl, GError *err, void *dat) {
+  fl_local_loading = FALSE;
+  ui_m(NULL, UIM_NOLOG, NULL);
+  if(!fl) {
+    ui_mf(uit_main_tab, UIP_MED, "Error loading local filelist: %s. Re-building list.", err->message);
+    g_error_free(err);
+  } else
+    fl_local_set_list(fl);
+  fl_init_finish(!fl);
+  // Our share size has changed, let the hubs know
+  hub_global_nfochange();
+}
+
+
+void fl_init() {
   // init stuff
   fl_local_list = NULL;
   fl_local_list_file = g_build_filename(db_dir, "files.xml.bz2", NULL);
   fl_refresh_queue = g_queue_new();
   fl_scan_pool = g_thread_pool_new(fl_scan_thread, NULL, 1, FALSE, NULL);
-  fl_hash_pool = g_thread_pool_new(fl_hash_thread, NULL, 1, FALSE, NULL);
+  fl_scan_dirpool = g_thread_pool_new(fl_scan_dirtask, NULL, FL_SCAN_THREADS, FALSE, NULL);
+  // The number of concurrent hash threads is limited by fl_hash_process()
+  fl_hash_pool = g_thread_pool_new(fl_hash_thread, NULL, -1, FALSE, NULL);
   fl_hash_queue = g_hash_table_new(g_direct_hash, g_direct_equal);
-  // Even though the keys are the tth roots, we can just use g_int_hash. The
-  // first four bytes provide enough unique data anyway.
-  fl_hash_index = g_hash_table_new(g_int_hash, tiger_hash_equal);
+  fl_hash_cur = g_hash_table_new(g_direct_hash, g_direct_equal);
+  fl_hash_devs = g_hash_table_new(g_int64_hash, g_int64_equal);
+  fl_hash_roots = g_hash_table_new(g_direct_hash, g_direct_equal);
   ratecalc_init(&fl_hash_rate);
 
   // flush unsaved data to disk every 60 seconds
@@ -1010,50 +2190,30 @@ void fl_init() {
   // the configured interval as a timeout, in which case we need to manually
   // adjust the timer on every change.
   g_timeout_add_seconds_full(G_PRIORITY_LOW, 60, fl_init_autorefresh, NULL, NULL);
-
-  // The following code may take a while on large shares, so indicate to the UI
-  // that we're busy.
-  ui_m(NULL, UIM_NOLOG|UIM_DIRECT, "Loading file list...");
-  ui_draw();
+  fl_watch_init();
 
   // check whether something is shared
   gboolean sharing = db_share_list()->name ? TRUE : FALSE;
 
-  // load our files.xml.bz2
-  fl_local_list = sharing ? fl_load(fl_local_list_file, &err, TRUE) : NULL;
-  if(sharing && !fl_local_list) {
-    ui_mf(uit_main_tab, UIP_MED, "Error loading local filelist: %s. Re-building list.", err->message);
-    g_error_free(err);
-    dorefresh = TRUE;
-  } else if(!sharing)
+  // Always make sure we at least have an fl_local_list. While the real list
+  // is being loaded this empty one is used, so searches won't return anything
+  // and nothing else needs to check for a NULL list.
+  fl_list_t *empty = fl_list_create("", FALSE);
+  empty->sub = g_ptr_array_new_with_free_func(fl_list_free);
+  fl_local_set_list(empty);
+
+  if(!sharing) {
     // Force a refresh when we're not sharing anything. This makes sure that we
     // at least have a files.xml.bz2
-    dorefresh = TRUE;
-  ui_m(NULL, UIM_NOLOG, NULL);
-
-  // Always make sure we at least have an fl_local_list
-  if(!fl_local_list) {
-    fl_local_list = fl_list_create("", FALSE);
-    fl_local_list->sub = g_ptr_array_new_with_free_func(fl_list_free);
-  }
-
-  // If ncdc was previously closed while hashing, make sure to force a refresh
-  // this time to continue the hash progress.
-  if(sharing && !var_get_bool(0, VAR_fl_done)) {
-    dorefresh = TRUE;
-    ui_m(uit_main_tab, UIM_NOTIFY, "File list incomplete, refreshing...");
+    fl_init_finish(TRUE);
+    return;
   }
 
-  // Initialize the fl_hash_index
-  if(fl_local_list)
-    fl_init_list(fl_local_list);
-
-  // reset loading indicator
-  if(!fl_local_list || !dorefresh)
-    ui_m(NULL, UIM_NOLOG|UIM_DIRECT, NULL);
-
-  if(dorefresh || var_get_int(0, VAR_autorefresh))
-    fl_refresh(NULL);
+  // Load our files.xml.bz2 in the background, this may take a while on large
+  // shares.
+  ui_m(NULL, UIM_NOLOG|UIM_DIRECT, "Loading file list...");
+  fl_local_loading = TRUE;
+  fl_load_async(fl_local_list_file, TRUE, fl_init_loaded, NULL);
 }
 
 
@@ -1101,18 +2261,16 @@ gboolean fl_gc() {
     return FALSE;
 
   // Init data
-  fl_gc_active = g_array_sized_new(FALSE, FALSE, 8, g_hash_table_size(fl_hash_index));
+  fl_gc_active = g_array_sized_new(FALSE, FALSE, 8, fl_hash_index_files);
   fl_gc_remove = g_array_new(FALSE, FALSE, 8);
   fl_gc_last = 0;
 
   // Fill fl_active array.  It is possible that two identical ids are added to
   // the array, but this isn't a problem.
-  GSList *l;
-  GHashTableIter iter;
-  g_hash_table_iter_init(&iter, fl_hash_index);
-  while(g_hash_table_iter_next(&iter, NULL, (gpointer *)&l))
-    for(; l; l=l->next)
-      g_array_append_val(fl_gc_active, fl_list_getlocal((fl_list_t *)l->data).id);
+  guint i;
+  for(i=0; fl_hash_index && i<=fl_hash_index_mask; i++)
+    if(fl_hash_index[i])
+      g_array_append_val(fl_gc_active, fl_list_getlocal(fl_hash_index[i]).id);
   g_array_sort(fl_gc_active, fl_gc_idcmp);
 
   // walk through hashfiles table and fill fl_gc_remove
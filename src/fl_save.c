@@ -70,6 +70,9 @@
 #define BUFSIZE (64*1024 - 1024)
 // Minimum output buffer size to give to zlib's deflate() function.
 #define ZLIBBUFSIZE (16*1024)
+// Size of the independently compressed blocks in FO_FP mode. Each block
+// becomes one bzip2 stream, bzip2 itself works on 700k blocks at level 7.
+#define PBZ_BLOCKSIZE (700*1024)
 
 // Some estimate stats for determining what to include in a file list.
 #define AVGFILELEN 105 // Average size of a <File /> entry
@@ -81,9 +84,34 @@
 #define FO_FB 1 // Write to file (bzip2)
 #define FO_MU 2 // Write to memory (uncompressed)
 #define FO_MZ 3 // Write to memory (zlib)
+#define FO_FP 4 // Write to file (parallel multi-stream bzip2)
+
+
+typedef struct ctx_t ctx_t;
+
+// A single block of the file list in FO_FP mode
+typedef struct pbz_block_t {
+  ctx_t *x;
+  GString *in;     // Uncompressed data, NULL once compressed
+  GByteArray *out; // Compressed bzip2 stream
+  int err;         // BZ_* result of the compression
+  gboolean done;   // Protected by x->pbz_lock
+} pbz_block_t;
+
+// Cached compressed <Directory> element of a share root
+typedef struct pbz_cache_t {
+  GByteArray *data; // One or more concatenated bzip2 streams
+  int size;         // Uncompressed size
+} pbz_cache_t;
+
+// A freshly serialized share root, to be added to the cache
+typedef struct pbz_root_t {
+  char *name;
+  int start, end;   // Block indices
+  int size;
+} pbz_root_t;
 
-
-typedef struct ctx_t {
+struct ctx_t {
   int conf;         // FO_*
   int size;
   GString *buf;     // Write buffer (final in F0_MU, temporary otherwise)
@@ -94,7 +122,186 @@ typedef struct ctx_t {
   const char *file; // F0_F* - Filename (ownership is of the caller)
   char *tmpfile;    // F0_F* - Temp filename (ownership is ours)
   GError *err;
-} ctx_t;
+  // F0_FP
+  int pbz_threads;
+  GPtrArray *pbz_blocks;
+  int pbz_written;  // Number of blocks written to fh_f
+  int pbz_inflight; // Number of blocks being compressed
+  GMutex pbz_lock;
+  GCond pbz_cond;
+  int pbz_start, pbz_startsize;
+  GSList *pbz_roots;
+};
+
+
+// Thread pool used to compress the blocks of FO_FP, shared among all lists.
+static GThreadPool *pbz_pool = NULL;
+
+// Compressed share roots of our own list, indexed by name. Entries are
+// removed by fl_save_invalidate() whenever a share root changes.
+static GHashTable *pbz_cache = NULL;
+
+
+static void pbz_cache_free(gpointer dat) {
+  pbz_cache_t *c = dat;
+  g_byte_array_unref(c->data);
+  g_slice_free(pbz_cache_t, c);
+}
+
+
+// Forget the cached serialization of a share root, or of all roots if root is NULL.
+void fl_save_invalidate(const char *root) {
+  if(!pbz_cache)
+    return;
+  if(root)
+    g_hash_table_remove(pbz_cache, root);
+  else
+    g_hash_table_remove_all(pbz_cache);
+}
+
+
+// Runs in a pbz_pool thread
+static void pbz_compress(gpointer dat, gpointer udat) {
+  pbz_block_t *b = dat;
+  ctx_t *x = b->x;
+
+  unsigned int len = b->in->len + b->in->len/100 + 600;
+  b->out = g_byte_array_sized_new(len);
+  g_byte_array_set_size(b->out, len);
+  int r = BZ2_bzBuffToBuffCompress((char *)b->out->data, &len, b->in->str, b->in->len, 7, 0, 0);
+  g_byte_array_set_size(b->out, r == BZ_OK ? len : 0);
+  g_string_free(b->in, TRUE);
+  b->in = NULL;
+
+  g_mutex_lock(&x->pbz_lock);
+  b->err = r;
+  b->done = TRUE;
+  x->pbz_inflight--;
+  g_cond_broadcast(&x->pbz_cond);
+  g_mutex_unlock(&x->pbz_lock);
+}
+
+
+// Hands the current write buffer to the compression threads, waiting if too
+// many blocks are in flight already.
+static void pbz_submit(ctx_t *x) {
+  if(!x->buf->len)
+    return;
+  pbz_block_t *b = g_slice_new0(pbz_block_t);
+  b->x = x;
+  b->in = x->buf;
+  x->buf = g_string_sized_new(PBZ_BLOCKSIZE + BUFSIZE);
+  g_ptr_array_add(x->pbz_blocks, b);
+
+  g_mutex_lock(&x->pbz_lock);
+  while(x->pbz_inflight >= 2*x->pbz_threads)
+    g_cond_wait(&x->pbz_cond, &x->pbz_lock);
+  x->pbz_inflight++;
+  g_mutex_unlock(&x->pbz_lock);
+  g_thread_pool_push(pbz_pool, b, NULL);
+}
+
+
+// Writes out the compressed blocks in order, as far as they are available. If
+// all is set, waits for the remaining blocks to finish.
+static int pbz_write(ctx_t *x, gboolean all) {
+  if(x->err)
+    return -1;
+  while(x->pbz_written < x->pbz_blocks->len) {
+    pbz_block_t *b = g_ptr_array_index(x->pbz_blocks, x->pbz_written);
+    g_mutex_lock(&x->pbz_lock);
+    while(all && !b->done)
+      g_cond_wait(&x->pbz_cond, &x->pbz_lock);
+    gboolean done = b->done;
+    g_mutex_unlock(&x->pbz_lock);
+    if(!done)
+      break;
+
+    if(b->err != BZ_OK) {
+      g_set_error(&x->err, 1, 0, "Bzip2 compression error (%d)", b->err);
+      return -1;
+    }
+    if(fwrite(b->out->data, 1, b->out->len, x->fh_f) != b->out->len) {
+      g_set_error(&x->err, 1, 0, "Write error: %s", g_strerror(errno));
+      return -1;
+    }
+    x->pbz_written++;
+  }
+  return 0;
+}
+
+
+// Called before serializing a share root. Returns TRUE if the cached
+// serialization has been used instead.
+static gboolean pbz_root_begin(ctx_t *x, fl_list_t *fl) {
+  pbz_submit(x);
+  pbz_cache_t *c = g_hash_table_lookup(pbz_cache, fl->name);
+  if(c) {
+    pbz_block_t *b = g_slice_new0(pbz_block_t);
+    b->out = g_byte_array_ref(c->data);
+    b->err = BZ_OK;
+    b->done = TRUE;
+    g_ptr_array_add(x->pbz_blocks, b);
+    x->size += c->size;
+    return TRUE;
+  }
+  x->pbz_start = x->pbz_blocks->len;
+  x->pbz_startsize = x->size;
+  return FALSE;
+}
+
+
+static void pbz_root_end(ctx_t *x, fl_list_t *fl) {
+  pbz_submit(x);
+  pbz_root_t *r = g_slice_new(pbz_root_t);
+  r->name = g_strdup(fl->name);
+  r->start = x->pbz_start;
+  r->end = x->pbz_blocks->len;
+  r->size = x->size - x->pbz_startsize;
+  x->pbz_roots = g_slist_prepend(x->pbz_roots, r);
+}
+
+
+// Waits for the compression threads, moves the newly serialized roots into
+// the cache and frees the blocks.
+static void pbz_close(ctx_t *x) {
+  g_mutex_lock(&x->pbz_lock);
+  while(x->pbz_inflight > 0)
+    g_cond_wait(&x->pbz_cond, &x->pbz_lock);
+  g_mutex_unlock(&x->pbz_lock);
+
+  GSList *l;
+  for(l=x->pbz_roots; l; l=l->next) {
+    pbz_root_t *r = l->data;
+    if(!x->err) {
+      pbz_cache_t *c = g_slice_new(pbz_cache_t);
+      c->data = g_byte_array_new();
+      c->size = r->size;
+      int i;
+      for(i=r->start; i<r->end; i++) {
+        pbz_block_t *b = g_ptr_array_index(x->pbz_blocks, i);
+        g_byte_array_append(c->data, b->out->data, b->out->len);
+      }
+      g_hash_table_replace(pbz_cache, r->name, c);
+    } else
+      g_free(r->name);
+    g_slice_free(pbz_root_t, r);
+  }
+  g_slist_free(x->pbz_roots);
+
+  int i;
+  for(i=0; i<x->pbz_blocks->len; i++) {
+    pbz_block_t *b = g_ptr_array_index(x->pbz_blocks, i);
+    if(b->in)
+      g_string_free(b->in, TRUE);
+    if(b->out)
+      g_byte_array_unref(b->out);
+    g_slice_free(pbz_block_t, b);
+  }
+  g_ptr_array_unref(x->pbz_blocks);
+  g_mutex_clear(&x->pbz_lock);
+  g_cond_clear(&x->pbz_cond);
+}
 
 
 // Flushes the write buffer to the underlying bzip2/zlib/file object (if any).
@@ -146,6 +353,13 @@ static int doflush(ctx_t *x, gboolean force) {
   case FO_MU:
     // Nothing to do here, x->buf is already our destiniation.
     break;
+
+  case FO_FP:
+    if(force || x->buf->len >= PBZ_BLOCKSIZE)
+      pbz_submit(x);
+    if(pbz_write(x, force))
+      return -1;
+    break;
   }
 
   return 0;
@@ -225,6 +439,13 @@ static int af(ctx_t *x, fl_list_t *fl, int targetsize) {
     //   new_targetsize = ((size_left - (files_left*AVGFILELEN)) / dirs_left) - size_of_this_dir_entry
     // (That's a moving average)
     if(!cur->isfile) {
+      // Share roots of a FO_FP list are compressed separately, so that
+      // unchanged roots can be taken from the cache.
+      gboolean isroot = x->conf == FO_FP && !fl->parent;
+      if(isroot && pbz_root_begin(x, cur)) {
+        numdirs--;
+        continue;
+      }
       gboolean isempty = fl_list_isempty(cur);
       int size = targetsize ? (((sizemax - x->size) - (numfiles*AVGFILELEN)) / numdirs) - (30 + strlen(cur->name)) : 0;
       gboolean include = isempty ? FALSE : !targetsize ? TRUE : size > (int)(cur->sub->len*AVGENTRYLEN);
@@ -242,6 +463,8 @@ static int af(ctx_t *x, fl_list_t *fl, int targetsize) {
         as("</Directory>\n");
       } else
         as("/>\n");
+      if(isroot)
+        pbz_root_end(x, cur);
       numdirs--;
     }
 
@@ -307,8 +530,20 @@ static int ctx_open(ctx_t *x, int conf, const char *file, GString *buf) {
     }
   }
 
+  // compression threads
+  if(x->conf == FO_FP) {
+    if(!pbz_pool)
+      pbz_pool = g_thread_pool_new(pbz_compress, NULL, 1, FALSE, NULL);
+    if(!pbz_cache)
+      pbz_cache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, pbz_cache_free);
+    x->pbz_threads = 1;
+    x->pbz_blocks = g_ptr_array_new();
+    g_mutex_init(&x->pbz_lock);
+    g_cond_init(&x->pbz_cond);
+  }
+
   // open file
-  if(x->conf == FO_FB || x->conf == FO_FU) {
+  if(x->conf == FO_FB || x->conf == FO_FU || x->conf == FO_FP) {
     x->tmpfile = g_strdup_printf("%s.tmp-%d", file, rand());
     x->fh_f = fopen(x->tmpfile, "w");
     if(!x->fh_f) {
@@ -352,7 +587,10 @@ static void ctx_close(ctx_t *x) {
       g_set_error(&x->err, 1, 0, "Error closing bzip2 stream (%d): %s", bzerr, g_strerror(errno));
   }
 
-  if(x->conf == FO_FB || x->conf == FO_FU) {
+  if(x->conf == FO_FP)
+    pbz_close(x);
+
+  if(x->conf == FO_FB || x->conf == FO_FU || x->conf == FO_FP) {
     if(x->fh_f && fclose(x->fh_f) && !x->err)
       g_set_error(&x->err, 1, 0, "Error closing file: %s", g_strerror(errno));
 
@@ -387,3 +625,25 @@ int fl_save(fl_list_t *fl, const char *cid, int targetsize, gboolean zlib, GStri
   return x.err ? 0 : x.size;
 }
 
+
+
+// Write a file list as a series of bzip2 streams, compressed in parallel with
+// the given number of threads. The <Directory> elements of the top-level
+// directories are cached across calls, so this should only be used for our
+// own list, with fl_save_invalidate() called whenever a share root changes.
+// Returns the uncompressed size of the list or 0 on error.
+int fl_save_parallel(fl_list_t *fl, const char *cid, int threads, const char *file, GError **err) {
+  g_return_val_if_fail(err == NULL || *err == NULL, FALSE);
+
+  ctx_t x;
+  if(ctx_open(&x, FO_FP, file, NULL) == 0) {
+    x.pbz_threads = threads;
+    g_thread_pool_set_max_threads(pbz_pool, threads, NULL);
+    at(&x, fl, cid, 0);
+  }
+  ctx_close(&x);
+  if(x.err)
+    g_propagate_error(err, x.err);
+
+  return x.err ? 0 : x.size;
+}
@@ -40,6 +40,8 @@ struct fl_list_t {
   gboolean isfile : 1;
   gboolean hastth : 1;  // only if isfile==TRUE
   gboolean islocal : 1; // only if isfile==TRUE
+  gboolean inarena : 1; // allocated with fl_list_arena_create()
+  gboolean islazy : 1;  // directory whose children have not been loaded yet, see fl_list_expand()
   char name[1];
 };
 
@@ -83,11 +85,134 @@ struct fl_list_local_t {
 #endif
 
 
+// Arena-allocated file lists. These are used for lists that are built once
+// and never modified afterwards, such as the lists loaded by fl_load(). All
+// items are allocated from large chunks of memory and the directories do not
+// free their children, so that the entire tree can be freed in one go by
+// calling fl_list_free() on the root. Calling fl_list_free() on any other
+// item in the tree is a no-op; its memory is reclaimed with the rest of the
+// tree.
+
+#define FL_ARENA_CHUNK (1024*1024)
+
+typedef struct fl_list_arena_t {
+  GSList *chunks;
+  char *ptr;       // free space in the current chunk
+  gsize left;
+  GPtrArray *dirs; // sub arrays of all directories
+  gpointer lazy;   // fl_load_cache_*() data for lazily expanded lists
+  fl_list_t root;  // must be last, name is always ""
+} fl_list_arena_t;
+
+#define fl_list_arena(r) ((fl_list_arena_t *)((char *)(r) - G_STRUCT_OFFSET(fl_list_arena_t, root)))
+
+
+// Create the root of a new arena-allocated list.
+fl_list_t *fl_list_arena_new() {
+  fl_list_arena_t *a = g_new0(fl_list_arena_t, 1);
+  a->dirs = g_ptr_array_new();
+  a->root.inarena = TRUE;
+  a->root.sub = g_ptr_array_new();
+  g_ptr_array_add(a->dirs, a->root.sub);
+  return &a->root;
+}
+
+
+// Create a new item in the arena of the given root. Directories get an empty
+// sub array.
+fl_list_t *fl_list_arena_create(fl_list_t *root, const char *name, gboolean isfile, gboolean local) {
+  fl_list_arena_t *a = fl_list_arena(root);
+  gsize size = (fl_list_size(name, local) + 7) & ~7;
+  if(size > a->left) {
+    gsize len = MAX(size, FL_ARENA_CHUNK);
+    a->ptr = g_malloc(len);
+    a->left = len;
+    a->chunks = g_slist_prepend(a->chunks, a->ptr);
+  }
+  fl_list_t *fl = (fl_list_t *)a->ptr;
+  a->ptr += size;
+  a->left -= size;
+  memset(fl, 0, G_STRUCT_OFFSET(fl_list_t, name));
+  strcpy(fl->name, name);
+  fl->isfile = isfile;
+  fl->islocal = local;
+  fl->inarena = TRUE;
+  if(local)
+    memset(&fl_list_getlocal(fl), 0, sizeof(fl_list_local_t));
+  if(!isfile) {
+    fl->sub = g_ptr_array_new();
+    g_ptr_array_add(a->dirs, fl->sub);
+  }
+  return fl;
+}
+
+
+// Mark the list as being lazily expanded from the given binary cache. The
+// cache is freed together with the list.
+void fl_list_arena_setlazy(fl_list_t *root, gpointer lazy) {
+  fl_list_arena(root)->lazy = lazy;
+}
+
+
+// Load the children of a lazily expanded directory. Must be called before
+// accessing the sub array of any directory that is not part of our own list.
+// This is a no-op for directories that have already been expanded.
+void fl_list_expand(fl_list_t *fl) {
+  if(!fl->islazy)
+    return;
+  fl_list_t *root = fl;
+  while(root->parent)
+    root = root->parent;
+  fl->islazy = FALSE;
+  fl_load_cache_expand(fl_list_arena(root)->lazy, root, fl);
+}
+
+
+// Calls cb() with the TTH of every hashed file in the directory, recursively.
+// Lazily expanded directories are read directly from the cache, without
+// expanding them.
+void fl_list_foreach_tth(fl_list_t *fl, void (*cb)(const char *, gpointer), gpointer dat) {
+  if(fl->isfile) {
+    if(fl->hastth)
+      cb(fl->tth, dat);
+    return;
+  }
+  fl_list_t *root = fl;
+  while(root->parent)
+    root = root->parent;
+  if(root->inarena && fl_list_arena(root)->lazy) {
+    fl_load_cache_foreach(fl_list_arena(root)->lazy, fl, cb, dat);
+    return;
+  }
+  int i;
+  for(i=0; i<fl->sub->len; i++)
+    fl_list_foreach_tth(g_ptr_array_index(fl->sub, i), cb, dat);
+}
+
+
+static void fl_list_arena_free(fl_list_t *root) {
+  fl_list_arena_t *a = fl_list_arena(root);
+  int i;
+  if(a->lazy)
+    fl_load_cache_free(a->lazy);
+  for(i=0; i<a->dirs->len; i++)
+    g_ptr_array_unref(g_ptr_array_index(a->dirs, i));
+  g_ptr_array_unref(a->dirs);
+  g_slist_free_full(a->chunks, g_free);
+  g_free(a);
+}
+
+
 // only frees the given item and its childs. leaves the parent(s) untouched
 void fl_list_free(gpointer dat) {
   fl_list_t *fl = dat;
   if(!fl)
     return;
+  if(fl->inarena) {
+    if(!fl->parent)
+      fl_list_arena_free(fl);
+    return;
+  }
   if(fl->sub)
     g_ptr_array_unref(fl->sub);
   g_slice_free1(fl_list_size(fl->name, fl->islocal), fl);
@@ -180,6 +305,9 @@ fl_list_t *fl_list_copy(const fl_list_t *fl) {
   fl_list_t *cur = g_slice_alloc(size);
   memcpy(cur, fl, size);
   cur->parent = NULL;
+  cur->inarena = FALSE;
+  fl_list_expand((fl_list_t *)fl);
+  cur->islazy = FALSE;
   if(fl->sub) {
     cur->sub = g_ptr_array_sized_new(fl->sub->len);
     g_ptr_array_set_free_func(cur->sub, fl_list_free);
@@ -199,6 +327,7 @@ fl_list_t *fl_list_copy(const fl_list_t *fl) {
 gboolean fl_list_isempty(fl_list_t *fl) {
   g_return_val_if_fail(!fl->isfile, FALSE);
 
+  fl_list_expand(fl);
   int i;
   for(i=0; i<fl->sub->len; i++) {
     fl_list_t *f = g_ptr_array_index(fl->sub, i);
@@ -211,6 +340,7 @@ gboolean fl_list_isempty(fl_list_t *fl) {
 
 // Get a file by name in a directory. This search is case-insensitive.
 fl_list_t *fl_list_file(const fl_list_t *dir, const char *name) {
+  fl_list_expand((fl_list_t *)dir);
   fl_list_t *cmp = fl_list_create(name, FALSE);
   int i = ptr_array_search(dir->sub, cmp, fl_list_cmp);
   fl_list_free(cmp);
@@ -220,6 +350,7 @@ fl_list_t *fl_list_file(const fl_list_t *dir, const char *name) {
 
 // Get a file name in a directory with the same name as *fl. This search is case-sensitive.
 fl_list_t *fl_list_file_strict(const fl_list_t *dir, const fl_list_t *fl) {
+  fl_list_expand((fl_list_t *)dir);
   int i = ptr_array_search(dir->sub, fl, fl_list_cmp_strict);
   return i < 0 ? NULL : g_ptr_array_index(dir->sub, i);
 }
@@ -290,7 +421,8 @@ void fl_list_suggest(fl_list_t *root, char *opath, char **sug) {
     name = path;
     path = "";
   }
-  if(parent) {
+  if(parent && !parent->isfile) {
+    fl_list_expand(parent);
     int n = 0, len = strlen(name);
     // Note: performance can be improved by using a binary search instead
     int i;
@@ -420,6 +552,7 @@ gboolean fl_search_match_name(fl_list_t *fl, fl_search_t *s) {
 int fl_search_rec(fl_list_t *parent, fl_search_t *s, fl_list_t **res, int max) {
   if(!parent || !parent->sub)
     return 0;
+  fl_list_expand(parent);
   // weed out stuff from 'and' if it's already matched in parent (I'm assuming
   // that stuff matching the parent of parent has already been removed)
   GRegex **o = s->and;
@@ -445,25 +578,29 @@ int fl_search_rec(fl_list_t *parent, fl_search_t *s, fl_list_t **res, int max) {
 }
 
 
+// Copies the keywords from 'and' to 'res', except for those that match the
+// name of p or any of its parents. 'res' must have room for all keywords and
+// the terminating NULL.
+static void fl_search_weed(fl_list_t *p, GRegex **and, GRegex **res) {
+  int i = 0;
+  fl_list_t *c;
+  for(; and&&*and; and++) {
+    for(c=p; c && c->parent; c=c->parent)
+      if(G_UNLIKELY(g_regex_match(*and, c->name, 0, NULL)))
+        break;
+    if(!c || !c->parent)
+      res[i++] = *and;
+  }
+  res[i] = NULL;
+}
+
+
 // Similar to fl_search_match(), but also matches the name of the parents.
 gboolean fl_search_match_full(fl_list_t *fl, fl_search_t *s) {
   // weed out stuff from 'and' if it's already matched in any of its parents.
   GRegex **oand = s->and;
-  int len = fl_search_and_len(s->and);
-  GRegex *nand[len];
-  fl_list_t *p = fl->parent;
-  int i;
-  memcpy(nand, s->and, len*sizeof(GRegex *));
-  for(; p && p->parent; p=p->parent)
-    for(i=0; i<len; i++)
-      if(G_UNLIKELY(nand[i] && g_regex_match(nand[i], p->name, 0, NULL)))
-        nand[i] = NULL;
-  GRegex *and[len];
-  int j=0;
-  for(i=0; i<len; i++)
-    if(nand[i])
-      and[j++] = nand[i];
-  and[j] = NULL;
+  GRegex *and[fl_search_and_len(oand)+1];
+  fl_search_weed(fl->parent, oand, and);
   s->and = and;
   // and now match
   gboolean r = fl_search_match(fl, s);
@@ -471,3 +608,22 @@ gboolean fl_search_match_full(fl_list_t *fl, fl_search_t *s) {
   return r;
 }
 
+
+// Matches fl and everything below it, taking the names of its parents into
+// account. Results are in the same order as fl_search_rec() would give.
+int fl_search_sub(fl_list_t *fl, fl_search_t *s, fl_list_t **res, int max) {
+  if(max <= 0)
+    return 0;
+  GRegex **oand = s->and;
+  GRegex *and[fl_search_and_len(oand)+1];
+  fl_search_weed(fl->parent, oand, and);
+  s->and = and;
+  int n = 0;
+  if(fl_search_match(fl, s))
+    res[n++] = fl;
+  if(!fl->isfile && n < max)
+    n += fl_search_rec(fl, s, res+n, max-n);
+  s->and = oand;
+  return n;
+}
+
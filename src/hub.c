@@ -48,14 +48,16 @@ struct hub_user_t {
   unsigned int as;       // auto-open slot if upload is below n bytes/s
   int sid;        // for ADC
   struct in_addr ip4;
-  struct in6_addr ip6;
   hub_t *hub;
   char *name;     // UTF-8
+  char *name_key; // g_utf8_collate_key() of name, see hub_user_name_key()
   char *name_hub; // hub-encoded (NMDC)
+  // desc, conn (NMDC), mail and client are interned, see strpool_set()
   char *desc;
   char *conn;     // NMDC: string pointer, ADC: GUINT_TO_POINTER() of the US param
   char *mail;
   char *client;
+  struct in6_addr *ip6; // slice-alloc'ed, NULL if unknown. Use hub_user_ip6()
   guint64 uid;
   guint64 sharesize;
   char *kp;      // ADC with KEYP, 32 bytes slice-alloc'ed
@@ -211,11 +213,14 @@ static void user_free(gpointer dat) {
     g_slice_free1(32, u->kp);
   g_free(u->name_hub);
   g_free(u->name);
-  g_free(u->desc);
+  g_free(u->name_key);
+  strpool_unref(u->desc);
   if(!u->hub->adc)
-    g_free(u->conn);
-  g_free(u->mail);
-  g_free(u->client);
+    strpool_unref(u->conn);
+  strpool_unref(u->mail);
+  strpool_unref(u->client);
+  if(u->ip6)
+    g_slice_free(struct in6_addr, u->ip6);
   g_slice_free(hub_user_t, u);
 }
 
@@ -232,6 +237,16 @@ hub_user_t *hub_user_get(hub_t *hub, const char *name) {
 }
 
 
+// Returns a collation key of the user name, to be compared with strcmp().
+// Sorting by user name is common and g_utf8_collate() is slow, so this is
+// calculated only once for each user.
+const char *hub_user_name_key(hub_user_t *u) {
+  if(!u->name_key)
+    u->name_key = g_utf8_collate_key(u->name, -1);
+  return u->name_key;
+}
+
+
 // Auto-complete suggestions for hub_user_get()
 void hub_user_suggest(hub_t *hub, char *str, char **sug) {
   GHashTableIter iter;
@@ -251,11 +266,32 @@ void hub_user_suggest(hub_t *hub, char *str, char **sug) {
 #define hub_user_conn(u) (!(u)->conn ? NULL :\
   (u)->hub->adc ? g_strdup_printf("%d KiB/s", GPOINTER_TO_UINT((u)->conn)/1024) : g_strdup((u)->conn))
 
-#define hub_user_ip(u, def) (!ip4_isany((u)->ip4) ? ip4_unpack((u)->ip4) : !ip6_isany((u)->ip6) ? ip6_unpack((u)->ip6) : def)
+// The IPv6 address of a user, as a struct in6_addr lvalue
+#define hub_user_ip6(u) (*((u)->ip6 ? (u)->ip6 : &ip6_any))
+
+#define hub_user_ip(u, def) (!ip4_isany((u)->ip4) ? ip4_unpack((u)->ip4) : (u)->ip6 ? ip6_unpack(*(u)->ip6) : def)
 
 #endif
 
 
+// Sets the IPv6 address of a user from a string, returns whether it has
+// changed. Most users don't have one, so it's only allocated when needed.
+gboolean hub_user_setip6(hub_user_t *u, const char *str) {
+  struct in6_addr ip = ip6_pack(str);
+  if(ip6_cmp(ip, hub_user_ip6(u)) == 0)
+    return FALSE;
+  if(ip6_isany(ip)) {
+    g_slice_free(struct in6_addr, u->ip6);
+    u->ip6 = NULL;
+  } else {
+    if(!u->ip6)
+      u->ip6 = g_slice_new(struct in6_addr);
+    *u->ip6 = ip;
+  }
+  return TRUE;
+}
+
+
 char *hub_user_tag(hub_user_t *u) {
   if(!u->client || !u->slots)
     return NULL;
@@ -276,6 +312,22 @@ char *hub_user_tag(hub_user_t *u) {
       (str)[strlen(str)-1] = 0;\
   } while(0)
 
+// Sets an interned user info field from a $MyINFO string. Plain ASCII
+// without escapes is the same in every hub encoding, so most fields can be
+// compared and interned without decoding them first.
+static void user_nmdc_setstr(hub_t *hub, char **dest, const char *str) {
+  const char *c = str;
+  while(*c && *c != '&' && !(*c & 0x80))
+    c++;
+  if(*c) {
+    char *tmp = nmdc_unescape_and_decode(hub, str);
+    strpool_set(dest, tmp);
+    g_free(tmp);
+  } else
+    strpool_set(dest, str);
+}
+
+
 static void user_nmdc_nfo(hub_t *hub, hub_user_t *u, char *str) {
   // these all point into *str. *str is modified to contain zeroes in the correct positions
   char *next, *tmp;
@@ -360,15 +412,11 @@ static void user_nmdc_nfo(hub_t *hub, hub_user_t *u, char *str) {
   share = g_ascii_strtoull(str, NULL, 10);
 
   // If we still haven't 'return'ed yet, that means we have a correct $MyINFO. Now we can update the struct.
-  g_free(u->desc);
-  g_free(u->client);
-  g_free(u->conn);
-  g_free(u->mail);
   u->sharesize = share;
-  u->desc = desc[0] ? nmdc_unescape_and_decode(hub, desc) : NULL;
-  u->client = client && client[0] ? g_strdup(client) : NULL;
-  u->conn = conn[0] ? nmdc_unescape_and_decode(hub, conn) : NULL;
-  u->mail = mail[0] ? nmdc_unescape_and_decode(hub, mail) : NULL;
+  user_nmdc_setstr(hub, &u->desc, desc);
+  strpool_set(&u->client, client);
+  user_nmdc_setstr(hub, &u->conn, conn);
+  user_nmdc_setstr(hub, &u->mail, mail);
   u->h_norm = h_norm;
   u->h_reg = h_reg;
   u->h_op = h_op;
@@ -403,21 +451,27 @@ static void user_adc_nfo(hub_t *hub, hub_user_t *u, adc_cmd_t *cmd) {
     case P('N','I'): // nick
       g_hash_table_steal(hub->users, u->name);
       g_free(u->name);
+      g_free(u->name_key);
+      u->name_key = NULL;
       u->name = g_strdup(p);
       g_hash_table_insert(hub->users, u->name, u);
       break;
     case P('D','E'): // description
-      g_free(u->desc);
-      u->desc = p[0] ? g_strdup(p) : NULL;
+      strpool_set(&u->desc, p);
       break;
-    case P('V','E'): // client name (+ version)
-      g_free(u->client);
-      char *ap = adc_getparam(cmd->argv, "AP", NULL);
-      u->client = !p[0] ? NULL : !ap || strncmp(p, ap, strlen(ap)) == 0 ? g_strdup(p) : g_strdup_printf("%s %s", ap, p);
+    case P('V','E'): { // client name (+ version)
+      char *ap = adc_cmd_param(cmd, 0, "AP");
+      if(!p[0] || !ap || strncmp(p, ap, strlen(ap)) == 0)
+        strpool_set(&u->client, p);
+      else {
+        char *tmp = g_strdup_printf("%s %s", ap, p);
+        strpool_set(&u->client, tmp);
+        g_free(tmp);
+      }
       break;
+    }
     case P('E','M'): // mail
-      g_free(u->mail);
-      u->mail = p[0] ? g_strdup(p) : NULL;
+      strpool_set(&u->mail, p);
       break;
     case P('S','S'): // share size
       u->sharesize = g_ascii_strtoull(p, NULL, 10);
@@ -441,7 +495,7 @@ static void user_adc_nfo(hub_t *hub, hub_user_t *u, adc_cmd_t *cmd) {
       u->ip4 = ip4_pack(p);
       break;
     case P('I','6'): // IPv6 address
-      u->ip6 = ip6_pack(p);
+      hub_user_setip6(u, p);
       break;
     case P('U','4'): // UDP4 port
       u->udp4 = strtol(p, NULL, 10);
@@ -880,7 +934,7 @@ static void setownip(hub_t *hub, hub_user_t *u) {
   char *oldconf = hub_ip(hub);
   char *oldval = hub->ip;
   char *new = net_is_ipv6(hub->net)
-    ? (ip6_isany(u->ip6) ? NULL : (char *)ip6_unpack(u->ip6))
+    ? (!u->ip6 ? NULL : (char *)ip6_unpack(*u->ip6))
     : (ip4_isany(u->ip4) ? NULL : (char *)ip4_unpack(u->ip4));
   if((!new && oldval) || (new && !oldval) || (new && oldval && strcmp(new, oldval) != 0)) {
     g_free(hub->ip);
@@ -895,6 +949,18 @@ static void setownip(hub_t *hub, hub_user_t *u) {
 }
 
 
+// Sets up a net_udp_t for search replies. Uses the UDP socket we're listening
+// on for this hub if possible, so that answering a search doesn't require
+// creating a new socket.
+static void hub_udp_init(hub_t *hub, net_udp_t *udp, const char *host, unsigned short port) {
+  int sock = listen_hub_udp_sock(hub->id, !ip4_isvalid(host));
+  if(sock >= 0)
+    net_udp_init_sock(udp, sock, host, port);
+  else
+    net_udp_init(udp, host, port, var_get(hub->id, VAR_local_address));
+}
+
+
 static void adc_sch_reply_send(hub_t *hub, net_udp_t *udp, GString *r, const char *key) {
   if(!udp) {
     net_writestr(hub->net, r->str);
@@ -925,8 +991,8 @@ static void adc_sch_reply_send(hub_t *hub, net_udp_t *udp, GString *r, const cha
 
 
 static void adc_sch_reply(hub_t *hub, adc_cmd_t *cmd, hub_user_t *u, fl_list_t **res, int len) {
-  char *ky = adc_getparam(cmd->argv, "KY", NULL); // SUDP key
-  char *to = adc_getparam(cmd->argv, "TO", NULL); // token
+  char *ky = adc_cmd_param(cmd, 0, "KY"); // SUDP key
+  char *to = adc_cmd_param(cmd, 0, "TO"); // token
 
   char sudpkey[16];
   if(ky && isbase32(ky) && strlen(ky) == 26)
@@ -945,11 +1011,9 @@ static void adc_sch_reply(hub_t *hub, adc_cmd_t *cmd, hub_user_t *u, fl_list_t *
     /* TODO: If the user has both UDP4 and UDP6, we should prefer the AF used
      * to connect to the hub, rather than IPv4. */
     udp = &udpbuf;
-    net_udp_init(udp,
-        u->hasudp4 && u->udp4 ? ip4_unpack(u->ip4) : ip6_unpack(u->ip6),
-        u->hasudp4 && u->udp4 ? u->udp4 : u->udp6,
-        var_get(hub->id, VAR_local_address)
-    );
+    hub_udp_init(hub, udp,
+        u->hasudp4 && u->udp4 ? ip4_unpack(u->ip4) : ip6_unpack(hub_user_ip6(u)),
+        u->hasudp4 && u->udp4 ? u->udp4 : u->udp6);
   }
 
   int i;
@@ -960,7 +1024,7 @@ static void adc_sch_reply(hub_t *hub, adc_cmd_t *cmd, hub_user_t *u, fl_list_t *
     if(to)
       adc_append(r, "TO", to);
     g_string_append_printf(r, " SL%d SI%"G_GUINT64_FORMAT, slots_free, res[i]->size);
-    char *path = fl_list_path(res[i]);
+    char *path = fl_local_vpath(res[i]);
     adc_append(r, "FN", path);
     g_free(path);
     if(res[i]->isfile) {
@@ -980,15 +1044,15 @@ static void adc_sch_reply(hub_t *hub, adc_cmd_t *cmd, hub_user_t *u, fl_list_t *
 
 
 static void adc_sch(hub_t *hub, adc_cmd_t *cmd) {
-  char *an = adc_getparam(cmd->argv, "AN", NULL); // and
-  char *no = adc_getparam(cmd->argv, "NO", NULL); // not
-  char *ex = adc_getparam(cmd->argv, "EX", NULL); // ext
-  char *le = adc_getparam(cmd->argv, "LE", NULL); // less-than
-  char *ge = adc_getparam(cmd->argv, "GE", NULL); // greater-than
-  char *eq = adc_getparam(cmd->argv, "EQ", NULL); // equal
-  char *ty = adc_getparam(cmd->argv, "TY", NULL); // type (1=file, 2=dir)
-  char *tr = adc_getparam(cmd->argv, "TR", NULL); // TTH root
-  char *td = adc_getparam(cmd->argv, "TD", NULL); // tree depth
+  char *an = adc_cmd_param(cmd, 0, "AN"); // and
+  char *no = adc_cmd_param(cmd, 0, "NO"); // not
+  char *ex = adc_cmd_param(cmd, 0, "EX"); // ext
+  char *le = adc_cmd_param(cmd, 0, "LE"); // less-than
+  char *ge = adc_cmd_param(cmd, 0, "GE"); // greater-than
+  char *eq = adc_cmd_param(cmd, 0, "EQ"); // equal
+  char *ty = adc_cmd_param(cmd, 0, "TY"); // type (1=file, 2=dir)
+  char *tr = adc_cmd_param(cmd, 0, "TR"); // TTH root
+  char *td = adc_cmd_param(cmd, 0, "TD"); // tree depth
 
   // no strong enough filters specified? ignore
   if(!an && !no && !ex && !le && !ge && !eq && !tr)
@@ -1014,17 +1078,17 @@ static void adc_sch(hub_t *hub, adc_cmd_t *cmd) {
     return;
 
   // create search struct
+  gint64 start = perf_start();
   fl_search_t s = {};
   s.sizem = eq ? 0 : le ? -1 : ge ? 1 : -2;
   s.size = s.sizem == -2 ? 0 : g_ascii_strtoull(eq ? eq : le ? le : ge, NULL, 10);
   s.filedir = !ty ? 3 : ty[0] == '1' ? 1 : 2;
-  char **tmp = adc_getparams(cmd->argv, "AN");
-  s.and = fl_search_create_and(tmp);
-  g_free(tmp);
-  tmp = adc_getparams(cmd->argv, "NO");
+  char **and = adc_cmd_params(cmd, 0, "AN");
+  s.and = fl_search_create_and(and);
+  char **tmp = adc_cmd_params(cmd, 0, "NO");
   s.not = fl_search_create_not(tmp);
   g_free(tmp);
-  s.ext = adc_getparams(cmd->argv, "EX");
+  s.ext = adc_cmd_params(cmd, 0, "EX");
 
   int i = 0;
   int max = (u->hasudp4 && u->udp4) || (u->hasudp6 && u->udp6) ? 10 : 5;
@@ -1034,21 +1098,22 @@ static void adc_sch(hub_t *hub, adc_cmd_t *cmd) {
   if(tr) {
     char root[24];
     base32_decode(tr, root);
-    GSList *l = fl_local_from_tth(root);
     // it still has to match the other requirements...
-    for(; i<max && l; l=l->next) {
-      fl_list_t *c = l->data;
+    guint it = 0;
+    fl_list_t *c;
+    while(i<max && (c = fl_local_tth_iter(root, &it)))
       if(fl_search_match_full(c, &s))
         res[i++] = c;
-    }
 
-  // Advanced lookup (Noo! This is slooow!)
+  // Advanced lookup
   } else
-    i = fl_search_rec(fl_local_list, &s, res, max);
+    i = fl_local_search(&s, and, res, max);
+  perf_time(search, start);
 
   if(i)
     adc_sch_reply(hub, cmd, u, res, i);
 
+  g_free(and);
   fl_search_free_and(s.and);
   if(s.not)
     g_regex_unref(s.not);
@@ -1105,12 +1170,10 @@ static void adc_handle(net_t *net, char *msg, int _len) {
     if(cmd.type == 'I') {
       // Get hub name. Some hubs (PyAdc) send multiple 'NI's, ignore the first
       // one in that case. Other hubs don't send 'NI', but only a 'DE'.
-      char **left = NULL;
-      char *hname = adc_getparam(cmd.argv, "NI", &left);
-      if(left)
-        hname = adc_getparam(left, "NI", NULL);
+      int ni = adc_cmd_find(&cmd, 0, "NI");
+      char *hname = ni < 0 ? NULL : adc_cmd_param(&cmd, ni+1, "NI");
       if(!hname)
-        hname = adc_getparam(cmd.argv, "DE", NULL);
+        hname = adc_cmd_param(&cmd, 0, "DE");
       if(hname) {
         g_free(hub->hubname);
         hub->hubname = g_strdup(hname);
@@ -1119,8 +1182,8 @@ static void adc_handle(net_t *net, char *msg, int _len) {
     } else if(cmd.type == 'B') {
       hub_user_t *u = g_hash_table_lookup(hub->sessions, GINT_TO_POINTER(cmd.source));
       if(!u) {
-        char *nick = adc_getparam(cmd.argv, "NI", NULL);
-        char *cid = adc_getparam(cmd.argv, "ID", NULL);
+        char *nick = adc_cmd_param(&cmd, 0, "NI");
+        char *cid = adc_cmd_param(&cmd, 0, "ID");
         if(nick && cid && iscid(cid))
           u = user_add(hub, nick, cid);
       }
@@ -1156,9 +1219,9 @@ static void adc_handle(net_t *net, char *msg, int _len) {
       int sid = ADC_DFCC(cmd.argv[0]);
       hub_user_t *u = g_hash_table_lookup(hub->sessions, GINT_TO_POINTER(sid));
       if(sid == hub->sid) {
-        char *rd = adc_getparam(cmd.argv, "RD", NULL);
-        char *ms = adc_getparam(cmd.argv, "MS", NULL);
-        char *tl = adc_getparam(cmd.argv, "TL", NULL);
+        char *rd = adc_cmd_param(&cmd, 0, "RD");
+        char *ms = adc_cmd_param(&cmd, 0, "MS");
+        char *tl = adc_cmd_param(&cmd, 0, "TL");
         if(rd) {
           ui_mf(hub->tab, UIP_HIGH, "\nThe hub is requesting you to move to %s.\nType `/connect %s' to do so.\n", rd, rd);
           if(ms)
@@ -1212,7 +1275,7 @@ static void adc_handle(net_t *net, char *msg, int _len) {
         g_message("CTM from user who is not on the hub (%s): %s", net_remoteaddr(hub->net), msg);
       else if(port < 1 || port > 65535)
         g_message("Invalid message from %s: %s", net_remoteaddr(hub->net), msg);
-      else if(!u->active || (ip4_isany(u->ip4) && ip6_isany(u->ip6))) {
+      else if(!u->active || (ip4_isany(u->ip4) && !u->ip6)) {
         g_message("CTM from user who is not active (%s): %s", net_remoteaddr(hub->net), msg);
         GString *r = adc_generate('D', ADCC_STA, hub->sid, cmd.source);
         g_string_append(r, " 140 No\\sIP\\sto\\sconnect\\sto.\n");
@@ -1264,8 +1327,8 @@ static void adc_handle(net_t *net, char *msg, int _len) {
     if(cmd.argc < 1 || (cmd.type != 'B' && cmd.type != 'E' && cmd.type != 'D' && cmd.type != 'I' && cmd.type != 'F'))
       g_message("Invalid message from %s: %s", net_remoteaddr(hub->net), msg);
     else {
-      char *pm = adc_getparam(cmd.argv+1, "PM", NULL);
-      gboolean me = adc_getparam(cmd.argv+1, "ME", NULL) != NULL;
+      char *pm = adc_cmd_param(&cmd, 1, "PM");
+      gboolean me = adc_cmd_param(&cmd, 1, "ME") != NULL;
       hub_user_t *u = cmd.type != 'I' ? g_hash_table_lookup(hub->sessions, GINT_TO_POINTER(cmd.source)) : NULL;
       hub_user_t *d = (cmd.type == 'E' || cmd.type == 'D') && cmd.source == hub->sid
         ? g_hash_table_lookup(hub->sessions, GINT_TO_POINTER(cmd.dest)) : NULL;
@@ -1317,8 +1380,8 @@ static void adc_handle(net_t *net, char *msg, int _len) {
     if(cmd.type != 'I' || cmd.argc < 4 || strcmp(cmd.argv[0], "blom") != 0 || strcmp(cmd.argv[1], "/") != 0 || strcmp(cmd.argv[2], "0") != 0)
       g_message("Invalid message from %s: %s", net_remoteaddr(hub->net), msg);
     else {
-      char *bk = adc_getparam(cmd.argv+4, "BK", NULL);
-      char *bh = adc_getparam(cmd.argv+4, "BH", NULL);
+      char *bk = adc_cmd_param(&cmd, 4, "BK");
+      char *bh = adc_cmd_param(&cmd, 4, "BH");
       long m = strtol(cmd.argv[3], NULL, 10);
       long k = bk ? strtol(bk, NULL, 10) : 0;
       long h = bh ? strtol(bh, NULL, 10) : 0;
@@ -1341,7 +1404,7 @@ static void adc_handle(net_t *net, char *msg, int _len) {
     g_message("Unknown command from %s: %s", net_remoteaddr(hub->net), msg);
   }
 
-  g_strfreev(cmd.argv);
+  adc_cmd_free(&cmd);
 }
 
 #undef is_adcs_proto
@@ -1351,6 +1414,7 @@ static void adc_handle(net_t *net, char *msg, int _len) {
 
 // If port = 0, 'from' is interpreted as a nick. Otherwise, from should be an IP address.
 static void nmdc_search(hub_t *hub, char *from, unsigned short port, int size_m, guint64 size, int type, char *query) {
+  gint64 start = perf_start();
   int max = port ? 10 : 5;
   fl_list_t *res[10];
   fl_search_t s = {};
@@ -1368,15 +1432,14 @@ static void nmdc_search(hub_t *hub, char *from, unsigned short port, int size_m,
     }
     char root[24];
     base32_decode(query+4, root);
-    GSList *l = fl_local_from_tth(root);
     // it still has to match the other requirements...
-    for(; i<max && l; l=l->next) {
-      fl_list_t *c = l->data;
+    guint it = 0;
+    fl_list_t *c;
+    while(i<max && (c = fl_local_tth_iter(root, &it)))
       if(fl_search_match_full(c, &s))
         res[i++] = c;
-    }
 
-  // Advanced lookup (Noo! This is slooow!)
+  // Advanced lookup
   } else {
     char *tmp = query;
     for(; *tmp; tmp++)
@@ -1386,10 +1449,11 @@ static void nmdc_search(hub_t *hub, char *from, unsigned short port, int size_m,
     char **args = g_strsplit(tmp, " ", 0);
     g_free(tmp);
     s.and = fl_search_create_and(args);
+    i = fl_local_search(&s, args, res, max);
     g_strfreev(args);
-    i = fl_search_rec(fl_local_list, &s, res, max);
     fl_search_free_and(s.and);
   }
+  perf_time(search, start);
 
   // reply
   if(!i)
@@ -1405,32 +1469,34 @@ static void nmdc_search(hub_t *hub, char *from, unsigned short port, int size_m,
 
   net_udp_t udp;
   if(port)
-    net_udp_init(&udp, from, port, var_get(hub->id, VAR_local_address));
+    hub_udp_init(hub, &udp, from, port);
 
+  // All replies are formatted into the same buffer
+  GString *msg = g_string_sized_new(512);
   while(--i>=0) {
-    char *fl = fl_list_path(res[i]);
+    char *fl = fl_local_vpath(res[i]);
     // Windows style path delimiters... why!?
     char *tmp = fl;
-    char *size = NULL;
     for(; *tmp; tmp++)
       if(*tmp == '/')
         *tmp = '\\';
     tmp = nmdc_encode_and_escape(hub, fl);
+    g_string_printf(msg, "$SR %s %s", hub->nick_hub, tmp);
     if(res[i]->isfile) {
       base32_encode(res[i]->tth, tth+4);
-      size = g_strdup_printf("\05%"G_GUINT64_FORMAT, res[i]->size);
+      g_string_append_printf(msg, "\05%"G_GUINT64_FORMAT, res[i]->size);
     }
-    char *msg = g_strdup_printf("$SR %s %s%s %d/%d\05%s (%s)",
-      hub->nick_hub, tmp, size ? size : "", slots_free, slots, res[i]->isfile ? tth : hub->hubname_hub, hubaddr);
+    g_string_append_printf(msg, " %d/%d\05%s (%s)", slots_free, slots, res[i]->isfile ? tth : hub->hubname_hub, hubaddr);
     if(!port)
-      net_writef(hub->net, "%s\05%s|", msg, from);
-    else
-      net_udp_sendf(&udp, "%s|", msg);
+      net_writef(hub->net, "%s\05%s|", msg->str, from);
+    else {
+      g_string_append_c(msg, '|');
+      net_udp_send(&udp, msg->str);
+    }
     g_free(fl);
-    g_free(msg);
-    g_free(size);
     g_free(tmp);
   }
+  g_string_free(msg, TRUE);
 
   if(port)
     net_udp_destroy(&udp);
@@ -1598,11 +1664,8 @@ static void nmdc_handle(net_t *net, char *cmd, int _len) {
           uit_hub_userchange(hub->tab, UIHUB_UC_NFO, u);
         }
       } else {
-        struct in6_addr new = ip6_pack(sep+1);
-        if(ip6_cmp(new, u->ip6) != 0) {
-          u->ip6 = new;
+        if(hub_user_setip6(u, sep+1))
           uit_hub_userchange(hub->tab, UIHUB_UC_NFO, u);
-        }
       }
       // Our own IP, configure active mode
       if(strcmp(*cur, hub->nick_hub) == 0)
@@ -23,6 +23,8 @@
 
 */
 
+// For recvmmsg()
+#define _GNU_SOURCE
 #include "ncdc.h"
 #include "listen.h"
 
@@ -49,6 +51,7 @@ struct listen_bind_t {
   struct in6_addr ip6;
   int src; // glib event source
   int sock;
+  guint32 drops; // SO_RXQ_OVFL count of the last received packet
   GSList *hubs; // hubs that use this bind
 };
 
@@ -94,6 +97,14 @@ guint16 listen_hub_udp(guint64 hub) {
   return b && b->udp ? b->udp->port : 0;
 }
 
+// Returns the UDP socket we're listening on for this hub, if it is of the
+// requested address family. Can be used to send UDP messages without creating
+// a new socket. Returns -1 if there is no such socket.
+int listen_hub_udp_sock(guint64 hub, gboolean v6) {
+  listen_hub_bind_t *b = g_hash_table_lookup(listen_hub_binds, &hub);
+  return b && b->udp && !(b->udp->type & (v6 ? LBT_IP4 : LBT_IP6)) ? b->udp->sock : -1;
+}
+
 
 const char *listen_bind_ipport(listen_bind_t *b) {
   static char buf[100];
@@ -167,33 +178,25 @@ static gboolean listen_tcp_handle(gpointer dat) {
 }
 
 
-static gboolean listen_udp_handle(gpointer dat) {
-  static char buf[5000]; // can be static, this function is only called in the main thread.
-  listen_bind_t *b = dat;
+static gboolean listen_udp_error(listen_bind_t *b) {
+  if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+    return TRUE;
+  ui_mf(uit_main_tab, 0, "UDP read error on %s: %s. Switching to passive mode.",
+    listen_bind_ipport(b), g_strerror(errno));
+  listen_stop();
+  hub_global_nfochange();
+  return FALSE;
+}
+
 
-  int r;
+static void listen_udp_msg(listen_bind_t *b, struct sockaddr *sa, char *buf, int r) {
   char addr_str[100];
   if(b->type & LBT_IP4) {
-    struct sockaddr_in a = {};
-    socklen_t len = sizeof(a);
-    r = recvfrom(b->sock, buf, sizeof(buf)-1, 0, (struct sockaddr *)&a, &len);
-    g_snprintf(addr_str, 100, "%s:%d", ip4_unpack(a.sin_addr), ntohs(a.sin_port));
+    struct sockaddr_in *a = (struct sockaddr_in *)sa;
+    g_snprintf(addr_str, 100, "%s:%d", ip4_unpack(a->sin_addr), ntohs(a->sin_port));
   } else {
-    struct sockaddr_in6 a = {};
-    socklen_t len = sizeof(a);
-    r = recvfrom(b->sock, buf, sizeof(buf)-1, 0, (struct sockaddr *)&a, &len);
-    g_snprintf(addr_str, 100, "[%s]:%d", ip6_unpack(a.sin6_addr), ntohs(a.sin6_port));
-  }
-
-  // handle error
-  if(r < 0) {
-    if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
-      return TRUE;
-    ui_mf(uit_main_tab, 0, "UDP read error on %s: %s. Switching to passive mode.",
-      listen_bind_ipport(b), g_strerror(errno));
-    listen_stop();
-    hub_global_nfochange();
-    return FALSE;
+    struct sockaddr_in6 *a = (struct sockaddr_in6 *)sa;
+    g_snprintf(addr_str, 100, "[%s]:%d", ip6_unpack(a->sin6_addr), ntohs(a->sin6_port));
   }
 
   // Since all incoming messages must be search results, just pass the messages to search.c
@@ -203,9 +206,83 @@ static gboolean listen_udp_handle(gpointer dat) {
     // may not be too useful.
     g_message("UDP:%s: Invalid message: %s", addr_str, buf);
   }
+}
+
+
+#ifdef HAVE_RECVMMSG
+
+// Popular searches may result in thousands of results per second, so receive
+// them in batches rather than a single datagram per main loop iteration.
+#define LISTEN_UDP_BATCH 32
+
+// Counts the packets dropped by the kernel since the previous packet.
+static void listen_udp_drops(listen_bind_t *b, struct msghdr *m) {
+#ifdef SO_RXQ_OVFL
+  struct cmsghdr *c;
+  for(c=CMSG_FIRSTHDR(m); c; c=CMSG_NXTHDR(m, c))
+    if(c->cmsg_level == SOL_SOCKET && c->cmsg_type == SO_RXQ_OVFL) {
+      guint32 d;
+      memcpy(&d, CMSG_DATA(c), sizeof(d));
+      // The counter is cumulative and may wrap around
+      perf_addn(udp_drop, 1, (guint32)(d - b->drops));
+      b->drops = d;
+    }
+#endif
+}
+
+static gboolean listen_udp_handle(gpointer dat) {
+  // Can be static, this function is only called in the main thread.
+  static char bufs[LISTEN_UDP_BATCH][5000];
+  static struct sockaddr_in6 addrs[LISTEN_UDP_BATCH];
+  static struct iovec iov[LISTEN_UDP_BATCH];
+  static struct mmsghdr msgs[LISTEN_UDP_BATCH];
+  static char ctrl[LISTEN_UDP_BATCH][CMSG_SPACE(sizeof(guint32))];
+  listen_bind_t *b = dat;
+
+  int i;
+  for(i=0; i<LISTEN_UDP_BATCH; i++) {
+    iov[i].iov_base = bufs[i];
+    iov[i].iov_len = sizeof(bufs[i])-1;
+    memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+    msgs[i].msg_hdr.msg_iov = iov+i;
+    msgs[i].msg_hdr.msg_iovlen = 1;
+    msgs[i].msg_hdr.msg_name = addrs+i;
+    msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+    msgs[i].msg_hdr.msg_control = ctrl[i];
+    msgs[i].msg_hdr.msg_controllen = sizeof(ctrl[i]);
+  }
+
+  int r = recvmmsg(b->sock, msgs, LISTEN_UDP_BATCH, MSG_DONTWAIT, NULL);
+  if(r < 0)
+    return listen_udp_error(b);
+
+  for(i=0; i<r; i++) {
+    perf_add(udp_in, msgs[i].msg_len);
+    listen_udp_drops(b, &msgs[i].msg_hdr);
+    listen_udp_msg(b, (struct sockaddr *)(addrs+i), bufs[i], msgs[i].msg_len);
+  }
   return TRUE;
 }
 
+#else
+
+static gboolean listen_udp_handle(gpointer dat) {
+  static char buf[5000]; // can be static, this function is only called in the main thread.
+  listen_bind_t *b = dat;
+
+  struct sockaddr_in6 a = {};
+  socklen_t len = sizeof(a);
+  int r = recvfrom(b->sock, buf, sizeof(buf)-1, 0, (struct sockaddr *)&a, &len);
+  if(r < 0)
+    return listen_udp_error(b);
+
+  perf_add(udp_in, r);
+  listen_udp_msg(b, (struct sockaddr *)&a, buf, r);
+  return TRUE;
+}
+
+#endif
+
 
 #define bind_hub_add(lb, h) do {\
     if((h)->tcp != lb && (h)->udp != lb)\
@@ -291,6 +368,11 @@ static void bind_create(listen_bind_t *b) {
 #endif
 
   setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (void *)&one, sizeof(one));
+#ifdef SO_RXQ_OVFL
+  // Have the kernel tell us how many packets it had to drop for /perf
+  if(b->type & LBT_UDP)
+    setsockopt(sock, SOL_SOCKET, SO_RXQ_OVFL, (void *)&one, sizeof(one));
+#endif
   fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0)|O_NONBLOCK);
 
   // Bind
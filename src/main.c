@@ -172,6 +172,9 @@ static gboolean one_second_timer(gpointer dat) {
   // Disconnect offline users
   cc_global_onlinecheck();
 
+  // Look for new download targets
+  dl_queue_check();
+
   // And draw the UI
   ui_draw();
   return TRUE;
@@ -423,6 +426,7 @@ int main(int argc, char **argv) {
   g_free(errlog);
 
   // Init more stuff
+  tth_init_global();
   hub_init_global();
   net_init_global();
   listen_global_init();
@@ -476,6 +480,7 @@ int main(int argc, char **argv) {
 
   g_timeout_add_seconds_full(G_PRIORITY_HIGH, 1, one_second_timer, NULL, NULL);
   g_timeout_add(100, screen_update_check, NULL);
+  perf_init();
   int maxage = var_get_int(0, VAR_filelist_maxage);
   g_timeout_add_seconds_full(G_PRIORITY_LOW, CLAMP(maxage, 3600, 24*3600), dl_fl_clean, NULL, NULL);
 
@@ -496,6 +501,7 @@ int main(int argc, char **argv) {
   cc_global_close();
   fl_flush(NULL);
   dl_close_global();
+  logfile_global_close();
   db_close();
   gnutls_global_deinit();
   if(!main_noterm)
@@ -42,6 +42,8 @@
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
@@ -53,6 +55,15 @@
 # include <sys/socket.h>
 # include <sys/uio.h>
 #endif
+#ifdef HAVE_SYS_INOTIFY_H
+# include <sys/inotify.h>
+#endif
+#ifdef HAVE_SYS_EPOLL_H
+# include <sys/epoll.h>
+#endif
+#ifdef HAVE_LINUX_TLS_H
+# include <linux/tls.h>
+#endif
 
 #include <yuri.h>
 #include <zlib.h>
@@ -24,6 +24,8 @@
 */
 
 
+// For sendmmsg()
+#define _GNU_SOURCE
 #include "ncdc.h"
 #include "net.h"
 
@@ -32,9 +34,14 @@
 ratecalc_t net_in, net_out;
 
 #define NET_RECV_SIZE (   8*1024)
+#define NET_RECV_MAX  ( 256*1024)
 #define NET_MAX_RBUF  (1024*1024)
 #define NET_TRANS_BUF (  32*1024)
 
+#ifdef HAVE_SYS_EPOLL_H
+#define NET_EPOLL
+#endif
+
 
 #if INTERFACE
 
@@ -86,9 +93,15 @@ struct net_t {
   gboolean shutdown_closed : 4; // state DIS, whether shutdown() has been called on the socket.
   gboolean writing : 4; // state ASY. Whether 'socksrc' is write poll event.
   gboolean wantwrite : 4; // state ASY. Whether we want a write on sock.
+  gboolean ktls : 4; // state ASY,SYN,DIS. Whether sending has been offloaded to kernel TLS.
+
+  int bufsize; // state SYN. Size of the userspace transfer buffer, 0 when using sendfile().
+  int sockbuf; // state SYN. Size of the kernel socket buffer in the transfer direction.
 
   GString *tlsrbuf; // state ASY. Temporary buffer for data read before switching to TLS. (To be fed to GnuTLS)
   GString *rbuf; // state ASY. Read buffer.
+  gsize rbuf_off; // state ASY. Offset of the first unconsumed byte in rbuf.
+  int rbuf_read; // state ASY. Size of the next read, grows while the peer keeps our buffer full.
   GString *wbuf; // state ASY. Write buffer.
 
   // Called when an error has occured. Second argument is NETERR_*, third a
@@ -193,6 +206,13 @@ static int low_recv(net_t *n, char *buf, int len, const char **err) {
 
 static ssize_t tls_push(gnutls_transport_ptr_t dat, const void *buf, size_t len) {
   net_t *n = dat;
+  // A record from GnuTLS after sending has been offloaded to the kernel would
+  // be encrypted a second time and corrupt the stream, so fail the write
+  // instead. This shouldn't happen, see ktls_enable().
+  if(n->ktls) {
+    gnutls_transport_set_errno(n->tls, EIO);
+    return -1;
+  }
   int r = send(n->sock, buf, len, 0);
   if(r < 0)
     gnutls_transport_set_errno(n->tls, errno == EWOULDBLOCK ? EAGAIN : errno);
@@ -205,13 +225,15 @@ static ssize_t tls_push(gnutls_transport_ptr_t dat, const void *buf, size_t len)
 
 
 // Same as low_recv(), but for send().
+// With kernel TLS, the socket does the encryption and GnuTLS is bypassed.
 static int low_send(net_t *n, const char *buf, int len, const char **err) {
-  int r = n->tls
+  gboolean tls = n->tls && !n->ktls;
+  int r = tls
     ? gnutls_record_send(n->tls, buf, len)
     : send(n->sock,              buf, len, 0);
 
   // Note: r == 0 is seen as a temporary error
-  if(!r || (r < 0 && (n->tls ? !gnutls_error_is_fatal(r) : errno == EINTR || errno == EWOULDBLOCK || errno == EAGAIN))) {
+  if(!r || (r < 0 && (tls ? !gnutls_error_is_fatal(r) : errno == EINTR || errno == EWOULDBLOCK || errno == EAGAIN))) {
     *err = NULL;
     return -1;
   }
@@ -219,11 +241,11 @@ static int low_send(net_t *n, const char *buf, int len, const char **err) {
   if(n->state != NETST_DIS)
     time(&n->timeout_last);
   if(r < 0) {
-    *err = n->tls ? gnutls_strerror(r) : g_strerror(errno);
+    *err = tls ? gnutls_strerror(r) : g_strerror(errno);
     return -1;
   }
 
-  if(!n->tls) {
+  if(!tls) {
     ratecalc_add(&net_out, r);
     ratecalc_add(&n->rate_out, r);
   }
@@ -244,6 +266,7 @@ struct synfer_t {
   net_t *net;
   guint64 left; // The transfer thread itself does not need the lock to read this value, only to write. (It is the only writer)
   int fd;     // for uploads
+  guint64 off; // for uploads, position in fd. The fd may be shared, so its own file offset is not used
   int cancel; // set to 1 to cancel transfer
   int can[2]; // close() this pipe (can[1]) to cancel the transfer
   gboolean upl : 1; // whether this is an upload or download
@@ -252,10 +275,34 @@ struct synfer_t {
   void *ctx; // for downloads
   void (*cb_downdone)(net_t *, void *);
   gboolean (*cb_downdata)(void *, const char *, int);
+  gboolean (*cb_downready)(void *); // for downloads, may pause reading, see net_recvfile()
   void (*cb_upldone)(net_t *);
+#ifdef NET_EPOLL
+  // State of the transfer engine, only used by the I/O thread
+  int sock;
+  gboolean tls : 1;
+  gboolean sendfile : 1; // upload with sendfile() rather than through buf
+  gboolean throttled : 1; // not in the epoll set, waiting for burst
+  gboolean done : 1; // finished, waiting to be handed to syn_done()
+  fadv_t adv;
+  char *buf;
+  int size; // of buf
+  int p, rd; // for uploads, offset and length of unsent data in buf
+  time_t tuned;
+#endif
 };
 
+#ifndef NET_EPOLL
 static GThreadPool *syn_pool = NULL;
+#endif
+
+// Number of transfers handed to a thread with syn_start() for which
+// syn_done() hasn't been called yet. Only accessed from the main thread.
+static int syn_active = 0;
+
+int net_syn_active() {
+  return syn_active;
+}
 
 
 static void syn_new(net_t *n, gboolean upl, guint64 len) {
@@ -296,6 +343,7 @@ static void syn_cancel(net_t *n) {
 static gboolean syn_done(gpointer dat) {
   synfer_t *s = dat;
   net_t *n = s->net;
+  syn_active--;
 
   // Cancelled
   if(s->cancel) {
@@ -327,6 +375,161 @@ static gboolean syn_done(gpointer dat) {
 }
 
 
+// Adaptive buffer sizing. A single 32 KiB buffer and the default socket
+// buffers are too small to keep a link with a large bandwidth-delay product
+// busy, so about once a second the buffers are resized to twice the product
+// of the measured transfer rate and the RTT, limited by transfer_buffer. The
+// socket buffer is only ever raised: setting it disables the kernel's own
+// autotuning, which is usually good enough. *size is the userspace buffer to
+// resize, or NULL when the transfer doesn't use one (sendfile()).
+static void syn_tune(synfer_t *s, int sock, gboolean write, time_t *last, int *size) {
+  time_t now = time(NULL);
+  if(*last == now)
+    return;
+  *last = now;
+
+  guint64 want = 0;
+#ifdef TCP_INFO
+  struct tcp_info ti;
+  socklen_t len = sizeof(ti);
+  if(getsockopt(sock, IPPROTO_TCP, TCP_INFO, &ti, &len) == 0)
+    want = 2 * (guint64)ratecalc_rate(write ? &s->net->rate_out : &s->net->rate_in) * ti.tcpi_rtt / 1000000;
+#endif
+  want = CLAMP(want, NET_TRANS_BUF, (guint64)var_get_int(0, VAR_transfer_buffer));
+
+  int opt = write ? SO_SNDBUF : SO_RCVBUF;
+  int sb = 0;
+  socklen_t sl = sizeof(sb);
+  if(getsockopt(sock, SOL_SOCKET, opt, &sb, &sl) == 0 && sb < (int)want) {
+    int v = want;
+    if(setsockopt(sock, SOL_SOCKET, opt, &v, sizeof(v)) == 0)
+      getsockopt(sock, SOL_SOCKET, opt, &sb, &sl);
+  }
+
+  // Only grow the userspace buffer, shrinking it again isn't worth the
+  // reallocations when the rate fluctuates.
+  if(size && *size < (int)want)
+    *size = want;
+
+  g_mutex_lock(&s->lock);
+  s->net->bufsize = size ? *size : 0;
+  s->net->sockbuf = sb;
+  g_mutex_unlock(&s->lock);
+}
+
+
+// Linux kernel TLS offload. Once the handshake has completed, the keys and
+// record sequence number of the sending direction are handed to the kernel,
+// so that TLS uploads can use sendfile() as well. Only the sending side is
+// offloaded, received data is still decrypted by GnuTLS. Since GnuTLS doesn't
+// know about this, all further writes on the connection must bypass it.
+
+#if defined(HAVE_LINUX_TLS_H) && defined(HAVE_LINUX_SENDFILE) && GNUTLS_VERSION_NUMBER >= 0x030603
+#define NET_KTLS
+
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+
+// Fills a tls12_crypto_info_* struct. GnuTLS' IV is only the implicit salt,
+// the explicit nonce starts at the sequence number.
+#define ktls_fill(ci, ctype, pfx) do {\
+    if(key.size != pfx##_KEY_SIZE || iv.size != pfx##_SALT_SIZE)\
+      return FALSE;\
+    (ci).info.version = TLS_1_2_VERSION;\
+    (ci).info.cipher_type = ctype;\
+    memcpy((ci).key, key.data, pfx##_KEY_SIZE);\
+    memcpy((ci).salt, iv.data, pfx##_SALT_SIZE);\
+    memcpy((ci).iv, seq, pfx##_IV_SIZE);\
+    memcpy((ci).rec_seq, seq, pfx##_REC_SEQ_SIZE);\
+    cilen = sizeof(ci);\
+  } while(0)
+
+
+// Should be called while holding the synfer lock, or from the main thread when
+// there is no synfer. Returns whether kernel TLS is active.
+static gboolean ktls_enable(net_t *n) {
+  if(n->ktls)
+    return TRUE;
+
+  // Only TLS 1.2. With 1.3, GnuTLS replies to a KeyUpdate from the peer with
+  // a KeyUpdate of its own and switches to a new sending key, neither of
+  // which can be done with the key that the kernel has. TLS 1.2 sessions don't
+  // send anything on their own: renegotiation requests are only reported to
+  // the application, and close_notify is sent by ktls_close_notify().
+  if(gnutls_protocol_get_version(n->tls) != GNUTLS_TLS1_2)
+    return FALSE;
+
+  gnutls_datum_t mac, iv, key;
+  unsigned char seq[8];
+  if(gnutls_record_get_state(n->tls, 0, &mac, &iv, &key, seq) < 0)
+    return FALSE;
+
+  union {
+    struct tls12_crypto_info_aes_gcm_128 gcm128;
+#ifdef TLS_CIPHER_AES_GCM_256
+    struct tls12_crypto_info_aes_gcm_256 gcm256;
+#endif
+  } ci;
+  size_t cilen;
+  memset(&ci, 0, sizeof(ci));
+
+  switch(gnutls_cipher_get(n->tls)) {
+  case GNUTLS_CIPHER_AES_128_GCM:
+    ktls_fill(ci.gcm128, TLS_CIPHER_AES_GCM_128, TLS_CIPHER_AES_GCM_128);
+    break;
+#ifdef TLS_CIPHER_AES_GCM_256
+  case GNUTLS_CIPHER_AES_256_GCM:
+    ktls_fill(ci.gcm256, TLS_CIPHER_AES_GCM_256, TLS_CIPHER_AES_GCM_256);
+    break;
+#endif
+  default:
+    return FALSE;
+  }
+
+  // If setting the keys fails after the ULP has been attached, the socket
+  // simply keeps working as a plain TCP socket, so we can still fall back to
+  // GnuTLS.
+  if(setsockopt(n->sock, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) < 0
+      || setsockopt(n->sock, SOL_TLS, TLS_TX, &ci, cilen) < 0) {
+    g_debug("%s: Kernel TLS not available: %s", net_remoteaddr(n), g_strerror(errno));
+    return FALSE;
+  }
+  g_debug("%s: Kernel TLS enabled", net_remoteaddr(n));
+  n->ktls = TRUE;
+  return TRUE;
+}
+
+
+// Sends a close_notify alert through the kernel, replacement for the alert
+// that gnutls_bye() would have sent.
+static void ktls_close_notify(net_t *n) {
+  char alert[2] = { 1, 0 }; // warning, close_notify
+  char cbuf[CMSG_SPACE(sizeof(unsigned char))];
+  struct iovec iov = { alert, 2 };
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cbuf;
+  msg.msg_controllen = sizeof(cbuf);
+  struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+  c->cmsg_level = SOL_TLS;
+  c->cmsg_type = TLS_SET_RECORD_TYPE;
+  c->cmsg_len = CMSG_LEN(sizeof(unsigned char));
+  *CMSG_DATA(c) = 21; // alert
+  msg.msg_controllen = c->cmsg_len;
+  sendmsg(n->sock, &msg, MSG_DONTWAIT);
+}
+
+#endif
+
+
+#ifndef NET_EPOLL
+
 // Does two things: Waits some time to ensure that we are allowed to burst with
 // the rate limiting thing, and then waits for the socket to become
 // readable/writable. Returns the number of bytes that may be read/written on
@@ -369,14 +572,9 @@ static int syn_wait(synfer_t *s, int sock, gboolean write) {
 #ifdef HAVE_SENDFILE
 
 static void syn_upload_sendfile(synfer_t *s, int sock, fadv_t *adv) {
-  off_t off = lseek(s->fd, 0, SEEK_CUR);
-  if(off == (off_t)-1) {
-    s->err = g_strdup(g_strerror(errno));
-    return;
-  }
-
+  time_t tuned = 0;
   while(s->left > 0 && !s->err && !s->cancel) {
-    off_t oldoff = off;
+    syn_tune(s, sock, TRUE, &tuned, NULL);
     int b = syn_wait(s, sock, TRUE);
     if(b <= 0)
       return;
@@ -385,12 +583,13 @@ static void syn_upload_sendfile(synfer_t *s, int sock, fadv_t *adv) {
     // are thread-safe. To some extent at least.
 #ifdef HAVE_LINUX_SENDFILE
     // XXX: On 32bit Linux with musl, sendfile() may fail with EOVERFLOW when
-    // an offset argument is given and is larger than UINT32_MAX, so we're
-    // passing NULL instead to use the fd's internal file offset.
-    ssize_t r = sendfile(sock, s->fd, NULL, MIN(b, s->left));
+    // the offset is larger than UINT32_MAX. The pread() fallback below
+    // handles that.
+    off_t off = s->off;
+    ssize_t r = sendfile(sock, s->fd, &off, MIN(b, s->left));
 #elif HAVE_BSD_SENDFILE
     off_t len = 0;
-    gint64 r = sendfile(s->fd, sock, off, (size_t)MIN(b, s->left), NULL, &len, 0);
+    gint64 r = sendfile(s->fd, sock, s->off, (size_t)MIN(b, s->left), NULL, &len, 0);
     // a partial write results in an EAGAIN error on BSD, even though this isn't
     // really an error condition at all.
     if(r != -1 || (r == -1 && errno == EAGAIN))
@@ -400,7 +599,7 @@ static void syn_upload_sendfile(synfer_t *s, int sock, fadv_t *adv) {
     if(r >= 0) {
       if(s->flush)
         fadv_purge(adv, r);
-      off = oldoff + r;
+      s->off += r;
       // This bypasses the low_send() function, so manually add it to the
       // ratecalc thing and update timeout_last.
       ratecalc_add(&net_out, r);
@@ -415,12 +614,6 @@ static void syn_upload_sendfile(synfer_t *s, int sock, fadv_t *adv) {
     } else if(errno == ENOTSUP || errno == ENOSYS || errno == EINVAL || errno == EOVERFLOW) {
       // Don't set s->err here, let the fallback handle the rest
       g_message("sendfile() failed with `%s', using fallback.", g_strerror(errno));
-      // The fallback code continues from the fd position, so make sure to
-      // update it in case (FreeBSD's) sendfile() didn't do so.
-      if(lseek(s->fd, off, SEEK_SET) == (off_t)-1) {
-        g_message("Can't switch to fallback, seek failed: %d (%s)", errno, g_strerror(errno));
-        s->err = g_strdup(g_strerror(errno));
-      }
       return;
     } else {
       if(errno != EPIPE && errno != ECONNRESET)
@@ -435,14 +628,25 @@ static void syn_upload_sendfile(synfer_t *s, int sock, fadv_t *adv) {
 
 
 static void syn_upload_buf(synfer_t *s, int sock, fadv_t *adv) {
-  char *buf = g_malloc(NET_TRANS_BUF);
+  int size = NET_TRANS_BUF;
+  char *buf = g_malloc(size);
+  time_t tuned = 0;
 
   while(s->left > 0 && !s->err && !s->cancel) {
-    int rd = read(s->fd, buf, MIN(NET_TRANS_BUF, s->left));
+    int nsize = size;
+    syn_tune(s, sock, TRUE, &tuned, &nsize);
+    if(nsize != size) {
+      g_free(buf);
+      buf = g_malloc(nsize);
+      size = nsize;
+    }
+
+    int rd = pread(s->fd, buf, MIN(size, s->left), s->off);
     if(rd <= 0) {
-      s->err = g_strdup(g_strerror(errno));
+      s->err = g_strdup(rd ? g_strerror(errno) : "Unexpected end of file");
       goto done;
     }
+    s->off += rd;
     if(s->flush)
       fadv_purge(adv, rd);
 
@@ -480,16 +684,37 @@ done:
 
 
 static void syn_download(synfer_t *s, int sock) {
-  char *buf = g_malloc(NET_TRANS_BUF);
+  int size = NET_TRANS_BUF;
+  char *buf = g_malloc(size);
+  time_t tuned = 0;
 
   while(s->left > 0 && !s->err && !s->cancel) {
+    int nsize = size;
+    syn_tune(s, sock, FALSE, &tuned, &nsize);
+    if(nsize != size) {
+      g_free(buf);
+      buf = g_malloc(nsize);
+      size = nsize;
+    }
+
+    // Poll for the receiver to become ready again, similar to syn_wait()
+    gboolean cancel = FALSE;
+    while(!cancel && s->cb_downready && !s->cb_downready(s->ctx)) {
+      GPollFD fd = {};
+      fd.fd = s->can[0];
+      fd.events = G_IO_IN;
+      cancel = g_poll(&fd, 1, 250) > 0;
+    }
+    if(cancel)
+      break;
+
     int b = syn_wait(s, sock, FALSE);
     if(b <= 0)
       break;
 
     g_mutex_lock(&s->lock);
     const char *err = NULL;
-    int r = s->cancel || !s->net->sock ? 0 : low_recv(s->net, buf, MIN(NET_TRANS_BUF, s->left), &err);
+    int r = s->cancel || !s->net->sock ? 0 : low_recv(s->net, buf, MIN(size, s->left), &err);
     if(r > 0)
       s->left -= r;
     g_mutex_unlock(&s->lock);
@@ -526,8 +751,15 @@ static void syn_thread(gpointer dat, gpointer udat) {
   if(sock && !s->cancel && s->upl) {
     fadv_t adv;
     if(s->flush)
-      fadv_init(&adv, s->fd, lseek(s->fd, 0, SEEK_CUR), VAR_FFC_UPLOAD);
+      fadv_init(&adv, s->fd, s->off, VAR_FFC_UPLOAD);
 
+#ifdef NET_KTLS
+    if(tls && var_get_bool(0, VAR_sendfile)) {
+      g_mutex_lock(&s->lock);
+      tls = !s->net->sock || !ktls_enable(s->net);
+      g_mutex_unlock(&s->lock);
+    }
+#endif
 #ifdef HAVE_SENDFILE
     if(!tls && var_get_bool(0, VAR_sendfile))
       syn_upload_sendfile(s, sock, &adv);
@@ -545,15 +777,375 @@ static void syn_thread(gpointer dat, gpointer udat) {
   g_idle_add(syn_done, s);
 }
 
+#else // NET_EPOLL
+
+// Event-driven transfer engine. Rather than blocking a thread for every
+// transfer, a fixed number of I/O threads each multiplex many transfers with
+// epoll. Every transfer is a small state machine that is advanced by
+// syn_step() whenever its socket is ready. Transfers that have used up their
+// rate limiting burst are taken out of the epoll set until the burst is
+// refilled. Finished transfers are handed to syn_done() in the main thread,
+// just like with the blocking implementation.
+
+#define SYN_THREADS 4
+
+typedef struct {
+  int ep;
+  int wake[2]; // a byte is written to wake[1] after adding to queue
+  GMutex lock; // protects queue
+  GPtrArray *queue; // new transfers, taken by the I/O thread
+  GPtrArray *throttled; // only accessed by the I/O thread
+} syn_engine_t;
+
+static syn_engine_t syn_engines[SYN_THREADS];
+static int syn_engine_next = 0;
+
+
+static void syn_engine_finish(syn_engine_t *e, GPtrArray *done, synfer_t *s) {
+  s->done = TRUE;
+  if(s->throttled)
+    g_ptr_array_remove_fast(e->throttled, s);
+  epoll_ctl(e->ep, EPOLL_CTL_DEL, s->can[0], NULL);
+  // If the socket has been closed in the main thread, then it has been
+  // removed from the epoll set automatically, and its fd may already be in
+  // use by another transfer.
+  g_mutex_lock(&s->lock);
+  if(s->sock && !s->throttled && s->net->sock == s->sock)
+    epoll_ctl(e->ep, EPOLL_CTL_DEL, s->sock, NULL);
+  g_mutex_unlock(&s->lock);
+  g_ptr_array_add(done, s);
+}
+
+
+static void syn_engine_begin(syn_engine_t *e, GPtrArray *done, synfer_t *s) {
+  g_mutex_lock(&s->lock);
+  s->sock = s->net->sock;
+  s->tls = !!s->net->tls;
+  g_mutex_unlock(&s->lock);
+
+  if(!s->sock || s->cancel || !s->left) {
+    syn_engine_finish(e, done, s);
+    return;
+  }
+
+  if(s->upl) {
+    if(s->flush)
+      fadv_init(&s->adv, s->fd, s->off, VAR_FFC_UPLOAD);
+#ifdef NET_KTLS
+    if(s->tls && var_get_bool(0, VAR_sendfile)) {
+      g_mutex_lock(&s->lock);
+      s->tls = !s->net->sock || !ktls_enable(s->net);
+      g_mutex_unlock(&s->lock);
+    }
+#endif
+#ifdef HAVE_LINUX_SENDFILE
+    s->sendfile = !s->tls && var_get_bool(0, VAR_sendfile);
+#endif
+  }
+  s->size = NET_TRANS_BUF;
+  if(!s->sendfile)
+    s->buf = g_malloc(s->size);
+
+  struct epoll_event ev = {};
+  ev.data.ptr = s;
+  ev.events = EPOLLIN;
+  if(epoll_ctl(e->ep, EPOLL_CTL_ADD, s->can[0], &ev) < 0) {
+    s->err = g_strdup(g_strerror(errno));
+    syn_engine_finish(e, done, s);
+    return;
+  }
+  ev.events = s->upl ? EPOLLOUT : EPOLLIN;
+  if(epoll_ctl(e->ep, EPOLL_CTL_ADD, s->sock, &ev) < 0) {
+    if(!s->cancel)
+      s->err = g_strdup(g_strerror(errno));
+    syn_engine_finish(e, done, s);
+  }
+}
+
+
+// Adds the socket to or removes it from the epoll set. Throttled transfers
+// are removed completely rather than registered without events, as
+// EPOLLHUP/EPOLLERR would still be reported.
+static void syn_engine_arm(syn_engine_t *e, synfer_t *s, gboolean on) {
+  struct epoll_event ev = {};
+  ev.data.ptr = s;
+  ev.events = s->upl ? EPOLLOUT : EPOLLIN;
+  g_mutex_lock(&s->lock);
+  if(s->net->sock == s->sock)
+    epoll_ctl(e->ep, on ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, s->sock, &ev);
+  g_mutex_unlock(&s->lock);
+  s->throttled = !on;
+}
+
+
+#ifdef HAVE_LINUX_SENDFILE
+
+static gboolean syn_step_sendfile(synfer_t *s, int b) {
+  // No need for a lock here, we're not using the TLS session and socket fd's
+  // are thread-safe. To some extent at least.
+  off_t off = s->off;
+  ssize_t r = sendfile(s->sock, s->fd, &off, MIN(b, s->left));
+
+  if(r >= 0) {
+    s->off += r;
+    if(s->flush)
+      fadv_purge(&s->adv, r);
+    // This bypasses the low_send() function, so manually add it to the
+    // ratecalc thing and update timeout_last.
+    ratecalc_add(&net_out, r);
+    ratecalc_add(&s->net->rate_out, r);
+    g_mutex_lock(&s->lock);
+    time(&s->net->timeout_last);
+    s->left -= r;
+    g_mutex_unlock(&s->lock);
+  } else if(errno == EAGAIN || errno == EINTR) {
+    return FALSE;
+  } else if(errno == ENOTSUP || errno == ENOSYS || errno == EINVAL || errno == EOVERFLOW) {
+    g_message("sendfile() failed with `%s', using fallback.", g_strerror(errno));
+    s->sendfile = FALSE;
+    s->buf = g_malloc(s->size);
+  } else {
+    if(errno != EPIPE && errno != ECONNRESET)
+      g_message("sendfile() returned an unknown error: %d (%s)", errno, g_strerror(errno));
+    s->err = g_strdup(g_strerror(errno));
+    return TRUE;
+  }
+  return !s->left;
+}
+
+#endif
+
+
+static gboolean syn_step_upload(synfer_t *s, int b) {
+  if(!s->rd) {
+    int rd = pread(s->fd, s->buf, MIN(s->size, s->left), s->off);
+    if(rd <= 0) {
+      s->err = g_strdup(rd ? g_strerror(errno) : "Unexpected end of file");
+      return TRUE;
+    }
+    s->off += rd;
+    if(s->flush)
+      fadv_purge(&s->adv, rd);
+    s->p = 0;
+    s->rd = rd;
+  }
+
+  g_mutex_lock(&s->lock);
+  const char *err = NULL;
+  int wr = s->cancel || !s->net->sock ? 0 : low_send(s->net, s->buf+s->p, MIN(s->rd, b), &err);
+  // successful write
+  if(wr > 0) {
+    s->p += wr;
+    s->left -= wr;
+    s->rd -= wr;
+  }
+  g_mutex_unlock(&s->lock);
+
+  if(!wr) // cancelled
+    return TRUE;
+  if(wr < 0 && err) { // actual error
+    s->err = g_strdup(err);
+    return TRUE;
+  }
+  return !s->left;
+}
+
+
+static gboolean syn_step_download(synfer_t *s) {
+  gboolean more;
+  // Keep reading while GnuTLS has buffered data, the socket itself won't
+  // become readable for that.
+  do {
+    g_mutex_lock(&s->lock);
+    const char *err = NULL;
+    int r = s->cancel || !s->net->sock ? 0 : low_recv(s->net, s->buf, MIN(s->size, s->left), &err);
+    if(r > 0)
+      s->left -= r;
+    more = r > 0 && s->left && s->net->tls && gnutls_record_check_pending(s->net->tls) > 0;
+    g_mutex_unlock(&s->lock);
+
+    if(!r)
+      return TRUE;
+    if(r < 0 && !err)
+      return FALSE;
+    if(r < 0) {
+      s->err = g_strdup(err);
+      return TRUE;
+    }
+
+    if(!s->cb_downdata(s->ctx, s->buf, r)) {
+      s->err = g_strdup("Operation cancelled");
+      return TRUE;
+    }
+  } while(more);
+  return !s->left;
+}
+
+
+// Whether a throttled transfer may continue.
+static gboolean syn_step_ready(synfer_t *s) {
+  if(!s->upl && s->cb_downready && !s->cb_downready(s->ctx))
+    return FALSE;
+  return ratecalc_burst(s->upl ? &s->net->rate_out : &s->net->rate_in) > 0;
+}
+
+
+// Called when the socket (or the cancel pipe) is ready. Returns TRUE when the
+// transfer has finished.
+static gboolean syn_step(syn_engine_t *e, synfer_t *s) {
+  if(s->cancel)
+    return TRUE;
+
+  // The receiver can't keep up, stop reading until net_syn_wake() is called.
+  // This is handled the same way as rate limiting.
+  if(!s->upl && s->cb_downready && !s->cb_downready(s->ctx)) {
+    syn_engine_arm(e, s, FALSE);
+    g_ptr_array_add(e->throttled, s);
+    return FALSE;
+  }
+
+  int size = s->size;
+  syn_tune(s, s->sock, s->upl, &s->tuned, s->sendfile ? NULL : &size);
+  if(size != s->size) {
+    // Pending upload data is kept, g_realloc() preserves it
+    s->buf = g_realloc(s->buf, size);
+    s->size = size;
+  }
+
+  int b = ratecalc_burst(s->upl ? &s->net->rate_out : &s->net->rate_in);
+  if(b <= 0) {
+    syn_engine_arm(e, s, FALSE);
+    g_ptr_array_add(e->throttled, s);
+    return FALSE;
+  }
+
+#ifdef HAVE_LINUX_SENDFILE
+  if(s->upl && s->sendfile)
+    return syn_step_sendfile(s, b);
+#endif
+  return s->upl ? syn_step_upload(s, b) : syn_step_download(s);
+}
+
+
+static gpointer syn_engine_thread(gpointer dat) {
+  syn_engine_t *e = dat;
+  GPtrArray *done = g_ptr_array_new();
+  struct epoll_event ev[64];
+  int i;
+
+  while(1) {
+    // Wake up 4 times per second to check on throttled transfers, like
+    // syn_wait() did in the blocking implementation. Transfers paused by the
+    // receiver are also checked after a net_syn_wake().
+    int n = epoll_wait(e->ep, ev, G_N_ELEMENTS(ev), e->throttled->len ? 250 : -1);
+    if(n < 0 && errno != EINTR) {
+      g_critical("epoll_wait() failed: %s", g_strerror(errno));
+      break;
+    }
+
+    for(i=0; i<n; i++) {
+      synfer_t *s = ev[i].data.ptr;
+      if(!s) {
+        char tmp[64];
+        while(read(e->wake[0], tmp, sizeof(tmp)) > 0)
+          ;
+        g_mutex_lock(&e->lock);
+        GPtrArray *new = e->queue;
+        e->queue = g_ptr_array_new();
+        g_mutex_unlock(&e->lock);
+        guint j;
+        for(j=0; j<new->len; j++)
+          syn_engine_begin(e, done, g_ptr_array_index(new, j));
+        g_ptr_array_unref(new);
+        continue;
+      }
+      // 'done' transfers haven't been handed to the main thread yet, so s is
+      // still valid here.
+      if(s->done || (s->throttled && !s->cancel))
+        continue;
+      if(s->throttled)
+        syn_engine_finish(e, done, s);
+      else if(syn_step(e, s))
+        syn_engine_finish(e, done, s);
+    }
+
+    for(i=e->throttled->len-1; i>=0; i--) {
+      synfer_t *s = g_ptr_array_index(e->throttled, i);
+      if(syn_step_ready(s)) {
+        g_ptr_array_remove_index_fast(e->throttled, i);
+        syn_engine_arm(e, s, TRUE);
+      }
+    }
+
+    for(i=0; i<(int)done->len; i++) {
+      synfer_t *s = g_ptr_array_index(done, i);
+      if(s->upl && s->flush)
+        fadv_close(&s->adv);
+      g_free(s->buf);
+      s->buf = NULL;
+      g_idle_add(syn_done, s);
+    }
+    g_ptr_array_set_size(done, 0);
+  }
+  g_ptr_array_unref(done);
+  return NULL;
+}
+
+
+static void syn_engine_init() {
+  int i;
+  for(i=0; i<SYN_THREADS; i++) {
+    syn_engine_t *e = syn_engines+i;
+    e->ep = epoll_create1(0);
+    if(e->ep < 0 || pipe(e->wake) < 0) {
+      g_critical("Can't initialize transfer engine: %s", g_strerror(errno));
+      g_return_if_reached();
+    }
+    fcntl(e->wake[0], F_SETFL, fcntl(e->wake[0], F_GETFL, 0)|O_NONBLOCK);
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    epoll_ctl(e->ep, EPOLL_CTL_ADD, e->wake[0], &ev);
+    g_mutex_init(&e->lock);
+    e->queue = g_ptr_array_new();
+    e->throttled = g_ptr_array_new();
+    g_thread_unref(g_thread_new("transfer", syn_engine_thread, e));
+  }
+}
+
+#endif // NET_EPOLL
+
+
+// Notifies the transfer threads that a receiver that returned FALSE from its
+// ready() callback may be ready again. Can be called from any thread.
+void net_syn_wake() {
+#ifdef NET_EPOLL
+  int i;
+  for(i=0; i<SYN_THREADS; i++)
+    if(write(syn_engines[i].wake[1], "", 1) < 0)
+      g_warning("Can't wake up transfer thread: %s", g_strerror(errno));
+#endif
+}
+
 
 static void syn_start(net_t *n) {
   n->state = NETST_SYN;
+  syn_active++;
   // We're coming from the ASY state, so make sure to clean this up.
   if(n->socksrc) {
     g_source_remove(n->socksrc);
     n->socksrc = 0;
   }
+#ifdef NET_EPOLL
+  syn_engine_t *e = &syn_engines[syn_engine_next++ % SYN_THREADS];
+  g_mutex_lock(&e->lock);
+  g_ptr_array_add(e->queue, n->syn);
+  g_mutex_unlock(&e->lock);
+  if(write(e->wake[1], "", 1) < 0)
+    g_warning("Can't wake up transfer thread: %s", g_strerror(errno));
+#else
   g_thread_pool_push(syn_pool, n->syn, NULL);
+#endif
 }
 
 
@@ -576,6 +1168,30 @@ guint64 net_left(net_t *n) {
 
 static gboolean handle_timer(gpointer dat);
 
+// Consumed data at the start of rbuf isn't removed immediately, that would
+// memmove() the rest of the buffer for every message. Instead rbuf_off is
+// advanced and the buffer is compacted in asy_read() when it runs out of
+// space, so the cost of consuming a message doesn't depend on the amount of
+// data following it.
+#define asy_rbuf_len(n) ((n)->rbuf->len - (n)->rbuf_off)
+
+static void asy_rbuf_consume(net_t *n, gsize len) {
+  n->rbuf_off += len;
+  if(n->rbuf_off >= n->rbuf->len) {
+    n->rbuf_off = 0;
+    g_string_truncate(n->rbuf, 0);
+  }
+}
+
+
+static void asy_rbuf_compact(net_t *n) {
+  if(!n->rbuf_off)
+    return;
+  g_string_erase(n->rbuf, 0, n->rbuf_off);
+  n->rbuf_off = 0;
+}
+
+
 // Checks rbuf against any queued read events and handles those. (Can be called
 // as a glib idle function)
 static gboolean asy_handlerbuf(gpointer dat) {
@@ -586,27 +1202,28 @@ static gboolean asy_handlerbuf(gpointer dat) {
   // otherwise we need to make a copy of rbuf before passing it to the
   // callback.
   net_ref(n);
-  while(n->state == NETST_ASY && n->rbuf->len && n->rd_cb && !n->syn) {
+  while(n->state == NETST_ASY && asy_rbuf_len(n) && n->rd_cb && !n->syn) {
     gboolean msg = n->rd_msg;
     gboolean consume = n->rd_consume;
     int dat = n->rd_dat;
     void(*cb)(net_t *, char *, int) = n->rd_cb;
+    char *str = n->rbuf->str + n->rbuf_off;
 
     char *end = msg
-      ? memchr(n->rbuf->str, dat, n->rbuf->len)
-      : n->rbuf->len >= dat ? n->rbuf->str + dat : NULL;
+      ? memchr(str, dat, asy_rbuf_len(n))
+      : asy_rbuf_len(n) >= dat ? str + dat : NULL;
     if(!end)
       break;
     n->rd_cb = NULL;
     if(msg) {
       *end = 0;
       if(consume)
-        g_debug("%s< %s%c", net_remoteaddr(n), n->rbuf->str, dat != '\n' ? dat : ' ');
+        g_debug("%s< %s%c", net_remoteaddr(n), str, dat != '\n' ? dat : ' ');
     }
-    cb(n, n->rbuf->str, end - n->rbuf->str);
+    cb(n, str, end - str);
     if(n->state == NETST_ASY || n->state == NETST_SYN || n->state == NETST_DIS) {
       if(consume)
-        g_string_erase(n->rbuf, 0, end - n->rbuf->str + (msg ? 1 : 0));
+        asy_rbuf_consume(n, end - str + (msg ? 1 : 0));
       else if(msg)
         *end = dat;
     }
@@ -615,11 +1232,11 @@ static gboolean asy_handlerbuf(gpointer dat) {
   // Handle recvfile
   if(n->syn && n->state == NETST_ASY && !n->syn->upl) {
     synfer_t *s = n->syn;
-    if(n->rbuf->len) {
-      int w = MIN(n->rbuf->len, s->left);
+    if(asy_rbuf_len(n)) {
+      int w = MIN(asy_rbuf_len(n), s->left);
       s->left -= w;
-      s->cb_downdata(s->ctx, n->rbuf->str, w);
-      g_string_erase(n->rbuf, 0, w);
+      s->cb_downdata(s->ctx, n->rbuf->str + n->rbuf_off, w);
+      asy_rbuf_consume(n, w);
     }
     if(s->left)
       syn_start(n);
@@ -639,13 +1256,19 @@ static gboolean asy_handlerbuf(gpointer dat) {
 // Tries a read. Returns FALSE if there was an error other than "please try
 // again later".
 static gboolean asy_read(net_t *n) {
-  // Make sure we have enough buffer space
-  if(n->rbuf->allocated_len < NET_MAX_RBUF && n->rbuf->allocated_len - n->rbuf->len < NET_RECV_SIZE) {
+  // Make sure we have enough buffer space. Reclaim consumed data first, but
+  // only when we're running out of space or it's more than the unconsumed
+  // part, to keep the amount of copying linear.
+  int want = MAX(n->rbuf_read, NET_RECV_SIZE);
+  if(n->rbuf_off && (n->rbuf->allocated_len - n->rbuf->len < want || n->rbuf_off > asy_rbuf_len(n)))
+    asy_rbuf_compact(n);
+  if(n->rbuf->allocated_len < NET_MAX_RBUF && n->rbuf->allocated_len - n->rbuf->len < want) {
     gsize oldlen = n->rbuf->len;
-    g_string_set_size(n->rbuf, MIN(NET_MAX_RBUF, n->rbuf->len+NET_RECV_SIZE));
+    g_string_set_size(n->rbuf, MIN(NET_MAX_RBUF, n->rbuf->len+want));
     n->rbuf->len = oldlen;
+    perf_add(rbuf_size, n->rbuf->allocated_len);
   }
-  int len = n->rbuf->allocated_len - n->rbuf->len - 1;
+  int len = MIN(n->rbuf->allocated_len - n->rbuf->len - 1, want);
   if(len <= 10) { // Some arbitrary low number.
     g_debug("%s: Read buffer full", net_remoteaddr(n));
     n->cb_err(n, NETERR_RECV, "Read buffer full");
@@ -664,10 +1287,17 @@ static gboolean asy_read(net_t *n) {
     return FALSE;
   }
 
-  // Otherwise, update buffer info
+  // Otherwise, update buffer info. When the read filled all the space we
+  // asked for, the peer is likely sending a burst of messages (e.g. the user
+  // list on hub join). Read more at once next time, so that we wake up and
+  // run the handlers less often.
   g_return_val_if_fail(n->rbuf->len + r < n->rbuf->allocated_len, FALSE);
   n->rbuf->len += r;
   n->rbuf->str[n->rbuf->len] = 0;
+  if(r == len)
+    n->rbuf_read = MIN(NET_RECV_MAX, want*2);
+  else if(r < want/4)
+    n->rbuf_read = MAX(NET_RECV_SIZE, want/2);
   net_ref(n);
   asy_handlerbuf(n);
   gboolean ret = n->state == NETST_ASY;
@@ -678,6 +1308,14 @@ static gboolean asy_read(net_t *n) {
 
 static gboolean dis_shutdown(net_t *n) {
   // Shutdown TLS
+#ifdef NET_KTLS
+  if(n->tls && n->ktls) {
+    ktls_close_notify(n);
+    gnutls_deinit(n->tls);
+    n->tls = NULL;
+    n->ktls = FALSE;
+  }
+#endif
   if(n->tls) {
     int r = gnutls_bye(n->tls, GNUTLS_SHUT_RDWR);
     if(r == 0) {
@@ -898,11 +1536,15 @@ void net_peekbytes(net_t *n, int bytes, void(*cb)(net_t *, char *, int)) {
 
 // Similar to net_readbytes(), but will call the data() callback for every read
 // from the network, this callback may be run from another thread. When done,
-// the done() callback will be run in the main thread.
-void net_recvfile(net_t *n, guint64 len, gboolean(*data)(void *, const char *, int), void(*done)(net_t *, void *), void *ctx) {
+// the done() callback will be run in the main thread. If ready() is set, it is
+// called from the transfer thread before reading, and reading is paused while
+// it returns FALSE. The receiver must call net_syn_wake() when it is ready
+// again.
+void net_recvfile(net_t *n, guint64 len, gboolean(*data)(void *, const char *, int), gboolean(*ready)(void *), void(*done)(net_t *, void *), void *ctx) {
   g_return_if_fail(n->state == NETST_ASY);
   syn_new(n, FALSE, len);
   n->syn->cb_downdata = data;
+  n->syn->cb_downready = ready;
   n->syn->cb_downdone = done;
   n->syn->ctx = ctx;
   n->rd_cb = NULL;
@@ -963,14 +1605,17 @@ void net_writef(net_t *n, const char *fmt, ...) {
 #undef flush
 
 
-// Switches to the SYN state when the write buffer has been flushed. fd will be
-// close()'d when done. cb() will be called in the main thread.
-void net_sendfile(net_t *n, int fd, guint64 len, gboolean flush, void (*cb)(net_t *)) {
+// Switches to the SYN state when the write buffer has been flushed. len bytes
+// are sent from fd starting at off, without using or modifying the file
+// offset of fd. fd will be close()'d when done. cb() will be called in the
+// main thread.
+void net_sendfile(net_t *n, int fd, guint64 off, guint64 len, gboolean flush, void (*cb)(net_t *)) {
   g_return_if_fail(n->state == NETST_ASY && !n->syn);
   syn_new(n, TRUE, len);
   n->syn->flush = flush;
   n->syn->cb_upldone = cb;
   n->syn->fd = fd;
+  n->syn->off = off;
   if(!n->wbuf->len)
     syn_start(n);
 }
@@ -1007,6 +1652,7 @@ void net_settls(net_t *n, gboolean serv, gboolean negotiate, void (*cb)(net_t *,
   g_return_if_fail(n->state == NETST_ASY);
   g_return_if_fail(!n->wbuf->len);
   g_return_if_fail(!n->tls);
+  asy_rbuf_compact(n);
   if(n->rbuf->len) {
     n->tlsrbuf = n->rbuf;
     n->rbuf = g_string_sized_new(1024);
@@ -1042,6 +1688,8 @@ void net_connected(net_t *n, int sock, const char *addr, gboolean v6) {
   n->v6 = v6;
   n->wbuf = g_string_sized_new(1024);
   n->rbuf = g_string_sized_new(1024);
+  n->rbuf_off = 0;
+  n->rbuf_read = NET_RECV_SIZE;
 
   if(v6) {
     struct sockaddr_in6 a;
@@ -1073,11 +1721,36 @@ void net_connected(net_t *n, int sock, const char *addr, gboolean v6) {
 
 // DNS resolution and connecting
 
+// Resolved addresses are cached, so that reconnecting to many hubs at once or
+// receiving many connect requests for the same host doesn't repeat the same
+// lookups. getaddrinfo() doesn't tell us the TTL of the records, so a fixed
+// (short) lifetime is used instead, and failed lookups are cached for an even
+// shorter period. Concurrent lookups for the same host share a single
+// getaddrinfo() call, and numeric addresses are handled without involving a
+// resolver thread at all.
+
+#define DNS_CACHE_TTL   60
+#define DNS_CACHE_NEG   10
+#define DNS_CACHE_MAX  256
+
+typedef struct dnscache_t {
+  int ref;
+  char *key; // "host:port", also used as argument to the resolver
+  char *host;
+  unsigned short port;
+  gboolean pending; // lookup in progress, dnscon_t's are queued in 'waiting'
+  time_t expires;
+  struct addrinfo *nfo;
+  char *err;
+  GSList *waiting;
+} dnscache_t;
+
 struct dnscon_t {
   net_t *net;
   char *addr;
   char *laddr;
   unsigned short port;
+  dnscache_t *cache; // holds a reference, owns nfo
   struct addrinfo *nfo;
   struct addrinfo *next;
   char *err;
@@ -1086,14 +1759,27 @@ struct dnscon_t {
 
 
 static GThreadPool *dns_pool = NULL;
+static GHashTable *dns_cache = NULL; // key -> dnscache_t
+
+
+static void dnscache_unref(dnscache_t *c) {
+  if(--c->ref > 0)
+    return;
+  if(c->nfo)
+    freeaddrinfo(c->nfo);
+  g_free(c->err);
+  g_free(c->key);
+  g_free(c->host);
+  g_slice_free(dnscache_t, c);
+}
 
 
 static void dnscon_free(dnscon_t *r) {
   g_free(r->err);
   g_free(r->addr);
   g_free(r->laddr);
-  if(r->nfo)
-    freeaddrinfo(r->nfo);
+  if(r->cache)
+    dnscache_unref(r->cache);
   g_slice_free(dnscon_t, r);
 }
 
@@ -1122,7 +1808,11 @@ static void dnsconn_handleconn(net_t *n, int err) {
     return;
   }
 
-  // Error on the last try, time to give up.
+  // Error on the last try, time to give up. The cached addresses may be the
+  // problem, so look them up again next time.
+  dnscache_t *c = n->dnscon->cache;
+  if(c && g_hash_table_lookup(dns_cache, c->key) == c)
+    g_hash_table_remove(dns_cache, c->key);
   g_debug("%s: Connect error: %s", net_remoteaddr(n), g_strerror(err));
   n->cb_err(n, NETERR_CONN, g_strerror(err));
 }
@@ -1184,49 +1874,135 @@ static void dnscon_tryconn(net_t *n) {
 }
 
 
-// Called as an idle function from the dnscon_thread.
-static gboolean dnscon_gotdns(gpointer dat) {
-  dnscon_t *r = dat;
+// Called when the lookup for r has finished or was found in the cache.
+static void dnscon_gotdns(dnscon_t *r, dnscache_t *c) {
   net_t *n = r->net;
   // It's possible that a net_disconnect() has happened in the mean time. Free
   // and ignore the results in that case.
   if(!n) {
     dnscon_free(r);
-    return FALSE;
+    return;
   }
 
+  c->ref++;
+  r->cache = c;
+  r->nfo = c->nfo;
+
   // Handle error
-  if(r->err) {
+  if(c->err) {
+    r->err = g_strdup(c->err);
     g_debug("%s: DNS resolve: %s", net_remoteaddr(n), r->err);
     n->cb_err(n, NETERR_CONN, r->err);
-    return FALSE;
+    return;
   }
 
   // Is it possible for getaddrinfo() to return an empty result set without an error?
-  g_return_val_if_fail(r->nfo, FALSE);
+  g_return_if_fail(r->nfo);
 
   // Try connecting to each of the addresses.
   n->state = NETST_CON;
   r->next = r->nfo;
   dnscon_tryconn(n);
-  return FALSE;
 }
 
 
-// Async DNS resolution in a background thread
-static void dnscon_thread(gpointer dat, gpointer udat) {
+// Idle function for cache hits, to keep the callbacks asynchronous.
+static gboolean dnscon_cached(gpointer dat) {
   dnscon_t *r = dat;
+  dnscache_t *c = r->cache;
+  r->cache = NULL;
+  dnscon_gotdns(r, c);
+  dnscache_unref(c);
+  return FALSE;
+}
+
+
+// Called as an idle function from the dnscon_thread.
+static gboolean dnscache_done(gpointer dat) {
+  dnscache_t *c = dat;
+  c->pending = FALSE;
+  c->expires = time(NULL) + (c->err ? DNS_CACHE_NEG : DNS_CACHE_TTL);
+
+  GSList *l = g_slist_reverse(c->waiting);
+  c->waiting = NULL;
+  GSList *i;
+  for(i=l; i; i=i->next)
+    dnscon_gotdns(i->data, c);
+  g_slist_free(l);
+  dnscache_unref(c);
+  return FALSE;
+}
+
+
+static int dnscache_resolve(dnscache_t *c, int flags) {
   struct addrinfo hint = {};
   hint.ai_family = AF_UNSPEC;
   hint.ai_socktype = SOCK_STREAM;
   hint.ai_protocol = 0;
-  hint.ai_flags = 0;
+  hint.ai_flags = flags;
   char port[20];
-  g_snprintf(port, sizeof(port), "%d", (int)r->port);
-  int n = getaddrinfo(r->addr, port, &hint, &r->nfo);
-  if(n)
-    r->err = g_strdup(n == EAI_SYSTEM ? g_strerror(errno) : gai_strerror(n));
-  g_idle_add(dnscon_gotdns, r);
+  g_snprintf(port, sizeof(port), "%d", (int)c->port);
+  int n = getaddrinfo(c->host, port, &hint, &c->nfo);
+  if(n && !(flags & AI_NUMERICHOST))
+    c->err = g_strdup(n == EAI_SYSTEM ? g_strerror(errno) : gai_strerror(n));
+  return n;
+}
+
+
+// Async DNS resolution in a background thread
+static void dnscon_thread(gpointer dat, gpointer udat) {
+  dnscache_t *c = dat;
+  dnscache_resolve(c, 0);
+  g_idle_add(dnscache_done, c);
+}
+
+
+static gboolean dnscache_expired(gpointer key, gpointer val, gpointer dat) {
+  dnscache_t *c = val;
+  return !c->pending && c->expires <= *((time_t *)dat);
+}
+
+
+static void dnscache_lookup(dnscon_t *r) {
+  time_t now = time(NULL);
+  char *key = g_strdup_printf("%s:%d", r->addr, (int)r->port);
+  dnscache_t *c = g_hash_table_lookup(dns_cache, key);
+
+  if(c && c->pending) {
+    c->waiting = g_slist_prepend(c->waiting, r);
+    g_free(key);
+    return;
+  }
+  if(c && c->expires > now) {
+    c->ref++;
+    r->cache = c;
+    g_idle_add(dnscon_cached, r);
+    g_free(key);
+    return;
+  }
+
+  c = g_slice_new0(dnscache_t);
+  c->ref = 1;
+  c->key = key;
+  c->host = g_strdup(r->addr);
+  c->port = r->port;
+
+  // Numeric addresses don't need a resolver thread, and aren't worth caching.
+  if(dnscache_resolve(c, AI_NUMERICHOST) == 0) {
+    r->cache = c;
+    g_idle_add(dnscon_cached, r);
+    return;
+  }
+
+  if(g_hash_table_size(dns_cache) >= DNS_CACHE_MAX)
+    g_hash_table_foreach_remove(dns_cache, dnscache_expired, &now);
+  // The hash table holds a reference, and another one is held by the resolver
+  // until dnscache_done().
+  c->ref++;
+  c->pending = TRUE;
+  c->waiting = g_slist_prepend(NULL, r);
+  g_hash_table_replace(dns_cache, c->key, c);
+  g_thread_pool_push(dns_pool, c, NULL);
 }
 
 
@@ -1258,6 +2034,8 @@ const char *net_remoteaddr(net_t *n) { return n->addr; }
 const char *net_localaddr(net_t *n)  { return n->laddr; }
 ratecalc_t *net_rate_in(net_t *n)    { return &n->rate_in; }
 ratecalc_t *net_rate_out(net_t *n)   { return &n->rate_out; }
+int         net_bufsize(net_t *n)    { return n->bufsize; }
+int         net_sockbuf(net_t *n)    { return n->sockbuf; }
 void       *net_handle(net_t *n)     { return n->handle; }
 
 gboolean net_is_asy(net_t *n)           { return n->state == NETST_ASY; }
@@ -1330,7 +2108,7 @@ void net_connect(net_t *n, const char *host, unsigned short port, const char *la
   time(&n->timeout_last);
   n->dnscon = r;
   n->state = NETST_DNS;
-  g_thread_pool_push(dns_pool, r, NULL);
+  dnscache_lookup(r);
 }
 
 
@@ -1375,6 +2153,8 @@ void net_disconnect(net_t *n) {
     gnutls_deinit(n->tls);
     n->tls = NULL;
   }
+  n->ktls = FALSE;
+  n->bufsize = n->sockbuf = 0;
   if(n->sock) {
     close(n->sock);
     n->sock = 0;
@@ -1430,23 +2210,42 @@ void net_unref(net_t *n) {
 
 
 
-// Simple API for sending UDP packets
+// Simple API for sending UDP packets. Messages are queued in a single buffer
+// and sent in one go (with sendmmsg() where available) when the queue is full
+// or the net_udp_t is destroyed, since search replies usually come in bursts
+// and are always sent to the same destination.
 
 #if INTERFACE
 
+#define NET_UDP_BATCH 32
+
 struct net_udp_t {
   char addr[62];
   int sock;
+  gboolean shared; // sock belongs to someone else (listen.c), send with sendto()
+  struct sockaddr_in6 dest; // when shared, large enough for IPv4 as well
+  socklen_t destlen;
+  GString *buf; // queued messages
+  int lens[NET_UDP_BATCH];
+  int num;
 };
 
 #endif
 
 
+static void net_udp_setup(net_udp_t *udp, int af, const char *host, unsigned short port) {
+  snprintf(udp->addr, sizeof(udp->addr), af == AF_INET ? "%s:%d" : "[%s]:%d", host, (int)port);
+  udp->buf = g_string_sized_new(8*1024);
+  udp->num = 0;
+}
+
+
 // Creates a new UDP socket for sending messages to the given destination.
 // host is assumed to be a valid IPv4 or IPv6 address.
 void net_udp_init(net_udp_t *udp, const char *host, unsigned short port, char *laddr) {
   int af = ip4_isvalid(host) ? AF_INET : AF_INET6;
-  snprintf(udp->addr, sizeof(udp->addr), af == AF_INET ? "%s:%d" : "[%s]:%d", host, (int)port);
+  net_udp_setup(udp, af, host, port);
+  udp->shared = FALSE;
 
   udp->sock = socket(af, SOCK_DGRAM, 0);
   fcntl(udp->sock, F_SETFL, fcntl(udp->sock, F_GETFL, 0)|O_NONBLOCK);
@@ -1454,6 +2253,7 @@ void net_udp_init(net_udp_t *udp, const char *host, unsigned short port, char *l
   if(net_sock_bind(af, udp->sock, laddr) < 0) {
     g_message("Can't bind UDP socket for '%s' to local address '%s': %s", udp->addr, laddr, g_strerror(errno));
     close(udp->sock);
+    udp->sock = -1;
     return;
   }
 
@@ -1468,29 +2268,98 @@ void net_udp_init(net_udp_t *udp, const char *host, unsigned short port, char *l
   if(n < 0) {
     g_message("Can't associate UDP socket with '%s': %s", udp->addr, g_strerror(errno));
     close(udp->sock);
+    udp->sock = -1;
+    return;
+  }
+}
+
+
+// Like net_udp_init(), but sends over an existing (non-blocking) socket of the
+// same address family rather than creating a new one.
+void net_udp_init_sock(net_udp_t *udp, int sock, const char *host, unsigned short port) {
+  int af = ip4_isvalid(host) ? AF_INET : AF_INET6;
+  net_udp_setup(udp, af, host, port);
+  udp->shared = TRUE;
+  udp->sock = sock;
+  if(af == AF_INET) {
+    udp->destlen = sizeof(struct sockaddr_in);
+    memcpy(&udp->dest, ip4_sockaddr(ip4_pack(host), port), udp->destlen);
+  } else {
+    udp->destlen = sizeof(struct sockaddr_in6);
+    memcpy(&udp->dest, ip6_sockaddr(ip6_pack(host), port), udp->destlen);
+  }
+}
+
+
+// Sends all queued messages. Logs but otherwise ignores errors. Note that the
+// socket is non-blocking and this function does not attempt to retry on
+// EWOULDBLOCK or EAGAIN. It is assumed that the kernel buffers are large
+// enough that we can burst-queue several messages, and that, if the kernel
+// buffers are full, we might be better off dropping some messages than
+// queueing them until infinity.
+void net_udp_flush(net_udp_t *udp) {
+  int i, off, sent = 0;
+  if(!udp->num || udp->sock < 0) {
+    g_string_truncate(udp->buf, 0);
+    udp->num = 0;
     return;
   }
+
+#ifdef HAVE_SENDMMSG
+  struct iovec iov[NET_UDP_BATCH];
+  struct mmsghdr msgs[NET_UDP_BATCH];
+  memset(msgs, 0, udp->num*sizeof(*msgs));
+  for(i=off=0; i<udp->num; off+=udp->lens[i++]) {
+    iov[i].iov_base = udp->buf->str + off;
+    iov[i].iov_len = udp->lens[i];
+    msgs[i].msg_hdr.msg_iov = iov+i;
+    msgs[i].msg_hdr.msg_iovlen = 1;
+    if(udp->shared) {
+      msgs[i].msg_hdr.msg_name = &udp->dest;
+      msgs[i].msg_hdr.msg_namelen = udp->destlen;
+    }
+  }
+  int r = sendmmsg(udp->sock, msgs, udp->num, 0);
+  for(i=0; i<r; i++)
+    if((int)msgs[i].msg_len == udp->lens[i])
+      sent += udp->lens[i];
+  if(r != udp->num)
+    g_message("Error sending UDP message to '%s': %s", udp->addr, r < 0 ? g_strerror(errno) : "Short write");
+#else
+  gboolean err = FALSE;
+  for(i=off=0; i<udp->num; off+=udp->lens[i++]) {
+    int r = udp->shared
+      ? sendto(udp->sock, udp->buf->str+off, udp->lens[i], 0, (struct sockaddr *)&udp->dest, udp->destlen)
+      : send(udp->sock, udp->buf->str+off, udp->lens[i], 0);
+    if(r == udp->lens[i])
+      sent += r;
+    else if(!err) {
+      g_message("Error sending UDP message to '%s': %s", udp->addr, g_strerror(errno));
+      err = TRUE;
+    }
+  }
+#endif
+
+  ratecalc_add(&net_out, sent);
+  g_string_truncate(udp->buf, 0);
+  udp->num = 0;
 }
 
 
 void net_udp_destroy(net_udp_t *udp) {
-  if(udp->sock >= 0)
+  net_udp_flush(udp);
+  if(udp->sock >= 0 && !udp->shared)
     close(udp->sock);
+  g_string_free(udp->buf, TRUE);
 }
 
 
-// Send a message to a UDP socket, logs but otherwise ignores errors. Note that
-// the socket is created as non-blocking and this function does not attempt to
-// retry the send() on EWOULDBLOCK or EAGAIN. It is assumed that the kernel
-// buffers are large enough that we can burst-queue several messages, and that,
-// if the kernel buffers are full, we might be better off dropping some
-// messages than queueing them until infinity.
+// Queues a message to be sent as a single datagram.
 void net_udp_send_raw(net_udp_t *udp, const char *msg, int len) {
-  int r = send(udp->sock, msg, len, 0);
-  if(r != len)
-    g_message("Error sending UDP message to '%s': %s", udp->addr, g_strerror(errno));
-  else
-    ratecalc_add(&net_out, len);
+  if(udp->num >= NET_UDP_BATCH)
+    net_udp_flush(udp);
+  g_string_append_len(udp->buf, msg, len);
+  udp->lens[udp->num++] = len;
 }
 
 
@@ -1526,6 +2395,11 @@ void net_init_global() {
   ratecalc_register(&net_out, RCC_NONE);
 
   dns_pool = g_thread_pool_new(dnscon_thread, NULL, -1, FALSE, NULL);
+  dns_cache = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, (GDestroyNotify)dnscache_unref);
+#ifdef NET_EPOLL
+  syn_engine_init();
+#else
   syn_pool = g_thread_pool_new(syn_thread, NULL, -1, FALSE, NULL);
+#endif
 }
 
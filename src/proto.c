@@ -194,6 +194,13 @@ enum adc_cmd_type {
 };
 
 
+// Messages with up to ADC_ARGS arguments and shorter than ADC_BUFSIZE bytes
+// are parsed without any memory allocation.
+#define ADC_ARGS    64
+#define ADC_BUFSIZE 1024
+
+#define ADC_PARAMHASH(a, b) (((a)*7 + (b)) & 63)
+
 struct adc_cmd_t {
   char type;        // B|C|D|E|F|H|I|U
   adc_cmd_type cmd; // ADCC_*, but can also be something else. Unhandled commands should be ignored anyway.
@@ -201,6 +208,14 @@ struct adc_cmd_t {
   int dest;         // Only when type = D|E
   char **argv;
   int argc;
+  // Internal. The arguments are unescaped into 'inl' (or 'buf' for large
+  // messages) and up to ADC_ARGS of them are indexed by their two-letter
+  // name, see adc_cmd_find().
+  char *buf;
+  guint8 idx[64];         // hash of a name -> 1 + index of the first argument
+  guint8 next[ADC_ARGS];  // 1 + index of the next argument with the same hash
+  char *args[ADC_ARGS+1];
+  char inl[ADC_BUFSIZE];
 };
 
 
@@ -223,12 +238,14 @@ static gboolean int_in_array(const int *arr, int needle) {
 
 
 gboolean adc_parse(const char *str, adc_cmd_t *c, int *feats, GError **err) {
-  if(!g_utf8_validate(str, -1, NULL)) {
+  // g_utf8_validate() also finds the end of the string for us
+  const char *end;
+  if(!g_utf8_validate(str, -1, &end)) {
     g_set_error_literal(err, 1, 0, "Invalid encoding.");
     return FALSE;
   }
 
-  if(strlen(str) < 4) {
+  if(end-str < 4) {
     g_set_error_literal(err, 1, 0, "Message too short.");
     return FALSE;
   }
@@ -252,7 +269,7 @@ gboolean adc_parse(const char *str, adc_cmd_t *c, int *feats, GError **err) {
 
   // type = B|D|E|F, first argument must be the source SID
   if(c->type == 'B' || c->type == 'D' || c->type == 'E' || c->type == 'F') {
-    if(strlen(off) < 4) {
+    if(end-off < 4) {
       g_set_error_literal(err, 1, 0, "Message too short");
       return FALSE;
     }
@@ -266,7 +283,7 @@ gboolean adc_parse(const char *str, adc_cmd_t *c, int *feats, GError **err) {
 
   // type = D|E, next argument must be the destination SID
   if(c->type == 'D' || c->type == 'E') {
-    if(strlen(off) < 4) {
+    if(end-off < 4) {
       g_set_error_literal(err, 1, 0, "Message too short");
       return FALSE;
     }
@@ -283,7 +300,8 @@ gboolean adc_parse(const char *str, adc_cmd_t *c, int *feats, GError **err) {
   // to make sure it's correct. Some hubs broadcast F messages without actually
   // checking the listed features. :-/
   if(c->type == 'F') {
-    int l = strchr(off, ' ') ? strchr(off, ' ')-off : strlen(off);
+    const char *sp = memchr(off, ' ', end-off);
+    int l = sp ? sp-off : end-off;
     if((l % 5) != 0) {
       g_set_error_literal(err, 1, 0, "Message too short");
       return FALSE;
@@ -303,32 +321,121 @@ gboolean adc_parse(const char *str, adc_cmd_t *c, int *feats, GError **err) {
     off += off[l] ? l+1 : l;
   }
 
-  // parse the rest of the arguments
-  char **s = g_strsplit(off, " ", 0);
-  c->argc = s ? g_strv_length(s) : 0;
-  if(s) {
-    char **a = g_new0(char *, c->argc+1);
-    int i;
-    for(i=0; i<c->argc; i++) {
-      a[i] = adc_unescape(s[i], FALSE);
-      if(!a[i]) {
+  // Parse the rest of the arguments. This is a single pass that splits and
+  // unescapes the arguments into the output buffer and indexes them by name.
+  c->buf = end-off < ADC_BUFSIZE ? NULL : g_malloc(end-off+1);
+  char *w = c->buf ? c->buf : c->inl;
+  c->argv = c->args;
+  c->argc = 0;
+  memset(c->idx, 0, sizeof(c->idx));
+  int size = ADC_ARGS;
+  gboolean more = *off ? TRUE : FALSE;
+
+  while(more) {
+    if(c->argc >= size) {
+      size *= 2;
+      if(c->argv == c->args)
+        c->argv = g_memdup(c->args, ADC_ARGS*sizeof(char *));
+      c->argv = g_realloc(c->argv, (size+1)*sizeof(char *));
+    }
+    char *a = c->argv[c->argc] = w;
+
+    const char *sp = memchr(off, ' ', end-off);
+    const char *e = sp ? sp : end;
+    const char *esc;
+    while((esc = memchr(off, '\\', e-off)) != NULL) {
+      memcpy(w, off, esc-off);
+      w += esc-off;
+      if(esc[1] == 's')
+        *(w++) = ' ';
+      else if(esc[1] == 'n')
+        *(w++) = '\n';
+      else if(esc[1] == '\\')
+        *(w++) = '\\';
+      else {
         g_set_error_literal(err, 1, 0, "Invalid escape in argument.");
-        break;
+        adc_cmd_free(c);
+        return FALSE;
       }
+      off = esc+2;
     }
-    g_strfreev(s);
-    if(i < c->argc) {
-      g_strfreev(a);
-      return FALSE;
+    memcpy(w, off, e-off);
+    w += e-off;
+    *(w++) = 0;
+
+    // Add the argument to the end of its hash chain, so that adc_cmd_find()
+    // returns the arguments in order.
+    if(c->argc < ADC_ARGS && a[0] && a[1]) {
+      guint8 *n = c->idx + ADC_PARAMHASH(a[0], a[1]);
+      while(*n)
+        n = c->next + *n - 1;
+      *n = c->argc+1;
+      c->next[c->argc] = 0;
     }
-    c->argv = a;
-  } else
-    c->argv = NULL;
+    c->argc++;
+
+    // A trailing space results in an empty last argument, like g_strsplit().
+    more = sp ? TRUE : FALSE;
+    if(more)
+      off = sp+1;
+  }
+  c->argv[c->argc] = NULL;
 
   return TRUE;
 }
 
 
+void adc_cmd_free(adc_cmd_t *c) {
+  if(c->argv != c->args)
+    g_free(c->argv);
+  g_free(c->buf);
+  c->argv = c->args;
+  c->args[0] = NULL;
+  c->buf = NULL;
+}
+
+
+// Returns the index of the first argument at or after 'from' that starts with
+// the given two-letter name, or -1 if there is no such argument.
+int adc_cmd_find(adc_cmd_t *c, int from, const char *name) {
+  int i = c->idx[ADC_PARAMHASH(name[0], name[1])];
+  for(; i; i=c->next[i-1])
+    if(i-1 >= from && c->argv[i-1][0] == name[0] && c->argv[i-1][1] == name[1])
+      return i-1;
+  // Arguments beyond ADC_ARGS are not indexed
+  for(i=MAX(from, ADC_ARGS); i<c->argc; i++)
+    if(c->argv[i][0] == name[0] && c->argv[i][1] == name[1])
+      return i;
+  return -1;
+}
+
+
+// Indexed alternatives to adc_getparam() and adc_getparams(), only looking at
+// the arguments at or after 'from'.
+char *adc_cmd_param(adc_cmd_t *c, int from, const char *name) {
+  int i = adc_cmd_find(c, from, name);
+  return i < 0 ? NULL : c->argv[i]+2;
+}
+
+
+char **adc_cmd_params(adc_cmd_t *c, int from, const char *name) {
+  // Count the matches first, so that the array is allocated only once
+  int n = 0, i = from-1;
+  while((i = adc_cmd_find(c, i+1, name)) >= 0)
+    n++;
+  if(!n)
+    return NULL;
+
+  char **res = g_new(char *, n+1);
+  n = 0;
+  i = from-1;
+  while((i = adc_cmd_find(c, i+1, name)) >= 0)
+    res[n++] = c->argv[i]+2;
+  res[n] = NULL;
+  return res;
+}
+
+
 char *adc_getparam(char **a, char *name, char ***left) {
   while(a && *a) {
     if(**a && **a == name[0] && (*a)[1] == name[1]) {
@@ -50,6 +50,7 @@ struct search_q_t {
 struct search_r_t {
   guint64 uid;
   char *file;     // full path + filename. Slashes as path saparator, no trailing slash
+  char *file_key; // collation key of the file name, cached by uit_search. Not copied
   guint64 size;   // file size, G_MAXUINT64 = directory
   int slots;      // free slots
   char tth[24];   // TTH root (for regular files)
@@ -66,6 +67,41 @@ struct search_type_t {
 // A set of search_q pointers, listing the searches we're currently interested in.
 static GHashTable *search_list = NULL;
 
+// The searches from search_list that have an SUDP key, most recently matched
+// first. Results tend to arrive in bursts for the same search, so the right
+// key is usually found on the first try.
+static GPtrArray *search_keys = NULL;
+
+// Index of the TTH searches in search_list: TTH root -> GSList of search_q
+// pointers. The key points into the tth field of the first query in the list.
+static GHashTable *search_tth = NULL;
+
+// The other searches in search_list, as search_text_t pointers.
+static GPtrArray *search_text = NULL;
+
+typedef struct {
+  search_q_t *q;
+  GArray *terms; // term IDs in the automaton, set by search_ac_build()
+} search_text_t;
+
+// A single Aho-Corasick automaton matching the case-folded terms of all
+// queries in search_text, so that a file name is scanned only once for any
+// number of searches. It is rebuilt on the next result after search_text has
+// been modified.
+static struct {
+  gboolean dirty;
+  int states;
+  guint32 *next;  // [state*256 + byte] -> state
+  int *term;      // state -> ID of the term ending at this state or -1
+  guint32 *dict;  // state -> nearest state on the fail path with a term, 0 for none
+  int terms;
+  guint32 *seen;  // term ID -> value of gen when it has last been found
+  guint32 gen;
+} search_ac;
+
+// Extension (in lowercase) -> bitmask of the search_types that include it.
+static GHashTable *search_exts = NULL;
+
 
 
 // NMDC search types and the relevant ADC SEGA extensions.
@@ -106,6 +142,7 @@ void search_r_free(gpointer data) {
   if(!r)
     return;
   g_free(r->file);
+  g_free(r->file_key);
   g_slice_free(search_r_t, r);
 }
 
@@ -113,6 +150,7 @@ void search_r_free(gpointer data) {
 search_r_t *search_r_copy(search_r_t *r) {
   search_r_t *res = g_slice_dup(search_r_t, r);
   res->file = g_strdup(r->file);
+  res->file_key = NULL;
   return res;
 }
 
@@ -206,22 +244,218 @@ gboolean search_add(hub_t *hub, search_q_t *q, GError **err) {
   if(!search_list)
     search_list = g_hash_table_new(g_direct_hash, g_direct_equal);
   g_hash_table_insert(search_list, q, q);
+  if(q->type == 9) {
+    if(!search_tth)
+      search_tth = g_hash_table_new(g_int_hash, tiger_hash_equal);
+    GSList *l = g_hash_table_lookup(search_tth, q->tth);
+    if(l)
+      l->next = g_slist_prepend(l->next, q);
+    else
+      g_hash_table_insert(search_tth, q->tth, g_slist_prepend(NULL, q));
+  } else {
+    if(!search_text)
+      search_text = g_ptr_array_new();
+    search_text_t *t = g_slice_new(search_text_t);
+    t->q = q;
+    t->terms = g_array_new(FALSE, FALSE, sizeof(int));
+    g_ptr_array_add(search_text, t);
+    search_ac.dirty = TRUE;
+  }
+  if(var_get_int(0, VAR_sudp_policy) == VAR_SUDPP_PREFER) {
+    if(!search_keys)
+      search_keys = g_ptr_array_new();
+    g_ptr_array_add(search_keys, q);
+  }
   return TRUE;
 }
 
 
 // Remove a query from the active searches.
 void search_remove(search_q_t *q) {
-  if(search_list && g_hash_table_remove(search_list, q))
+  if(search_list && g_hash_table_remove(search_list, q)) {
+    if(search_keys)
+      g_ptr_array_remove(search_keys, q);
+    if(q->type == 9) {
+      GSList *l = g_hash_table_lookup(search_tth, q->tth);
+      l = g_slist_remove(l, q);
+      // The key may point into q, so always replace it.
+      if(l)
+        g_hash_table_replace(search_tth, ((search_q_t *)l->data)->tth, l);
+      else
+        g_hash_table_remove(search_tth, q->tth);
+    } else {
+      guint i;
+      for(i=0; i<search_text->len; i++) {
+        search_text_t *t = g_ptr_array_index(search_text, i);
+        if(t->q == q) {
+          g_array_unref(t->terms);
+          g_slice_free(search_text_t, t);
+          g_ptr_array_remove_index_fast(search_text, i);
+          break;
+        }
+      }
+      search_ac.dirty = TRUE;
+    }
     search_q_free(q);
+  }
+}
+
+
+// Appends the case-folded str to dest, in the same way as str_casestr()
+// compares characters. Folding is done per character, so a substring match on
+// the folded strings is equivalent to a str_casestr() match.
+static void search_fold(GString *dest, const char *str) {
+  for(; *str; str = g_utf8_next_char(str)) {
+    if(!(*str & 0x80))
+      g_string_append_c(dest, g_ascii_tolower(*str));
+    else
+      g_string_append_unichar(dest, g_unichar_tolower(g_utf8_get_char(str)));
+  }
 }
 
 
-// Match a search result with a query.
-static gboolean match(search_q_t *q, search_r_t *r) {
-  // TTH match is fast and easy
-  if(q->type == 9)
-    return r->size == G_MAXUINT64 ? FALSE : memcmp(q->tth, r->tth, 24) == 0 ? TRUE : FALSE;
+static void search_ac_free() {
+  g_free(search_ac.next);
+  g_free(search_ac.term);
+  g_free(search_ac.dict);
+  g_free(search_ac.seen);
+  memset(&search_ac, 0, sizeof(search_ac));
+}
+
+
+static void search_ac_build() {
+  search_ac_free();
+
+  GHashTable *ids = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+  GArray *next = g_array_new(FALSE, TRUE, sizeof(guint32));
+  GArray *term = g_array_new(FALSE, FALSE, sizeof(int));
+  GString *fold = g_string_new("");
+  int none = -1;
+  g_array_set_size(next, 256);
+  g_array_append_val(term, none);
+
+  // Build the trie, one ID for each distinct term
+  guint i, j;
+  for(i=0; i<search_text->len; i++) {
+    search_text_t *t = g_ptr_array_index(search_text, i);
+    g_array_set_size(t->terms, 0);
+    char **str = t->q->query;
+    for(; str&&*str; str++) {
+      g_string_truncate(fold, 0);
+      search_fold(fold, *str);
+      if(!fold->len) // empty pattern, matches anything
+        continue;
+      gpointer id;
+      if(!g_hash_table_lookup_extended(ids, fold->str, NULL, &id)) {
+        guint32 s = 0;
+        for(j=0; j<fold->len; j++) {
+          guint32 *n = &g_array_index(next, guint32, s*256 + (guchar)fold->str[j]);
+          if(!*n) {
+            *n = term->len;
+            g_array_append_val(term, none);
+            g_array_set_size(next, next->len + 256);
+          }
+          s = g_array_index(next, guint32, s*256 + (guchar)fold->str[j]);
+        }
+        id = GINT_TO_POINTER(g_hash_table_size(ids));
+        g_array_index(term, int, s) = GPOINTER_TO_INT(id);
+        g_hash_table_insert(ids, g_strdup(fold->str), id);
+      }
+      int n = GPOINTER_TO_INT(id);
+      g_array_append_val(t->terms, n);
+    }
+  }
+
+  search_ac.states = term->len;
+  search_ac.terms = g_hash_table_size(ids);
+  search_ac.next = (guint32 *)g_array_free(next, FALSE);
+  search_ac.term = (int *)g_array_free(term, FALSE);
+  search_ac.dict = g_new0(guint32, search_ac.states);
+  search_ac.seen = g_new0(guint32, MAX(1, search_ac.terms));
+  g_hash_table_unref(ids);
+  g_string_free(fold, TRUE);
+
+  // Calculate the fail links in breadth-first order and turn the trie into a
+  // complete state machine. States are only ever created with a higher
+  // number than their parent, but that's not a BFS order, hence the queue.
+  guint32 *fail = g_new0(guint32, search_ac.states);
+  guint32 *queue = g_new(guint32, search_ac.states);
+  int qhead = 0, qtail = 0, c;
+  for(c=0; c<256; c++)
+    if(search_ac.next[c])
+      queue[qtail++] = search_ac.next[c];
+  while(qhead < qtail) {
+    guint32 s = queue[qhead++];
+    for(c=0; c<256; c++) {
+      guint32 *n = search_ac.next + s*256 + c;
+      guint32 f = search_ac.next[fail[s]*256 + c];
+      if(*n) {
+        fail[*n] = f;
+        search_ac.dict[*n] = search_ac.term[f] >= 0 ? f : search_ac.dict[f];
+        queue[qtail++] = *n;
+      } else
+        *n = f;
+    }
+  }
+  g_free(fail);
+  g_free(queue);
+}
+
+
+// Runs the automaton on the case-folded file name and marks the terms found
+// with a new search_ac.gen.
+static void search_ac_scan(search_r_t *r) {
+  static GString *fold = NULL; // only used in the main thread
+  if(!fold)
+    fold = g_string_new("");
+  g_string_truncate(fold, 0);
+  search_fold(fold, r->file);
+
+  if(!++search_ac.gen) {
+    memset(search_ac.seen, 0, MAX(1, search_ac.terms)*sizeof(guint32));
+    search_ac.gen = 1;
+  }
+
+  guint32 s = 0;
+  const guchar *p = (const guchar *)fold->str;
+  for(; *p; p++) {
+    s = search_ac.next[s*256 + *p];
+    guint32 o = search_ac.term[s] >= 0 ? s : search_ac.dict[s];
+    for(; o; o=search_ac.dict[o])
+      search_ac.seen[search_ac.term[o]] = search_ac.gen;
+  }
+}
+
+
+// Returns the bitmask of search types that the extension of the file belongs
+// to.
+static int search_ext_mask(search_r_t *r) {
+  if(!search_exts) {
+    search_exts = g_hash_table_new(g_str_hash, g_str_equal);
+    int i;
+    char **ext;
+    for(i=2; i<=7; i++)
+      for(ext=search_types[i].exts; *ext; ext++)
+        g_hash_table_insert(search_exts, *ext,
+          GINT_TO_POINTER(GPOINTER_TO_INT(g_hash_table_lookup(search_exts, *ext)) | (1<<i)));
+  }
+
+  char *l = strrchr(r->file, '.');
+  if(!l || !l[1] || strlen(l+1) > 8)
+    return 0;
+  char buf[10];
+  int i;
+  for(i=0; l[i+1]; i++)
+    buf[i] = g_ascii_tolower(l[i+1]);
+  buf[i] = 0;
+  return GPOINTER_TO_INT(g_hash_table_lookup(search_exts, buf));
+}
+
+
+// Match a search result with a non-TTH query, search_ac_scan() must have been
+// called for the result and ext is its search_ext_mask().
+static gboolean match(search_text_t *t, search_r_t *r, int ext) {
+  search_q_t *q = t->q;
   // Match file/dir type
   if(q->type == 8 && r->size != G_MAXUINT64)
     return FALSE;
@@ -230,24 +464,14 @@ static gboolean match(search_q_t *q, search_r_t *r) {
   // Match size
   if(q->size && !(q->ge ? r->size >= q->size : r->size <= q->size))
     return FALSE;
-  // Match query
-  char **str = q->query;
-  for(; str&&*str; str++)
-    if(G_LIKELY(!str_casestr(r->file, *str)))
-      return FALSE;
   // Match extension
-  char **ext = search_types[(int)q->type].exts;
-  if(ext && *ext) {
-    char *l = strrchr(r->file, '.');
-    if(G_UNLIKELY(!l || !l[1]))
-      return FALSE;
-    l++;
-    for(; *ext; ext++)
-      if(G_UNLIKELY(g_ascii_strcasecmp(l, *ext) == 0))
-        break;
-    if(!*ext)
+  if(q->type >= 2 && q->type <= 7 && !(ext & (1<<q->type)))
+    return FALSE;
+  // Match query
+  guint i;
+  for(i=0; i<t->terms->len; i++)
+    if(G_LIKELY(search_ac.seen[g_array_index(t->terms, int, i)] != search_ac.gen))
       return FALSE;
-  }
   // Okay, we have a match
   return TRUE;
 }
@@ -258,12 +482,29 @@ static gboolean match(search_q_t *q, search_r_t *r) {
 static void dispatch(search_r_t *r) {
   if(!search_list)
     return;
-  GHashTableIter i;
-  g_hash_table_iter_init(&i, search_list);
-  search_q_t *q;
-  while(g_hash_table_iter_next(&i, (gpointer *)&q, NULL))
-    if(q->cb && match(q, r))
-      q->cb(r, q->cb_dat);
+
+  // TTH searches, only an index lookup
+  if(search_tth && r->size != G_MAXUINT64) {
+    GSList *l = g_hash_table_lookup(search_tth, r->tth);
+    for(; l; l=l->next) {
+      search_q_t *q = l->data;
+      if(q->cb)
+        q->cb(r, q->cb_dat);
+    }
+  }
+
+  if(!search_text || !search_text->len)
+    return;
+  if(search_ac.dirty)
+    search_ac_build();
+  search_ac_scan(r);
+  int ext = search_ext_mask(r);
+  guint i;
+  for(i=0; i<search_text->len; i++) {
+    search_text_t *t = g_ptr_array_index(search_text, i);
+    if(t->q->cb && match(t, r, ext))
+      t->q->cb(r, t->q->cb_dat);
+  }
 }
 
 
@@ -390,10 +631,10 @@ static search_r_t *parse_adc(hub_t *hub, adc_cmd_t *cmd) {
   if(!hub && (cmd->type != 'U' || cmd->argc < 1 || !iscid(cmd->argv[0])))
     return NULL;
   char *cid = hub ? NULL : cmd->argv[0];
-  char **argv = hub ? cmd->argv : cmd->argv+1;
+  int from = hub ? 0 : 1;
 
   // file
-  r.file = adc_getparam(argv, "FN", NULL);
+  r.file = adc_cmd_param(cmd, from, "FN");
   if(!r.file)
     return NULL;
   gboolean isfile = TRUE;
@@ -403,12 +644,12 @@ static search_r_t *parse_adc(hub_t *hub, adc_cmd_t *cmd) {
   }
 
   // tth & size
-  tmp = isfile ? adc_getparam(argv, "TR", NULL) : NULL;
+  tmp = isfile ? adc_cmd_param(cmd, from, "TR") : NULL;
   if(tmp) {
     if(!istth(tmp))
       return NULL;
     base32_decode(tmp, r.tth);
-    tmp = adc_getparam(argv, "SI", NULL);
+    tmp = adc_cmd_param(cmd, from, "SI");
     if(!tmp)
       return NULL;
     r.size = g_ascii_strtoull(tmp, &tmp2, 10);
@@ -418,7 +659,7 @@ static search_r_t *parse_adc(hub_t *hub, adc_cmd_t *cmd) {
     r.size = G_MAXUINT64;
 
   // slots
-  tmp = adc_getparam(argv, "SL", NULL);
+  tmp = adc_cmd_param(cmd, from, "SL");
   if(tmp) {
     r.slots = g_ascii_strtoull(tmp, &tmp2, 10);
     if(tmp == tmp2 || !tmp2 || *tmp2)
@@ -435,7 +676,7 @@ static search_r_t *parse_adc(hub_t *hub, adc_cmd_t *cmd) {
   // uid - active. Active responses must have the hubid in the token, from
   // which we can generate the uid.
   } else {
-    tmp = adc_getparam(argv, "TO", NULL);
+    tmp = adc_cmd_param(cmd, from, "TO");
     if(!tmp || strlen(tmp) != 13 || !isbase32(tmp))
       return NULL;
     guint64 hubid;
@@ -496,11 +737,36 @@ static char *try_decrypt(const char *key, const char *in, int inlen, char *out)
 }
 
 
+// Finds the search whose key the packet has been encrypted with. Only the
+// first two blocks (the random prefix and the start of the message) are
+// decrypted for each candidate, the full packet is decrypted only once.
+static search_q_t *sudp_key(const char *in, int inlen) {
+  if(!search_keys || inlen < 32 || inlen & 15)
+    return NULL;
+  guint i;
+  for(i=0; i<search_keys->len; i++) {
+    search_q_t *q = g_ptr_array_index(search_keys, i);
+    char head[32];
+    memcpy(head, in, 32);
+    crypt_aes128cbc(FALSE, q->key, 16, head, 32);
+    if(strncmp(head+16, "$SR ", 4) != 0 && strncmp(head+16, "URES ", 5) != 0)
+      continue;
+    if(i) {
+      memmove(search_keys->pdata+1, search_keys->pdata, i*sizeof(gpointer));
+      search_keys->pdata[0] = q;
+    }
+    return q;
+  }
+  return NULL;
+}
+
+
+// pack[len] must be writable, the message is parsed in-place.
 gboolean search_handle_udp(const char *addr, char *pack, int len) {
+  static char buf[8192]; // can be static, this function is only called in the main thread.
   if(len < 10 || !search_list)
     return TRUE;
 
-  pack = g_memdup(pack, len+1);
   char *msg = pack;
   msg[len] = 0;
 
@@ -511,30 +777,14 @@ gboolean search_handle_udp(const char *addr, char *pack, int len) {
     adc = FALSE;
   else if(strncmp(msg, "URES ", 5) == 0)
     adc = TRUE;
-  else if(!(len & 15) && var_get_int(0, VAR_sudp_policy) != VAR_SUDPP_DISABLE) {
-    char *buf = g_malloc(len);
-    GHashTableIter i;
-    g_hash_table_iter_init(&i, search_list);
-    search_q_t *q;
-    while(g_hash_table_iter_next(&i, (gpointer *)&q, NULL)) {
-      char *new = try_decrypt(q->key, pack, len, buf);
-      if(new && (strncmp(new, "$SR ", 4) == 0 || strncmp(new, "URES ", 5) == 0)) {
-        g_free(pack);
-        pack = buf;
-        msg = new;
-        sudp = TRUE;
-        adc = msg[0] == 'U';
-      }
-    }
-    if(!sudp) {
-      g_free(pack);
-      g_free(buf);
+  else if(!(len & 15) && len < (int)sizeof(buf) && var_get_int(0, VAR_sudp_policy) != VAR_SUDPP_DISABLE) {
+    search_q_t *q = sudp_key(pack, len);
+    if(!q || !(msg = try_decrypt(q->key, pack, len, buf)))
       return FALSE;
-    }
-  } else {
-    g_free(pack);
+    sudp = TRUE;
+    adc = msg[0] == 'U';
+  } else
     return FALSE;
-  }
 
   // handle message
   char *next;
@@ -544,26 +794,19 @@ gboolean search_handle_udp(const char *addr, char *pack, int len) {
 
     if(adc) {
       adc_cmd_t cmd;
-      if(!adc_parse(msg, &cmd, NULL, NULL)) {
-        g_free(pack);
+      if(!adc_parse(msg, &cmd, NULL, NULL))
         return FALSE;
-      }
       gboolean r = search_handle_adc(NULL, &cmd);
-      g_strfreev(cmd.argv);
-      if(!r) {
-        g_free(pack);
+      adc_cmd_free(&cmd);
+      if(!r)
         return FALSE;
-      }
 
-    } else if(!search_handle_nmdc(NULL, msg)) {
-      g_free(pack);
+    } else if(!search_handle_nmdc(NULL, msg))
       return FALSE;
-    }
 
     msg = next;
   }
 
-  g_free(pack);
   return TRUE;
 }
 
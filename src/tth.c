@@ -310,6 +310,231 @@ struct tth_ctx_t {
   } while(0)
 
 
+/* Multi-buffer leaf hashing.
+ *
+ * The leaves of a TTH tree are independent of each other, so several of them
+ * can be hashed side by side. A full base leaf is always hashed as
+ * tiger(0x00 || 1024 bytes of data), which is exactly 17 Tiger blocks: 16
+ * blocks of data (shifted by the prefix byte) and a final block with the last
+ * data byte, padding and the length.
+ *
+ * The kernel below is written using GCC vector extensions, so that the same
+ * code works with any vector width. Only the S-box lookups (mb_sbox) and the
+ * message loads (mb_load) differ per implementation: AVX2 and AVX-512 have
+ * 64-bit gathers, the generic implementation does one lookup per lane and
+ * leaves the arithmetic to whatever the compiler makes of the vector type
+ * (NEON on ARM, SSE2 on x86, interleaved scalar code elsewhere). Which
+ * implementation is fastest depends a lot on the CPU (gathers are slow on
+ * some), so tth_init_global() measures them once at startup. */
+
+#if defined(__GNUC__)
+# define TIGER_MB
+#endif
+#if defined(TIGER_MB) && defined(__x86_64__)
+# define TIGER_MB_X86
+# include <immintrin.h>
+#endif
+
+#ifdef TIGER_MB
+
+typedef guint64 tiger_v4_t __attribute__((vector_size(32)));
+
+#define mb_round(a,b,c,x,mul) \
+  c ^= x; \
+  a -= mb_sbox(t1, c, 0*8) ^ mb_sbox(t2, c, 2*8) ^ \
+       mb_sbox(t3, c, 4*8) ^ mb_sbox(t4, c, 6*8); \
+  b += mb_sbox(t4, c, 1*8) ^ mb_sbox(t3, c, 3*8) ^ \
+       mb_sbox(t2, c, 5*8) ^ mb_sbox(t1, c, 7*8); \
+  b *= mul;
+
+#define mb_pass(a,b,c,mul) \
+  mb_round(a,b,c,x0,mul) \
+  mb_round(b,c,a,x1,mul) \
+  mb_round(c,a,b,x2,mul) \
+  mb_round(a,b,c,x3,mul) \
+  mb_round(b,c,a,x4,mul) \
+  mb_round(c,a,b,x5,mul) \
+  mb_round(a,b,c,x6,mul) \
+  mb_round(b,c,a,x7,mul)
+
+// Equivalent to tiger_process_block(), for all lanes at once. The key
+// schedule works unmodified on vector types.
+#define mb_process_block(a, b, c) do {\
+    __typeof__(a) aa = a, bb = b, cc = c;\
+    mb_pass(a, b, c, 5);\
+    key_schedule;\
+    mb_pass(c, a, b, 7);\
+    key_schedule;\
+    mb_pass(b, c, a, 9);\
+    a ^= aa;\
+    b -= bb;\
+    c += cc;\
+  } while(0)
+
+// Hashes n (= number of elements in vt) consecutive full leaves from msg and
+// writes n*3 words to res. mb_load(p) must return a vector of the
+// (unaligned, little-endian) 64-bit words at p + lane*tth_base_block.
+#define mb_leaves(vt, n, msg, res) do {\
+    vt zero = {};\
+    vt a = zero + G_GUINT64_CONSTANT(0x0123456789ABCDEF);\
+    vt b = zero + G_GUINT64_CONSTANT(0xFEDCBA9876543210);\
+    vt c = zero + G_GUINT64_CONSTANT(0xF096A5B4C3B2E187);\
+    vt x0, x1, x2, x3, x4, x5, x6, x7;\
+    int blk, l;\
+    for(blk=0; blk<16; blk++) {\
+      const char *p = (msg) + blk*tiger_block_size - 1;\
+      if(blk)\
+        x0 = mb_load(p);\
+      else\
+        x0 = mb_load(msg) << 8;\
+      x1 = mb_load(p+8);  x2 = mb_load(p+16);\
+      x3 = mb_load(p+24); x4 = mb_load(p+32);\
+      x5 = mb_load(p+40); x6 = mb_load(p+48);\
+      x7 = mb_load(p+56);\
+      mb_process_block(a, b, c);\
+    }\
+    for(l=0; l<n; l++)\
+      x0[l] = (guint8)(msg)[l*tth_base_block + tth_base_block-1] | 0x100;\
+    x1 = x2 = x3 = x4 = x5 = x6 = zero;\
+    x7 = zero + (guint64)((tth_base_block+1) << 3);\
+    mb_process_block(a, b, c);\
+    for(l=0; l<n; l++) {\
+      (res)[l*3+0] = GUINT64_TO_LE(a[l]);\
+      (res)[l*3+1] = GUINT64_TO_LE(b[l]);\
+      (res)[l*3+2] = GUINT64_TO_LE(c[l]);\
+    }\
+  } while(0)
+
+#endif
+
+
+#ifdef TIGER_MB_X86
+
+typedef guint64 tiger_v8_t __attribute__((vector_size(64)));
+
+__attribute__((target("avx2")))
+static void tiger_leaves_avx2(const char *msg, guint64 *res) {
+#define mb_sbox(t, c, s) ((tiger_v4_t)_mm256_i64gather_epi64((const long long *)(t), (__m256i)(((c) >> (s)) & 0xff), 8))
+#define mb_load(p) ((tiger_v4_t)_mm256_i64gather_epi64((const long long *)(p), _mm256_set_epi64x(3*tth_base_block, 2*tth_base_block, tth_base_block, 0), 1))
+  mb_leaves(tiger_v4_t, 4, msg, res);
+#undef mb_sbox
+#undef mb_load
+}
+
+
+__attribute__((target("avx512f")))
+static void tiger_leaves_avx512(const char *msg, guint64 *res) {
+#define mb_sbox(t, c, s) ((tiger_v8_t)_mm512_i64gather_epi64((__m512i)(((c) >> (s)) & 0xff), (const void *)(t), 8))
+#define mb_load(p) ((tiger_v8_t)_mm512_i64gather_epi64(_mm512_set_epi64(7*tth_base_block, 6*tth_base_block, 5*tth_base_block,\
+    4*tth_base_block, 3*tth_base_block, 2*tth_base_block, tth_base_block, 0), (const void *)(p), 1))
+  mb_leaves(tiger_v8_t, 8, msg, res);
+#undef mb_sbox
+#undef mb_load
+}
+
+#endif
+
+
+#ifdef TIGER_MB
+
+static inline guint64 tiger_mb_load64(const char *p) {
+  guint64 v;
+  memcpy(&v, p, 8);
+  return GUINT64_FROM_LE(v);
+}
+
+static void tiger_leaves_generic(const char *msg, guint64 *res) {
+#define mb_sbox(t, c, s) ((tiger_v4_t){\
+    (t)[(guint8)((c)[0] >> (s))], (t)[(guint8)((c)[1] >> (s))],\
+    (t)[(guint8)((c)[2] >> (s))], (t)[(guint8)((c)[3] >> (s))] })
+#define mb_load(p) ((tiger_v4_t){\
+    tiger_mb_load64(p), tiger_mb_load64((p)+tth_base_block),\
+    tiger_mb_load64((p)+2*tth_base_block), tiger_mb_load64((p)+3*tth_base_block) })
+  mb_leaves(tiger_v4_t, 4, msg, res);
+#undef mb_sbox
+#undef mb_load
+}
+
+#endif
+
+
+// Number of leaves hashed by tiger_leaves(), 0 to use tiger_update() for each
+// leaf instead.
+static int tiger_leaves_num = 0;
+static void (*tiger_leaves)(const char *, guint64 *) = NULL;
+
+
+#ifdef TIGER_MB
+
+// Returns the time it takes (in microseconds) to hash buf[len] with the
+// current tiger_leaves implementation.
+static gint64 tth_init_time(const char *buf, int len) {
+  gint64 best = G_MAXINT64;
+  char res[24];
+  int i;
+  for(i=0; i<3; i++) {
+    tth_ctx_t t;
+    gint64 start = g_get_monotonic_time();
+    tth_init(&t);
+    tth_update(&t, buf, len);
+    tth_final(&t, res);
+    best = MIN(best, g_get_monotonic_time() - start);
+  }
+  return best;
+}
+
+#endif
+
+
+// Selects the multi-buffer implementation to use. Must be called before
+// starting any threads that may call tth_update().
+void tth_init_global() {
+#ifdef TIGER_MB
+  static const struct {
+    const char *name;
+    int num;
+    void (*fn)(const char *, guint64 *);
+  } impl[] = {
+    { "scalar",  0, NULL },
+    { "generic", 4, tiger_leaves_generic },
+#ifdef TIGER_MB_X86
+    { "avx2",    4, tiger_leaves_avx2 },
+    { "avx512",  8, tiger_leaves_avx512 },
+#endif
+  };
+#ifdef TIGER_MB_X86
+  __builtin_cpu_init();
+#endif
+
+  int len = 256*1024;
+  char *buf = g_malloc0(len);
+  int i, best = 0;
+  gint64 besttime = G_MAXINT64;
+  for(i=0; i<G_N_ELEMENTS(impl); i++) {
+#ifdef TIGER_MB_X86
+    if(strcmp(impl[i].name, "avx2") == 0 && !__builtin_cpu_supports("avx2"))
+      continue;
+    if(strcmp(impl[i].name, "avx512") == 0 && !__builtin_cpu_supports("avx512f"))
+      continue;
+#endif
+    tiger_leaves_num = impl[i].num;
+    tiger_leaves = impl[i].fn;
+    gint64 t = tth_init_time(buf, len);
+    g_debug("tth: %s implementation: %.1f MiB/s", impl[i].name, (double)len/MAX(1, t)*1e6/(1024*1024));
+    if(t < besttime) {
+      besttime = t;
+      best = i;
+    }
+  }
+  g_free(buf);
+
+  tiger_leaves_num = impl[best].num;
+  tiger_leaves = impl[best].fn;
+  g_debug("tth: Using the %s implementation.", impl[best].name);
+#endif
+}
+
+
 void tth_init(tth_ctx_t *ctx) {
   tth_new_leaf(ctx);
   ctx->leafnum = ctx->gotfirst = 0;
@@ -339,6 +564,18 @@ void tth_update(tth_ctx_t *ctx, const char *msg, size_t len) {
   if(len > 0)
     ctx->gotfirst = 1;
   while(len > 0) {
+    // Use the multi-buffer implementation if we're at a leaf boundary and
+    // have enough data to fill all lanes.
+    if(tiger_leaves_num && ctx->tiger.length == 1 && len >= tiger_leaves_num*tth_base_block) {
+      guint64 leaves[8*3];
+      int i;
+      tiger_leaves(msg, leaves);
+      for(i=0; i<tiger_leaves_num; i++)
+        tth_update_leaf(ctx, (char *)(leaves+i*3));
+      len -= tiger_leaves_num*tth_base_block;
+      msg += tiger_leaves_num*tth_base_block;
+      continue;
+    }
     left = MIN(tth_base_block - (ctx->tiger.length-1), len);
     tiger_update(&ctx->tiger, msg, left);
     len -= left;
@@ -41,6 +41,7 @@ struct ui_listing_t {
   gboolean selisbegin;
   gboolean (*skip)(ui_listing_t *, GSequenceIter *, void *);
   void *dat;
+  GSequenceIter *begin; // cache for ui_listing_getbegin(), see below
 
   // fields needed for searching
   ui_textinput_t *search_box;
@@ -57,16 +58,26 @@ struct ui_listing_t {
 #define REGEX_ERROR    -2
 
 
-// TODO: This can be relatively slow (linear search), is used often but rarely
-// changes. Cache this in the struct if it becomes a problem.
+// With a skip function this is a linear search, and ui_listing_prev() needs it
+// for every step. The result is cached in ul->begin, but the list and the
+// result of skip() may change at any time between calls into the widget, so
+// every public function starts with ui_listing_reset().
 static GSequenceIter *ui_listing_getbegin(ui_listing_t *ul) {
-  GSequenceIter *i = g_sequence_get_begin_iter(ul->list);
-  while(!g_sequence_iter_is_end(i) && ul->skip && ul->skip(ul, i, ul->dat))
-    i = g_sequence_iter_next(i);
-  return i;
+  if(!ul->skip)
+    return g_sequence_get_begin_iter(ul->list);
+  if(!ul->begin) {
+    GSequenceIter *i = g_sequence_get_begin_iter(ul->list);
+    while(!g_sequence_iter_is_end(i) && ul->skip(ul, i, ul->dat))
+      i = g_sequence_iter_next(i);
+    ul->begin = i;
+  }
+  return ul->begin;
 }
 
 
+#define ui_listing_reset(ul) ((ul)->begin = NULL)
+
+
 static GSequenceIter *ui_listing_next(ui_listing_t *ul, GSequenceIter *i) {
   do
     i = g_sequence_iter_next(i);
@@ -88,6 +99,7 @@ static GSequenceIter *ui_listing_prev(ui_listing_t *ul, GSequenceIter *i) {
 
 // update top/sel in case they used to be the start of the list but aren't anymore
 void ui_listing_inserted(ui_listing_t *ul) {
+  ui_listing_reset(ul);
   GSequenceIter *begin = ui_listing_getbegin(ul);
   if(!!ul->topisbegin != !!(ul->top == begin))
     ul->top = ui_listing_getbegin(ul);
@@ -99,6 +111,7 @@ void ui_listing_inserted(ui_listing_t *ul) {
 // called after the order of the list has changed
 // update sel in case it used to be the start of the list but isn't anymore
 void ui_listing_sorted(ui_listing_t *ul) {
+  ui_listing_reset(ul);
   if(!!ul->selisbegin != !!(ul->sel == ui_listing_getbegin(ul)))
     ul->sel = ui_listing_getbegin(ul);
 }
@@ -114,6 +127,7 @@ static void ui_listing_updateisbegin(ui_listing_t *ul) {
 // update top/sel in case one of them is removed.
 // call this before using g_sequence_remove()
 void ui_listing_remove(ui_listing_t *ul, GSequenceIter *iter) {
+  ui_listing_reset(ul);
   if(ul->top == iter)
     ul->top = ui_listing_prev(ul, iter);
   if(ul->top == iter)
@@ -132,6 +146,7 @@ void ui_listing_remove(ui_listing_t *ul, GSequenceIter *iter) {
 // called when the skip() function changes behaviour (i.e. some items that were
 // skipped aren't now or the other way around).
 void ui_listing_skipchanged(ui_listing_t *ul) {
+  ui_listing_reset(ul);
   // sel got hidden? oops!
   if(!g_sequence_iter_is_end(ul->sel) && ul->skip(ul, ul->sel, ul->dat)) {
     ul->sel = ui_listing_next(ul, ul->sel);
@@ -228,6 +243,7 @@ static void ui_listing_search(ui_listing_t *ul, guint64 key) {
 
 
 gboolean ui_listing_key(ui_listing_t *ul, guint64 key, int page) {
+  ui_listing_reset(ul);
   if(ul->search_box) {
     ui_listing_search(ul, key);
     return TRUE;
@@ -255,8 +271,11 @@ gboolean ui_listing_key(ui_listing_t *ul, guint64 key, int page) {
     break;
   case INPT_KEY(KEY_NPAGE): { // page down
     int i = page;
-    while(i-- && !g_sequence_iter_is_end(ul->sel))
-      ul->sel = ui_listing_next(ul, ul->sel);
+    if(!ul->skip)
+      ul->sel = g_sequence_iter_move(ul->sel, page);
+    else
+      while(i-- && !g_sequence_iter_is_end(ul->sel))
+        ul->sel = ui_listing_next(ul, ul->sel);
     if(g_sequence_iter_is_end(ul->sel))
       ul->sel = ui_listing_prev(ul, ul->sel);
     break;
@@ -264,8 +283,11 @@ gboolean ui_listing_key(ui_listing_t *ul, guint64 key, int page) {
   case INPT_KEY(KEY_PPAGE): { // page up
     int i = page;
     GSequenceIter *begin = ui_listing_getbegin(ul);
-    while(i-- && ul->sel != begin)
-      ul->sel = ui_listing_prev(ul, ul->sel);
+    if(!ul->skip)
+      ul->sel = g_sequence_iter_move(ul->sel, -page);
+    else
+      while(i-- && ul->sel != begin)
+        ul->sel = ui_listing_prev(ul, ul->sel);
     break;
   }
   case INPT_KEY(KEY_DOWN): // item down
@@ -294,6 +316,20 @@ gboolean ui_listing_key(ui_listing_t *ul, guint64 key, int page) {
 
 
 static void ui_listing_fixtop(ui_listing_t *ul, int height) {
+  // Without hidden items, the same can be done with the positions in the
+  // GSequence, which are O(log n) to look up.
+  if(!ul->skip) {
+    int len = g_sequence_get_length(ul->list);
+    int sel = g_sequence_iter_get_position(ul->sel);
+    int top = MIN(g_sequence_iter_get_position(ul->top), sel);
+    if(sel - top >= height)
+      top = sel - height + 1;
+    if(len - top < height)
+      top = MAX(0, len - height);
+    ul->top = g_sequence_get_iter_at_pos(ul->list, top);
+    return;
+  }
+
   // sel before top? top = sel!
   if(g_sequence_iter_compare(ul->top, ul->sel) > 0)
     ul->top = ul->sel;
@@ -328,10 +364,8 @@ static void ui_listing_fixtop(ui_listing_t *ul, int height) {
 // Every item is assumed to occupy exactly one line.
 // Returns the relative position of the current page (in percent).
 // The selected row number is written to *cur, to be used with move(cur, 0).
-// TODO: The return value is only correct if no skip function is used or if
-// there are otherwise no hidden rows. It'll give a blatantly wrong number if
-// there are.
 int ui_listing_draw(ui_listing_t *ul, int top, int bottom, ui_cursor_t *cur, void (*cb)(ui_listing_t *, GSequenceIter *, int, void *)) {
+  ui_listing_reset(ul);
   int search_box_height = !!ul->search_box;
   int listing_height = 1 + bottom - top - search_box_height;
   ui_listing_fixtop(ul, listing_height);
@@ -368,8 +402,20 @@ int ui_listing_draw(ui_listing_t *ul, int top, int bottom, ui_cursor_t *cur, voi
 
   ui_listing_updateisbegin(ul);
 
-  int last = g_sequence_iter_get_position(g_sequence_get_end_iter(ul->list));
-  return MIN(100, last ? (g_sequence_iter_get_position(ul->top)+listing_height)*100/last : 0);
+  // Hidden items don't count for the position. Lists with a skip function
+  // are small enough to count them on every draw.
+  int last = 0, toppos = 0;
+  if(!ul->skip) {
+    last = g_sequence_get_length(ul->list);
+    toppos = g_sequence_iter_get_position(ul->top);
+  } else {
+    for(n=ui_listing_getbegin(ul); !g_sequence_iter_is_end(n); n=ui_listing_next(ul, n)) {
+      if(n == ul->top)
+        toppos = last;
+      last++;
+    }
+  }
+  return MIN(100, last ? (toppos+listing_height)*100/last : 0);
 }
 
 
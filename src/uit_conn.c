@@ -175,7 +175,9 @@ static void t_draw_details(tab_t *t, int l) {
   mvaddstr(l+5, 42, "ETA:");
   mvaddstr(l+6, 41, "Idle:");
   mvaddstr(l+7,  7, "File:");
-  mvaddstr(l+8,  1, "Last error:");
+  mvaddstr(l+8,  4, "Buffer:");
+  mvaddstr(l+8, 38, "Sockbuf:");
+  mvaddstr(l+9,  1, "Last error:");
   attroff(A_BOLD);
 
   // line 1
@@ -212,10 +214,18 @@ static void t_draw_details(tab_t *t, int l) {
   else
     mvaddstr(l+7, 13, "None.");
   // line 8
+  if(net_is_connected(cc->net) && net_sockbuf(cc->net)) {
+    mvaddstr(l+8, 13, net_bufsize(cc->net) ? str_formatsize(net_bufsize(cc->net)) : "sendfile");
+    mvaddstr(l+8, 47, str_formatsize(net_sockbuf(cc->net)));
+  } else {
+    mvaddstr(l+8, 13, "-");
+    mvaddstr(l+8, 47, "-");
+  }
+  // line 9
   if(cc->err)
-    mvaddnstr(l+8, 13, cc->err->message, str_offset_from_columns(cc->err->message, wincols-13));
+    mvaddnstr(l+9, 13, cc->err->message, str_offset_from_columns(cc->err->message, wincols-13));
   else
-    mvaddstr(l+8, 13, "-");
+    mvaddstr(l+9, 13, "-");
 }
 
 
@@ -237,7 +247,7 @@ static void t_draw(ui_tab_t *tab) {
   mvaddstr(1, 58, "File");
   attroff(UIC(list_header));
 
-  int bottom = t->details ? winrows-11 : winrows-3;
+  int bottom = t->details ? winrows-12 : winrows-3;
   ui_cursor_t cursor;
   ui_listing_draw(t->list, 2, bottom-1, &cursor, t_draw_row);
 
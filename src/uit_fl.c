@@ -83,6 +83,7 @@ static void setdir(tab_t *t, fl_list_t *fl, fl_list_t *sel) {
 
   // Open this one and select *sel, if set
   t->fl = fl;
+  fl_list_expand(fl);
   GSequence *seq = g_sequence_new(NULL);
   GSequenceIter *seli = NULL;
   int i;
@@ -212,7 +213,7 @@ void uit_fl_queue(guint64 uid, gboolean force, const char *sel, ui_tab_t *parent
       if(match)
         matchqueue((tab_t *)tab, NULL);
     } else if(match)
-      fl_load_async(fn, loadmatch, g_memdup(&uid, 8));
+      fl_load_async(fn, FALSE, loadmatch, g_memdup(&uid, 8));
   } else {
     g_return_if_fail(u); // the caller should have checked this
     dl_queue_addlist(u, sel, parent, open, match);
@@ -276,7 +277,7 @@ ui_tab_t *uit_fl_create(guint64 uid, const char *sel) {
     struct stat st;
     if(stat(fn, &st) >= 0)
       t->age = st.st_mtime;
-    fl_load_async(fn, loaddone, t);
+    fl_load_async(fn, FALSE, loaddone, t);
     g_free(tmp);
     g_free(fn);
     ui_tab_incprio((ui_tab_t *)t, UIP_LOW);
@@ -391,6 +392,7 @@ static void t_draw(ui_tab_t *tab) {
     }
   }
   if(sel && !sel->isfile) {
+    fl_list_expand(sel);
     int num = sel->sub ? sel->sub->len : 0;
     if(!num)
       mvaddstr(winrows-3, 0, " Selected directory is empty.");
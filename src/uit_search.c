@@ -40,6 +40,9 @@ typedef struct tab_t {
   int order;
   gboolean reverse : 1;
   gboolean hide_hub : 1;
+  // Results that haven't been added to the list yet. Results can arrive by
+  // the thousands, these are merged into the list in one go before drawing.
+  GPtrArray *pending; // owned by the tab until flush() moves them to the list
 } tab_t;
 
 
@@ -62,17 +65,24 @@ static int cmp_user(guint64 ua, guint64 ub) {
   hub_user_t *b = g_hash_table_lookup(hub_uids, &ub);
   int o =
     !a && !b ? (ua > ub ? 1 : ua < ub ? -1 : 0) :
-     a && !b ? 1 : !a && b ? -1 : g_utf8_collate(a->name, b->name);
+     a && !b ? 1 : !a && b ? -1 : strcmp(hub_user_name_key(a), hub_user_name_key(b));
   if(!o && a && b)
     return g_utf8_collate(a->hub->tab->name, b->hub->tab->name);
   return o;
 }
 
 
-static int cmp_file(const char *fa, const char *fb) {
-  const char *a = strrchr(fa, '/');
-  const char *b = strrchr(fb, '/');
-  return g_utf8_collate(a?a+1:fa, b?b+1:fb);
+static const char *file_key(search_r_t *r) {
+  if(!r->file_key) {
+    const char *f = strrchr(r->file, '/');
+    r->file_key = g_utf8_collate_key(f?f+1:r->file, -1);
+  }
+  return r->file_key;
+}
+
+
+static int cmp_file(search_r_t *a, search_r_t *b) {
+  return strcmp(file_key(a), file_key(b));
 }
 
 
@@ -91,7 +101,7 @@ static gint sort_func(gconstpointer da, gconstpointer db, gpointer dat) {
 #define CMP_USER  cmp_user(a->uid, b->uid)
 #define CMP_SIZE  (a->size == b->size ? 0 : (a->size == G_MAXUINT64 ? 0 : a->size) > (b->size == G_MAXUINT64 ? 0 : b->size) ? 1 : -1)
 #define CMP_SLOTS (a->slots > b->slots ? 1 : a->slots < b->slots ? -1 : 0)
-#define CMP_FILE  cmp_file(a->file, b->file)
+#define CMP_FILE  cmp_file((search_r_t *)a, (search_r_t *)b)
 #define CMP_TTH   memcmp(a->tth, b->tth, 24)
 
   // Try 1
@@ -113,11 +123,42 @@ static gint sort_func(gconstpointer da, gconstpointer db, gpointer dat) {
 }
 
 
+static gint sort_ptr_func(gconstpointer a, gconstpointer b, gpointer dat) {
+  return sort_func(*(search_r_t **)a, *(search_r_t **)b, dat);
+}
+
+
+// Adds the pending results to the list. A small batch is inserted one by one,
+// otherwise the batch is sorted and merged into the list in a single pass.
+static void flush(tab_t *t) {
+  if(!t->pending->len)
+    return;
+  GSequence *l = t->list->list;
+  int len = g_sequence_get_length(l);
+  guint i;
+
+  if(t->pending->len*g_bit_storage(len) < (guint)len) {
+    for(i=0; i<t->pending->len; i++)
+      g_sequence_insert_sorted(l, g_ptr_array_index(t->pending, i), sort_func, t);
+  } else {
+    g_ptr_array_sort_with_data(t->pending, sort_ptr_func, t);
+    GSequenceIter *iter = g_sequence_get_begin_iter(l);
+    for(i=0; i<t->pending->len; i++) {
+      search_r_t *r = g_ptr_array_index(t->pending, i);
+      while(!g_sequence_iter_is_end(iter) && sort_func(g_sequence_get(iter), r, t) <= 0)
+        iter = g_sequence_iter_next(iter);
+      g_sequence_insert_before(iter, r);
+    }
+  }
+  g_ptr_array_set_size(t->pending, 0);
+  ui_listing_inserted(t->list);
+}
+
+
 // Callback from search.c when we have a new result.
 static void result(search_r_t *r, void *dat) {
   tab_t *t = dat;
-  g_sequence_insert_sorted(t->list->list, search_r_copy(r), sort_func, t);
-  ui_listing_inserted(t->list);
+  g_ptr_array_add(t->pending, search_r_copy(r));
   ui_tab_incprio((ui_tab_t *)t, UIP_LOW);
 }
 
@@ -164,6 +205,7 @@ ui_tab_t *uit_search_create(hub_t *hub, search_q_t *q, GError **err) {
     t->tab.name[strlen(t->tab.name)-1] = 0;
 
   t->list = ui_listing_create(g_sequence_new(search_r_free), NULL, t, search_r_get_file);
+  t->pending = g_ptr_array_new();
   return (ui_tab_t *)t;
 }
 
@@ -171,6 +213,8 @@ ui_tab_t *uit_search_create(hub_t *hub, search_q_t *q, GError **err) {
 static void t_close(ui_tab_t *tab) {
   tab_t *t = (tab_t *)tab;
   search_remove(t->q);
+  g_ptr_array_foreach(t->pending, (GFunc)search_r_free, NULL);
+  g_ptr_array_unref(t->pending);
   g_sequence_free(t->list->list);
   ui_listing_free(t->list);
   ui_tab_remove(tab);
@@ -236,6 +280,7 @@ static void draw_row(ui_listing_t *list, GSequenceIter *iter, int row, void *dat
 static void t_draw(ui_tab_t *tab) {
   tab_t *t = (tab_t *)tab;
 
+  flush(t);
   attron(UIC(list_header));
   mvhline(1, 0, ' ', wincols);
   mvaddstr(1,    2, "User");
@@ -279,6 +324,7 @@ static void t_draw(ui_tab_t *tab) {
 static void t_key(ui_tab_t *tab, guint64 key) {
   tab_t *t = (tab_t *)tab;
 
+  flush(t);
   if(ui_listing_key(t->list, key, (winrows-4)/2))
     return;
 
@@ -44,8 +44,15 @@ typedef struct tab_t {
   gboolean hide_conn : 1;
   gboolean hide_ip : 1;
   int cw_user, cw_country, cw_share, cw_conn, cw_desc, cw_mail, cw_tag, cw_ip;
+  // Users that have joined or changed but haven't been (re)sorted into the
+  // list yet. A hub sends its entire user list when we join and big hubs
+  // keep sending info updates, so these are applied in batches by flush().
+  GHashTable *pending; // hub_user_t -> PEND_*
 } tab_t;
 
+#define PEND_JOIN 1 // not in the list yet
+#define PEND_NFO  2
+
 
 
 // Columns to sort on
@@ -74,11 +81,11 @@ static gint sort_func(gconstpointer da, gconstpointer db, gpointer dat) {
     p == SORT_DESC   ? g_utf8_collate(a->desc?a->desc:"", b->desc?b->desc:"") :
     p == SORT_MAIL   ? g_utf8_collate(a->mail?a->mail:"", b->mail?b->mail:"") :
     p == SORT_CLIENT ? strcmp(a->client?a->client:"", b->client?b->client:"")
-                     : (ip4_cmp(a->ip4, b->ip4) != 0 ? ip4_cmp(a->ip4, b->ip4) : ip6_cmp(a->ip6, b->ip6));
+                     : (ip4_cmp(a->ip4, b->ip4) != 0 ? ip4_cmp(a->ip4, b->ip4) : ip6_cmp(hub_user_ip6(a), hub_user_ip6(b)));
 
   // Username sort
   if(!o)
-    o = g_utf8_collate(a->name, b->name);
+    o = strcmp(hub_user_name_key((hub_user_t *)a), hub_user_name_key((hub_user_t *)b));
   if(!o && a->name_hub && b->name_hub)
     o = strcmp(a->name_hub, b->name_hub);
   if(!o)
@@ -87,12 +94,83 @@ static gint sort_func(gconstpointer da, gconstpointer db, gpointer dat) {
 }
 
 
+static gint sort_ptr_func(gconstpointer a, gconstpointer b, gpointer dat) {
+  return sort_func(*(hub_user_t **)a, *(hub_user_t **)b, dat);
+}
+
+
 static const char *get_name(GSequenceIter *iter) {
   hub_user_t *u = g_sequence_get(iter);
   return u->name;
 }
 
 
+// Sorts the users and replaces the list with them, in a single pass. The
+// selected user, if any, remains selected.
+static void build(tab_t *t, GPtrArray *users) {
+  hub_user_t *sel = t->list && !g_sequence_iter_is_end(t->list->sel) ? g_sequence_get(t->list->sel) : NULL;
+
+  g_ptr_array_sort_with_data(users, sort_ptr_func, t);
+  GSequence *seq = g_sequence_new(NULL);
+  guint i;
+  for(i=0; i<users->len; i++) {
+    hub_user_t *u = g_ptr_array_index(users, i);
+    u->iter = g_sequence_append(seq, u);
+  }
+
+  if(!t->list) {
+    t->list = ui_listing_create(seq, NULL, t, get_name);
+    return;
+  }
+  g_sequence_free(t->list->list);
+  t->list->list = seq;
+  t->list->top = t->list->sel = g_sequence_get_begin_iter(seq);
+  t->list->topisbegin = t->list->selisbegin = TRUE;
+  if(sel) {
+    t->list->sel = sel->iter;
+    t->list->selisbegin = sel->iter == t->list->top;
+  }
+}
+
+
+// Applies the pending changes. Small batches are (re)inserted one by one, but
+// when a large part of the list has changed (e.g. while joining a hub), it's
+// faster to sort everything again.
+static void flush(tab_t *t) {
+  int num = g_hash_table_size(t->pending);
+  if(!num)
+    return;
+
+  GHashTableIter iter;
+  hub_user_t *u;
+  gpointer v;
+  g_hash_table_iter_init(&iter, t->pending);
+
+  int len = g_sequence_get_length(t->list->list);
+  if(num >= len/4) {
+    GPtrArray *users = g_ptr_array_sized_new(len + num);
+    GSequenceIter *i = g_sequence_get_begin_iter(t->list->list);
+    for(; !g_sequence_iter_is_end(i); i=g_sequence_iter_next(i))
+      g_ptr_array_add(users, g_sequence_get(i));
+    while(g_hash_table_iter_next(&iter, (gpointer *)&u, &v))
+      if(GPOINTER_TO_INT(v) == PEND_JOIN)
+        g_ptr_array_add(users, u);
+    build(t, users);
+    g_ptr_array_unref(users);
+  } else {
+    while(g_hash_table_iter_next(&iter, (gpointer *)&u, &v)) {
+      if(GPOINTER_TO_INT(v) == PEND_JOIN)
+        u->iter = g_sequence_insert_sorted(t->list->list, u, sort_func, t);
+      else
+        g_sequence_sort_changed(u->iter, sort_func, t);
+    }
+    ui_listing_inserted(t->list);
+    ui_listing_sorted(t->list);
+  }
+  g_hash_table_remove_all(t->pending);
+}
+
+
 
 ui_tab_t *uit_userlist_create(hub_t *hub) {
   tab_t *t = g_new0(tab_t, 1);
@@ -104,18 +182,17 @@ ui_tab_t *uit_userlist_create(hub_t *hub) {
   t->hide_mail = TRUE;
   t->hide_ip = TRUE;
 
-  GSequence *users = g_sequence_new(NULL);
+  t->pending = g_hash_table_new(g_direct_hash, g_direct_equal);
+
   // populate the list
-  // g_sequence_sort() uses insertion sort? in that case it is faster to insert
-  // all items using g_sequence_insert_sorted() rather than inserting them in
-  // no particular order and then sorting them in one go. (which is faster for
-  // linked lists, since it uses a faster sorting algorithm)
+  GPtrArray *users = g_ptr_array_sized_new(g_hash_table_size(hub->users));
   GHashTableIter iter;
   g_hash_table_iter_init(&iter, hub->users);
   hub_user_t *u;
   while(g_hash_table_iter_next(&iter, NULL, (gpointer *)&u))
-    u->iter = g_sequence_insert_sorted(users, u, sort_func, t);
-  t->list = ui_listing_create(users, NULL, t, get_name);
+    g_ptr_array_add(users, u);
+  build(t, users);
+  g_ptr_array_unref(users);
 
   return (ui_tab_t *)t;
 }
@@ -130,6 +207,7 @@ static void t_close(ui_tab_t *tab) {
   // get reset in a subsequent ui_userlist_create().
   g_sequence_free(t->list->list);
   ui_listing_free(t->list);
+  g_hash_table_unref(t->pending);
   g_free(t->tab.name);
   g_free(t);
 }
@@ -169,7 +247,7 @@ static void draw_row(ui_listing_t *list, GSequenceIter *iter, int row, void *dat
   int j = 6;
   const char *cc =
     !ip4_isany(user->ip4) ? geoip_country(ip4_sockaddr(user->ip4, 0)) :
-    !ip6_isany(user->ip6) ? geoip_country(ip6_sockaddr(user->ip6, 0)) : NULL;
+    user->ip6 ? geoip_country(ip6_sockaddr(*user->ip6, 0)) : NULL;
   DRAW_COL(row, j, t->cw_country, cc?cc:"");
   if(t->cw_user > 1)
     ui_listing_draw_match(list, iter, row, j, str_offset_from_columns(user->name, t->cw_user-1));
@@ -251,6 +329,7 @@ static void calc_widths(tab_t *t) {
 static void t_draw(ui_tab_t *tab) {
   tab_t *t = (tab_t *)tab;
 
+  flush(t);
   calc_widths(t);
 
   // header
@@ -322,6 +401,7 @@ static void t_draw(ui_tab_t *tab) {
 static void t_key(ui_tab_t *tab, guint64 key) {
   tab_t *t = (tab_t *)tab;
 
+  flush(t);
   if(ui_listing_key(t->list, key, winrows/2))
     return;
 
@@ -437,6 +517,7 @@ static void t_key(ui_tab_t *tab, guint64 key) {
 void uit_userlist_disconnect(ui_tab_t *tab) {
   tab_t *t = (tab_t *)tab;
 
+  g_hash_table_remove_all(t->pending);
   g_sequence_free(t->list->list);
   ui_listing_free(t->list);
   t->list = ui_listing_create(g_sequence_new(NULL), NULL, t, get_name);
@@ -447,17 +528,19 @@ void uit_userlist_disconnect(ui_tab_t *tab) {
 void uit_userlist_userchange(ui_tab_t *tab, int change, hub_user_t *user) {
   tab_t *t = (tab_t *)tab;
 
-  if(change == UIHUB_UC_JOIN) {
-    user->iter = g_sequence_insert_sorted(t->list->list, user, sort_func, t);
-    ui_listing_inserted(t->list);
-  } else if(change == UIHUB_UC_QUIT) {
+  int pend = GPOINTER_TO_INT(g_hash_table_lookup(t->pending, user));
+
+  if(change == UIHUB_UC_JOIN)
+    g_hash_table_insert(t->pending, user, GINT_TO_POINTER(PEND_JOIN));
+  else if(change == UIHUB_UC_QUIT) {
+    g_hash_table_remove(t->pending, user);
+    if(pend == PEND_JOIN)
+      return;
     g_return_if_fail(g_sequence_get(user->iter) == (gpointer)user);
     ui_listing_remove(t->list, user->iter);
     g_sequence_remove(user->iter);
-  } else {
-    g_sequence_sort_changed(user->iter, sort_func, t);
-    ui_listing_sorted(t->list);
-  }
+  } else if(!pend)
+    g_hash_table_insert(t->pending, user, GINT_TO_POINTER(PEND_NFO));
 }
 
 
@@ -482,6 +565,7 @@ gboolean uit_userlist_open(hub_t *hub, guint64 uid, const char *user, gboolean u
 
   if(u) {
     tab_t *t = (tab_t *)ut;
+    flush(t);
     // u->iter should be valid at this point.
     t->list->sel = u->iter;
     t->details = TRUE;
@@ -332,108 +332,65 @@ path_suggest_f:
 
 
 
-// Reads from fd until EOF and returns the number of lines found. Starts
-// counting after the first '\n' if start is FALSE. Returns -1 on error.
-static int file_count_lines(int fd) {
-  char buf[1024];
-  int n = 0;
-  int r;
-  while((r = read(fd, buf, 1024)) > 0)
-    while(r--)
-      if(buf[r] == '\n')
-        n++;
-  return r == 0 ? MAX(0, n) : r;
-}
-
-
-// Skips 'skip' lines and reads n lines from fd.
-static char **file_read_lines(int fd, int skip, int n) {
-  char buf[1024];
-  // skip 'skip' lines
-  int r = 0;
-  while(skip > 0 && (r = read(fd, buf, 1024)) > 0) {
-    int i;
-    for(i=0; i<r; i++) {
-      if(buf[i] == '\n' && !--skip) {
-        r -= i+1;
-        memmove(buf, buf+i+1, r);
-        break;
-      }
-    }
-  }
-  if(r < 0)
-    return NULL;
-  // now read the rest of the lines
-  char **res = g_new0(char *, n+1);
-  int num = 0;
-  GString *cur = g_string_sized_new(1024);
-  do {
-    char *tmp = buf;
-    int left = r;
-    char *sep;
-    while(num < n && left > 0 && (sep = memchr(tmp, '\n', left)) != NULL) {
-      int w = sep - tmp;
-      g_string_append_len(cur, tmp, w);
-      res[num++] = g_strdup(cur->str);
-      g_string_assign(cur, "");
-      left -= w+1;
-      tmp += w+1;
-    }
-    g_string_append_len(cur, tmp, left);
-  } while(num < n && (r = read(fd, buf, 1024)) > 0);
-  g_string_free(cur, TRUE);
-  if(r < 0) {
-    g_strfreev(res);
-    return NULL;
-  }
-  return res;
-}
-
-
-// Read the last n lines from a file and return them in a string array. The
-// file must end with a newline, and only \n is recognized as one.  Returns
-// NULL on error, with errno set. Can return an empty string array (result &&
-// !*result). This isn't the fastest implementation available, but at least it
-// does not have to read the entire file.
+// Read the last n lines from a file and return them in a string array. Only \n
+// is recognized as a newline, a final line without newline is included as
+// well. Returns NULL on error, with errno set. Can return an empty string array
+// (result && !*result). The file is scanned backwards from the end, so only the
+// requested lines are read regardless of the size of the file.
 char **file_tail(const char *fn, int n) {
   if(n <= 0)
     return g_new0(char *, 1);
-  char **ret = NULL;
 
   int fd = open(fn, O_RDONLY);
   if(fd < 0)
     return NULL;
-  int backbytes = n*128;
-  off_t offset;
-  while((offset = lseek(fd, -backbytes, SEEK_END)) != (off_t)-1) {
-    int lines = file_count_lines(fd);
-    if(lines < 0)
-      goto done;
-    // not enough lines, try seeking back further
-    if(offset > 0 && lines < n)
-      backbytes *= 2;
-    // otherwise, if we have enough lines seek again and fetch them
-    else if(lseek(fd, offset, SEEK_SET) == (off_t)-1)
-      goto done;
-    else {
-      ret = file_read_lines(fd, MAX(0, lines-n), MIN(lines+1, n));
-      goto done;
-    }
+  struct stat st;
+  if(fstat(fd, &st) < 0) {
+    close(fd);
+    return NULL;
   }
 
-  // offset is -1 if we reach this. we may have been seeking to a negative
-  // offset, so let's try from the beginning.
-  if(errno == EINVAL) {
-    if(lseek(fd, 0, SEEK_SET) == (off_t)-1)
-      goto done;
-    int lines = file_count_lines(fd);
-    if(lines < 0 || lseek(fd, 0, SEEK_SET) == (off_t)-1)
-      goto done;
-    ret = file_read_lines(fd, MAX(0, lines-n), MIN(lines+1, n));
+  // Find the start of the n'th line from the end
+  char buf[4096];
+  off_t end = st.st_size, pos = end, start = 0;
+  int lines = 0;
+  gboolean found = FALSE;
+  while(pos > 0 && !found) {
+    int len = MIN(pos, (off_t)sizeof(buf));
+    pos -= len;
+    if(pread(fd, buf, len, pos) != len) {
+      close(fd);
+      return NULL;
+    }
+    int i;
+    for(i=len-1; i>=0 && !found; i--)
+      // The newline at the end of the file only terminates the last line
+      if(buf[i] == '\n' && pos+i != end-1 && ++lines == n) {
+        start = pos+i+1;
+        found = TRUE;
+      }
   }
 
-done:
+  // Read and split those lines
+  int len = end-start;
+  char *dat = g_malloc(len+1);
+  int rd = 0, r = 1;
+  while(rd < len && (r = pread(fd, dat+rd, len-rd, start+rd)) > 0)
+    rd += r;
   close(fd);
+  if(rd < len) {
+    g_free(dat);
+    return NULL;
+  }
+  dat[len] = 0;
+
+  char **ret = g_strsplit(dat, "\n", -1);
+  g_free(dat);
+  len = g_strv_length(ret);
+  if(len && !*ret[len-1]) {
+    g_free(ret[len-1]);
+    ret[len-1] = NULL;
+  }
   return ret;
 }
 
@@ -512,6 +469,63 @@ err:
 
 
 
+// Reference counted string interning pool, for the many duplicated strings
+// (client versions, connection types, descriptions, etc) of users on
+// different hubs. Interned strings must not be modified and must be released
+// with strpool_unref(). Not thread-safe, only used from the main thread.
+
+typedef struct {
+  guint ref;
+  char str[];
+} strpool_t;
+
+static GHashTable *strpool = NULL;
+
+
+char *strpool_ref(const char *str) {
+  if(!str)
+    return NULL;
+  if(!strpool)
+    strpool = g_hash_table_new(g_str_hash, g_str_equal);
+  strpool_t *e = g_hash_table_lookup(strpool, str);
+  if(!e) {
+    size_t len = strlen(str);
+    e = g_malloc(offsetof(strpool_t, str) + len + 1);
+    e->ref = 0;
+    memcpy(e->str, str, len+1);
+    g_hash_table_insert(strpool, e->str, e);
+  }
+  e->ref++;
+  return e->str;
+}
+
+
+void strpool_unref(char *str) {
+  if(!str)
+    return;
+  strpool_t *e = (strpool_t *)(str - offsetof(strpool_t, str));
+  if(--e->ref)
+    return;
+  g_hash_table_remove(strpool, e->str);
+  g_free(e);
+}
+
+
+// Replaces *dest with an interned copy of str, or with NULL if str is empty.
+// Does nothing when the value hasn't changed, which is the common case for
+// repeated user info updates.
+void strpool_set(char **dest, const char *str) {
+  if(str && !*str)
+    str = NULL;
+  if(*dest == str || (*dest && str && strcmp(*dest, str) == 0))
+    return;
+  char *old = *dest;
+  *dest = strpool_ref(str);
+  strpool_unref(old);
+}
+
+
+
 // Bit array utility functions. These functions work on an array of guint8,
 // where each bit can be accessed with its own index.
 // This does not use, because those may require byte swapping to store in a
@@ -739,13 +753,18 @@ char *darray_get_dat(char *v, int *l) {
  *   ratecalc_register(&thing, class);
  * From any thread (usually some worker thread):
  *   ratecalc_add(&thing, bytes);
- * From any other thread (usually main thread):
  *   rate = ratecalc_rate(&thing);
  * From main thread:
+ *   total = ratecalc_total(&thing);
  *   ratecalc_reset(&thing);
  *   ratecalc_unregister(&thing);
  *
  * ratecalc_calc() should be called with a one-second interval
+ *
+ * No locks are used, transfer threads only do an atomic add on the counters,
+ * and ratecalc_calc() hands out new burst by atomically adding to it. Any
+ * bytes transferred while ratecalc_calc() is running are simply accounted for
+ * in the next round.
  */
 
 #if INTERFACE
@@ -758,22 +777,23 @@ char *darray_get_dat(char *v, int *l) {
 #define RCC_MAX  RCC_DOWN
 
 struct ratecalc_t {
-  GMutex lock; // protects total, last, rate and burst
-  gint64 total;
-  gint64 last;
-  int burst;
-  int rate;
+  // Accessed atomically
+  gint pending; // bytes added since the last ratecalc_calc()
+  gint burst;
+  gint rate;
+  // Only accessed from the main thread
+  gint64 total; // excluding pending
   int reg; // 0 = not registered, >1 = registered with class #n
 };
 
 #define ratecalc_reset(rc) do {\
-    g_mutex_lock(&((rc)->lock));\
-    (rc)->total = (rc)->last = (rc)->rate = (rc)->burst = 0;\
-    g_mutex_unlock(&((rc)->lock));\
+    g_atomic_int_set(&(rc)->pending, 0);\
+    g_atomic_int_set(&(rc)->burst, 0);\
+    g_atomic_int_set(&(rc)->rate, 0);\
+    (rc)->total = 0;\
   } while(0)
 
 #define ratecalc_init(rc) do {\
-    g_mutex_init(&((rc)->lock));\
     ratecalc_unregister(rc);\
     ratecalc_reset(rc);\
   } while(0)
@@ -788,7 +808,10 @@ struct ratecalc_t {
 // TODO: give rc->burst back to the class? (in particular the negative ones)
 #define ratecalc_unregister(rc) do {\
     ratecalc_list = g_slist_remove(ratecalc_list, rc);\
-    (rc)->reg = (rc)->rate = (rc)->burst = 0;\
+    (rc)->total += ratecalc_take_pending(rc);\
+    (rc)->reg = 0;\
+    g_atomic_int_set(&(rc)->rate, 0);\
+    g_atomic_int_set(&(rc)->burst, 0);\
   } while(0)
 
 #endif
@@ -797,33 +820,31 @@ GSList *ratecalc_list = NULL;
 
 
 void ratecalc_add(ratecalc_t *rc, int b) {
-  g_mutex_lock(&rc->lock);
-  rc->total += b;
-  rc->burst -= b;
-  g_mutex_unlock(&rc->lock);
+  g_atomic_int_add(&rc->pending, b);
+  g_atomic_int_add(&rc->burst, -b);
 }
 
 
 int ratecalc_rate(ratecalc_t *rc) {
-  g_mutex_lock(&rc->lock);
-  int r = rc->rate;
-  g_mutex_unlock(&rc->lock);
-  return r;
+  return g_atomic_int_get(&rc->rate);
 }
 
 
 int ratecalc_burst(ratecalc_t *rc) {
-  g_mutex_lock(&rc->lock);
-  int r = rc->burst;
-  g_mutex_unlock(&rc->lock);
-  return r;
+  return g_atomic_int_get(&rc->burst);
 }
 
 
 gint64 ratecalc_total(ratecalc_t *rc) {
-  g_mutex_lock(&rc->lock);
-  gint64 r = rc->total;
-  g_mutex_unlock(&rc->lock);
+  return rc->total + g_atomic_int_get(&rc->pending);
+}
+
+
+// Removes and returns the pending byte count. Concurrent ratecalc_add() calls
+// are either included in the result or remain pending.
+int ratecalc_take_pending(ratecalc_t *rc) {
+  int r = g_atomic_int_get(&rc->pending);
+  g_atomic_int_add(&rc->pending, -r);
   return r;
 }
 
@@ -848,20 +869,22 @@ void ratecalc_calc() {
   // Pass one: calculate rc->rate, substract negative burst values from left[] and calculate nums[].
   for(n=ratecalc_list; n; n=n->next) {
     ratecalc_t *rc = n->data;
-    g_mutex_lock(&rc->lock);
-    gint64 diff = rc->total - rc->last;
-    rc->rate = diff + ((rc->rate - diff) / 2);
-    rc->last = rc->total;
-    if(rc->burst < 0) {
-      int sub = MIN(left[rc->reg], -rc->burst);
+    int diff = ratecalc_take_pending(rc);
+    rc->total += diff;
+    g_atomic_int_set(&rc->rate, diff + ((g_atomic_int_get(&rc->rate) - diff) / 2));
+    // Burst is only ever modified by adding a difference, so that anything
+    // consumed by the transfer threads in the mean time isn't lost.
+    int burst = g_atomic_int_get(&rc->burst);
+    if(burst < 0) {
+      int sub = MIN(left[rc->reg], -burst);
       left[rc->reg] -= sub;
-      rc->burst += sub;
+      g_atomic_int_add(&rc->burst, sub);
+      burst += sub;
     }
-    if(rc->burst < maxburst[rc->reg])
+    if(burst < maxburst[rc->reg])
       nums[rc->reg]++;
     else
-      rc->burst = maxburst[rc->reg];
-    g_mutex_unlock(&rc->lock);
+      g_atomic_int_add(&rc->burst, maxburst[rc->reg] - burst);
   }
 
   //g_debug("Num: %d - %d - %d", nums[2], nums[3], nums[4]);
@@ -885,12 +908,10 @@ void ratecalc_calc() {
     for(n=ratecalc_list; n; n=n->next) {
       ratecalc_t *rc = n->data;
       if(bwp[rc->reg] > 0) {
-        g_mutex_lock(&rc->lock);
-        int alloc = MIN(maxburst[rc->reg]-rc->burst, bwp[rc->reg]);
+        int alloc = MIN(maxburst[rc->reg]-g_atomic_int_get(&rc->burst), bwp[rc->reg]);
         //g_debug("Allocing class %d(num=%d), %d new bytes to %d", rc->reg, nums[rc->reg], alloc, rc->burst);
-        rc->burst += alloc;
+        g_atomic_int_add(&rc->burst, alloc);
         left[rc->reg] -= alloc;
-        g_mutex_unlock(&rc->lock);
         if(alloc > 0 && alloc < bwp[rc->reg])
           nums[rc->reg]--;
       }
@@ -913,8 +934,257 @@ char *ratecalc_eta(ratecalc_t *rc, guint64 left) {
 
 
 
+// Performance counters. Each counter keeps the number of recorded values,
+// their sum and maximum, and a histogram with power-of-two buckets. Counters
+// can be updated from any thread. Values are recorded at most a few thousand
+// times per second, so a single lock is cheap enough.
+//
+// Gauges such as the length of the database queue are sampled every second
+// by perf_sample(). Use /perf to view the counters, or set perf_log to write
+// them to logs/perf.log periodically.
+
+#if INTERFACE
+
+#define PERF_BUCKETS 48
+
+#define PERF_NONE  0
+#define PERF_USEC  1
+#define PERF_BYTES 2
+
+// P(name, unit, description)
+#define PERF_COUNTERS \
+  P(main_lag,    PERF_USEC,  "Main loop lag")\
+  P(db_queue,    PERF_NONE,  "Database queue length")\
+  P(db_query,    PERF_USEC,  "Database query time")\
+  P(hash_file,   PERF_USEC,  "Time to hash a file")\
+  P(hash_bytes,  PERF_BYTES, "Size of hashed files")\
+  P(search,      PERF_USEC,  "Incoming search requests")\
+  P(search_rec,  PERF_USEC,  "Time spent in fl_search_rec()")\
+  P(udp_in,      PERF_BYTES, "Received UDP packets")\
+  P(udp_drop,    PERF_NONE,  "UDP packets dropped by the kernel")\
+  P(rbuf_size,   PERF_BYTES, "Connection read buffer growth")\
+  P(syn_active,  PERF_NONE,  "Active transfers in threads")
+
+enum perf_type {
+#define P(n, u, d) PERF_##n,
+  PERF_COUNTERS
+#undef P
+  PERF_NUM
+};
+
+typedef struct perf_snap_t perf_snap_t;
+
+#define perf_add(n, v) perf_record(PERF_##n, v)
+#define perf_addn(n, v, num) perf_record_n(PERF_##n, v, num)
+#define perf_start() g_get_monotonic_time()
+#define perf_time(n, start) perf_record(PERF_##n, g_get_monotonic_time() - (start))
+
+#endif
+
+typedef struct perf_t {
+  guint64 count;
+  guint64 sum;
+  guint64 max;
+  guint64 hist[PERF_BUCKETS]; // hist[i] = number of values < 2^i and >= 2^(i-1)
+} perf_t;
+
+// A copy of all counters at some point in time. Two snapshots are used to
+// show what happened in the time between them.
+struct perf_snap_t {
+  gint64 time;
+  perf_t c[PERF_NUM];
+};
+
+static const struct {
+  const char *name;
+  int unit;
+  const char *desc;
+} perf_info[] = {
+#define P(n, u, d) { G_STRINGIFY(n), u, d },
+  PERF_COUNTERS
+#undef P
+};
+
+static GMutex perf_lock; // protects perf_list
+static perf_t perf_list[PERF_NUM];
+static gint64 perf_started;
+
+#define PERF_LAG_INTERVAL 100 // ms
+
+
+// Records the same value num times.
+void perf_record_n(perf_type n, guint64 v, guint64 num) {
+  if(!num)
+    return;
+  int b = v ? MIN(g_bit_storage(v), PERF_BUCKETS-1) : 0;
+  g_mutex_lock(&perf_lock);
+  perf_t *p = perf_list+n;
+  p->count += num;
+  p->sum += v*num;
+  p->max = MAX(p->max, v);
+  p->hist[b] += num;
+  g_mutex_unlock(&perf_lock);
+}
+
+
+void perf_record(perf_type n, guint64 v) {
+  perf_record_n(n, v, 1);
+}
+
+
+// Returns a copy of the current counters, free with g_free().
+perf_snap_t *perf_snapshot() {
+  perf_snap_t *s = g_new(perf_snap_t, 1);
+  g_mutex_lock(&perf_lock);
+  memcpy(s->c, perf_list, sizeof(perf_list));
+  g_mutex_unlock(&perf_lock);
+  s->time = g_get_monotonic_time();
+  return s;
+}
+
+
+// Estimates the q'th quantile from the histogram differences, as the upper
+// bound of the bucket it falls in.
+static guint64 perf_quantile(const perf_t *o, const perf_t *n, double q) {
+  guint64 want = ceil((n->count - o->count) * q), have = 0;
+  int i;
+  for(i=0; i<PERF_BUCKETS; i++) {
+    have += n->hist[i] - o->hist[i];
+    if(have >= want && have)
+      return i ? ((guint64)1)<<i : 0;
+  }
+  return 0;
+}
+
+
+static void perf_fmtval(GString *s, int unit, guint64 v) {
+  char buf[32];
+  if(unit == PERF_USEC && v >= 1000000)
+    g_snprintf(buf, sizeof(buf), "%.2fs", v/1e6);
+  else if(unit == PERF_USEC && v >= 1000)
+    g_snprintf(buf, sizeof(buf), "%.1fms", v/1e3);
+  else if(unit == PERF_USEC)
+    g_snprintf(buf, sizeof(buf), "%dus", (int)v);
+  else if(unit == PERF_BYTES)
+    g_strlcpy(buf, str_formatsize(v), sizeof(buf));
+  else
+    g_snprintf(buf, sizeof(buf), "%"G_GUINT64_FORMAT, v);
+  g_string_append_printf(s, " %10s", buf);
+}
+
+
+// Formats the changes between two snapshots, one counter per line. With
+// human=FALSE, the lines are tab-separated with raw numbers (microseconds and
+// bytes) in the columns: name, count, rate/s, avg, p50, p99, max. The max is
+// over the entire run rather than the interval. If o is NULL, the changes
+// since startup are formatted.
+char *perf_format(const perf_snap_t *o, const perf_snap_t *n, gboolean human) {
+  static const perf_snap_t zero = {};
+  if(!o)
+    o = &zero;
+  GString *s = g_string_new("");
+  double sec = MAX(1, n->time - (o->time ? o->time : perf_started)) / 1e6;
+  int i;
+
+  if(human)
+    g_string_append_printf(s, "%-11s %9s %9s %10s %10s %10s %10s\n", "", "count", "rate/s", "avg", "p50", "p99", "max");
+  for(i=0; i<PERF_NUM; i++) {
+    const perf_t *a = o->c+i, *b = n->c+i;
+    guint64 cnt = b->count - a->count;
+    guint64 avg = cnt ? (b->sum - a->sum) / cnt : 0;
+    guint64 p50 = perf_quantile(a, b, 0.5), p99 = perf_quantile(a, b, 0.99);
+    if(!human) {
+      g_string_append_printf(s, "%s\t%"G_GUINT64_FORMAT"\t%.2f\t%"G_GUINT64_FORMAT"\t%"G_GUINT64_FORMAT"\t%"G_GUINT64_FORMAT"\t%"G_GUINT64_FORMAT"\n",
+        perf_info[i].name, cnt, cnt/sec, avg, p50, p99, b->max);
+      continue;
+    }
+    g_string_append_printf(s, "%-11s %9"G_GUINT64_FORMAT" %9.1f", perf_info[i].name, cnt, cnt/sec);
+    perf_fmtval(s, perf_info[i].unit, avg);
+    perf_fmtval(s, perf_info[i].unit, p50);
+    perf_fmtval(s, perf_info[i].unit, p99);
+    perf_fmtval(s, perf_info[i].unit, b->max);
+    g_string_append_printf(s, "  %s\n", perf_info[i].desc);
+  }
+
+  // Hashing throughput of a single thread, the time is summed over all
+  // threads.
+  guint64 bytes = n->c[PERF_hash_bytes].sum - o->c[PERF_hash_bytes].sum;
+  guint64 usec = n->c[PERF_hash_file].sum - o->c[PERF_hash_file].sum;
+  double rate = usec ? bytes / (usec/1e6) : 0;
+  if(human)
+    g_string_append_printf(s, "Hash rate per thread: %s/s", str_formatsize(rate));
+  else
+    g_string_append_printf(s, "hash_rate\t%.0f", rate);
+  return g_string_free(s, FALSE);
+}
+
+
+static gboolean perf_lag_timer(gpointer dat) {
+  static gint64 last = 0;
+  gint64 now = g_get_monotonic_time();
+  if(last)
+    perf_add(main_lag, MAX(0, now - last - PERF_LAG_INTERVAL*1000));
+  last = now;
+  return TRUE;
+}
+
+
+static gboolean perf_sample(gpointer dat) {
+  perf_add(db_queue, db_queue_length());
+  perf_add(syn_active, net_syn_active());
+
+  static logfile_t *log = NULL;
+  static perf_snap_t *last = NULL;
+  int interval = var_get_int(0, VAR_perf_log);
+  if(!interval) {
+    if(log)
+      logfile_free(log);
+    g_free(last);
+    log = NULL;
+    last = NULL;
+    return TRUE;
+  }
+
+  perf_snap_t *cur = perf_snapshot();
+  if(!log) {
+    log = logfile_create("perf");
+    last = cur;
+    return TRUE;
+  }
+  if(cur->time - last->time < interval*G_GINT64_CONSTANT(1000000)) {
+    g_free(cur);
+    return TRUE;
+  }
+
+  char *str = perf_format(last, cur, FALSE);
+  char **lines = g_strsplit(str, "\n", 0), **l;
+  for(l=lines; *l; l++)
+    logfile_add(log, *l);
+  g_strfreev(lines);
+  g_free(str);
+  g_free(last);
+  last = cur;
+  return TRUE;
+}
+
+
+void perf_init() {
+  perf_started = g_get_monotonic_time();
+  g_timeout_add(PERF_LAG_INTERVAL, perf_lag_timer, NULL);
+  g_timeout_add_seconds_full(G_PRIORITY_LOW, 1, perf_sample, NULL, NULL);
+}
+
+
+
+
+
 // Log file writer. Prefixes all messages with a timestamp and allows the logs
 // to be rotated.
+//
+// The actual writing is done by a background thread, so that slow storage
+// doesn't hold up the main thread. The other functions only add a message to
+// a queue, and all fields except path are only accessed from the writer
+// thread. Lines for the same file are written together with writev().
 
 #if INTERFACE
 
@@ -922,12 +1192,40 @@ struct logfile_t {
   int file;
   char *path;
   struct stat st;
+  time_t checked; // last time logfile_checkfile() was called
 };
 
 #endif
 
-
-static GSList *logfile_instances = NULL;
+// Maximum number of queued lines. Further lines are dropped, rather than
+// blocking the main thread or using up all memory when the log storage hangs.
+#define LOGFILE_QUEUE_MAX 10000
+// How often to check whether the log file has been moved or removed.
+#define LOGFILE_CHECK 10
+// Maximum number of lines in a single writev()
+#define LOGFILE_IOV 64
+
+#define LOGFILE_LINE   0
+#define LOGFILE_OPEN   1
+#define LOGFILE_FREE   2
+#define LOGFILE_REOPEN 3
+
+typedef struct logfile_msg_t {
+  int type;
+  logfile_t *l; // NULL for LOGFILE_REOPEN
+  time_t time;
+  char *msg;
+} logfile_msg_t;
+
+static GMutex logfile_lock;  // protects the following four
+static GCond logfile_cond;
+static GQueue logfile_queue = G_QUEUE_INIT;
+static int logfile_lines;    // number of LOGFILE_LINE messages in the queue
+static int logfile_dropped;
+static gboolean logfile_quit;
+static GThread *logfile_thread = NULL;
+
+static GSList *logfile_instances = NULL; // only used by the writer thread
 
 
 // (Re-)opens the log file and checks for inode and file size changes.
@@ -962,6 +1260,152 @@ static void logfile_checkfile(logfile_t *l) {
   }
 
   memcpy(&l->st, &st, sizeof(struct stat));
+  time(&l->checked);
+}
+
+
+// Formats the timestamp of a line. Consecutive lines tend to have the same
+// time, so the last one is cached.
+static const char *logfile_timestamp(time_t t) {
+  static time_t last = 0;
+  static char *ts = NULL;
+  if(!ts || t != last) {
+    g_free(ts);
+    GDateTime *tm = g_date_time_new_from_unix_local(t);
+    ts = g_date_time_format(tm, "[%F %H:%M:%S %Z]");
+    g_date_time_unref(tm);
+    last = t;
+  }
+  return ts;
+}
+
+
+// Writes n lines to the file. logerr indicates whether any of the lines is an
+// error message about logging, in which case errors aren't reported again.
+static void logfile_writev(logfile_t *l, struct iovec *iov, int n, gboolean logerr) {
+  if(l->file < 0 || l->checked < time(NULL)-LOGFILE_CHECK)
+    logfile_checkfile(l);
+
+  int r = 1;
+  while(l->file >= 0 && n > 0 && (r = writev(l->file, iov, n)) > 0) {
+    while(n > 0 && (size_t)r >= iov->iov_len) {
+      r -= iov->iov_len;
+      iov++;
+      n--;
+    }
+    if(n > 0) {
+      iov->iov_base = (char *)iov->iov_base + r;
+      iov->iov_len -= r;
+    }
+  }
+
+  if(l->file >= 0 && r <= 0 && !logerr)
+    g_warning("Error writing to log file: %s (LOGERR)", g_strerror(errno));
+}
+
+
+static gpointer logfile_thread_func(gpointer dat) {
+  struct iovec iov[LOGFILE_IOV];
+  char *lines[LOGFILE_IOV];
+  int n = 0, i;
+  gboolean logerr = FALSE;
+  logfile_t *cur = NULL;
+
+  while(1) {
+    g_mutex_lock(&logfile_lock);
+    while(!logfile_queue.length && !logfile_quit)
+      g_cond_wait(&logfile_cond, &logfile_lock);
+    GQueue q = logfile_queue;
+    g_queue_init(&logfile_queue);
+    logfile_lines = 0;
+    int dropped = logfile_dropped;
+    logfile_dropped = 0;
+    gboolean quit = logfile_quit && !q.length;
+    g_mutex_unlock(&logfile_lock);
+
+    if(quit)
+      break;
+    if(dropped)
+      g_warning("Log files can't be written fast enough, %d lines have been dropped. (LOGERR)", dropped);
+
+    logfile_msg_t *m;
+    while(1) {
+      m = g_queue_pop_head(&q);
+
+      // Write out the lines collected so far
+      if(n && (!m || m->type != LOGFILE_LINE || m->l != cur || n == LOGFILE_IOV)) {
+        logfile_writev(cur, iov, n, logerr);
+        for(i=0; i<n; i++)
+          g_free(lines[i]);
+        n = 0;
+        logerr = FALSE;
+      }
+      if(!m)
+        break;
+
+      switch(m->type) {
+      case LOGFILE_LINE:
+        cur = m->l;
+        lines[n] = g_strdup_printf("%s %s\n", logfile_timestamp(m->time), m->msg);
+        iov[n].iov_base = lines[n];
+        iov[n].iov_len = strlen(lines[n]);
+        n++;
+        if(strstr(m->msg, " (LOGERR)"))
+          logerr = TRUE;
+        g_free(m->msg);
+        break;
+      case LOGFILE_OPEN:
+        logfile_instances = g_slist_prepend(logfile_instances, m->l);
+        logfile_checkfile(m->l);
+        break;
+      case LOGFILE_FREE:
+        logfile_instances = g_slist_remove(logfile_instances, m->l);
+        if(m->l->file >= 0)
+          close(m->l->file);
+        g_free(m->l->path);
+        g_slice_free(logfile_t, m->l);
+        break;
+      case LOGFILE_REOPEN: {
+        GSList *f = logfile_instances;
+        for(; f; f=f->next) {
+          logfile_t *l = f->data;
+          if(l->file >= 0) {
+            close(l->file);
+            l->file = -1;
+          }
+          logfile_checkfile(l);
+        }
+        break;
+      }
+      }
+      g_slice_free(logfile_msg_t, m);
+    }
+  }
+  return NULL;
+}
+
+
+static void logfile_push(int type, logfile_t *l, const char *msg) {
+  logfile_msg_t *m = g_slice_new(logfile_msg_t);
+  m->type = type;
+  m->l = l;
+  m->msg = msg ? g_strdup(msg) : NULL;
+  time(&m->time);
+
+  g_mutex_lock(&logfile_lock);
+  if(!logfile_thread)
+    logfile_thread = g_thread_new("logfile", logfile_thread_func, NULL);
+  if(type == LOGFILE_LINE && logfile_lines >= LOGFILE_QUEUE_MAX) {
+    logfile_dropped++;
+    g_free(m->msg);
+    g_slice_free(logfile_msg_t, m);
+  } else {
+    if(type == LOGFILE_LINE)
+      logfile_lines++;
+    g_queue_push_tail(&logfile_queue, m);
+    g_cond_signal(&logfile_cond);
+  }
+  g_mutex_unlock(&logfile_lock);
 }
 
 
@@ -973,55 +1417,41 @@ logfile_t *logfile_create(const char *name) {
   l->path = g_build_filename(db_dir, "logs", n, NULL);
   g_free(n);
 
-  logfile_checkfile(l);
-  logfile_instances = g_slist_prepend(logfile_instances, l);
+  logfile_push(LOGFILE_OPEN, l, NULL);
   return l;
 }
 
 
+// The struct is freed by the writer thread, after all of its lines have been
+// written.
 void logfile_free(logfile_t *l) {
-  if(!l)
-    return;
-  logfile_instances = g_slist_remove(logfile_instances, l);
-  if(l->file >= 0)
-    close(l->file);
-  g_free(l->path);
-  g_slice_free(logfile_t, l);
+  if(l)
+    logfile_push(LOGFILE_FREE, l, NULL);
 }
 
 
 void logfile_add(logfile_t *l, const char *msg) {
-  logfile_checkfile(l);
-  if(l->file < 0)
-    return;
-
-  char *ts = localtime_fmt("[%F %H:%M:%S %Z]");
-  char *line = g_strdup_printf("%s %s\n", ts, msg);
-  g_free(ts);
-
-  int len = strlen(line);
-  int wr = 0;
-  int r = 1;
-  while(wr < len && (r = write(l->file, line+wr, len-wr)) > 0)
-    wr += r;
-
-  g_free(line);
-  if(r <= 0 && !strstr(msg, " (LOGERR)"))
-    g_warning("Error writing to log file: %s (LOGERR)", g_strerror(errno));
+  logfile_push(LOGFILE_LINE, l, msg);
 }
 
 
 // Flush and re-open all opened log files.
 void logfile_global_reopen() {
-  GSList *n = logfile_instances;
-  for(; n; n=n->next) {
-    logfile_t *l = n->data;
-    if(l->file >= 0) {
-      close(l->file);
-      l->file = -1;
-    }
-    logfile_checkfile(l);
-  }
+  logfile_push(LOGFILE_REOPEN, NULL, NULL);
+}
+
+
+// Writes out all queued lines and stops the writer thread. Should be called
+// before exiting.
+void logfile_global_close() {
+  if(!logfile_thread)
+    return;
+  g_mutex_lock(&logfile_lock);
+  logfile_quit = TRUE;
+  g_cond_signal(&logfile_cond);
+  g_mutex_unlock(&logfile_lock);
+  g_thread_join(logfile_thread);
+  logfile_thread = NULL;
 }
 
 
@@ -1074,6 +1504,7 @@ struct fadv_t {
 #define fadv_purge(a, l)   ((a)->fd = 0)
 #define fadv_close(a)      ((a)->fd = 0)
 #define fadv_oneshot(f,o,s,l)
+#define fadv_readahead(f,o,s)
 
 #endif
 
@@ -1106,6 +1537,11 @@ void fadv_oneshot(int fd, guint64 off, size_t length, int flag) {
     posix_fadvise(fd, off, length, POSIX_FADV_DONTNEED);
 }
 
+// Tell the OS that the given range will be read soon.
+void fadv_readahead(int fd, guint64 off, guint64 length) {
+  posix_fadvise(fd, off, length, POSIX_FADV_WILLNEED);
+}
+
 #endif
 
 
@@ -292,10 +292,20 @@ static char *f_autorefresh(const char *val) {
   return f_interval(val);
 }
 
+// Refreshes only scan modified directories when inotify is available, so
+// these can be done more often.
+#ifdef HAVE_SYS_INOTIFY_H
+#define AUTOREFRESH_MIN "1 minute"
+#define AUTOREFRESH_MIN_RAW 60
+#else
+#define AUTOREFRESH_MIN "10 minutes"
+#define AUTOREFRESH_MIN_RAW 600
+#endif
+
 static char *p_autorefresh(const char *val, GError **err) {
   char *raw = p_interval(val, err);
-  if(raw && raw[0] != '0' && int_raw(raw) < 600) {
-    g_set_error_literal(err, 1, 0, "Interval between automatic refreshes should be at least 10 minutes.");
+  if(raw && raw[0] != '0' && int_raw(raw) < AUTOREFRESH_MIN_RAW) {
+    g_set_error_literal(err, 1, 0, "Interval between automatic refreshes should be at least "AUTOREFRESH_MIN".");
     g_free(raw);
     return NULL;
   }
@@ -623,6 +633,17 @@ static gboolean s_geoip_cc(guint64 hub, const char *key, const char *val, GError
 }
 
 
+// hash_threads
+
+static gboolean s_hash_threads(guint64 hub, const char *key, const char *val, GError **err) {
+  int old = var_get_int(hub, VAR_hash_threads);
+  db_vars_set(hub, key, val);
+  if(int_raw(val) > old)
+    fl_hash_more();
+  return TRUE;
+}
+
+
 // hubname
 
 static char *p_hubname(const char *val, GError **err) {
@@ -804,6 +825,22 @@ static char *p_tls_priority(const char *val, GError **err) {
 }
 
 
+// transfer_buffer
+
+static char *f_transfer_buffer(const char *var) {
+  return g_strdup(str_formatsize(int_raw(var)));
+}
+
+static char *p_transfer_buffer(const char *val, GError **err) {
+  guint64 size = str_parsesize(val);
+  if(size == G_MAXUINT64) {
+    g_set_error_literal(err, 1, 0, "Invalid size.");
+    return NULL;
+  }
+  return g_strdup_printf("%"G_GUINT64_FORMAT, CLAMP(size, 32*1024, 256*1024*1024));
+}
+
+
 // notify_bell
 
 #if INTERFACE
@@ -968,10 +1005,12 @@ struct var_t {
   V(email,            1,1, f_id,           p_id,            su_old,        NULL,         s_hubinfo,       NULL)\
   V(encoding,         1,1, f_id,           p_encoding,      su_encoding,   NULL,         NULL,            "UTF-8")\
   V(filelist_maxage,  1,0, f_interval,     p_interval,      su_old,        NULL,         NULL,            "604800")\
+  V(filelist_threads, 1,0, f_int,          p_int_ge1,       NULL,          NULL,         NULL,            "1")\
   V(fl_done,          0,0, NULL,           NULL,            NULL,          NULL,         NULL,            "false")\
   V(flush_file_cache, 1,0, f_ffc,          p_ffc,           su_ffc,        g_ffc,        s_ffc,           i_ffc())\
   V(geoip_cc,         1,0, f_id,           p_id,            su_path,       NULL,         s_geoip_cc,      NULL)\
   V(hash_rate,        1,0, f_speed,        p_speed,         NULL,          NULL,         NULL,            NULL)\
+  V(hash_threads,     1,0, f_int,          p_int_ge1,       NULL,          NULL,         s_hash_threads,  "1")\
   V(hubaddr,          0,0, NULL,           NULL,            NULL,          NULL,         NULL,            NULL)\
   V(hubkp,            0,0, NULL,           NULL,            NULL,          NULL,         NULL,            NULL)\
   V(hubname,          0,1, f_id,           p_hubname,       su_old,        NULL,         s_hubname,       NULL)\
@@ -987,6 +1026,7 @@ struct var_t {
   V(nick,             1,1, f_id,           p_nick,          su_old,        NULL,         s_nick,          i_nick())\
   V(notify_bell,      1,0, f_notify_bell,  p_notify_bell,   su_notify_bell,g_notify_bell,s_notify_bell,   G_STRINGIFY(VAR_NOTB_DISABLE))\
   V(password,         0,1, f_password,     p_id,            NULL,          NULL,         s_password,      NULL)\
+  V(perf_log,         1,0, f_interval,     p_interval,      su_old,        NULL,         NULL,            "0")\
   V(pid,              0,0, NULL,           NULL,            NULL,          NULL,         NULL,            i_cid_pid())\
   V(reconnect_timeout,1,1, f_interval,     p_interval,      su_old,        NULL,         NULL,            "30")\
   V(sendfile,         1,0, f_sendfile,     p_sendfile,      su_bool,       NULL,         NULL,            "true")\
@@ -1000,6 +1040,8 @@ struct var_t {
   V(sudp_policy,      1,0, f_sudp_policy,  p_sudp_policy,   su_sudp_policy,g_sudp_policy,s_sudp_policy,   G_STRINGIFY(VAR_SUDPP_PREFER))\
   V(tls_policy,       1,1, f_tls_policy,   p_tls_policy,    su_tls_policy, g_tls_policy, s_tls_policy,    G_STRINGIFY(VAR_TLSP_PREFER))\
   V(tls_priority,     1,0, f_id,           p_tls_priority,  su_old,        NULL,         NULL,            "NORMAL:-ARCFOUR-128")\
+  V(transfer_buffer,  1,0, f_transfer_buffer,p_transfer_buffer,NULL,      NULL,         NULL,            "4194304")\
+  V(tthl_store,       1,0, f_bool,         p_bool,          su_bool,       NULL,         NULL,            "false")\
   V(ui_time_format,   1,0, f_id,           p_id,            su_old,        NULL,         NULL,            "[%H:%M:%S]")\
   V(upload_rate,      1,0, f_speed,        p_speed,         NULL,          NULL,         NULL,            NULL)
 